@@ -202,8 +202,8 @@ closure_function(0, 2, void, mkfs_write_handler,
     }
 }
 
-closure_function(4, 2, void, fsc,
-                 heap, h, descriptor, out, tuple, root, const char *, target_root,
+closure_function(5, 2, void, fsc,
+                 heap, h, descriptor, out, ssize_t, offset, tuple, root, const char *, target_root,
                  filesystem, fs, status, s)
 {
     tuple root = bound(root);
@@ -242,7 +242,12 @@ closure_function(4, 2, void, fsc,
             }
         }
     }
-    filesystem_flush(fs, ignore_status);
+    filesystem_compact_log(fs, ignore_status);
+
+    /* log extensions past the last write must still be readable */
+    off_t end = bound(offset) + filesystem_log_end(fs);
+    if (lseek(bound(out), 0, SEEK_END) < end && ftruncate(bound(out), end))
+        halt("could not extend image: %s\n", strerror(errno));
     closure_finish();
 }
 
@@ -445,7 +450,7 @@ int main(int argc, char **argv)
         assert(pc != INVALID_ADDRESS);
         create_filesystem(h, SECTOR_SIZE, BOOTFS_SIZE, 0,
                           closure(h, bwrite, out, offset), pc, allocate_tuple(),
-                          true, closure(h, fsc, h, out, boot, target_root));
+                          true, closure(h, fsc, h, out, offset, boot, target_root));
         offset += BOOTFS_SIZE;
 
         /* Remove tuple from root, so it doesn't end up in the root FS. */
@@ -462,7 +467,7 @@ int main(int argc, char **argv)
                       pc,
                       allocate_tuple(),
                       true,
-                      closure(h, fsc, h, out, root, target_root));
+                      closure(h, fsc, h, out, offset, root, target_root));
 
     if (img_size > 0) {
         off_t current_size = lseek(out, 0, SEEK_END);
@@ -0,0 +1 @@
+const char *gitversion = "1549ae290ab82f3b484ccf7fee3b90b789d62633";
@@ -3,6 +3,13 @@
 #include <vmware/storage.h>
 #include <drivers/ata-pci.h>
 
+//#define BLOCK_QUEUE_DEBUG
+#ifdef BLOCK_QUEUE_DEBUG
+#define bq_debug(x, ...) do {rprintf("BLKQ: " x, ##__VA_ARGS__);} while(0)
+#else
+#define bq_debug(x, ...)
+#endif
+
 void init_storage(kernel_heaps kh, storage_attach a)
 {
     virtio_register_blk(kh, a);
@@ -10,3 +17,158 @@ void init_storage(kernel_heaps kh, storage_attach a)
     pvscsi_register(kh, a);
     ata_pci_register(kh, a);
 }
+
+typedef struct block_request {
+    struct list l;
+    boolean write;
+    void *buf;
+    range blocks;
+    status_handler sh;
+} *block_request;
+
+struct block_queue {
+    heap h;
+    sg_io read;
+    sg_io write;
+    int block_order;
+    u64 max_blocks;             /* per dispatched request */
+    u64 max_segments;           /* pages touched per dispatched request */
+    struct spinlock lock;
+    struct list pending;
+    boolean scheduled;
+    thunk dispatch;
+};
+
+/* the most segments a driver will need for this buffer */
+static u64 request_segments(block_queue bq, block_request r)
+{
+    u64 start = u64_from_pointer(r->buf);
+    u64 end = start + (range_span(r->blocks) << bq->block_order);
+    return (pad(end, PAGESIZE) - (start & ~MASK(PAGELOG))) >> PAGELOG;
+}
+
+closure_function(1, 1, void, block_queue_complete,
+                 vector, handlers,
+                 status, s)
+{
+    status_handler sh;
+    vector_foreach(bound(handlers), sh)
+        apply(sh, s);
+    deallocate_vector(bound(handlers));
+    closure_finish();
+}
+
+/* Issue r along with the requests following it that continue it on the
+   device in the same direction, as far as the driver limits allow. */
+static void block_queue_issue(block_queue bq, struct list *q)
+{
+    block_request r = struct_from_list(list_get_next(q), block_request, l);
+    boolean write = r->write;
+    range blocks = irange(r->blocks.start, r->blocks.start);
+    u64 segments = 0;
+    sg_list sg = allocate_sg_list();
+    vector handlers = allocate_vector(bq->h, 4);
+    assert(sg != INVALID_ADDRESS && handlers != INVALID_ADDRESS);
+    do {
+        u64 length = range_span(r->blocks) << bq->block_order;
+        sg_buf sgb = sg_list_tail_add(sg, length);
+        sgb->buf = r->buf;
+        sgb->size = length;
+        sgb->offset = 0;
+        sgb->refcount = 0;
+        vector_push(handlers, r->sh);
+        blocks.end = r->blocks.end;
+        segments += request_segments(bq, r);
+        list_delete(&r->l);
+        deallocate(bq->h, r, sizeof(*r));
+        list l = list_get_next(q);
+        if (!l)
+            break;
+        r = struct_from_list(l, block_request, l);
+    } while (r->write == write && r->blocks.start == blocks.end &&
+             range_span(blocks) + range_span(r->blocks) <= bq->max_blocks &&
+             segments + request_segments(bq, r) <= bq->max_segments);
+
+    bq_debug("%s %R, %d requests, %ld segments\n", write ? "write" : "read",
+             blocks, vector_length(handlers), segments);
+    apply(write ? bq->write : bq->read, sg, blocks,
+          closure(bq->h, block_queue_complete, handlers));
+}
+
+closure_function(1, 0, void, block_queue_dispatch,
+                 block_queue, bq)
+{
+    block_queue bq = bound(bq);
+    struct list q;
+    u64 flags = spin_lock_irq(&bq->lock);
+    bq->scheduled = false;
+    list_move(&q, &bq->pending);
+    spin_unlock_irq(&bq->lock, flags);
+
+    while (!list_empty(&q))
+        block_queue_issue(bq, &q);
+}
+
+static void block_queue_request(block_queue bq, boolean write, void *buf,
+                                range blocks, status_handler sh)
+{
+    block_request r = allocate(bq->h, sizeof(struct block_request));
+    if (r == INVALID_ADDRESS) {
+        apply(sh, timm("result", "%s: unable to allocate request", __func__));
+        return;
+    }
+    r->write = write;
+    r->buf = buf;
+    r->blocks = blocks;
+    r->sh = sh;
+    u64 flags = spin_lock_irq(&bq->lock);
+    list_insert_before(&bq->pending, &r->l);
+    boolean schedule = !bq->scheduled;
+    bq->scheduled = true;
+    spin_unlock_irq(&bq->lock, flags);
+    if (schedule)
+        assert(enqueue_bh(bq->dispatch));
+}
+
+closure_function(1, 3, void, block_queue_read,
+                 block_queue, bq,
+                 void *, dest, range, blocks, status_handler, sh)
+{
+    block_queue_request(bound(bq), false, dest, blocks, sh);
+}
+
+closure_function(1, 3, void, block_queue_write,
+                 block_queue, bq,
+                 void *, source, range, blocks, status_handler, sh)
+{
+    block_queue_request(bound(bq), true, source, blocks, sh);
+}
+
+block_queue allocate_block_queue(heap h, sg_io read, sg_io write, int block_order,
+                                 u64 max_blocks, u64 max_segments)
+{
+    block_queue bq = allocate(h, sizeof(struct block_queue));
+    if (bq == INVALID_ADDRESS)
+        return bq;
+    bq->h = h;
+    bq->read = read;
+    bq->write = write;
+    bq->block_order = block_order;
+    bq->max_blocks = max_blocks;
+    bq->max_segments = max_segments;
+    spin_lock_init(&bq->lock);
+    list_init(&bq->pending);
+    bq->scheduled = false;
+    bq->dispatch = closure(h, block_queue_dispatch, bq);
+    return bq;
+}
+
+block_io block_queue_reader(block_queue bq)
+{
+    return closure(bq->h, block_queue_read, bq);
+}
+
+block_io block_queue_writer(block_queue bq)
+{
+    return closure(bq->h, block_queue_write, bq);
+}
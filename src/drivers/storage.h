@@ -1,3 +1,14 @@
 typedef closure_type(storage_attach, void, block_io, block_io, u64);
 
 void init_storage(kernel_heaps kh, storage_attach);
+
+/* A block queue sits in front of a driver taking scatter-gather
+   requests, with ranges in blocks. Requests made within one pass of the
+   runloop are held and dispatched together, with those that continue
+   one another on the device merged into a single request. */
+typedef struct block_queue *block_queue;
+
+block_queue allocate_block_queue(heap h, sg_io read, sg_io write, int block_order,
+                                 u64 max_blocks, u64 max_segments);
+block_io block_queue_reader(block_queue bq);
+block_io block_queue_writer(block_queue bq);
@@ -73,6 +73,7 @@ typedef unsigned long size_t;
 #define LWIP_DHCP_BOOTP_FILE 1
 
 #define LWIP_IPV6   1
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1  /* offload in virtio_net */
 
 typedef unsigned long u64_t;
 typedef unsigned u32_t;
@@ -184,5 +184,8 @@ void init_net(kernel_heaps kh)
     heap h = heap_general(kh);
     heap backed = heap_backed(kh);
     lwip_heap = allocate_mcache(h, backed, 5, 11, PAGESIZE);
+    assert(lwip_heap != INVALID_ADDRESS);
+    /* lwIP pools are malloc-backed, so draining this covers them */
+    mm_register_mcache(lwip_heap);
     lwip_init();
 }
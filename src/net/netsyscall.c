@@ -47,16 +47,6 @@ struct sockaddr_in6 {
     u32 sin6_scope_id;
 };
 
-struct msghdr {
-    void *msg_name;
-    socklen_t msg_namelen;
-    struct iovec *msg_iov;
-    size_t msg_iovlen;
-    void *msg_control;
-    size_t msg_controllen;
-    int msg_flags;
-};
-
 struct mmsghdr {
     struct msghdr msg_hdr;
     unsigned int msg_len;
@@ -132,6 +122,7 @@ typedef struct netsock {
 	struct {
 	    struct tcp_pcb *lw;
 	    enum tcp_socket_state state; // half open?
+	    buffer zc_pending;  /* struct tcp_zc_ref, in sequence order */
 	} tcp;
 	struct {
 	    struct udp_pcb *lw;
@@ -144,13 +135,20 @@ static sysreturn netsock_bind(struct sock *sock, struct sockaddr *addr,
         socklen_t addrlen);
 static sysreturn netsock_listen(struct sock *sock, int backlog);
 static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen);
+        socklen_t addrlen, thread t, boolean bh, io_completion completion);
 static sysreturn netsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags);
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion);
 static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *dest_addr, socklen_t addrlen);
+        int flags, struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+        boolean bh, io_completion completion);
 static sysreturn netsock_recvfrom(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen, thread t,
+        boolean bh, io_completion completion);
+static sysreturn netsock_sendmsg(struct sock *sock, const struct msghdr *msg,
+        int flags, thread t, boolean bh, io_completion completion);
+static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
+        int flags, thread t, boolean bh, io_completion completion);
 
 static thunk net_loop_poll;
 static boolean net_loop_poll_queued;
@@ -241,6 +239,54 @@ static void wakeup_sock(netsock s, int flags)
     fdesc_notify_events(&s->sock.f);
 }
 
+/* Zero-copy transmit: data passed to tcp_write() without
+   TCP_WRITE_FLAG_COPY is referenced by lwIP until the peer has
+   acknowledged it (and it can no longer be retransmitted). The
+   reference held on each such buffer - typically a pagecache page
+   handed over by sendfile - is queued along with the sequence number
+   following its last byte, and released as lastack moves past it. */
+typedef struct tcp_zc_ref {
+    u32 end_seq;
+    refcount refcount;
+} *tcp_zc_ref;
+
+#define TCP_ZC_PENDING_INITIAL  16
+
+/* Release references for acknowledged data, or all of them if pcb is
+   null (the pcb and its segments have been freed). */
+static void tcp_zc_release(buffer pending, struct tcp_pcb *pcb)
+{
+    while (buffer_length(pending) >= sizeof(struct tcp_zc_ref)) {
+        tcp_zc_ref r = buffer_ref(pending, 0);
+        if (pcb && (s32)(pcb->lastack - r->end_seq) < 0)
+            break;
+        refcount_release(r->refcount);
+        buffer_consume(pending, sizeof(struct tcp_zc_ref));
+    }
+    if (buffer_length(pending) == 0)
+        buffer_clear(pending);
+}
+
+/* Take a reference for data just queued by tcp_write(), ending at
+   snd_lbb. Successive writes from the same buffer share an entry. */
+static void tcp_zc_hold(buffer pending, struct tcp_pcb *pcb, refcount r)
+{
+    if (buffer_length(pending) >= sizeof(struct tcp_zc_ref)) {
+        tcp_zc_ref tail = buffer_ref(pending, buffer_length(pending) -
+                                     sizeof(struct tcp_zc_ref));
+        if (tail->refcount == r) {
+            tail->end_seq = pcb->snd_lbb;
+            return;
+        }
+    }
+    /* space was reserved by the caller prior to tcp_write() */
+    tcp_zc_ref n = buffer_ref(pending, buffer_length(pending));
+    n->end_seq = pcb->snd_lbb;
+    n->refcount = r;
+    refcount_reserve(r);
+    buffer_produce(pending, sizeof(struct tcp_zc_ref));
+}
+
 static inline void sockaddr_to_ip6addr(struct sockaddr_in6 *addr,
                                        ip_addr_t *ip_addr)
 {
@@ -467,7 +513,7 @@ closure_function(7, 1, sysreturn, sock_read_bh,
 }
 
 static void recvmsg_complete_internal(netsock s, struct msghdr * msg, void * dest, u64 length,
-                                      thread t, sysreturn rv)
+                                      io_completion completion, thread t, sysreturn rv)
 {
     s64 offset = 0;
     int iv = 0;
@@ -482,31 +528,18 @@ static void recvmsg_complete_internal(netsock s, struct msghdr * msg, void * des
     deallocate(s->sock.h, dest, length);
     msg->msg_controllen = 0;
     msg->msg_flags = 0;
-    apply(syscall_io_complete, t, rv);
+    apply(completion, t, rv);
 }
 
-closure_function(4, 2, void, recvmsg_complete,
-                 netsock, s, struct msghdr *, msg, void *, dest, u64, length,
+closure_function(5, 2, void, recvmsg_complete,
+                 netsock, s, struct msghdr *, msg, void *, dest, u64, length, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
-    recvmsg_complete_internal(bound(s), bound(msg), bound(dest), bound(length), t, rv);
+    recvmsg_complete_internal(bound(s), bound(msg), bound(dest), bound(length),
+                              bound(completion), t, rv);
     closure_finish();
 }
 
-closure_function(5, 1, sysreturn, recvmsg_bh,
-                 netsock, s, thread, t, void *, dest, u64, length, struct msghdr *, msg,
-                 u64, flags)
-{
-    io_completion completion = closure(bound(s)->sock.h, recvmsg_complete,
-                                       bound(s), bound(msg), bound(dest),
-                                       bound(length));
-    sysreturn rv = sock_read_bh_internal(bound(s), bound(t), bound(dest), bound(length), bound(msg)->msg_name,
-                                         &bound(msg)->msg_namelen, completion, flags);
-    if (rv != BLOCKQ_BLOCK_REQUIRED)
-        closure_finish();
-    return rv;
-}
-
 closure_function(1, 6, sysreturn, socket_read,
                  netsock, s,
                  void *, dest, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
@@ -522,13 +555,64 @@ closure_function(1, 6, sysreturn, socket_read,
     return blockq_check(s->sock.rxbq, t, ba, bh);
 }
 
-static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
+/* Queue up to n bytes from the head of sg, consuming buffers as they
+   are written. Buffers which carry a refcount are passed to lwIP by
+   reference, with the reference kept on the zero-copy pending list
+   until acknowledged; others are copied. Returns the number of bytes
+   queued, with any lwIP error that stopped short in *errp. */
+static u64 tcp_write_sg(netsock s, sg_list sg, u64 n, boolean more, err_t *errp)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u64 remain = n;
+    err_t err = ERR_OK;
+    sg_buf sgb;
+
+    while (remain > 0 && (sgb = sg_list_head_peek(sg)) != INVALID_ADDRESS) {
+        assert(sgb->size > sgb->offset);
+        u64 len = MIN(remain, sgb->size - sgb->offset);
+        u8 apiflags = (more || len < remain) ? TCP_WRITE_FLAG_MORE : 0;
+        boolean zc = sgb->refcount != 0;
+        if (zc) {
+            buffer pending = s->info.tcp.zc_pending;
+            if (!pending) {
+                pending = allocate_buffer(s->sock.h, TCP_ZC_PENDING_INITIAL *
+                                          sizeof(struct tcp_zc_ref));
+                if (pending == INVALID_ADDRESS) {
+                    err = ERR_MEM;
+                    break;
+                }
+                s->info.tcp.zc_pending = pending;
+            }
+            if (!buffer_extend(pending, sizeof(struct tcp_zc_ref))) {
+                err = ERR_MEM;
+                break;
+            }
+        } else {
+            apiflags |= TCP_WRITE_FLAG_COPY;
+        }
+        err = tcp_write(lw, sgb->buf + sgb->offset, len, apiflags);
+        if (err != ERR_OK)
+            break;
+        if (zc)
+            tcp_zc_hold(s->info.tcp.zc_pending, lw, sgb->refcount);
+        sgb->offset += len;
+        remain -= len;
+        if (sgb->offset < sgb->size)
+            break;
+        sg_list_head_remove(sg);
+        sg_buf_release(sgb);
+    }
+    *errp = err;
+    return n - remain;
+}
+
+static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf, sg_list sg,
                                               u64 remain, io_completion completion, u64 flags)
 {
     sysreturn rv = 0;
     err_t err = get_lwip_error(s);
-    net_debug("fd %d, thread %ld, buf %p, remain %ld, flags 0x%lx, lwip err %d\n",
-              s->sock.fd, t->tid, buf, remain, flags, err);
+    net_debug("fd %d, thread %ld, buf %p, sg %p, remain %ld, flags 0x%lx, lwip err %d\n",
+              s->sock.fd, t->tid, buf, sg, remain, flags, err);
     assert(remain > 0);
 
     if (flags & BLOCKQ_ACTION_NULLIFY) {
@@ -575,7 +659,15 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
     }
 
     /* XXX need to pore over lwIP error conditions here */
-    err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
+    if (sg) {
+        /* a partial write still goes out; ERR_MEM with nothing queued
+           is handled as a full send buffer below */
+        n = tcp_write_sg(s, sg, n, avail < remain, &err);
+        if (n > 0)
+            err = ERR_OK;
+    } else {
+        err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
+    }
     if (err == ERR_OK) {
         /* XXX prob add a flag to determine whether to continuously
            post data, e.g. if used by send/sendto... */
@@ -606,11 +698,12 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
     return rv;
 }
 
-closure_function(5, 1, sysreturn, socket_write_tcp_bh,
-                 netsock, s, thread, t, void *, buf, u64, remain, io_completion, completion,
+closure_function(6, 1, sysreturn, socket_write_tcp_bh,
+                 netsock, s, thread, t, void *, buf, sg_list, sg, u64, remain, io_completion, completion,
                  u64, flags)
 {
-    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain), bound(completion), flags);
+    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(sg),
+                                                bound(remain), bound(completion), flags);
     if (rv != BLOCKQ_BLOCK_REQUIRED)
         closure_finish();
     return rv;
@@ -669,7 +762,7 @@ static sysreturn socket_write_internal(struct sock *sock, void *source,
             goto out;
         }
         blockq_action ba = closure(sock->h, socket_write_tcp_bh, s, t,
-                                   source, length, completion);
+                                   source, 0, length, completion);
         return blockq_check(sock->txbq, t, ba, bh);
     } else if (sock->type == SOCK_DGRAM) {
         rv = socket_write_udp(s, source, length, dest_addr, addrlen);
@@ -693,6 +786,30 @@ closure_function(1, 6, sysreturn, socket_write,
     return socket_write_internal(s, source, length, 0, 0, t, bh, completion);
 }
 
+/* Write from an sg_list (as from a pagecache read), consuming the
+   buffers written; stream sockets only. */
+closure_function(1, 6, sysreturn, socket_sg_write,
+                 netsock, s,
+                 sg_list, sg, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
+{
+    netsock s = bound(s);
+    net_debug("sock %d, thread %ld, sg %p, length %ld\n", s->sock.fd, t->tid, sg, length);
+    if (s->info.tcp.state != TCP_SOCK_OPEN)
+        return io_complete(completion, t, -EPIPE);
+    if (length == 0)
+        return io_complete(completion, t, 0);
+    blockq_action ba = closure(s->sock.h, socket_write_tcp_bh, s, t, 0, sg, length, completion);
+    return blockq_check(s->sock.txbq, t, ba, bh);
+}
+
+static u64 netsock_send_space(struct sock *sock)
+{
+    netsock s = (netsock)sock;
+    if (s->info.tcp.state != TCP_SOCK_OPEN || !s->info.tcp.lw)
+        return 0;
+    return tcp_sndbuf(s->info.tcp.lw);
+}
+
 closure_function(1, 2, sysreturn, netsock_ioctl,
                  netsock, s,
                  unsigned long, request, vlist, ap)
@@ -762,6 +879,57 @@ closure_function(1, 2, sysreturn, netsock_ioctl,
 
 #define SOCK_QUEUE_LEN 128
 
+/* A pcb may outlive its socket while closing, and zero-copy data still
+   awaiting acknowledgement must stay referenced until then. The
+   pending list is handed over to the pcb and released from its own
+   sent and error callbacks. */
+static void tcp_zc_orphan_free(buffer pending, struct tcp_pcb *pcb)
+{
+    if (pcb) {
+        tcp_arg(pcb, 0);
+        tcp_sent(pcb, 0);
+        tcp_err(pcb, 0);
+    }
+    deallocate_buffer(pending);
+}
+
+static err_t lwip_tcp_zc_orphan_sent(void *arg, struct tcp_pcb *pcb, u16 len)
+{
+    buffer pending = arg;
+    if (pending) {
+        tcp_zc_release(pending, pcb);
+        if (buffer_length(pending) == 0)
+            tcp_zc_orphan_free(pending, pcb);
+    }
+    return ERR_OK;
+}
+
+static void lwip_tcp_zc_orphan_err(void *arg, err_t err)
+{
+    buffer pending = arg;
+    if (pending) {
+        tcp_zc_release(pending, 0);
+        tcp_zc_orphan_free(pending, 0);
+    }
+}
+
+/* Detach the socket from its pcb ahead of a close, so that no lwIP
+   callback may reference the socket after it is freed. */
+static void netsock_tcp_detach(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    buffer pending = s->info.tcp.zc_pending;
+    if (pending && buffer_length(pending) > 0) {
+        tcp_recv(lw, 0);
+        tcp_sent(lw, lwip_tcp_zc_orphan_sent);
+        tcp_err(lw, lwip_tcp_zc_orphan_err);
+        tcp_arg(lw, pending);
+        s->info.tcp.zc_pending = 0;
+    } else {
+        tcp_arg(lw, 0);
+    }
+}
+
 closure_function(1, 2, sysreturn, socket_close,
                  netsock, s,
                  thread, t, io_completion, completion)
@@ -772,13 +940,19 @@ closure_function(1, 2, sysreturn, socket_close,
     case SOCK_STREAM:
         /* tcp_close() doesn't really stop everything synchronously; in order to
          * prevent any lwIP callback that might be called after tcp_close() from
-         * using a stale reference to the socket structure, set the callback
-         * argument to NULL. */
+         * using a stale reference to the socket structure, detach it from the
+         * pcb first. */
         if (s->info.tcp.lw) {
+            netsock_tcp_detach(s);
             tcp_close(s->info.tcp.lw);
-            tcp_arg(s->info.tcp.lw, 0);
             netsock_check_loop();
         }
+        if (s->info.tcp.zc_pending) {
+            tcp_zc_release(s->info.tcp.zc_pending, 0);
+            deallocate_buffer(s->info.tcp.zc_pending);
+        }
+        if (s->sock.f.sg_write)
+            deallocate_closure(s->sock.f.sg_write);
         break;
     case SOCK_DGRAM:
         udp_remove(s->info.udp.lw);
@@ -821,7 +995,7 @@ static sysreturn netsock_shutdown(struct sock *sock, int how)
             return -ENOTCONN;
         }
         if (shut_rx && shut_tx) {
-            tcp_arg(s->info.tcp.lw, 0);
+            netsock_tcp_detach(s);
         }
         tcp_shutdown(s->info.tcp.lw, shut_rx, shut_tx);
         if (shut_rx && shut_tx) {
@@ -909,6 +1083,8 @@ static int allocate_sock(process p, int af, int type, u32 flags, netsock *rs)
     s->sock.accept4 = netsock_accept4;
     s->sock.sendto = netsock_sendto;
     s->sock.recvfrom = netsock_recvfrom;
+    s->sock.sendmsg = netsock_sendmsg;
+    s->sock.recvmsg = netsock_recvmsg;
     s->sock.shutdown = netsock_shutdown;
     s->ipv6only = 0;
     set_lwip_error(s, ERR_OK);
@@ -930,6 +1106,9 @@ static int allocate_tcp_sock(process p, int af, struct tcp_pcb *pcb, u32 flags)
     if (fd >= 0) {
 	s->info.tcp.lw = pcb;
 	s->info.tcp.state = TCP_SOCK_CREATED;
+	s->info.tcp.zc_pending = 0;
+	s->sock.f.sg_write = closure(s->sock.h, socket_sg_write, s);
+	s->sock.send_space = netsock_send_space;
     }
     return fd;
 }
@@ -1081,6 +1260,8 @@ static void lwip_tcp_conn_err(void * z, err_t err) {
 
     /* Don't try to use the pcb, it may have been deallocated already. */
     s->info.tcp.lw = 0;
+    if (s->sock.type == SOCK_STREAM && s->info.tcp.zc_pending)
+        tcp_zc_release(s->info.tcp.zc_pending, 0);
 
     wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
 }
@@ -1092,12 +1273,14 @@ static err_t lwip_tcp_sent(void * arg, struct tcp_pcb * pcb, u16 len)
     }
     netsock s = (netsock)arg;
     net_debug("fd %d, pcb %p, len %d\n", s->sock.fd, pcb, len);
+    if (s->info.tcp.zc_pending)
+        tcp_zc_release(s->info.tcp.zc_pending, pcb);
     wakeup_sock(s, WAKEUP_SOCK_TX);
     return ERR_OK;
 }
 
-closure_function(2, 1, sysreturn, connect_tcp_bh,
-                 netsock, s, thread, t,
+closure_function(3, 1, sysreturn, connect_tcp_bh,
+                 netsock, s, thread, t, io_completion, completion,
                  u64, flags)
 {
     sysreturn rv = 0;
@@ -1120,10 +1303,9 @@ closure_function(2, 1, sysreturn, connect_tcp_bh,
     assert(s->info.tcp.state == TCP_SOCK_OPEN);
     rv = lwip_to_errno(err);
   out:
-    if (flags & BLOCKQ_ACTION_BLOCKED)
-        thread_wakeup(t);
+    blockq_handle_completion(s->sock.rxbq, flags, bound(completion), t, rv);
     closure_finish();
-    return set_syscall_return(t, rv);
+    return rv;
 }
 
 static err_t connect_tcp_complete(void* arg, struct tcp_pcb* tpcb, err_t err)
@@ -1140,26 +1322,31 @@ static err_t connect_tcp_complete(void* arg, struct tcp_pcb* tpcb, err_t err)
    assert(s->info.tcp.state == TCP_SOCK_IN_CONNECTION);
    s->info.tcp.state = TCP_SOCK_OPEN; /* XXX state handling needs fixing; this could indicate an error as well */
    set_lwip_error(s, err);
-   blockq_wake_one(s->sock.rxbq);
+   wakeup_sock(s, WAKEUP_SOCK_RX);  /* notify for epoll as well */
    return ERR_OK;
 }
 
-static inline err_t connect_tcp(netsock s, const ip_addr_t* address,
-                                unsigned short port)
+static inline sysreturn connect_tcp(netsock s, const ip_addr_t* address,
+                                    unsigned short port, thread t, boolean bh,
+                                    io_completion completion)
 {
     net_debug("sock %d, tcp state %d, port %d\n", s->sock.fd,
             s->info.tcp.state, port);
+    err_t err;
     switch (s->info.tcp.state) {
     case TCP_SOCK_IN_CONNECTION:
     case TCP_SOCK_ABORTING_CONNECTION:
-        return ERR_ALREADY;
+        err = ERR_ALREADY;
+        goto out;
     case TCP_SOCK_OPEN:
-        return ERR_ISCONN;
+        err = ERR_ISCONN;
+        goto out;
     case TCP_SOCK_CREATED:
         break;
     default:
         msg_err("connect attempt while in state %d\n", s->info.tcp.state);
-        return ERR_VAL;
+        err = ERR_VAL;
+        goto out;
     }
     struct tcp_pcb * lw = s->info.tcp.lw;
     tcp_arg(lw, s);
@@ -1168,20 +1355,19 @@ static inline err_t connect_tcp(netsock s, const ip_addr_t* address,
     tcp_sent(lw, lwip_tcp_sent);
     s->info.tcp.state = TCP_SOCK_IN_CONNECTION;
     set_lwip_error(s, ERR_OK);
-    err_t err = tcp_connect(lw, address, port, connect_tcp_complete);
+    err = tcp_connect(lw, address, port, connect_tcp_complete);
     if (err != ERR_OK)
-        return err;
+        goto out;
     netsock_check_loop();
 
-    sysreturn rv = blockq_check(s->sock.rxbq, current,
-            closure(s->sock.h, connect_tcp_bh, s, current), false);
-    /* should not return under normal cirucmstances */
-    msg_err("blockq check error: %ld\n", rv);
-    return ERR_OK;
+    return blockq_check(s->sock.rxbq, t,
+            closure(s->sock.h, connect_tcp_bh, s, t, completion), bh);
+  out:
+    return io_complete(completion, t, lwip_to_errno(err));
 }
 
 static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen)
+        socklen_t addrlen, thread t, boolean bh, io_completion completion)
 {
     err_t err = ERR_OK;
     netsock s = (netsock) sock;
@@ -1190,7 +1376,7 @@ static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
     sysreturn ret = sockaddr_to_addrport(s->sock.domain, addr, addrlen, &ipaddr,
         &port);
     if (ret)
-        return ret;
+        return io_complete(completion, t, ret);
     if (s->sock.type == SOCK_STREAM) {
         if (s->info.tcp.state == TCP_SOCK_IN_CONNECTION) {
             err = ERR_ALREADY;
@@ -1200,16 +1386,16 @@ static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
             msg_warn("attempt to connect on listening socket fd = %d; ignored\n", sockfd);
             err = ERR_ARG;
         } else {
-            err = connect_tcp(s, &ipaddr, port);
+            return connect_tcp(s, &ipaddr, port, t, bh, completion);
         }
     } else if (s->sock.type == SOCK_DGRAM) {
 	/* Set remote endpoint */
 	err = udp_connect(s->info.udp.lw, &ipaddr, port);
     } else {
 	msg_err("can't connect on socket type %d\n", s->sock.type);
-	return -EINVAL;
+	return io_complete(completion, t, -EINVAL);
     }
-    return lwip_to_errno(err);
+    return io_complete(completion, t, lwip_to_errno(err));
 }
 
 sysreturn connect(int sockfd, struct sockaddr *addr, socklen_t addrlen)
@@ -1221,7 +1407,8 @@ sysreturn connect(int sockfd, struct sockaddr *addr, socklen_t addrlen)
     if (!validate_user_memory(addr, addrlen, false)) {
         return -EFAULT;
     }
-    return sock->connect(sock, addr, addrlen);
+    return sock->connect(sock, addr, addrlen, current, false,
+            syscall_io_complete);
 }
 
 #define MSG_OOB         0x00000001
@@ -1264,14 +1451,15 @@ static sysreturn sendto_prepare(struct sock *sock, int flags)
 }
 
 static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *dest_addr, socklen_t addrlen)
+        int flags, struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+        boolean bh, io_completion completion)
 {
     sysreturn rv = sendto_prepare(sock, flags);
     if (rv < 0) {
-        return set_syscall_return(current, rv);
+        return io_complete(completion, t, rv);
     }
-    return socket_write_internal(sock, buf, len, dest_addr, addrlen, current, false,
-            syscall_io_complete);
+    return socket_write_internal(sock, buf, len, dest_addr, addrlen, t, bh,
+            completion);
 }
 
 sysreturn sendto(int sockfd, void *buf, u64 len, int flags,
@@ -1285,10 +1473,12 @@ sysreturn sendto(int sockfd, void *buf, u64 len, int flags,
         return -EOPNOTSUPP;
     }
     if (!validate_user_memory(buf, len, false) ||
-        (dest_addr && !validate_user_memory(dest_addr, addrlen, false))) {
+        (dest_addr && !validate_user_memory(dest_addr, addrlen, false)) ||
+        !fault_in_user_memory(buf, len, true)) {
         return -EFAULT;
     }
-    return sock->sendto(sock, buf, len, flags, dest_addr, addrlen);
+    return sock->sendto(sock, buf, len, flags, dest_addr, addrlen, current,
+            false, syscall_io_complete);
 }
 
 static sysreturn sendmsg_prepare(struct sock *s, const struct msghdr *msg,
@@ -1324,38 +1514,49 @@ static sysreturn sendmsg_prepare(struct sock *s, const struct msghdr *msg,
 }
 
 static void sendmsg_complete_internal(struct sock *s, void * buf, u64 len,
-                                      thread t, sysreturn rv)
+                                      io_completion completion, thread t, sysreturn rv)
 {
     deallocate(s->h, buf, len);
-    apply(syscall_io_complete, t, rv);
+    apply(completion, t, rv);
 }
 
-closure_function(3, 2, void, sendmsg_complete,
-                 struct sock *, s, void *, buf, u64, len,
+closure_function(4, 2, void, sendmsg_complete,
+                 struct sock *, s, void *, buf, u64, len, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
-    sendmsg_complete_internal(bound(s), bound(buf), bound(len), t, rv);
+    sendmsg_complete_internal(bound(s), bound(buf), bound(len), bound(completion), t, rv);
     closure_finish();
 }
 
-sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
+static sysreturn netsock_sendmsg(struct sock *s, const struct msghdr *msg,
+        int flags, thread t, boolean bh, io_completion completion)
 {
-    struct sock *s = resolve_socket(current->p, sockfd);
-    if (!get_netsock(s))
-        return -EOPNOTSUPP;
     void *buf;
     u64 len;
     sysreturn rv;
 
     net_debug("sock %d, type %d, msg %p, flags 0x%x\n", s->fd, s->type, msg, flags);
-    if (!validate_user_memory(msg, sizeof(struct msghdr), false))
-        return -EFAULT;
     rv = sendmsg_prepare(s, msg, flags, &buf, &len);
     if (rv <= 0)
-        return set_syscall_return(current, rv);
-    io_completion completion = closure(s->h, sendmsg_complete, s, buf, len);
+        return io_complete(completion, t, rv);
+    io_completion c = closure(s->h, sendmsg_complete, s, buf, len, completion);
+    if (c == INVALID_ADDRESS) {
+        deallocate(s->h, buf, len);
+        return io_complete(completion, t, -ENOMEM);
+    }
     return socket_write_internal(s, buf, len, msg->msg_name, msg->msg_namelen,
-        current, false, completion);
+        t, bh, c);
+}
+
+sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    struct sock *s = resolve_socket(current->p, sockfd);
+    if (!s->sendmsg)
+        return -EOPNOTSUPP;
+    if (!validate_msghdr((struct msghdr *)msg, false) ||
+        !fault_in_iovec(msg->msg_iov, msg->msg_iovlen, true))
+        return -EFAULT;
+    return s->sendmsg(s, msg, flags, current, false, syscall_io_complete);
 }
 
 closure_function(3, 2, void, sendmmsg_buf_complete,
@@ -1378,7 +1579,7 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
 
     io_completion completion = closure(s->sock.h, sendmmsg_buf_complete, s, buf,
             len);
-    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, 0, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
 
     while (true) {
         if (rv == BLOCKQ_BLOCK_REQUIRED) {
@@ -1398,7 +1599,7 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
                 bound(flags), &buf, &len);
         if (rv > 0) {
             completion = closure(s->sock.h, sendmmsg_buf_complete, s, buf, len);
-            rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+            rv = socket_write_tcp_bh_internal(s, t, buf, 0, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
         }
     }
 
@@ -1409,17 +1610,6 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
     return set_syscall_return(t, rv);
 }
 
-static boolean validate_msghdr(struct msghdr *mh, boolean write)
-{
-    if (!validate_user_memory(mh, sizeof(struct msghdr), false))
-        return false;
-    if (mh->msg_name && !validate_user_memory(mh->msg_name, mh->msg_namelen, false))
-        return false;
-    if (mh->msg_control && !validate_user_memory(mh->msg_control, mh->msg_controllen, write))
-        return false;
-    return validate_iovec(mh->msg_iov, mh->msg_iovlen, write);
-}
-
 sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
         int flags)
 {
@@ -1481,18 +1671,19 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 }
 
 static sysreturn netsock_recvfrom(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen, thread t,
+        boolean bh, io_completion completion)
 {
     netsock s = (netsock) sock;
     if (sock->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN)
-        return set_syscall_error(current, ENOTCONN);
+        return io_complete(completion, t, -ENOTCONN);
 
     if (len == 0)
-        return 0;
+        return io_complete(completion, t, 0);
 
-    blockq_action ba = closure(sock->h, sock_read_bh, s, current, buf, len,
-                               src_addr, addrlen, syscall_io_complete);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, sock_read_bh, s, t, buf, len,
+                               src_addr, addrlen, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
@@ -1508,40 +1699,54 @@ sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
     if (src_addr && (!validate_user_memory(addrlen, sizeof(socklen_t), true) ||
                      !validate_user_memory(src_addr, *addrlen, true)))
         return -EFAULT;
+    if (!validate_user_memory(buf, len, true) || !fault_in_user_memory(buf, len, true))
+        return -EFAULT;
 
-    return sock->recvfrom(sock, buf, len, flags, src_addr, addrlen);
+    return sock->recvfrom(sock, buf, len, flags, src_addr, addrlen, current,
+            false, syscall_io_complete);
 }
 
-sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
+static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
+        int flags, thread t, boolean bh, io_completion completion)
 {
     u64 total_len;
     u8 *buf;
-    struct sock *sock = resolve_socket(current->p, sockfd);
-    netsock s = get_netsock(sock);
-    if (!s)
-        return -EOPNOTSUPP;
+    netsock s = (netsock) sock;
 
-    net_debug("sock %d, type %d, thread %ld\n", sock->fd, sock->type,
-            current->tid);
-    if (!validate_msghdr(msg, true))
-        return -EFAULT;
+    net_debug("sock %d, type %d, thread %ld\n", sock->fd, sock->type, t->tid);
     if ((sock->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN)) {
-        return set_syscall_error(current, ENOTCONN);
+        return io_complete(completion, t, -ENOTCONN);
     }
     total_len = 0;
     for (int i = 0; i < msg->msg_iovlen; i++) {
         total_len += msg->msg_iov[i].iov_len;
     }
     if (total_len == 0) {
-        return 0;
+        return io_complete(completion, t, 0);
     }
     buf = allocate(sock->h, total_len);
     if (buf == INVALID_ADDRESS) {
-        return set_syscall_error(current, ENOMEM);
+        return io_complete(completion, t, -ENOMEM);
+    }
+    io_completion c = closure(sock->h, recvmsg_complete, s, msg, buf, total_len,
+            completion);
+    if (c == INVALID_ADDRESS) {
+        deallocate(sock->h, buf, total_len);
+        return io_complete(completion, t, -ENOMEM);
     }
-    blockq_action ba = closure(sock->h, recvmsg_bh, s, current, buf, total_len,
-            msg);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, sock_read_bh, s, t, buf, total_len,
+            msg->msg_name, &msg->msg_namelen, c);
+    return blockq_check(sock->rxbq, t, ba, bh);
+}
+
+sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    struct sock *sock = resolve_socket(current->p, sockfd);
+    if (!sock->recvmsg)
+        return -EOPNOTSUPP;
+    if (!validate_msghdr(msg, true) || !fault_in_iovec(msg->msg_iov, msg->msg_iovlen, true))
+        return -EFAULT;
+    return sock->recvmsg(sock, msg, flags, current, false, syscall_io_complete);
 }
 
 static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
@@ -1612,8 +1817,8 @@ sysreturn listen(int sockfd, int backlog)
     return sock->listen(sock, backlog);
 }
 
-closure_function(5, 1, sysreturn, accept_bh,
-                 netsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags,
+closure_function(6, 1, sysreturn, accept_bh,
+                 netsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags, io_completion, completion,
                  u64, bqflags)
 {
     netsock s = bound(s);
@@ -1662,28 +1867,26 @@ closure_function(5, 1, sysreturn, accept_bh,
 
     rv = child->sock.fd;
   out:
-    set_syscall_return(t, rv);
-    if (bqflags & BLOCKQ_ACTION_BLOCKED)
-        thread_wakeup(t);
-
+    blockq_handle_completion(s->sock.rxbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn netsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags)
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion)
 {
     netsock s = (netsock) sock;
     if (sock->type != SOCK_STREAM)
-	return -EOPNOTSUPP;
+	return io_complete(completion, t, -EOPNOTSUPP);
 
     if ((s->info.tcp.state != TCP_SOCK_LISTENING) ||
             (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)))
-	return set_syscall_error(current, EINVAL);
+	return io_complete(completion, t, -EINVAL);
 
-    blockq_action ba = closure(sock->h, accept_bh, s, current, addr, addrlen,
-            flags);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, accept_bh, s, t, addr, addrlen,
+            flags, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
@@ -1701,7 +1904,8 @@ sysreturn accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
         return -EFAULT;
     }
 
-    return sock->accept4(sock, addr, addrlen, flags);
+    return sock->accept4(sock, addr, addrlen, flags, current, false,
+            syscall_io_complete);
 }
 
 sysreturn accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
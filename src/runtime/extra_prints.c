@@ -66,6 +66,7 @@ void print_tuple(buffer b, tuple z)
 // copied from print_tuple()
 static void _print_root(buffer b, tuple z, int indent, boolean is_children)
 {
+    tuple_load(z, 0);
     table t = valueof(z);
     boolean sub = false;
     bprintf(b, "(");
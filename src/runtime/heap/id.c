@@ -213,16 +213,31 @@ static boolean add_range(id_heap i, u64 base, u64 length)
     return id_add_range(i, base, length) != INVALID_ADDRESS;
 }
 
-closure_function(4, 1, void, set_intersection,
-                 range, q, boolean *, fail, boolean, validate, boolean, allocate,
+closure_function(5, 1, void, set_intersection,
+                 id_heap, i, range, q, boolean *, fail, boolean, validate, boolean, allocate,
                  rmnode, n)
 {
+    id_heap i = bound(i);
     range ri = range_intersection(bound(q), n->r);
     id_range r = (id_range)n;
 
     int bit = ri.start - n->r.start;
-    if (!bitmap_range_check_and_set(r->b, bit, range_span(ri), bound(validate), bound(allocate)))
+    if (!bitmap_range_check_and_set(r->b, bit, range_span(ri), bound(validate), bound(allocate))) {
         *bound(fail) = true;
+        return;
+    }
+
+    /* Only a validated change is known to have flipped every bit in
+       the range, so that it may be accounted for. */
+    if (bound(validate)) {
+        u64 length = range_span(ri) << page_order(i);
+        if (bound(allocate)) {
+            i->allocated += length;
+        } else {
+            assert(i->allocated >= length);
+            i->allocated -= length;
+        }
+    }
 }
 
 static u64 id_allocated(heap h)
@@ -242,7 +257,7 @@ static boolean set_area(id_heap i, u64 base, u64 length, boolean validate, boole
 
     range q = irange(base >> page_order(i), (base + length) >> page_order(i));
     boolean fail = false;
-    rmnode_handler nh = stack_closure(set_intersection, q, &fail, validate, allocate);
+    rmnode_handler nh = stack_closure(set_intersection, i, q, &fail, validate, allocate);
     boolean result = rangemap_range_lookup(i->ranges, q, nh);
     return result && !fail;
 }
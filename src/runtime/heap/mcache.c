@@ -137,6 +137,22 @@ void destroy_mcache(heap h)
     deallocate(m->meta, m, sizeof(struct mcache));
 }
 
+/* Release unused pages of the caches to the parent heap, until at
+   least len bytes have been released. Returns the bytes released. */
+bytes mcache_drain(heap h, bytes len)
+{
+    mcache m = (mcache)h;
+    bytes released = 0;
+    heap o;
+    vector_foreach(m->caches, o) {
+	if (released >= len)
+	    break;
+	if (o)
+	    released += objcache_drain(o, len - released);
+    }
+    return released;
+}
+
 static u64 mcache_allocated(heap h)
 {
     return ((mcache)h)->allocated;
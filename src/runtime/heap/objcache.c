@@ -241,6 +241,27 @@ static void objcache_destroy(heap h)
 	deallocate_u64(o->parent, page_from_footer(o, f), page_size(o));
 }
 
+/* Return pages with no objects allocated to the parent heap, until at
+   least len bytes have been released. Returns the bytes released. */
+bytes objcache_drain(heap h, bytes len)
+{
+    objcache o = (objcache)h;
+    bytes released = 0;
+    struct list *l = o->free.next;
+    while (l != &o->free && released < len) {
+	footer f = footer_from_list(l);
+	l = l->next;
+	if (f->avail < o->objs_per_page)
+	    continue;
+	msg_debug("heap %p, releasing page %lx\n", o, page_from_footer(o, f));
+	list_delete(&f->list);
+	o->total_objs -= o->objs_per_page;
+	deallocate_u64(o->parent, page_from_footer(o, f), page_size(o));
+	released += page_size(o);
+    }
+    return released;
+}
+
 static u64 objcache_allocated(heap h)
 {
     objcache o = (objcache)h;
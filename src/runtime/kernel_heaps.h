@@ -39,6 +39,10 @@ typedef struct kernel_heaps {
        attempt to verify one if given, so use -1ull to indicate an
        unspecified size). */
     heap general;
+
+    /* The locked heap is like the general heap, but may also be used
+       without the kernel lock (see x86_64/locked_heap.c). */
+    heap locked;
 } *kernel_heaps;
 
 static inline heap heap_general(kernel_heaps heaps)
@@ -46,6 +50,11 @@ static inline heap heap_general(kernel_heaps heaps)
     return heaps->general;
 }
 
+static inline heap heap_locked(kernel_heaps heaps)
+{
+    return heaps->locked;
+}
+
 static inline id_heap heap_physical(kernel_heaps heaps)
 {
     return heaps->physical;
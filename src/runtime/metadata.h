@@ -32,24 +32,15 @@ static inline tuple tuple_from_vector(vector v)
     return t;
 }
 
-static inline tuple resolve_path(tuple n, vector v)
-{
-    buffer i;
-    vector_foreach(v, i) {
-        /* null entries ("//") are skipped in path */
-        if (buffer_length(i) == 0)
-            continue;
-        tuple c = table_find(n, sym(children));
-        assert(c);
-        n = table_find(c, intern(i));
-        assert(n);
-    }
-    return n;
-}
-
+/* Directory entries may be loaded on demand (see tuple_set_loader()).
+   children() returns them all, while lookup() only loads the one being
+   looked for. Testing for a directory is left to table_find(). */
 static inline table children(table x)
 {
-    return table_find(x, sym(children));
+    table c = table_find(x, sym(children));
+    if (c)
+        tuple_load(c, 0);
+    return c;
 }
 
 static inline buffer contents(table x)
@@ -59,7 +50,22 @@ static inline buffer contents(table x)
 
 static inline tuple lookup(tuple t, symbol a)
 {
-    void *c = children(t);
+    void *c = table_find(t, sym(children));
     if (!c) return c;
+    tuple_load(c, a);
     return table_find(c, a);
 }
+
+static inline tuple resolve_path(tuple n, vector v)
+{
+    buffer i;
+    vector_foreach(v, i) {
+        /* null entries ("//") are skipped in path */
+        if (buffer_length(i) == 0)
+            continue;
+        assert(table_find(n, sym(children)));
+        n = lookup(n, intern(i));
+        assert(n);
+    }
+    return n;
+}
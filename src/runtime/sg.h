@@ -60,6 +60,11 @@ static inline sg_buf sg_list_head_remove(sg_list sg)
     return sgb;
 }
 
+/* walk the buffers of a list without consuming them */
+#define sg_list_foreach(sg, sgb)                                        \
+    for (sg_buf sgb = buffer_ref((sg)->b, 0);                           \
+         (void *)sgb < buffer_ref((sg)->b, buffer_length((sg)->b)); sgb++)
+
 static inline void sg_buf_release(sg_buf sgb)
 {
     if (sgb->refcount)
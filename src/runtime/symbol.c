@@ -43,10 +43,11 @@ string symbol_string(symbol s)
     return s->s;
 }
 
+/* null is a valid key, e.g. for the index counter of a dictionary */
 key key_from_symbol(void *z)
 {
     symbol s = z;
-    return s->k;
+    return s ? s->k : 0;
 }
 
 void init_symbols(heap h, heap init)
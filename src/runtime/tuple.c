@@ -11,6 +11,9 @@ static heap theap;
 
 static value tnullval;
 
+/* tuples with entries yet to be loaded, mapped to their loaders */
+static table loaders;
+
 // use runtime tags directly?
 #define type_tuple 1
 #define type_buffer 0
@@ -18,20 +21,57 @@ static value tnullval;
 #define immediate 1
 #define reference 0
 
+/* The last index handed out by a dictionary is kept under the key 0,
+   which is neither a valid index nor a valid object. */
+u64 dictionary_reserve(table dictionary, u64 n)
+{
+    u64 last = u64_from_pointer(table_find(dictionary, 0));
+    if (n > 0)
+        table_set(dictionary, 0, pointer_from_u64(last + n));
+    return last + 1;
+}
+
 static inline void drecord(table dictionary, void *x)
 {
-    u64 count = dictionary->count + 1;
+    u64 count = dictionary_reserve(dictionary, 1);
     tuple_debug("drecord: dict %p, index 0x%lx <-> x %p\n", dictionary, count, x);
     table_set(dictionary, pointer_from_u64(count), x);
 }
 
 static inline void srecord(table dictionary, void *x)
 {
-    u64 count = dictionary->count + 1;
+    u64 count = dictionary_reserve(dictionary, 1);
     tuple_debug("srecord: dict %p, x %p -> index 0x%lx\n", dictionary, x, count);
     table_set(dictionary, x, pointer_from_u64(count));
 }
 
+/* Entries of t, or those under the key k if given, are to be filled
+   in by the loader before being looked at. The loader drops itself
+   with tuple_set_loader(t, 0) once t is complete. */
+void tuple_set_loader(tuple t, tuple_loader l)
+{
+    table_set(loaders, t, l);
+}
+
+void tuple_load(tuple t, void *k)
+{
+    if (loaders->count == 0)
+        return;
+    tuple_loader l = table_find(loaders, t);
+    if (l)
+        apply(l, t, k);
+}
+
+static void *dictionary_find(table dictionary, u64 index)
+{
+    void *x = table_find(dictionary, pointer_from_u64(index));
+    if (!x) {
+        tuple_load(dictionary, pointer_from_u64(index));
+        x = table_find(dictionary, pointer_from_u64(index));
+    }
+    return x;
+}
+
 // decode dictionary can really be a vector
 // region?
 tuple allocate_tuple()
@@ -110,9 +150,12 @@ value decode_value(heap h, tuple dictionary, buffer source)
             drecord(dictionary, t);
         } else {
             u64 e = pop_varint(source);
-            t = table_find(dictionary, pointer_from_u64(e));
+            t = dictionary_find(dictionary, e);
             if (!t) halt("indirect tuple not found: 0x%lx, offset %d\n", e, source->start);
             tuple_debug("decode_value: indirect 0x%lx -> 0x%lx\n", e, u64_from_pointer(t));
+            /* entries that follow supersede those yet to be loaded */
+            if (len > 0)
+                tuple_load(t, 0);
         }
 
         for (int i = 0; i < len ; i++) {
@@ -126,7 +169,7 @@ value decode_value(heap h, tuple dictionary, buffer source)
                 drecord(dictionary, s);
                 source->start += nlen;                                
             } else {
-                s = table_find(dictionary, pointer_from_u64(nlen));
+                s = dictionary_find(dictionary, nlen);
                 if (!s) halt("indirect symbol not found: 0x%lx, offset %d\n", nlen, source->start);
             }
             value nv = decode_value(h, dictionary, source);
@@ -144,7 +187,7 @@ value decode_value(heap h, tuple dictionary, buffer source)
             buffer_write(b, buffer_ref(source, 0), len);
             source->start += len;
         } else {
-            b = table_find(dictionary, pointer_from_u64(len));
+            b = dictionary_find(dictionary, len);
             if (!b) halt("indirect buffer not found: 0x%lx, offset %d\n", len, source->start);
         }
         tuple_debug("decode_value: %s buffer %p (%b)\n",
@@ -193,8 +236,7 @@ void encode_eav(buffer dest, table dictionary, tuple e, symbol a, value v)
         push_header(dest, reference, type_tuple, 1);
         push_varint(dest, d);
     } else {
-        tuple_debug("encode_eav: e (%t) immediate at index 0x%lx\n",
-                    e, dictionary->count + 1);
+        tuple_debug("encode_eav: e (%t) immediate\n", e);
         push_header(dest, immediate, type_tuple, 1);
         srecord(dictionary, e);
     }
@@ -205,6 +247,7 @@ void encode_eav(buffer dest, table dictionary, tuple e, symbol a, value v)
 
 void encode_tuple(buffer dest, table dictionary, tuple t)
 {
+    tuple_load(t, 0);
     u64 d = u64_from_pointer(table_find(dictionary, t));
     if (d) {
         push_header(dest, reference, type_tuple, t->count);
@@ -219,9 +262,39 @@ void encode_tuple(buffer dest, table dictionary, tuple t)
     }        
 }
 
+/* As encode_tuple, but only entries for which filter returns true
+   are encoded, here and in any tuple values below t. */
+void encode_tuple_filtered(buffer dest, table dictionary, tuple t, tuple_filter filter)
+{
+    u64 count = 0;
+    tuple_load(t, 0);
+    table_foreach(t, n, v) {
+        if (apply(filter, t, n, v))
+            count++;
+    }
+    u64 d = u64_from_pointer(table_find(dictionary, t));
+    if (d) {
+        push_header(dest, reference, type_tuple, count);
+        push_varint(dest, d);
+    } else {
+        push_header(dest, immediate, type_tuple, count);
+        srecord(dictionary, t);
+    }
+    table_foreach(t, n, v) {
+        if (!apply(filter, t, n, v))
+            continue;
+        encode_symbol(dest, dictionary, n);
+        if (v && tagof(v) == tag_tuple)
+            encode_tuple_filtered(dest, dictionary, (tuple)v, filter);
+        else
+            encode_value(dest, dictionary, v);
+    }
+}
+
 void init_tuples(heap h)
 {
     theap = h;
+    loaders = allocate_table(h, identity_key, pointer_equal);
     tnullval = wrap_buffer_cstring(h, "");
 }
 
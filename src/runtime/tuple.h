@@ -18,6 +18,17 @@ static inline void clear_tuple(tuple t)
 }
 
 void encode_tuple(buffer dest, table dictionary, tuple t);
+u64 dictionary_reserve(table dictionary, u64 n);
+
+/* Tuples may be filled in on demand, e.g. from an on-disk index. The
+   loader is given the key being looked for, or 0 to load everything;
+   for a decoding dictionary, the key is an index. */
+typedef closure_type(tuple_loader, void, tuple, void *);
+void tuple_set_loader(tuple t, tuple_loader l);
+void tuple_load(tuple t, void *k);
+
+typedef closure_type(tuple_filter, boolean, tuple, symbol, value);
+void encode_tuple_filtered(buffer dest, table dictionary, tuple t, tuple_filter filter);
 
 
 // h is for the bodies, the space for symbols and tuples are both implicit
@@ -82,7 +82,12 @@ extern void * AP_BOOT_PAGE;
 #define XENNET_TX_SERVICEQUEUE_DEPTH 512
 
 /* mm stuff */
-#define CACHE_DRAIN_CUTOFF (64 * MB)
+/* The low watermark for free memory is this share of physical memory,
+   within bounds; the high watermark is half as much again. */
+#define MM_LOW_WATERMARK_ORDER 5
+#define MM_LOW_WATERMARK_MIN (4 * MB)
+#define MM_LOW_WATERMARK_MAX (64 * MB)
+#define MM_RECLAIM_MAX_PASSES 4
 
 #include <x86.h>
 void xsave(void *);
@@ -34,7 +34,7 @@ u64 fsfile_get_length(fsfile f)
 
 void fsfile_set_length(fsfile f, u64 length)
 {
-    f->length = length;
+    f->length = f->log_length = length;
     pagecache_set_node_length(f->cache_node, length);
 }
 
@@ -53,6 +53,11 @@ sg_io fsfile_get_writer(fsfile f)
     return f->write;
 }
 
+pagecache_node fsfile_get_cachenode(fsfile f)
+{
+    return f->cache_node;
+}
+
 void filesystem_read_sg(fsfile f, sg_list sg, range q, status_handler completion)
 {
     apply(f->read, sg, q, completion);
@@ -111,9 +116,11 @@ void filesystem_set_mtime(filesystem fs, tuple t, timestamp tim)
     filesystem_set_time(fs, t, sym(mtime), tim);
 }
 
+/* Only entries already loaded are visited; the rest are fixed up as
+   they get loaded. */
 void fixup_directory(tuple parent, tuple dir)
 {
-    tuple c = children(dir);
+    tuple c = table_find(dir, sym(children));
     if (!c)
         return;
 
@@ -162,7 +169,8 @@ boolean filesystem_reserve_storage(filesystem fs, range blocks)
     return true;
 }
 
-void ingest_extent(fsfile f, symbol off, tuple value)
+/* Storage may already be accounted for, as it is by log snapshots. */
+void ingest_extent(fsfile f, symbol off, tuple value, boolean reserve)
 {
     tfs_debug("ingest_extent: f %p, off %b, value %v\n", f, symbol_string(off), value);
     u64 length, file_offset, start_block, allocated;
@@ -175,7 +183,7 @@ void ingest_extent(fsfile f, symbol off, tuple value)
               file_offset, length, start_block, allocated);
 
     range storage_blocks = irangel(start_block, allocated);
-    if (!filesystem_reserve_storage(f->fs, storage_blocks)) {
+    if (reserve && !filesystem_reserve_storage(f->fs, storage_blocks)) {
         /* soft error... */
         msg_err("unable to reserve storage blocks %R\n", storage_blocks);
     }
@@ -364,6 +372,17 @@ void filesystem_write_tuple(filesystem fs, tuple t)
 void filesystem_write_eav(filesystem fs, tuple t, symbol a, value v)
 {
     log_write_eav(fs->tl, t, a, v);
+    fsfile f = fsfile_from_node(fs, t);
+    if (f)
+        f->md_seq = log_seq(fs->tl);
+}
+
+/* Log a record which is needed to read back the file data (extents,
+   length), as opposed to metadata which fdatasync may leave behind. */
+static void fsfile_write_eav(fsfile f, tuple t, symbol a, value v)
+{
+    log_write_eav(f->fs->tl, t, a, v);
+    f->md_seq = f->data_seq = log_seq(f->fs->tl);
 }
 
 /* create a new extent in the filesystem
@@ -377,14 +396,23 @@ void filesystem_write_eav(filesystem fs, tuple t, symbol a, value v)
 
 */
 
-static fs_status create_extent(filesystem fs, range blocks, boolean uninited, extent *ex)
+/* Storage is taken at goal, if given and free, so that the extent may
+   be merged with the one before it. At least nblocks are allocated,
+   which may be more than the extent covers for now. */
+static fs_status create_extent(filesystem fs, range blocks, u64 nblocks, u64 goal,
+                               boolean uninited, extent *ex)
 {
     heap h = fs->h;
-    u64 nblocks = MAX(range_span(blocks), MIN_EXTENT_SIZE >> fs->blocksize_order);
+    nblocks = MAX(MAX(range_span(blocks), nblocks), MIN_EXTENT_SIZE >> fs->blocksize_order);
 
-    tfs_debug("create_extent: blocks %R, uninited %d, nblocks %ld\n", blocks, uninited, nblocks);
+    tfs_debug("create_extent: blocks %R, uninited %d, nblocks %ld, goal 0x%lx\n",
+              blocks, uninited, nblocks, goal);
 
-    u64 start_block = allocate_u64((heap)fs->storage, nblocks);
+    u64 start_block;
+    if (goal != INVALID_PHYSICAL && id_heap_set_area(fs->storage, goal, nblocks, true, true))
+        start_block = goal;
+    else
+        start_block = allocate_u64((heap)fs->storage, nblocks);
     if (start_block == u64_from_pointer(INVALID_ADDRESS)) {
         /* In lieu of precise error handling up the stack, report here... */
         msg_err("out of storage allocating %ld blocks\n", nblocks);
@@ -402,15 +430,51 @@ static fs_status create_extent(filesystem fs, range blocks, boolean uninited, ex
     return FS_STATUS_OK;
 }
 
+/* Unlike a deallocation, this takes any range of blocks, as merged
+   and trimmed extents need not match what was allocated. The release
+   is logged, as the blocks may be recorded in use by a snapshot. */
+static void filesystem_release_storage(filesystem fs, range blocks)
+{
+    if (!id_heap_set_area(fs->storage, blocks.start, range_span(blocks), true, false))
+        msg_err("unable to release storage blocks %R\n", blocks);
+    log_release_storage(fs->tl, blocks);
+}
+
 static void destroy_extent(filesystem fs, extent ex)
 {
-    deallocate_u64((heap)fs->storage, ex->start_block, ex->allocated);
+    filesystem_release_storage(fs, irangel(ex->start_block, ex->allocated));
     deallocate(fs->h, ex, sizeof(*ex));
 }
 
-static void add_extent_to_file(fsfile f, extent ex)
+static void update_extent_length(fsfile f, extent ex, u64 new_length);
+static void update_extent_allocated(fsfile f, extent ex, u64 allocated);
+
+/* An extent which continues the last one in both the file and storage
+   is absorbed by it, rather than being logged as a new one. */
+static extent merge_extent(fsfile f, extent ex)
+{
+    if (ex->uninited)
+        return 0;
+    extent prev = (extent)rangemap_lookup_max_lte(f->extentmap, ex->node.r.start);
+    if (prev == INVALID_ADDRESS || prev->uninited || prev->node.r.end != ex->node.r.start ||
+        range_span(prev->node.r) != prev->allocated ||
+        prev->start_block + prev->allocated != ex->start_block ||
+        prev->allocated + ex->allocated > (MAX_EXTENT_SIZE >> f->fs->blocksize_order))
+        return 0;
+    tfs_debug("%s: f %p, %R into %R\n", __func__, f, ex->node.r, prev->node.r);
+    update_extent_allocated(f, prev, prev->allocated + ex->allocated);
+    update_extent_length(f, prev, range_span(prev->node.r) + range_span(ex->node.r));
+    deallocate(f->fs->h, ex, sizeof(*ex));
+    return prev;
+}
+
+/* Returns the extent which now covers the range of ex. */
+static extent add_extent_to_file(fsfile f, extent ex)
 {
     heap h = f->fs->h;
+    extent merged = merge_extent(f, ex);
+    if (merged)
+        return merged;
 
     // XXX encode this as an immediate bitstring
     tuple e = allocate_tuple();
@@ -431,11 +495,12 @@ static void add_extent_to_file(fsfile f, extent ex)
     if (!(extents = table_find(f->md, a))) {
         extents = allocate_tuple();
         table_set(f->md, a, extents);
-        log_write_eav(f->fs->tl, f->md, a, extents);
+        fsfile_write_eav(f, f->md, a, extents);
     }
     symbol offs = intern_u64(ex->node.r.start);
     table_set(extents, offs, e);
-    log_write_eav(f->fs->tl, extents, offs, e);
+    fsfile_write_eav(f, extents, offs, e);
+    return ex;
 }
 
 static void remove_extent_from_file(fsfile f, extent ex)
@@ -476,7 +541,7 @@ static void remove_extent_from_file(fsfile f, extent ex)
     ex->md = 0;
     symbol offs = intern_u64(ex->node.r.start);
     table_set(extents, offs, 0);
-    log_write_eav(f->fs->tl, extents, offs, 0);
+    fsfile_write_eav(f, extents, offs, 0);
     rangemap_remove_node(f->extentmap, &ex->node);
 }
 
@@ -486,14 +551,14 @@ static fs_status add_extents(filesystem fs, range i, rangemap rm)
     fs_status fss;
     while (range_span(i) >= MAX_EXTENT_SIZE) {
         range r = {.start = i.start, .end = i.start + MAX_EXTENT_SIZE};
-        fss = create_extent(fs, r, true, &ex);
+        fss = create_extent(fs, r, 0, INVALID_PHYSICAL, true, &ex);
         if (fss != FS_STATUS_OK)
             return fss;
         assert(rangemap_insert(rm, &ex->node));
         i.start += MAX_EXTENT_SIZE;
     }
     if (range_span(i)) {
-        fss = create_extent(fs, i, true, &ex);
+        fss = create_extent(fs, i, 0, INVALID_PHYSICAL, true, &ex);
         if (fss != FS_STATUS_OK)
             return fss;
         assert(rangemap_insert(rm, &ex->node));
@@ -522,7 +587,7 @@ static u64 write_extent(fsfile f, extent ex, sg_list sg, range blocks, merge m)
             assert(ex->md);
             symbol a = sym(uninited);
             table_set(ex->md, a, 0);
-            filesystem_write_eav(f->fs, ex->md, a, 0);
+            fsfile_write_eav(f, ex->md, a, 0);
             ex->uninited = false;
         }
         filesystem_storage_op(fs, sg, m, r, fs->w);
@@ -533,16 +598,26 @@ static u64 write_extent(fsfile f, extent ex, sg_list sg, range blocks, merge m)
     return i.end;
 }
 
+/* A file growing at its end gets storage ahead of its writes, as much
+   again as it has already, up to the size of an extent; what is left
+   over is trimmed on close. */
 static fs_status fill_gap(fsfile f, sg_list sg, range blocks, merge m, u64 *edge)
 {
-    blocks = irangel(blocks.start, MIN(MAX_EXTENT_SIZE >> f->fs->blocksize_order,
-                                       range_span(blocks)));
+    u64 max_blocks = MAX_EXTENT_SIZE >> f->fs->blocksize_order;
+    blocks = irangel(blocks.start, MIN(max_blocks, range_span(blocks)));
     tfs_debug("   %s: writing new extent blocks %R\n", __func__, blocks);
+    u64 nblocks = 0;
+    if (rangemap_lookup_at_or_next(f->extentmap, blocks.start) == INVALID_ADDRESS)
+        nblocks = MIN(max_blocks, blocks.start);
+    u64 goal = INVALID_PHYSICAL;
+    extent prev = (extent)rangemap_lookup_max_lte(f->extentmap, blocks.start);
+    if (prev != INVALID_ADDRESS && prev->node.r.end == blocks.start)
+        goal = prev->start_block + prev->allocated;
     extent ex;
-    fs_status fss = create_extent(f->fs, blocks, false, &ex);
+    fs_status fss = create_extent(f->fs, blocks, nblocks, goal, false, &ex);
     if (fss != FS_STATUS_OK)
         return fss;
-    add_extent_to_file(f, ex);
+    ex = add_extent_to_file(f, ex);
     write_extent(f, ex, sg, blocks, m);
     *edge = blocks.end;
     return FS_STATUS_OK;
@@ -560,7 +635,20 @@ static void update_extent_length(fsfile f, extent ex, u64 new_length)
     deallocate_buffer(length);
     value v = value_from_u64(f->fs->h, new_length);
     table_set(ex->md, sym(length), v);
-    log_write_eav(f->fs->tl, ex->md, sym(length), v);
+    fsfile_write_eav(f, ex->md, sym(length), v);
+}
+
+static void update_extent_allocated(fsfile f, extent ex, u64 allocated)
+{
+    tfs_debug("   %s: allocated 0x%lx, now 0x%lx\n", __func__, ex->allocated, allocated);
+    ex->allocated = allocated;
+    assert(ex->md);
+    string v = table_find(ex->md, sym(allocated));
+    assert(v);
+    deallocate_buffer(v);
+    v = value_from_u64(f->fs->h, allocated);
+    table_set(ex->md, sym(allocated), v);
+    fsfile_write_eav(f, ex->md, sym(allocated), v);
 }
 
 static u64 extend(fsfile f, extent ex, sg_list sg, range blocks, merge m)
@@ -660,15 +748,29 @@ closure_function(2, 3, void, filesystem_storage_write,
         assert(blocks.start <= blocks.end); // XXX tmp
     } while (range_span(blocks) > 0);
 
-    if (fsfile_get_length(f) < q.end) {
-        tfs_debug("   append; update length to %ld\n", q.end);
-        fsfile_set_length(f, q.end);
-        log_write_eav(fs->tl, f->md, sym(filelength), value_from_u64(fs->h, q.end));
+    /* appends held in the cache may have taken the length further */
+    if (f->log_length < q.end) {
+        tfs_debug("   append; log length %ld\n", q.end);
+        f->log_length = q.end;
+        f->length = MAX(f->length, q.end);
+        fsfile_write_eav(f, f->md, sym(filelength), value_from_u64(fs->h, q.end));
     }
   out:
     apply(sh, s);
 }
 
+/* Writes go through the cache, which may hold appends back until
+   writeback, so the length seen by readers is set here. */
+closure_function(1, 3, void, filesystem_write,
+                 fsfile, f,
+                 sg_list, sg, range, q, status_handler, complete)
+{
+    fsfile f = bound(f);
+    if (sg && f->length < q.end)
+        f->length = q.end;
+    apply(pagecache_node_get_writer(f->cache_node), sg, q, complete);
+}
+
 closure_function(3, 1, void, filesystem_write_complete,
                  sg_list, sg, u64, length, io_status_handler, io_complete,
                  status, s)
@@ -702,26 +804,120 @@ boolean filesystem_truncate(filesystem fs, fsfile f, u64 len)
         return true;
     }
     fsfile_set_length(f, len);
-    log_write_eav(fs->tl, f->md, sym(filelength), value_from_u64(fs->h, len));
+    fsfile_write_eav(f, f->md, sym(filelength), value_from_u64(fs->h, len));
     return false;
 }
 
-closure_function(3, 1, void, log_flush_completed,
-                 filesystem, fs, status_handler, completion, boolean, sync_complete,
+closure_function(4, 1, void, volume_sync_completed,
+                 filesystem, fs, status_handler, completion, boolean, compact, boolean, log_complete,
                  status, s)
 {
-    if (is_ok(s) && !bound(sync_complete)) {
-        bound(sync_complete) = true;
-        pagecache_sync_volume(bound(fs)->pv, (status_handler)closure_self());
+    if (is_ok(s) && !bound(log_complete)) {
+        bound(log_complete) = true;
+        if (bound(compact))
+            log_compact(bound(fs)->tl, (status_handler)closure_self());
+        else
+            log_flush(bound(fs)->tl, (status_handler)closure_self());
     } else {
         apply(bound(completion), s);
         closure_finish();
     }
 }
 
+/* Dirty pages are written back ahead of the log flush, as doing so
+   may allocate extents. */
 void filesystem_flush(filesystem fs, status_handler completion)
 {
-    log_flush(fs->tl, closure(fs->h, log_flush_completed, fs, completion, false));
+    pagecache_sync_volume(fs->pv, closure(fs->h, volume_sync_completed, fs, completion, false, false));
+}
+
+void filesystem_flush_log(filesystem fs, status_handler completion)
+{
+    log_flush(fs->tl, completion);
+}
+
+/* As with a flush, dirty pages go first, so that the snapshot has the
+   extents they end up in. */
+void filesystem_compact_log(filesystem fs, status_handler completion)
+{
+    pagecache_sync_volume(fs->pv, closure(fs->h, volume_sync_completed, fs, completion, true, false));
+}
+
+/* Start compacting the log if its dictionary has grown well beyond the
+   last snapshot, to let go of objects since removed; for use under
+   memory pressure. Returns true if compaction was started. */
+boolean filesystem_shrink_log(filesystem fs)
+{
+    if (!fs->w || !log_dictionary_bloated(fs->tl))
+        return false;
+    filesystem_compact_log(fs, ignore_status);
+    return true;
+}
+
+u64 filesystem_log_size(filesystem fs)
+{
+    return log_storage_size(fs->tl);
+}
+
+u64 filesystem_log_end(filesystem fs)
+{
+    return log_storage_end(fs->tl);
+}
+
+closure_function(3, 1, void, fsfile_sync_complete,
+                 fsfile, f, boolean, datasync, status_handler, completion,
+                 status, s)
+{
+    fsfile f = bound(f);
+    log tl = f->fs->tl;
+
+    /* a flush already in progress may not cover the latest records */
+    if (is_ok(s) && !log_flushed(tl, bound(datasync) ? f->data_seq : f->md_seq)) {
+        log_flush(tl, (status_handler)closure_self());
+        return;
+    }
+    apply(bound(completion), s);
+    closure_finish();
+}
+
+/* Write back the dirty pages of a single file, followed by the log
+   records it depends on. Unrelated dirty pages are left in the cache. */
+void fsfile_flush(fsfile f, boolean datasync, status_handler completion)
+{
+    pagecache_sync_node(f->cache_node, closure(f->fs->h, fsfile_sync_complete,
+                                               f, datasync, completion));
+}
+
+closure_function(1, 1, void, fsfile_trim_complete,
+                 fsfile, f,
+                 status, s)
+{
+    fsfile f = bound(f);
+    /* appends that failed to sync may still be headed for this storage */
+    if (!is_ok(s)) {
+        tfs_debug("%s: f %p, sync failed: %v\n", __func__, f, s);
+        closure_finish();
+        return;
+    }
+    extent ex = (extent)rangemap_lookup_max_lte(f->extentmap, infinity);
+    if (ex != INVALID_ADDRESS && !ex->uninited) {
+        u64 keep = MAX(range_span(ex->node.r), MIN_EXTENT_SIZE >> f->fs->blocksize_order);
+        if (ex->allocated > keep) {
+            tfs_debug("%s: f %p, release 0x%lx blocks\n", __func__, f, ex->allocated - keep);
+            filesystem_release_storage(f->fs, irange(ex->start_block + keep,
+                                                     ex->start_block + ex->allocated));
+            update_extent_allocated(f, ex, keep);
+        }
+    }
+    closure_finish();
+}
+
+/* Storage preallocated past the end of the file is released once any
+   appends held in the cache have been written out. Extents reserved
+   with fallocate are left alone. */
+void fsfile_trim(fsfile f)
+{
+    pagecache_sync_node(f->cache_node, closure(f->fs->h, fsfile_trim_complete, f));
 }
 
 closure_function(2, 1, void, filesystem_op_complete,
@@ -801,7 +997,7 @@ void filesystem_alloc(filesystem fs, tuple t, long offset, long len,
     u64 end = offset + len;
     if (!keep_size && (end > fsfile_get_length(f))) {
         fsfile_set_length(f, end);
-        log_write_eav(fs->tl, t, sym(filelength), value_from_u64(fs->h, end));
+        fsfile_write_eav(f, t, sym(filelength), value_from_u64(fs->h, end));
     }
 done:
     deallocate_rangemap(new_rm, status == FS_STATUS_OK ? stack_closure(assert_no_node) :
@@ -958,14 +1154,11 @@ fsfile allocate_fsfile(filesystem fs, tuple md);
 tuple filesystem_creat(filesystem fs, tuple parent, const char *name)
 {
     tuple dir = fs_new_entry(fs);
-    static buffer off = 0;
-
-    if (!off)
-        off = wrap_buffer_cstring(fs->h, "0");
 
-    /* 'make it a file' by adding an empty extents list */
+    /* 'make it a file' by adding an empty extents list; the length is
+       replaced on log compaction, so it can't be shared */
     table_set(dir, sym(extents), allocate_tuple());
-    table_set(dir, sym(filelength), off);
+    table_set(dir, sym(filelength), value_from_u64(fs->h, 0));
 
     /* record tuple independently so that tlog read can detect the new file */
     log_write(fs->tl, dir);
@@ -1037,11 +1230,16 @@ fsfile allocate_fsfile(filesystem fs, tuple md)
     f->extentmap = allocate_rangemap(fs->h);
     f->fs = fs;
     f->md = md;
-    f->length = 0;
+    f->length = f->log_length = 0;
+    f->md_seq = f->data_seq = 0;
     table_set(fs->files, f->md, f);
     f->cache_node = pn;
     f->read = pagecache_node_get_reader(pn);
+#ifndef TFS_READ_ONLY
+    f->write = closure(fs->h, filesystem_write, f);
+#else
     f->write = pagecache_node_get_writer(pn);
+#endif
     return f;
 }
 
@@ -1110,6 +1308,11 @@ tuple filesystem_getroot(filesystem fs)
     return fs->root;
 }
 
+pagecache fs_pagecache(filesystem fs)
+{
+    return fs->pc;
+}
+
 u64 fs_blocksize(filesystem fs)
 {
     return U64_FROM_BIT(fs->blocksize_order);
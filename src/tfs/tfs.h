@@ -9,6 +9,7 @@ void fsfile_set_length(fsfile f, u64 length);
 tuple fsfile_get_meta(fsfile f);
 sg_io fsfile_get_reader(fsfile f);
 sg_io fsfile_get_writer(fsfile f);
+pagecache_node fsfile_get_cachenode(fsfile f);
 
 extern io_status_handler ignore_io_status;
 
@@ -44,6 +45,11 @@ void filesystem_write_eav(filesystem fs, tuple t, symbol a, value v);
 
 boolean filesystem_truncate(filesystem fs, fsfile f, u64 len);
 void filesystem_flush(filesystem fs, status_handler completion);
+void filesystem_flush_log(filesystem fs, status_handler completion);
+void filesystem_compact_log(filesystem fs, status_handler completion);
+boolean filesystem_shrink_log(filesystem fs);
+u64 filesystem_log_size(filesystem fs);
+u64 filesystem_log_end(filesystem fs);
 
 timestamp filesystem_get_atime(filesystem fs, tuple t);
 timestamp filesystem_get_mtime(filesystem fs, tuple t);
@@ -61,7 +67,8 @@ fsfile fsfile_from_node(filesystem fs, tuple n);
 fsfile file_lookup(filesystem fs, vector v);
 void filesystem_read_entire(filesystem fs, tuple t, heap bufheap, buffer_handler c, status_handler s);
 fsfile allocate_fsfile(filesystem fs, tuple md);
-// XXX per-file flush
+void fsfile_flush(fsfile f, boolean datasync, status_handler completion);
+void fsfile_trim(fsfile f);
 
 typedef enum {
     FS_STATUS_OK = 0,
@@ -99,6 +106,7 @@ void filesystem_exchange(filesystem fs, tuple parent1, symbol sym1,
 
 tuple filesystem_getroot(filesystem fs);
 
+pagecache fs_pagecache(filesystem fs);
 u64 fs_blocksize(filesystem fs);
 u64 fs_totalblocks(filesystem fs);
 u64 fs_freeblocks(filesystem fs);
@@ -35,9 +35,12 @@ typedef struct fsfile {
     filesystem fs;
     pagecache_node cache_node;
     u64 length;
+    u64 log_length;             /* behind length while appends are in the cache */
     tuple md;
     sg_io read;
     sg_io write;
+    u64 md_seq;                 /* last log record for the file */
+    u64 data_seq;               /* last one needed to retrieve its data */
 } *fsfile;
 
 typedef struct extent {
@@ -49,12 +52,20 @@ typedef struct extent {
     boolean uninited;
 } *extent;
 
-void ingest_extent(fsfile f, symbol foff, tuple value);
+void ingest_extent(fsfile f, symbol foff, tuple value, boolean reserve);
+void fixup_directory(tuple parent, tuple dir);
 
 log log_create(heap h, filesystem fs, boolean initialize, status_handler sh);
 void log_write(log tl, tuple t);
 void log_write_eav(log tl, tuple e, symbol a, value v);
 void log_flush(log tl, status_handler completion);
+u64 log_seq(log tl);
+boolean log_flushed(log tl, u64 seq);
+void log_compact(log tl, status_handler complete);
+boolean log_dictionary_bloated(log tl);
+u64 log_storage_size(log tl);
+u64 log_storage_end(log tl);
+void log_release_storage(log tl, range blocks);
 void flush(filesystem fs, status_handler);
 boolean filesystem_reserve_storage(filesystem fs, range storage_blocks);
 void filesystem_storage_op(filesystem fs, sg_list sg, merge m, range blocks, block_io op);
@@ -23,6 +23,14 @@ static const char *tfs_magic = "NVMTFS";
 
 #define COMPLETION_QUEUE_SIZE 10
 
+/* Compact when the chain of extensions reaches this length, or twice
+   the length it had after the last compaction, whichever is larger. */
+#define TFS_LOG_COMPACT_MIN_EXTENSIONS 4
+
+/* Under memory pressure, compact when the dictionary holds at least
+   this many objects and twice as many as after the last compaction. */
+#define TFS_LOG_SHRINK_MIN_ENTRIES 4096
+
 #define MAX_VARINT_SIZE 10 /* to encode 64 significant bits */
 
 #define TFS_EXTENSION_HEADER_BYTES (TFS_MAGIC_BYTES + 2 * MAX_VARINT_SIZE)
@@ -31,6 +39,11 @@ static const char *tfs_magic = "NVMTFS";
 
 typedef struct log *log;
 typedef struct log_ext *log_ext;
+typedef struct dir_index *dir_index;
+
+declare_closure_struct(1, 2, void, log_dictionary_load,
+                       log, tl,
+                       tuple, dictionary, void *, k);
 
 declare_closure_struct(1, 0, void, log_ext_free,
                        log_ext, ext);
@@ -61,6 +74,66 @@ struct log {
     boolean flushing;
     timer flush_timer;
     vector flush_completions;
+
+    /* records are numbered in the order they are written */
+    u64 seq;
+    u64 flushing_seq;
+    u64 flushed_seq;
+
+    tuple root;                 /* as read from the log */
+    buffer extensions;          /* sector ranges chained from the first extension */
+    u64 snapshot_extensions;    /* chain length after the last compaction */
+    u64 snapshot_entries;       /* dictionary size after the last compaction or mount */
+
+    boolean mounted;            /* log read through; dictionary reversed if writable */
+    boolean written;            /* some of the log is on storage */
+    table snapshot_extents;     /* read from directory indexes, storage reserved */
+    rangemap snapshot_storage;  /* storage record less releases since, reserved at end of log */
+    vector indexes;             /* directory indexes read, by ascending base */
+    closure_struct(log_dictionary_load, dictionary_load);
+};
+
+/* A snapshot describes each directory with an index record: a tuple
+   holding, under the key "directory_index", a buffer laid out as
+   follows (u32s are little-endian).
+
+     header      u32 entries, u32 buckets (a power of 2), u32 indices
+     buckets     u32 first entry of each hash chain
+     entries     struct dir_index_entry, in dictionary index order
+     data        per entry: varint name length, name, varint dictionary
+                 index of the children of a subdirectory (0 if none),
+                 the entry tuple encoded against a dictionary of its own
+
+   Reading the record takes the next "indices" dictionary indices,
+   starting at base: base is the children tuple, and index i of the
+   dictionary of an entry is base + first + i - 1. Entries are left
+   encoded until looked up, or until something in them is referred to
+   by a later record. */
+#define DIR_INDEX_HEADER_SIZE (3 * sizeof(u32))
+#define DIR_INDEX_NONE ((u32)-1)
+
+typedef struct dir_index_entry {
+    u32 hash;                   /* low bits of fnv64 of the name */
+    u32 next;                   /* in hash chain */
+    u32 offset;                 /* of entry data */
+    u32 first;                  /* dictionary index, relative to base */
+} *dir_index_entry;
+
+declare_closure_struct(1, 2, void, dir_index_load,
+                       dir_index, di,
+                       tuple, t, void *, k);
+
+struct dir_index {
+    log tl;
+    tuple children;
+    u64 base;
+    u64 indices;
+    buffer index;               /* released once all entries are loaded */
+    u32 entries;
+    u32 buckets;
+    u32 remain;
+    u64 *loaded;                /* bitmap of entries */
+    closure_struct(dir_index_load, load);
 };
 
 closure_function(0, 3, void, zero_fill,
@@ -237,6 +310,7 @@ log_ext log_extend(log tl, u64 size, status_handler sh) {
     range r = irangel(offset, size);
     tlog_debug("new log extension sectors %R\n", r);
     log_ext new_ext = open_log_extension(tl, r);
+    buffer_write(tl->extensions, &r, sizeof(r));
 
     /* flush new extension and link on completion */
     log_ext old_ext = tl->current;
@@ -295,19 +369,46 @@ static inline boolean log_write_internal(log tl, merge m)
     return true;
 }
 
+static void log_set_dirty(log tl);
+
+static inline u64 log_extension_count(log tl)
+{
+    return buffer_length(tl->extensions) / sizeof(range);
+}
+
+/* Common completion of a flush or compaction */
+static void log_flush_done(log tl, status s)
+{
+    /* would need to move these to runqueue if a flush is ever invoked from a tfs op */
+    if (is_ok(s))
+        tl->flushed_seq = tl->flushing_seq;
+    tl->dirty = false;
+    tl->flushing = false;
+
+    /* records written while the flush was in progress are left for the next one */
+    if (tl->flushed_seq != tl->seq)
+        log_set_dirty(tl);
+
+    /* a completion may start another flush, so only apply those queued so far */
+    int n = vector_length(tl->flush_completions);
+    for (int i = 0; i < n; i++) {
+        status_handler sh = vector_delete(tl->flush_completions, 0);
+        apply(sh, s);
+    }
+
+#ifdef STAGE3
+    if (is_ok(s) && tl->root && !tl->flushing &&
+        log_extension_count(tl) >= MAX(TFS_LOG_COMPACT_MIN_EXTENSIONS,
+                                       2 * tl->snapshot_extensions))
+        log_compact(tl, ignore_status);
+#endif
+}
+
 closure_function(1, 1, void, log_flush_complete,
                  log, tl,
                  status, s)
 {
-    /* would need to move these to runqueue if a flush is ever invoked from a tfs op */
-    bound(tl)->dirty = false;
-    if (bound(tl)->flush_completions) {
-        status_handler sh;
-        vector_foreach(bound(tl)->flush_completions, sh)
-            apply(sh, s);
-        vector_clear(bound(tl)->flush_completions);
-    }
-    bound(tl)->flushing = false;
+    log_flush_done(bound(tl), s);
     closure_finish();
 }
 
@@ -328,6 +429,8 @@ void log_flush(log tl, status_handler completion)
         tl->flush_timer = 0;
     }
     tl->flushing = true;
+    tl->written = true;
+    tl->flushing_seq = tl->seq;
     merge m = allocate_merge(tl->h, closure(tl->h, log_flush_complete, tl));
     status_handler sh = apply_merge(m);
     if (!log_write_internal(tl, m)) {
@@ -372,31 +475,450 @@ void log_write_eav(log tl, tuple e, symbol a, value v)
     encode_eav(tl->tuple_staging, tl->dictionary, e, a, v);
     len = buffer_length(tl->tuple_staging) - len;
     vector_push(tl->encoding_lengths, (void *)len);
+    tl->seq++;
     log_set_dirty(tl);
 }
 
 void log_write(log tl, tuple t)
 {
     tlog_debug("log_write: tl %p, t %p\n", tl, t);
+    /* as it will be at mount, the first tuple in the log is the root */
+    if (!tl->root && dictionary_reserve(tl->dictionary, 0) == 1)
+        tl->root = t;
     u64 len = buffer_length(tl->tuple_staging);
     encode_tuple(tl->tuple_staging, tl->dictionary, t);
     len = buffer_length(tl->tuple_staging) - len;
     vector_push(tl->encoding_lengths, (void *)len);
+    tl->seq++;
     log_set_dirty(tl);
 }
 
-#endif /* !TLOG_READ_ONLY */
+u64 log_seq(log tl)
+{
+    return tl->seq;
+}
 
-static boolean log_parse_tuple(log tl, buffer b)
+/* Whether records up to seq have made it to storage */
+boolean log_flushed(log tl, u64 seq)
 {
-    tuple dv = decode_value(tl->h, tl->dictionary, b);
-    tlog_debug("   decoded %v\n", dv);
-    if (tagof(dv) != tag_tuple)
+    return tl->flushed_seq >= seq;
+}
+
+/* The dictionary keeps every object ever logged, including those since
+   removed from the tree, until the log is compacted. */
+boolean log_dictionary_bloated(log tl)
+{
+    u64 n = table_elements(tl->dictionary);
+    return tl->mounted && !tl->flushing && n >= TFS_LOG_SHRINK_MIN_ENTRIES &&
+        n > 2 * tl->snapshot_entries;
+}
+
+u64 log_storage_size(log tl)
+{
+    return TFS_LOG_DEFAULT_EXTENSION_SIZE +
+        bytes_from_sectors(tl->fs, log_extension_count(tl) *
+                           (TFS_LOG_DEFAULT_EXTENSION_SIZE >> tl->fs->blocksize_order));
+}
+
+/* Extensions are read whole, so storage must extend to the end of each. */
+u64 log_storage_end(log tl)
+{
+    u64 end = TFS_LOG_DEFAULT_EXTENSION_SIZE;
+    buffer b = tl->extensions;
+    for (range *r = buffer_ref(b, 0); r < (range *)buffer_ref(b, buffer_length(b)); r++)
+        end = MAX(end, bytes_from_sectors(tl->fs, r->end));
+    return end;
+}
+
+closure_function(1, 3, boolean, log_snapshot_filter,
+                 table, dictionary,
+                 tuple, t, symbol, a, value, v)
+{
+    /* Directory back-links are restored at mount, directory contents
+       go to indexes of their own, and tuples that were never logged
+       (special files and such) aren't meant to persist. */
+    if (a == sym_this(".") || a == sym_this("..") || a == sym(children))
         return false;
+    return !v || tagof(v) != tag_tuple || table_find(bound(dictionary), v) != 0;
+}
+
+closure_function(1, 3, boolean, log_snapshot_link,
+                 tuple, root,
+                 tuple, t, symbol, a, value, v)
+{
+    return t == bound(root) && a == sym(children);
+}
+
+static void log_snapshot_record(log tl, tuple t, tuple_filter filter)
+{
+    buffer b = tl->tuple_staging;
+    u64 len = buffer_length(b);
+    encode_tuple_filtered(b, tl->dictionary, t, filter);
+    vector_push(tl->encoding_lengths, (void *)(buffer_length(b) - len));
+    tl->seq++;
+}
 
+/* File lengths aren't kept current in the tuples, and in a snapshot,
+   the tuple is all there is of a file. */
+static void log_snapshot_file_length(log tl, tuple t)
+{
+    fsfile f = table_find(tl->fs->files, t);
+    if (!f || !table_find(t, sym(extents)))
+        return;
+    buffer old = table_find(t, sym(filelength));
+    table_set(t, sym(filelength), value_from_u64(tl->h, fsfile_get_length(f)));
+    if (old)
+        deallocate_buffer(old);
+}
+
+/* Stage an index record for the entries of dir, preceded by those of
+   its subdirectories, and return the dictionary index of its children. */
+static u64 log_snapshot_directory(log tl, table olddict, tuple dir)
+{
+    tuple c = children(dir);
+    tuple_filter filter = stack_closure(log_snapshot_filter, olddict);
+    u32 n = 0;
+    table_foreach(c, k, v) {
+        if (k != sym_this(".") && k != sym_this("..") && table_find(olddict, v))
+            n++;
+    }
+    u32 buckets = 1;
+    while (buckets < n)
+        buckets <<= 1;
+
+    struct dir_index_entry *entries = allocate(tl->h, (n ? n : 1) * sizeof(struct dir_index_entry));
+    buffer data = allocate_buffer(tl->h, PAGESIZE);
+    table ids = allocate_table(tl->h, identity_key, pointer_equal);
+    assert(entries != INVALID_ADDRESS && data != INVALID_ADDRESS && ids != INVALID_ADDRESS);
+    u32 e = 0;
+    u64 first = 1;
+    table_foreach(c, k, v) {
+        if (k == sym_this(".") || k == sym_this("..") || !table_find(olddict, v))
+            continue;
+        buffer name = symbol_string(k);
+        entries[e].hash = fnv64(name);
+        entries[e].offset = buffer_length(data);
+        entries[e].first = first;
+        push_varint(data, buffer_length(name));
+        push_buffer(data, name);
+        push_varint(data, table_find(v, sym(children)) ?
+                    log_snapshot_directory(tl, olddict, v) : 0);
+        log_snapshot_file_length(tl, v);
+        table local = allocate_table(tl->h, identity_key, pointer_equal);
+        assert(local != INVALID_ADDRESS);
+        encode_tuple_filtered(data, local, v, filter);
+        table_foreach(local, x, i) {
+            if (x && tagof(x) == tag_tuple)
+                table_set(ids, x, pointer_from_u64(first + u64_from_pointer(i) - 1));
+        }
+        first += dictionary_reserve(local, 0) - 1;
+        deallocate_table(local);
+        e++;
+    }
+
+    buffer index = allocate_buffer(tl->h, DIR_INDEX_HEADER_SIZE + buckets * sizeof(u32) +
+                                   n * sizeof(struct dir_index_entry) + buffer_length(data));
+    assert(index != INVALID_ADDRESS);
+    buffer_write_le32(index, n);
+    buffer_write_le32(index, buckets);
+    buffer_write_le32(index, first);
+    u32 *heads = buffer_ref(index, DIR_INDEX_HEADER_SIZE);
+    buffer_produce(index, buckets * sizeof(u32));
+    for (u32 i = 0; i < buckets; i++)
+        heads[i] = DIR_INDEX_NONE;
+    for (u32 i = 0; i < n; i++) {
+        u32 *head = &heads[entries[i].hash & (buckets - 1)];
+        entries[i].next = *head;
+        *head = i;
+    }
+    buffer_write(index, entries, n * sizeof(struct dir_index_entry));
+    push_buffer(index, data);
+    deallocate(tl->h, entries, (n ? n : 1) * sizeof(struct dir_index_entry));
+    deallocate_buffer(data);
+
+    /* The record tuple itself is of no further use. */
+    tuple r = allocate_tuple();
+    table_set(r, sym(directory_index), index);
+    log_snapshot_record(tl, r, filter);
+    table_set(tl->dictionary, r, 0);
+    deallocate_tuple(r);
+    deallocate_buffer(index);
+
+    u64 base = dictionary_reserve(tl->dictionary, first);
+    table_set(tl->dictionary, c, pointer_from_u64(base));
+    table_foreach(ids, x, i)
+        table_set(tl->dictionary, x, pointer_from_u64(base + u64_from_pointer(i)));
+    deallocate_table(ids);
+    return base;
+}
+
+/* Files in directory indexes may not be loaded for a while after
+   mount, so the storage taken by their extents is recorded in one go,
+   as varint pairs of start block and length. Storage released after
+   the snapshot is logged (see log_release_storage) and taken out of
+   the record as the log is read. */
+static void log_snapshot_storage(log tl, tuple_filter filter)
+{
+    buffer storage = allocate_buffer(tl->h, PAGESIZE);
+    assert(storage != INVALID_ADDRESS);
+    table_foreach(tl->fs->files, md, f) {
+        if (!table_find(tl->dictionary, md))
+            continue;
+        rangemap_foreach(((fsfile)f)->extentmap, n) {
+            extent ex = (extent)n;
+            push_varint(storage, ex->start_block);
+            push_varint(storage, ex->allocated);
+        }
+    }
+    tuple r = allocate_tuple();
+    table_set(r, sym(storage), storage);
+    log_snapshot_record(tl, r, filter);
+    table_set(tl->dictionary, r, 0);
+    deallocate_tuple(r);
+    deallocate_buffer(storage);
+}
+
+/* Log the release of storage blocks from a file, which may have been
+   recorded as in use by the last snapshot. */
+void log_release_storage(log tl, range blocks)
+{
+    buffer released = allocate_buffer(tl->h, 2 * sizeof(u64));
+    assert(released != INVALID_ADDRESS);
+    push_varint(released, blocks.start);
+    push_varint(released, range_span(blocks));
+    tuple r = allocate_tuple();
+    table_set(r, sym(storage_release), released);
+    log_write(tl, r);
+    table_set(tl->dictionary, r, 0);
+    deallocate_tuple(r);
+    deallocate_buffer(released);
+}
+
+/* Stage records which recreate the tree reachable from the log root,
+   as encoded against a fresh dictionary: the root itself, the indexes
+   of all directories, the link from the root to its children and the
+   storage in use by files. */
+static void log_snapshot(log tl, table olddict)
+{
+    tuple_filter filter = stack_closure(log_snapshot_filter, olddict);
+    log_snapshot_record(tl, tl->root, filter);
+    log_snapshot_directory(tl, olddict, tl->root);
+    log_snapshot_record(tl, tl->root, stack_closure(log_snapshot_link, tl->root));
+    log_snapshot_storage(tl, filter);
+}
+
+/* Directories must be loaded, against the dictionary in use, before a
+   snapshot can be taken. Indexes not reachable from the root are left
+   behind. */
+static void log_load_directory(tuple dir)
+{
+    tuple c = children(dir);
+    if (!c)
+        return;
+    table_foreach(c, k, v) {
+        if (k != sym_this(".") && k != sym_this("..") && tagof(v) == tag_tuple)
+            log_load_directory(v);
+    }
+}
+
+static void dir_index_release(dir_index di);
+
+static void log_release_indexes(log tl)
+{
+    log_load_directory(tl->root);
+    dir_index di;
+    vector_foreach(tl->indexes, di)
+        dir_index_release(di);
+    vector_clear(tl->indexes);
+}
+
+/* Point the first extension, which is where the log is read from at
+   mount, to the head of the current chain. The link fits within a
+   single block, so the switch is atomic. */
+static void log_compact_switch(log tl, status_handler sh)
+{
+    range sectors = irange(0, TFS_LOG_DEFAULT_EXTENSION_SIZE >> tl->fs->blocksize_order);
+    log_ext ext = open_log_extension(tl, sectors);
+    if (ext == INVALID_ADDRESS) {
+        apply(sh, timm("result", "unable to open log extension"));
+        return;
+    }
+    range head = *(range *)buffer_ref(tl->extensions, 0);
+    log_extension_init(ext);
+    push_u8(ext->staging, LOG_EXTENSION_LINK);
+    push_varint(ext->staging, head.start);
+    push_varint(ext->staging, range_span(head));
+    flush_log_extension(ext, true, sh);
+}
+
+closure_function(5, 1, void, log_compact_complete,
+                 log, tl, log_ext, old_ext, buffer, old_extensions, status_handler, complete, int, phase,
+                 status, s)
+{
+    log tl = bound(tl);
+    tlog_debug("%s: phase %d, status %v\n", __func__, bound(phase), s);
+    if (is_ok(s)) {
+        switch (bound(phase)++) {
+        case 0:
+            /* the snapshot must be on storage before it is linked... */
+            pagecache_sync_volume(tl->fs->pv, (status_handler)closure_self());
+            return;
+        case 1:
+            log_compact_switch(tl, (status_handler)closure_self());
+            return;
+        case 2:
+            /* ...and the link before the old extensions are reused */
+            pagecache_sync_volume(tl->fs->pv, (status_handler)closure_self());
+            return;
+        }
+        buffer b = bound(old_extensions);
+        for (range *r = buffer_ref(b, 0); r < (range *)buffer_ref(b, buffer_length(b)); r++)
+            deallocate_u64((heap)tl->fs->storage, r->start, range_span(*r));
+        tl->snapshot_extensions = log_extension_count(tl);
+    } else {
+        /* The old chain remains the one on record; leave its storage be. */
+        msg_err("log compaction failed: %v\n", s);
+    }
+    deallocate_buffer(bound(old_extensions));
+    close_log_extension(bound(old_ext));
+    log_flush_done(tl, s);
+    apply(bound(complete), s);
+    closure_finish();
+}
+
+closure_function(2, 1, void, log_compact_retry,
+                 log, tl, status_handler, complete,
+                 status, s)
+{
+    if (is_ok(s))
+        log_compact(bound(tl), bound(complete));
+    else
+        apply(bound(complete), s);
+    closure_finish();
+}
+
+/* Replace the log with a snapshot of the current tuple tree, written
+   to a new chain of extensions, and release the storage of the old
+   chain. Completing a compaction has the effect of a flush. */
+void log_compact(log tl, status_handler complete)
+{
+    tlog_debug("%s: log %p, complete %F, %ld extensions\n", __func__, tl, complete,
+               log_extension_count(tl));
+    if (!tl->root) {
+        apply(complete, timm("result", "no log root to compact from"));
+        return;
+    }
+    if (tl->flushing) {
+        status_handler retry = closure(tl->h, log_compact_retry, tl, complete);
+        if (retry == INVALID_ADDRESS)
+            apply(complete, timm("result", "failed to allocate retry closure"));
+        else
+            vector_push(tl->flush_completions, retry);
+        return;
+    }
+
+    /* A new log with nothing on storage yet, as made by mkfs, is simply
+       replaced by the snapshot. */
+    if (!tl->written) {
+        table dictionary = allocate_table(tl->h, identity_key, pointer_equal);
+        if (dictionary == INVALID_ADDRESS) {
+            apply(complete, timm("result", "failed to allocate dictionary"));
+            return;
+        }
+        buffer_clear(tl->tuple_staging);
+        vector_clear(tl->encoding_lengths);
+        table olddict = tl->dictionary;
+        tl->dictionary = dictionary;
+        log_snapshot(tl, olddict);
+        deallocate_table(olddict);
+        tl->snapshot_entries = table_elements(dictionary);
+        log_set_dirty(tl);
+        log_flush(tl, complete);
+        return;
+    }
+
+    u64 size = TFS_LOG_DEFAULT_EXTENSION_SIZE >> tl->fs->blocksize_order;
+    u64 offset = allocate_u64((heap)tl->fs->storage, size);
+    if (offset == INVALID_PHYSICAL) {
+        apply(complete, timm("result", "failed to allocate log extension"));
+        return;
+    }
+    range r = irangel(offset, size);
+    log_ext ext = open_log_extension(tl, r);
+    if (ext == INVALID_ADDRESS)
+        goto fail_dealloc_storage;
+    table dictionary = allocate_table(tl->h, identity_key, pointer_equal);
+    if (dictionary == INVALID_ADDRESS)
+        goto fail_close_ext;
+    buffer extensions = allocate_buffer(tl->h, buffer_length(tl->extensions) + sizeof(range));
+    if (extensions == INVALID_ADDRESS)
+        goto fail_dealloc_dict;
+    status_handler sh = closure(tl->h, log_compact_complete, tl, tl->current, tl->extensions,
+                                complete, 0);
+    if (sh == INVALID_ADDRESS)
+        goto fail_dealloc_extensions;
+
+    if (tl->flush_timer) {
+        remove_timer(tl->flush_timer, 0);
+        tl->flush_timer = 0;
+    }
+    tl->flushing = true;
+
+    /* Staged records refer to the old dictionary, and the snapshot
+       covers them anyway. */
+    log_release_indexes(tl);
+    buffer_clear(tl->tuple_staging);
+    vector_clear(tl->encoding_lengths);
+    table olddict = tl->dictionary;
+    tl->dictionary = dictionary;
+    tl->current = ext;
+    tl->extensions = extensions;
+    buffer_write(extensions, &r, sizeof(r));
+    log_extension_init(ext);
+    log_snapshot(tl, olddict);
+    deallocate_table(olddict);
+    tl->snapshot_entries = table_elements(dictionary);
+    tl->flushing_seq = tl->seq;
+
+    merge m = allocate_merge(tl->h, sh);
+    sh = apply_merge(m);
+    if (!log_write_internal(tl, m)) {
+        apply(sh, timm("result", "log_write_internal failed"));
+        return;
+    }
+    flush_log_extension(tl->current, false, sh);
+    return;
+  fail_dealloc_extensions:
+    deallocate_buffer(extensions);
+  fail_dealloc_dict:
+    deallocate_table(dictionary);
+  fail_close_ext:
+    close_log_extension(ext);
+  fail_dealloc_storage:
+    deallocate_u64((heap)tl->fs->storage, offset, size);
+    apply(complete, timm("result", "failed to allocate log compaction state"));
+}
+
+#endif /* !TLOG_READ_ONLY */
+
+/* Until the log is read through, and for good if it isn't to be written,
+   the dictionary maps indices to objects. */
+static void log_dictionary_set(log tl, u64 i, void *x)
+{
+    if (tl->mounted && tl->fs->w)
+        table_set(tl->dictionary, x, pointer_from_u64(i));
+    else
+        table_set(tl->dictionary, pointer_from_u64(i), x);
+}
+
+/* A tuple with extents is the metadata of a file, which gets an fsfile
+   the first time it is seen. Extents seen while the log is read are
+   ingested at the end of it. Those of files from directory indexes
+   have had their storage reserved by the snapshot. */
+static void log_parse_file(log tl, tuple t, boolean indexed)
+{
     fsfile f = 0;
     u64 filelength = infinity;
-    tuple t = (tuple)dv;
 
     table_foreach(t, k, v) {
         if (k == sym(extents)) {
@@ -406,6 +928,14 @@ static boolean log_parse_tuple(log tl, buffer b)
                 f = allocate_fsfile(tl->fs, t);
                 table_set(tl->fs->extents, v, f);
                 tlog_debug("   created fsfile %p\n", f);
+                if (indexed) {
+                    table_foreach(v, off, e) {
+                        if (tl->mounted)
+                            ingest_extent(f, off, e, false);
+                        else
+                            table_set(tl->snapshot_extents, e, e);
+                    }
+                }
             } else {
                 tlog_debug("   found fsfile %p\n", f);
             }
@@ -413,12 +943,279 @@ static boolean log_parse_tuple(log tl, buffer b)
             assert(u64_from_value(v, &filelength));
         }
     }
-        
+
     if (f && filelength != infinity) {
         tlog_debug("   update fsfile length to %ld\n", filelength);
         fsfile_set_length(f, filelength);
     }
+}
+
+static inline dir_index_entry dir_index_get_entry(dir_index di, u32 e)
+{
+    return buffer_ref(di->index, DIR_INDEX_HEADER_SIZE + di->buckets * sizeof(u32) +
+                      e * sizeof(struct dir_index_entry));
+}
+
+static inline u64 dir_index_data_offset(dir_index di, dir_index_entry de)
+{
+    return DIR_INDEX_HEADER_SIZE + di->buckets * sizeof(u32) +
+        di->entries * sizeof(struct dir_index_entry) + de->offset;
+}
+
+static dir_index log_find_index(log tl, u64 i)
+{
+    int lo = 0, hi = vector_length(tl->indexes);
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        dir_index di = vector_get(tl->indexes, mid);
+        if (i < di->base)
+            hi = mid;
+        else if (i >= di->base + di->indices)
+            lo = mid + 1;
+        else
+            return di;
+    }
+    return 0;
+}
+
+static void dir_index_release(dir_index di)
+{
+    if (di->index) {
+        tuple_set_loader(di->children, 0);
+        deallocate_buffer(di->index);
+        deallocate(di->tl->h, di->loaded, pad(di->entries, 64) / 8);
+        di->index = 0;
+    }
+}
+
+static void dir_index_load_entry(dir_index di, u32 e)
+{
+    u64 bit = U64_FROM_BIT(e & 63);
+    if (di->loaded[e / 64] & bit)
+        return;
+    di->loaded[e / 64] |= bit;
+    di->remain--;
+
+    log tl = di->tl;
+    dir_index_entry de = dir_index_get_entry(di, e);
+    u64 offset = dir_index_data_offset(di, de);
+    buffer data = alloca_wrap_buffer(buffer_ref(di->index, offset), buffer_length(di->index) - offset);
+    u64 len = pop_varint(data);
+    symbol name = intern(alloca_wrap_buffer(buffer_ref(data, 0), len));
+    buffer_consume(data, len);
+    u64 sub = pop_varint(data);
+    table local = allocate_table(tl->h, identity_key, pointer_equal);
+    assert(local != INVALID_ADDRESS);
+    tuple t = decode_value(tl->h, local, data);
+    table_foreach(local, i, x) {
+        if (i && tagof(x) == tag_tuple)
+            log_dictionary_set(tl, di->base + de->first + u64_from_pointer(i) - 1, x);
+    }
+    deallocate_table(local);
+    tlog_debug("%s: index %p, entry %d (%b), tuple %p\n", __func__, di, e, symbol_string(name), t);
+
+    if (sub) {
+        dir_index sdi = log_find_index(tl, sub);
+        assert(sdi && sdi->base == sub);
+        table_set(t, sym(children), sdi->children);
+    }
+    table_set(di->children, name, t);
+    log_parse_file(tl, t, true);
+#ifndef TLOG_READ_ONLY
+    /* the directory is fixed up once loaded into */
+    tuple dir = table_find(di->children, sym_this("."));
+    if (dir)
+        fixup_directory(dir, t);
+#endif
+}
+
+static void dir_index_loaded(dir_index di)
+{
+    if (di->remain == 0)
+        dir_index_release(di);
+}
+
+define_closure_function(1, 2, void, dir_index_load,
+                        dir_index, di,
+                        tuple, t, void *, k)
+{
+    dir_index di = bound(di);
+    if (!k) {
+        for (u32 e = 0; e < di->entries; e++)
+            dir_index_load_entry(di, e);
+    } else {
+        buffer name = symbol_string(k);
+        u32 hash = fnv64(name);
+        u32 *heads = buffer_ref(di->index, DIR_INDEX_HEADER_SIZE);
+        for (u32 e = heads[hash & (di->buckets - 1)]; e != DIR_INDEX_NONE;
+             e = dir_index_get_entry(di, e)->next) {
+            dir_index_entry de = dir_index_get_entry(di, e);
+            if (de->hash != hash)
+                continue;
+            u64 offset = dir_index_data_offset(di, de);
+            buffer data = alloca_wrap_buffer(buffer_ref(di->index, offset),
+                                             buffer_length(di->index) - offset);
+            if (pop_varint(data) == buffer_length(name) &&
+                !runtime_memcmp(buffer_ref(data, 0), buffer_ref(name, 0), buffer_length(name))) {
+                dir_index_load_entry(di, e);
+                break;
+            }
+        }
+    }
+    dir_index_loaded(di);
+}
+
+/* Indices not in the dictionary belong to entries of directory indexes
+   which haven't been loaded yet. */
+define_closure_function(1, 2, void, log_dictionary_load,
+                        log, tl,
+                        tuple, dictionary, void *, k)
+{
+    dir_index di = log_find_index(bound(tl), u64_from_pointer(k));
+    if (!di || !di->index)
+        return;
+    u64 i = u64_from_pointer(k) - di->base;
+    u32 lo = 0, hi = di->entries;
+    while (hi - lo > 1) {
+        u32 mid = (lo + hi) / 2;
+        if (dir_index_get_entry(di, mid)->first <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (di->entries > 0 && dir_index_get_entry(di, lo)->first <= i) {
+        dir_index_load_entry(di, lo);
+        dir_index_loaded(di);
+    }
+}
+
+static boolean log_parse_index(log tl, buffer index)
+{
+    if (buffer_length(index) < DIR_INDEX_HEADER_SIZE)
+        return false;
+    u32 *header = buffer_ref(index, 0);
+    u32 entries = header[0], buckets = header[1];
+    if (buckets == 0 || (buckets & (buckets - 1)) ||
+        buffer_length(index) < DIR_INDEX_HEADER_SIZE + buckets * sizeof(u32) +
+        (u64)entries * sizeof(struct dir_index_entry))
+        return false;
+    dir_index di = allocate(tl->h, sizeof(struct dir_index));
+    if (di == INVALID_ADDRESS)
+        return false;
+    di->tl = tl;
+    di->children = allocate_tuple();
+    di->indices = header[2];
+    di->base = dictionary_reserve(tl->dictionary, di->indices);
+    di->index = index;
+    di->entries = entries;
+    di->buckets = buckets;
+    di->remain = entries;
+    di->loaded = allocate_zero(tl->h, pad(entries, 64) / 8);
+    assert(di->loaded != INVALID_ADDRESS);
+    tlog_debug("%s: index %p, %d entries, base 0x%lx, %ld indices\n", __func__,
+               di, entries, di->base, di->indices);
+    log_dictionary_set(tl, di->base, di->children);
+    if (vector_length(tl->indexes) == 0)
+        tuple_set_loader(tl->dictionary, (tuple_loader)&tl->dictionary_load);
+    vector_push(tl->indexes, di);
+    if (entries > 0)
+        tuple_set_loader(di->children, init_closure(&di->load, dir_index_load, di));
+    else
+        dir_index_release(di);
+    return true;
+}
+
+static void log_storage_add(log tl, range r)
+{
+    rmnode n = allocate(tl->h, sizeof(struct rmnode));
+    assert(n != INVALID_ADDRESS);
+    rmnode_init(n, r);
+    if (!rangemap_insert(tl->snapshot_storage, n)) {
+        msg_err("storage blocks %R recorded twice\n", r);
+        deallocate(tl->h, n, sizeof(struct rmnode));
+    }
+}
+
+/* Take the blocks of q out of the storage recorded by the snapshot.
+   Blocks allocated since the snapshot aren't there, and are left to
+   the extents which took them. */
+static void log_storage_remove(log tl, range q)
+{
+    rangemap rm = tl->snapshot_storage;
+    rmnode n = rangemap_lookup_at_or_next(rm, q.start);
+    while (n != INVALID_ADDRESS && n->r.start < q.end) {
+        rmnode next = rangemap_next_node(rm, n);
+        range r = n->r;
+        rangemap_remove_node(rm, n);
+        if (r.start < q.start) {
+            rmnode_init(n, irange(r.start, q.start));
+            rangemap_insert(rm, n);
+            n = 0;
+        }
+        if (r.end > q.end) {
+            if (!n) {
+                n = allocate(tl->h, sizeof(struct rmnode));
+                assert(n != INVALID_ADDRESS);
+            }
+            rmnode_init(n, irange(q.end, r.end));
+            rangemap_insert(rm, n);
+            n = 0;
+        }
+        if (n)
+            deallocate(tl->h, n, sizeof(struct rmnode));
+        n = next;
+    }
+}
+
+closure_function(1, 1, void, log_storage_reserve,
+                 log, tl,
+                 rmnode, n)
+{
+    if (!filesystem_reserve_storage(bound(tl)->fs, n->r))
+        msg_err("unable to reserve storage blocks %R\n", n->r);
+    deallocate(bound(tl)->h, n, sizeof(struct rmnode));
+}
+
+static boolean log_parse_storage(log tl, tuple t, symbol k, boolean release)
+{
+    buffer storage = table_find(t, k);
+    if (!storage || tagof(storage) == tag_tuple)
+        return false;
+    while (buffer_length(storage) > 0) {
+        u64 start = pop_varint(storage);
+        range r = irangel(start, pop_varint(storage));
+        if (release)
+            log_storage_remove(tl, r);
+        else
+            log_storage_add(tl, r);
+    }
+    table_set(t, k, 0);
+    deallocate_buffer(storage);
+    return true;
+}
+
+static boolean log_parse_tuple(log tl, buffer b)
+{
+    tuple dv = decode_value(tl->h, tl->dictionary, b);
+    tlog_debug("   decoded %v\n", dv);
+    if (tagof(dv) != tag_tuple)
+        return false;
 
+    tuple t = (tuple)dv;
+    if (log_parse_storage(tl, t, sym(storage), false) ||
+        log_parse_storage(tl, t, sym(storage_release), true))
+        return true;
+    buffer index = table_find(t, sym(directory_index));
+    if (index && tagof(index) != tag_tuple) {
+        table_set(t, sym(directory_index), 0);
+        if (!log_parse_index(tl, index)) {
+            msg_err("invalid directory index record\n");
+            deallocate_buffer(index);
+            return false;
+        }
+        return true;
+    }
+    log_parse_file(tl, t, false);
     return true;
 }
 
@@ -500,6 +1297,7 @@ closure_function(4, 1, void, log_read_complete,
                 s = timm("result", "failed to reserve sectors %R in log extension", r);
                 goto out_apply_status;
             }
+            buffer_write(tl->extensions, &r, sizeof(r));
 #endif
             /* chain to next log extension, carrying status handler to end */
             log_read(tl, sh);
@@ -563,18 +1361,25 @@ closure_function(4, 1, void, log_read_complete,
     b->start = 0;
     tlog_debug("   log parse finished, end now at %d\n", b->end);
 
+    /* what the snapshot recorded as in use is still so, less releases */
+    deallocate_rangemap(tl->snapshot_storage, stack_closure(log_storage_reserve, tl));
+    tl->snapshot_storage = 0;
+
     /* XXX this will only work for reading the log a single time
        through, but at present that's all we do */
     table_foreach(tl->fs->extents, t, f) {
         table_foreach(t, off, e) {
             tlog_debug("   tlog ingesting sym %p, val %p\n", symbol_string(off), e);
-            ingest_extent((fsfile)f, off, e);
+            ingest_extent((fsfile)f, off, e, !table_find(tl->snapshot_extents, e));
         }
     }
+    deallocate_table(tl->snapshot_extents);
+    tl->snapshot_extents = 0;
 
     // not sure we should be passing the root.. anyways, splat the
     // log root onto the given root
     table logroot = (table)table_find(tl->dictionary, pointer_from_u64(1));
+    tl->root = logroot;
     if (logroot) {
         // XXX prob better way
         table_foreach (logroot, k, v) {
@@ -591,9 +1396,13 @@ closure_function(4, 1, void, log_read_complete,
             if (tagof(v) == tag_tuple || tagof(v) == tag_symbol)
                 table_set(newdict, v, k);
         }
+        dictionary_reserve(newdict, dictionary_reserve(tl->dictionary, 0) - 1);
+        tuple_set_loader(tl->dictionary, 0);
         deallocate_table(tl->dictionary);
         tl->dictionary = newdict;
     }
+    tl->snapshot_entries = table_elements(tl->dictionary);
+    tl->mounted = true;
 
   out_apply_status:
     tlog_debug("log_read_complete exit with status %v\n", s);
@@ -650,9 +1459,28 @@ log log_create(heap h, filesystem fs, boolean initialize, status_handler sh)
     tl->dirty = false;
     tl->flushing = false;
     tl->flush_timer = 0;
+    tl->seq = tl->flushing_seq = tl->flushed_seq = 0;
     tl->flush_completions = allocate_vector(tl->h, COMPLETION_QUEUE_SIZE);
     if (tl->flush_completions == INVALID_ADDRESS)
         goto fail_dealloc_encoding_lengths;
+    tl->root = 0;
+    tl->extensions = allocate_buffer(h, 8 * sizeof(range));
+    if (tl->extensions == INVALID_ADDRESS)
+        goto fail_dealloc_completions;
+    tl->snapshot_extensions = 0;
+    tl->snapshot_entries = 0;
+    tl->mounted = false;
+    tl->written = !initialize;
+    tl->indexes = allocate_vector(h, 8);
+    if (tl->indexes == INVALID_ADDRESS)
+        goto fail_dealloc_extensions;
+    tl->snapshot_extents = allocate_table(h, identity_key, pointer_equal);
+    if (tl->snapshot_extents == INVALID_ADDRESS)
+        goto fail_dealloc_indexes;
+    tl->snapshot_storage = allocate_rangemap(h);
+    if (tl->snapshot_storage == INVALID_ADDRESS)
+        goto fail_dealloc_snapshot_extents;
+    init_closure(&tl->dictionary_load, log_dictionary_load, tl);
 
     fs->tl = tl;
     if (initialize) {
@@ -660,12 +1488,21 @@ log log_create(heap h, filesystem fs, boolean initialize, status_handler sh)
         halt("no tlog write support\n");
 #else
         log_extension_init(tl->current);
+        tl->mounted = true;
         apply(sh, STATUS_OK);
 #endif
     } else {
         log_read(tl, sh);
     }
     return tl;
+  fail_dealloc_snapshot_extents:
+    deallocate_table(tl->snapshot_extents);
+  fail_dealloc_indexes:
+    deallocate_vector(tl->indexes);
+  fail_dealloc_extensions:
+    deallocate_buffer(tl->extensions);
+  fail_dealloc_completions:
+    deallocate_vector(tl->flush_completions);
   fail_dealloc_encoding_lengths:
     deallocate_vector(tl->encoding_lengths);
   fail_dealloc_staging:
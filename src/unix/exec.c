@@ -247,7 +247,7 @@ process exec_elf(buffer ex, process kp)
     u64 brk = pad(load_range.end, PAGESIZE) + brk_offset;
     proc->brk = pointer_from_u64(brk);
     proc->heap_base = brk;
-    proc->heap_map = allocate_vmap(proc->vmaps, irange(brk, brk), VMAP_FLAG_WRITABLE);
+    proc->heap_map = allocate_vmap(proc->vmaps, irange(brk, brk), VMAP_FLAG_MMAP | VMAP_FLAG_WRITABLE);
     assert(proc->heap_map != INVALID_ADDRESS);
     exec_debug("entry %p, brk %p (offset 0x%lx)\n", entry, proc->brk, brk_offset);
 
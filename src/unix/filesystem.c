@@ -64,7 +64,7 @@ int resolve_cstring(tuple cwd, const char *f, tuple *entry, tuple *parent)
                     t = false;
                     goto done;
                 }
-                if (!children(t))
+                if (!is_dir(t))
                     return -ENOTDIR;
                 buffer_clear(a);
             }
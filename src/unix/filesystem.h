@@ -18,7 +18,7 @@ static inline buffer linktarget(table x)
 
 static inline boolean is_dir(tuple n)
 {
-    return children(n) ? true : false;
+    return table_find(n, sym(children)) ? true : false;
 }
 
 static inline boolean is_symlink(tuple n)
@@ -1,10 +1,16 @@
+#include <net_system_structs.h>
 #include <unix_internal.h>
 #include <page.h>
+#include <socket.h>
 
+#define IORING_SETUP_SQPOLL     (1 << 1)
 #define IORING_SETUP_CQSIZE     (1 << 3)
 
 #define IORING_FEAT_SINGLE_MMAP     (1 << 0)
 #define IORING_FEAT_RW_CUR_POS      (1 << 3)
+#define IORING_FEAT_SQPOLL_NONFIXED (1 << 7)
+
+#define IORING_SQ_NEED_WAKEUP   (1 << 0)
 
 #define IORING_OFF_SQ_RING  0ULL
 #define IORING_OFF_CQ_RING  0x8000000ULL
@@ -12,7 +18,10 @@
 
 #define IORING_TIMEOUT_ABS  (1 << 0)
 
+#define IORING_FSYNC_DATASYNC   (1 << 0)
+
 #define IORING_ENTER_GETEVENTS  (1 << 0)
+#define IORING_ENTER_SQ_WAKEUP  (1 << 1)
 
 #define IO_URING_OP_SUPPORTED   (1 << 0)
 
@@ -20,7 +29,12 @@
 #define IOUR_CQ_ENTRIES_MAX (2 * IOUR_SQ_ENTRIES_MAX)
 #define IOUR_FILES_MAX      0x8000
 
+#define IOUR_SQ_THREAD_IDLE_DEFAULT 1000    /* milliseconds */
+
 #define IOSQE_FIXED_FILE    (1 << 0)
+#define IOSQE_IO_DRAIN      (1 << 1)
+#define IOSQE_IO_LINK       (1 << 2)
+#define IOSQE_IO_HARDLINK   (1 << 3)
 #define IOSQE_ASYNC         (1 << 4)
 
 //#define IOUR_DEBUG
@@ -47,6 +61,7 @@ struct io_uring_sqe {
         u32 sync_range_flags;
         u32 msg_flags;
         u32 timeout_flags;
+        u32 accept_flags;
     };
     u64 user_data;
     union{
@@ -86,6 +101,10 @@ enum iour_enter_opcode {
     IORING_OP_STATX,
     IORING_OP_READ,
     IORING_OP_WRITE,
+    IORING_OP_FADVISE,
+    IORING_OP_MADVISE,
+    IORING_OP_SEND,
+    IORING_OP_RECV,
     IORING_OP_LAST,
 };
 
@@ -137,6 +156,12 @@ declare_closure_struct(1, 2, sysreturn, iour_close,
                        struct io_uring *, iour,
                        thread, t, io_completion, completion);
 
+declare_closure_struct(1, 0, void, iour_sqpoll,
+                       struct io_uring *, iour);
+
+declare_closure_struct(1, 0, void, iour_defer,
+                       struct io_uring *, iour);
+
 typedef struct io_uring {
     struct fdesc f;    /* must be first */
     heap h;
@@ -164,6 +189,42 @@ typedef struct io_uring {
     u32 cq_timeouts;
     u64 noncancelable_ops;
 
+    /* Completions are posted at cq_tail, and made visible to the application
+     * (with a single eventfd signal and waiter wakeup) when the outermost
+     * completion batch ends, or right away outside of a batch. cq_posted counts
+     * all completions, including those lost to CQ overflow. */
+    u32 cq_tail;
+    u32 cq_posted;
+    u32 cq_batch;
+    boolean cq_pending;
+    boolean cq_notify;
+
+    /* Requests which can't be issued yet: link chains whose in-flight member
+     * has completed (links), and chains or requests held back by
+     * IOSQE_IO_DRAIN, in submission order (deferred). Both lists are serviced
+     * by a runqueue thunk which, while queued, counts as a non-cancelable
+     * operation. sq_requests counts the requests taken from the SQ, each of
+     * which posts exactly one completion, and deferred requests are issued
+     * once cq_posted has caught up with drain_seq. */
+    struct list links;
+    struct list deferred;
+    u32 sq_requests;
+    u32 drain_seq;
+    boolean defer_queued;
+    closure_struct(iour_defer, defer);
+
+    /* SQ polling (IORING_SETUP_SQPOLL): submissions are picked up from the SQ
+     * ring by a runqueue thunk, on behalf of the thread that set up the ring,
+     * until the ring has been idle for sq_idle. While polling is active, the
+     * thunk counts as a non-cancelable operation, and in sqpoll_active, which
+     * keeps a cpu from halting while the thunk is requeued. */
+    thread sq_thread;
+    timestamp sq_idle;
+    timestamp sq_active;
+    boolean sq_polling;
+    boolean sq_stop;
+    closure_struct(iour_sqpoll, sqpoll);
+
     /* When true, the io_uring context is being shut down in the background,
      * i.e. no thread is blocked on close() and the context will be deallocated
      * when its last non-cancelable operation is completed. This can happen if
@@ -174,13 +235,29 @@ typedef struct io_uring {
     io_completion shutdown_completion;
 } *io_uring;
 
-declare_closure_struct(2, 2, void, iour_poll_notify,
+declare_closure_struct(2, 2, boolean, iour_poll_notify,
                        io_uring, iour, struct iour_poll *, p,
                        u64, events, thread, t);
 
+/* A link chain, or a single request submitted with IOSQE_IO_DRAIN: SQEs are
+ * copied when taken from the SQ, and issued one at a time, each after the
+ * completion of the previous one. A live chain counts as a non-cancelable
+ * operation. */
+typedef struct iour_link {
+    struct list l;
+    thread t;           /* submitter, on whose behalf members are issued */
+    u32 seq;            /* requests submitted before the chain */
+    u32 count;
+    u32 next;           /* next member to be issued */
+    boolean drain;
+    boolean canceled;
+    struct io_uring_sqe sqes[0];
+} *iour_link;
+
 typedef struct iour_poll {
     struct list l;
     u64 user_data;
+    iour_link link;
     fdesc f;
     notify_entry ne;
     closure_struct(iour_poll_notify, handler);
@@ -194,6 +271,7 @@ typedef struct iour_timer {
     struct list l;
     unsigned int target;
     u64 user_data;
+    iour_link link;
     timer t;
     closure_struct(iour_timeout, handler);
 } *iour_timer;
@@ -222,6 +300,23 @@ typedef struct iour_timer {
 #define iour_lock(iour)     u64 _irqflags = spin_lock_irq(&(iour)->lock)
 #define iour_unlock(iour)   spin_unlock_irq(&(iour)->lock, _irqflags)
 
+declare_closure_function(1, 0, void, iour_sqpoll,
+                         io_uring, iour);
+declare_closure_function(1, 0, void, iour_defer,
+                         io_uring, iour);
+static void iour_sqpoll_start(io_uring iour);
+
+/* Work left to be done after a completion, once the lock is released */
+struct iour_notify {
+    fdesc eventfd;
+    blockq bq;
+    boolean defer;
+};
+
+static void iour_flush_locked(io_uring iour, struct iour_notify *n);
+static void iour_notify(io_uring iour, struct iour_notify *n);
+static void iour_link_done_locked(io_uring iour, iour_link link, s32 res);
+
 static void iour_release(io_uring iour)
 {
     iour_debug("completion %p", iour->shutdown_completion);
@@ -238,6 +333,8 @@ static void iour_release(io_uring iour)
     release_fdesc(&iour->f);
     deallocate(iour->vh, iour->user_rings, alloc_size);
     deallocate(iour->h, iour->rings, alloc_size);
+    if (iour->sq_thread)
+        thread_release(iour->sq_thread);
     io_completion completion = iour->shutdown_completion;
     deallocate(iour->h, iour, sizeof(*iour));
     if (completion)
@@ -287,6 +384,11 @@ define_closure_function(1, 2, sysreturn, iour_close,
     list_foreach(&deleted_items, l) {
         iour_timer iour_tim = struct_from_list(l, iour_timer, l);
         remove_timer(iour_tim->t, 0);
+        if (iour_tim->link) {
+            irqflags = spin_lock_irq(&iour->lock);
+            iour_link_done_locked(iour, iour_tim->link, -ECANCELED);
+            spin_unlock_irq(&iour->lock, irqflags);
+        }
         deallocate(iour->h, iour_tim, sizeof(*iour_tim));
     }
     irqflags = spin_lock_irq(&iour->lock);
@@ -296,9 +398,23 @@ define_closure_function(1, 2, sysreturn, iour_close,
         iour_poll poller = struct_from_list(l, iour_poll, l);
         notify_remove(poller->f->ns, poller->ne, false);
         fdesc_put(poller->f);
+        if (poller->link) {
+            irqflags = spin_lock_irq(&iour->lock);
+            iour_link_done_locked(iour, poller->link, -ECANCELED);
+            spin_unlock_irq(&iour->lock, irqflags);
+        }
         deallocate(iour->h, poller, sizeof(*poller));
     }
 
+    /* Chains and deferred requests which have not been issued yet are
+     * canceled by the deferred submission thunk. */
+    struct iour_notify n;
+    irqflags = spin_lock_irq(&iour->lock);
+    iour->sq_stop = true;
+    iour_flush_locked(iour, &n);
+    spin_unlock_irq(&iour->lock, irqflags);
+    iour_notify(iour, &n);
+
     irqflags = spin_lock_irq(&iour->lock);
     if (iour->eventfd) {
         fdesc_put(iour->eventfd);
@@ -351,7 +467,8 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     iour_debug("entries %d, flags 0x%x, CQ entries %d", entries, params->flags,
                params->cq_entries);
     if ((entries == 0) || (entries > IOUR_SQ_ENTRIES_MAX) ||
-            (params->flags & ~IORING_SETUP_CQSIZE) || params->resv[0] ||
+            (params->flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_CQSIZE)) ||
+            params->resv[0] ||
             params->resv[1] || params->resv[2] || params->resv[3])
         return -EINVAL;
     params->sq_entries = U64_FROM_BIT(find_order(entries));
@@ -406,8 +523,17 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     list_init(&iour->timers);
     iour->cq_timeouts = 0;
     iour->noncancelable_ops = 0;
+    iour->cq_tail = iour->cq_posted = iour->cq_batch = 0;
+    iour->cq_pending = iour->cq_notify = false;
+    list_init(&iour->links);
+    list_init(&iour->deferred);
+    iour->sq_requests = iour->drain_seq = 0;
+    iour->defer_queued = false;
+    init_closure(&iour->defer, iour_defer, iour);
     iour->shutdown = false;
     iour->shutdown_completion = 0;
+    iour->sq_thread = 0;
+    iour->sq_polling = iour->sq_stop = false;
     ret = allocate_fd(current->p, iour);
     if (ret == INVALID_PHYSICAL) {
         ret = -EMFILE;
@@ -416,7 +542,16 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     iour_debug("fd %d", ret);
     init_fdesc(h, &iour->f, FDESC_TYPE_IORING);
     iour->f.close = init_closure(&iour->close, iour_close, iour);
-    params->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS;
+    if (params->flags & IORING_SETUP_SQPOLL) {
+        thread_reserve(current);
+        iour->sq_thread = current;
+        iour->sq_idle = milliseconds(params->sq_thread_idle ?
+            params->sq_thread_idle : IOUR_SQ_THREAD_IDLE_DEFAULT);
+        init_closure(&iour->sqpoll, iour_sqpoll, iour);
+        iour_sqpoll_start(iour);
+    }
+    params->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS |
+            IORING_FEAT_SQPOLL_NONFIXED;
     params->sq_off.head = offsetof(io_rings, sq_head);
     params->sq_off.tail = offsetof(io_rings, sq_tail);
     params->sq_off.ring_mask = offsetof(io_rings, sq_mask);
@@ -475,39 +610,127 @@ simple_closure_function(1, 2, void, iour_efd_complete,
     closure_finish();
 }
 
-static void iour_complete_locked(io_uring iour, u64 user_data, s32 res,
-                                 boolean async)
+static boolean iour_link_ready(io_uring iour, iour_link link)
+{
+    return ((s32)(iour->cq_posted - (link->drain ? link->seq : iour->drain_seq))
+            >= 0);
+}
+
+/* Whether the deferred submission thunk has anything to do; called with the
+ * lock held. */
+static boolean iour_defer_pending(io_uring iour)
+{
+    if (!list_empty(&iour->links))
+        return true;
+    if (list_empty(&iour->deferred))
+        return false;
+    return (iour->sq_stop || iour_link_ready(iour,
+            struct_from_list(list_begin(&iour->deferred), iour_link, l)));
+}
+
+/* The in-flight member of a chain has completed: the chain is queued for its
+ * next member to be issued, or for the remaining members to be canceled. */
+static void iour_link_done_locked(io_uring iour, iour_link link, s32 res)
+{
+    if ((res < 0) && !(link->sqes[link->next - 1].flags & IOSQE_IO_HARDLINK))
+        link->canceled = true;
+    list_push_back(&iour->links, &link->l);
+}
+
+static void iour_complete_locked(io_uring iour, u64 user_data, iour_link link,
+                                 s32 res, boolean async)
 {
     io_rings rings = iour->rings;
     iour_debug("user_data %ld, res %d, CQ tail %d", user_data, res,
-               rings->cq_tail);
-    if (rings->cq_tail < rings->cq_head + iour->cq_entries) {
-        struct io_uring_cqe *cqe = &iour->cqes[rings->cq_tail & iour->cq_mask];
+               iour->cq_tail);
+    if (iour->cq_tail - rings->cq_head < iour->cq_entries) {
+        struct io_uring_cqe *cqe = &iour->cqes[iour->cq_tail & iour->cq_mask];
         cqe->user_data = user_data;
         cqe->res = res;
         cqe->flags = 0;
-        write_barrier();
-        rings->cq_tail++;
+        iour->cq_tail++;
     } else {
         iour_debug("overflow");
         rings->cq_overflow++;
     }
-    if (iour->eventfd && (async || !iour->eventfd_async)) {
+    iour->cq_posted++;
+    iour->cq_pending = true;
+    if (iour->eventfd && (async || !iour->eventfd_async))
+        iour->cq_notify = true;
+    if (link)
+        iour_link_done_locked(iour, link, res);
+}
+
+/* Publishes the completions posted so far (unless a batch is in progress), and
+ * collects the notifications to be sent for them; called with the lock
+ * held. */
+static void iour_flush_locked(io_uring iour, struct iour_notify *n)
+{
+    n->eventfd = 0;
+    n->bq = 0;
+    if (!iour->cq_batch && iour->cq_pending) {
+        write_barrier();
+        iour->rings->cq_tail = iour->cq_tail;
+        iour->cq_pending = false;
+        if (iour->cq_notify && iour->eventfd) {
+            n->eventfd = iour->eventfd;
+            fetch_and_add(&n->eventfd->refcnt, 1);
+        }
+        iour->cq_notify = false;
+        n->bq = iour->bq;
+    }
+    n->defer = !iour->defer_queued && iour_defer_pending(iour);
+    if (n->defer) {
+        iour->defer_queued = true;
+        fetch_and_add(&iour->noncancelable_ops, 1);
+    }
+}
+
+static boolean iour_defer_stop(io_uring iour, boolean force);
+
+static void iour_notify(io_uring iour, struct iour_notify *n)
+{
+    if (n->eventfd) {
         closure_new(iour->h, iour_efd_complete, completion);
         if (completion != INVALID_ADDRESS) {
             completion->efd_val = 1;
-            apply(iour->eventfd->write, &completion->efd_val,
+            apply(n->eventfd->write, &completion->efd_val,
                   sizeof(completion->efd_val), 0, current, true,
                   closure_get(iour_efd_complete, completion));
         }
+        fdesc_put(n->eventfd);
+    }
+    if (n->bq)
+        blockq_wake_one(n->bq);
+    if (n->defer && !enqueue(runqueue, &iour->defer)) {
+        msg_err("failed to enqueue deferred submissions\n");
+        iour_defer_stop(iour, true);
     }
 }
 
-static void iour_complete(io_uring iour, u64 user_data, s32 res,
-                          boolean async, boolean noncancelable)
+/* Completions posted within a batch are published when the batch ends. */
+static void iour_batch_begin(io_uring iour)
+{
+    iour_lock(iour);
+    iour->cq_batch++;
+    iour_unlock(iour);
+}
+
+static void iour_batch_end(io_uring iour)
 {
+    struct iour_notify n;
     iour_lock(iour);
-    iour_complete_locked(iour, user_data, res, async);
+    iour->cq_batch--;
+    iour_flush_locked(iour, &n);
+    iour_unlock(iour);
+    iour_notify(iour, &n);
+}
+
+static void iour_complete(io_uring iour, u64 user_data, iour_link link,
+                          s32 res, boolean async, boolean noncancelable)
+{
+    iour_lock(iour);
+    iour_complete_locked(iour, user_data, link, res, async);
     if (noncancelable) {
         if ((fetch_and_add(&iour->noncancelable_ops, -1) == 1) &&
                 iour->shutdown) {
@@ -520,11 +743,12 @@ static void iour_complete(io_uring iour, u64 user_data, s32 res,
 check_timers:
     list_foreach(&iour->timers, l) {
         iour_timer iour_tim = struct_from_list(l, iour_timer, l);
-        if (iour_tim->target == iour->rings->cq_tail + iour->rings->cq_overflow) {
+        if (iour_tim->target == iour->cq_tail + iour->rings->cq_overflow) {
             list_delete(l);
             list_push_back(&deleted_timers, l);
             iour->cq_timeouts++;
-            iour_complete_locked(iour, iour_tim->user_data, 0, async);
+            iour_complete_locked(iour, iour_tim->user_data, iour_tim->link, 0,
+                                 async);
 
             /* Increment the target of any remaining timers, to compensate the
              * CQ tail increment due to the just completed timeout, then go
@@ -536,53 +760,54 @@ check_timers:
             goto check_timers;
         }
     }
-    blockq bq = iour->bq;
+    struct iour_notify n;
+    iour_flush_locked(iour, &n);
     iour_unlock(iour);
     list_foreach(&deleted_timers, l) {
         iour_timer iour_tim = struct_from_list(l, iour_timer, l);
         remove_timer(iour_tim->t, 0);
         deallocate(iour->h, iour_tim, sizeof(*iour_tim));
     }
-    if (bq)
-        blockq_wake_one(bq);
+    iour_notify(iour, &n);
 }
 
-static void iour_complete_timeout(io_uring iour, u64 user_data)
+static void iour_complete_timeout(io_uring iour, u64 user_data,
+                                  iour_link link)
 {
+    struct iour_notify n;
     iour_lock(iour);
     iour->cq_timeouts++;
-    iour_complete_locked(iour, user_data, -ETIME, true);
-    blockq bq = iour->bq;
+    iour_complete_locked(iour, user_data, link, -ETIME, true);
+    iour_flush_locked(iour, &n);
     iour_unlock(iour);
-    if (bq)
-        blockq_wake_one(bq);
+    iour_notify(iour, &n);
 }
 
-closure_function(3, 2, void, iour_rw_complete,
-                 io_uring, iour, fdesc, f, u64, user_data,
+closure_function(4, 2, void, iour_rw_complete,
+                 io_uring, iour, fdesc, f, u64, user_data, iour_link, link,
                  thread, t, sysreturn, rv)
 {
     fdesc_put(bound(f));
-    iour_complete(bound(iour), bound(user_data), rv, true, true);
+    iour_complete(bound(iour), bound(user_data), bound(link), rv, true, true);
     closure_finish();
 }
 
 static void iour_iov(io_uring iour, fdesc f, boolean write, struct iovec *iov,
-                     u32 len, u64 off, u64 user_data)
+                     u32 len, u64 off, u64 user_data, iour_link link, thread t)
 {
     io_completion completion = closure(iour->h, iour_rw_complete, iour, f,
-        user_data);
+        user_data, link);
     if (completion == INVALID_ADDRESS) {
         fdesc_put(f);
-        iour_complete(iour, user_data, -ENOMEM, false, false);
+        iour_complete(iour, user_data, link, -ENOMEM, false, false);
     } else {
         fetch_and_add(&iour->noncancelable_ops, 1);
-        iov_op(f, write, iov, len, off, false, completion);
+        iov_op(f, write, iov, len, off, t, false, completion);
     }
 }
 
 static void iour_rw(io_uring iour, fdesc f, boolean write, void *addr, u32 len,
-                    u64 offset, u64 user_data)
+                    u64 offset, u64 user_data, iour_link link, thread t)
 {
     iour_debug("%s at %p, len %d, offset %ld", write ? "write" : "read", addr,
             len, offset);
@@ -592,25 +817,26 @@ static void iour_rw(io_uring iour, fdesc f, boolean write, void *addr, u32 len,
     if (!op) {
         err = -EOPNOTSUPP;
     } else {
-        completion = closure(iour->h, iour_rw_complete, iour, f, user_data);
+        completion = closure(iour->h, iour_rw_complete, iour, f, user_data,
+            link);
         if (completion == INVALID_ADDRESS)
             err = -ENOMEM;
     }
     if (err) {
         fdesc_put(f);
-        iour_complete(iour, user_data, err, false, false);
+        iour_complete(iour, user_data, link, err, false, false);
     } else {
         fetch_and_add(&iour->noncancelable_ops, 1);
-        apply(op, addr, len, offset, current, true, completion);
+        apply(op, addr, len, offset, t, true, completion);
     }
 }
 
-define_closure_function(2, 2, void, iour_poll_notify,
+define_closure_function(2, 2, boolean, iour_poll_notify,
                         io_uring, iour, iour_poll, p,
                         u64, events, thread, t)
 {
     if (!events)
-        return;
+        return false;
     io_uring iour = bound(iour);
     iour_poll p = bound(p);
     iour_lock(iour);
@@ -621,14 +847,16 @@ define_closure_function(2, 2, void, iour_poll_notify,
     iour_unlock(iour);
     if (found) {
         iour_debug("user_data %ld, events %ld", p->user_data, events);
-        iour_complete(iour, p->user_data, events, true, false);
+        iour_complete(iour, p->user_data, p->link, events, true, false);
         notify_remove(p->f->ns, p->ne, false);
         fdesc_put(p->f);
         deallocate(iour->h, p, sizeof(*p));
     }
+    return found;
 }
 
-static void iour_poll_add(io_uring iour, fdesc f, u16 events, u64 user_data)
+static void iour_poll_add(io_uring iour, fdesc f, u16 events, u64 user_data,
+                          iour_link link, thread t)
 {
     s32 err = 0;
     iour_poll p = allocate(iour->h, sizeof(*p));
@@ -637,6 +865,7 @@ static void iour_poll_add(io_uring iour, fdesc f, u16 events, u64 user_data)
         goto done;
     }
     p->user_data = user_data;
+    p->link = link;
     p->f = f;
     iour_lock(iour);
     list_push_back(&iour->pollers, &p->l);
@@ -652,13 +881,13 @@ done:
     if (!err) {
         if (f->events)
             /* Check if poll events are already present. */
-            notify_dispatch_for_thread(f->ns, apply(f->events, current),
-                current);
+            notify_dispatch_for_thread(f->ns, apply(f->events, t), t);
     } else
-        iour_complete(iour, user_data, err, false, false);
+        iour_complete(iour, user_data, link, err, false, false);
 }
 
-static void iour_poll_remove(io_uring iour, u64 addr, u64 user_data)
+static void iour_poll_remove(io_uring iour, u64 addr, u64 user_data,
+                             iour_link link)
 {
     iour_poll p = 0;
     s32 res;
@@ -673,14 +902,14 @@ static void iour_poll_remove(io_uring iour, u64 addr, u64 user_data)
     }
     iour_unlock(iour);
     if (p) {
-        iour_complete(iour, addr, -ECANCELED, false, false);
+        iour_complete(iour, addr, p->link, -ECANCELED, false, false);
         res = 0;
         notify_remove(p->f->ns, p->ne, false);
         fdesc_put(p->f);
         deallocate(iour->h, p, sizeof(*p));
     } else
         res = -ENOENT;
-    iour_complete(iour, user_data, res, false, false);
+    iour_complete(iour, user_data, link, res, false, false);
 }
 
 define_closure_function(2, 1, void, iour_timeout,
@@ -696,13 +925,13 @@ define_closure_function(2, 1, void, iour_timeout,
     iour_unlock(iour);
     if (found) {
         iour_debug("user_data %ld", t->user_data);
-        iour_complete_timeout(iour, t->user_data);
+        iour_complete_timeout(iour, t->user_data, t->link);
         deallocate(iour->h, t, sizeof(*t));
     }
 }
 
 static void iour_timeout_add(io_uring iour, struct timespec *ts, u32 flags,
-                             u64 off, u64 user_data)
+                             u64 off, u64 user_data, iour_link link)
 {
     iour_debug("flags 0x%x, off %ld", flags, off);
     int err = 0;
@@ -716,6 +945,7 @@ static void iour_timeout_add(io_uring iour, struct timespec *ts, u32 flags,
         goto done;
     }
     iour_tim->user_data = user_data;
+    iour_tim->link = link;
     iour_lock(iour);
 
     /* off == 0 indicates a pure timeout request, i.e. one not linked to
@@ -723,7 +953,7 @@ static void iour_timeout_add(io_uring iour, struct timespec *ts, u32 flags,
      * completion (i.e. a past completion), so that it won't match future
      * completions (until after UINT_MAX operations, at which point the timeout
      * will have elapsed already, hopefully). */
-    iour_tim->target = iour->rings->cq_tail + off;
+    iour_tim->target = iour->cq_tail + off;
     iour_debug("target %ld", iour_tim->target);
 
     list_push_back(&iour->timers, &iour_tim->l);
@@ -738,10 +968,11 @@ static void iour_timeout_add(io_uring iour, struct timespec *ts, u32 flags,
     iour_unlock(iour);
 done:
     if (err)
-        iour_complete(iour, user_data, err, false, false);
+        iour_complete(iour, user_data, link, err, false, false);
 }
 
-static void iour_timeout_remove(io_uring iour, u64 addr, u64 user_data)
+static void iour_timeout_remove(io_uring iour, u64 addr, u64 user_data,
+                                iour_link link)
 {
     iour_timer t = 0;
     s32 res;
@@ -757,23 +988,23 @@ static void iour_timeout_remove(io_uring iour, u64 addr, u64 user_data)
     iour_unlock(iour);
     if (t) {
         remove_timer(t->t, 0);
-        iour_complete(iour, addr, -ECANCELED, false, false);
+        iour_complete(iour, addr, t->link, -ECANCELED, false, false);
         res = 0;
         deallocate(iour->h, t, sizeof(*t));
     } else
         res = -ENOENT;
-    iour_complete(iour, user_data, res, false, false);
+    iour_complete(iour, user_data, link, res, false, false);
 }
 
-closure_function(2, 2, void, iour_close_complete,
-                 io_uring, iour, u64, user_data,
+closure_function(3, 2, void, iour_close_complete,
+                 io_uring, iour, u64, user_data, iour_link, link,
                  thread, t, sysreturn, rv)
 {
-    iour_complete(bound(iour), bound(user_data), rv, true, true);
+    iour_complete(bound(iour), bound(user_data), bound(link), rv, true, true);
     closure_finish();
 }
 
-static int iour_register_files_update(io_uring iour, int *fds,
+static int iour_register_files_update(io_uring iour, process p, int *fds,
                                       unsigned int count, unsigned int offset)
 {
     iour_debug("count %d, offset %d", count, offset);
@@ -792,7 +1023,7 @@ static int iour_register_files_update(io_uring iour, int *fds,
             if (fds[i] == -1)
                 f = 0;
             else {
-                f = fdesc_get(current->p, fds[i]);
+                f = fdesc_get(p, fds[i]);
                 if (!f) {
                     iour_debug("invalid fd %d", fds[i]);
                     ret = -EBADF;
@@ -816,13 +1047,135 @@ static int iour_register_files_update(io_uring iour, int *fds,
     return ret;
 }
 
-static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
+static s32 iour_sock_check(struct sock *s, struct io_uring_sqe *sqe, thread t)
+{
+    void *addr = pointer_from_u64(sqe->addr);
+    switch (sqe->opcode) {
+    case IORING_OP_SENDMSG:
+        if (!s->sendmsg)
+            return -EOPNOTSUPP;
+        if (!validate_msghdr(addr, false) ||
+            !fault_in_process_iovec(t->p, ((struct msghdr *)addr)->msg_iov, ((struct msghdr *)addr)->msg_iovlen, false))
+            return -EFAULT;
+        break;
+    case IORING_OP_RECVMSG:
+        if (!s->recvmsg)
+            return -EOPNOTSUPP;
+        if (!validate_msghdr(addr, true) ||
+            !fault_in_process_iovec(t->p, ((struct msghdr *)addr)->msg_iov, ((struct msghdr *)addr)->msg_iovlen, false))
+            return -EFAULT;
+        break;
+    case IORING_OP_ACCEPT: {
+        socklen_t *addrlen = pointer_from_u64(sqe->off);
+        if (!s->accept4)
+            return -EOPNOTSUPP;
+        if (addr && (!validate_user_memory(addrlen, sizeof(socklen_t), true) ||
+                     !validate_user_memory(addr, *addrlen, true)))
+            return -EFAULT;
+        break;
+    }
+    case IORING_OP_CONNECT:
+        if (!s->connect)
+            return -EOPNOTSUPP;
+        if (!validate_user_memory(addr, sqe->off, false))
+            return -EFAULT;
+        break;
+    case IORING_OP_SEND:
+        if (!s->sendto)
+            return -EOPNOTSUPP;
+        if (!validate_user_memory(addr, sqe->len, false) ||
+            !fault_in_user_memory(addr, sqe->len, false))
+            return -EFAULT;
+        break;
+    case IORING_OP_RECV:
+        if (!s->recvfrom)
+            return -EOPNOTSUPP;
+        if (!validate_user_memory(addr, sqe->len, true) ||
+            !fault_in_user_memory(addr, sqe->len, false))
+            return -EFAULT;
+        break;
+    }
+    return 0;
+}
+
+/* Socket operations are issued as from a bottom half, so the submitting
+ * thread never sleeps on them: a request which can't complete right away
+ * stays queued on the socket and is completed from the network stack
+ * callback that makes progress on it. */
+static void iour_sock(io_uring iour, struct sock *s,
+                      struct io_uring_sqe *sqe, iour_link link, thread t)
+{
+    iour_debug("opcode %d, fd %d", sqe->opcode, s->fd);
+    io_completion completion = closure(iour->h, iour_rw_complete, iour, &s->f,
+        sqe->user_data, link);
+    if (completion == INVALID_ADDRESS) {
+        fdesc_put(&s->f);
+        iour_complete(iour, sqe->user_data, link, -ENOMEM, false, false);
+        return;
+    }
+    fetch_and_add(&iour->noncancelable_ops, 1);
+    void *addr = pointer_from_u64(sqe->addr);
+    switch (sqe->opcode) {
+    case IORING_OP_SENDMSG:
+        s->sendmsg(s, addr, sqe->msg_flags, t, true, completion);
+        break;
+    case IORING_OP_RECVMSG:
+        s->recvmsg(s, addr, sqe->msg_flags, t, true, completion);
+        break;
+    case IORING_OP_ACCEPT:
+        s->accept4(s, addr, pointer_from_u64(sqe->off), sqe->accept_flags,
+                   t, true, completion);
+        break;
+    case IORING_OP_CONNECT:
+        s->connect(s, addr, sqe->off, t, true, completion);
+        break;
+    case IORING_OP_SEND:
+        s->sendto(s, addr, sqe->len, sqe->msg_flags, 0, 0, t, true,
+                  completion);
+        break;
+    case IORING_OP_RECV:
+        s->recvfrom(s, addr, sqe->len, sqe->msg_flags, 0, 0, t, true,
+                    completion);
+        break;
+    }
+}
+
+static void iour_sync(io_uring iour, fdesc f, struct io_uring_sqe *sqe,
+                      iour_link link, thread t)
+{
+    iour_debug("opcode %d, fd %d, off %ld, len %d", sqe->opcode, sqe->fd,
+               sqe->off, sqe->len);
+    io_completion completion = closure(iour->h, iour_rw_complete, iour, f,
+        sqe->user_data, link);
+    if (completion == INVALID_ADDRESS) {
+        fdesc_put(f);
+        iour_complete(iour, sqe->user_data, link, -ENOMEM, false, false);
+        return;
+    }
+    fetch_and_add(&iour->noncancelable_ops, 1);
+    if (sqe->opcode == IORING_OP_FSYNC) {
+        /* the range, if any, is widened to the whole file */
+        file_sync(f, (sqe->fsync_flags & IORING_FSYNC_DATASYNC) != 0, t,
+                  completion);
+    } else {
+        range q = irangel(sqe->off, sqe->len);
+        if (sqe->len == 0)
+            q.end = infinity;
+        file_sync_range(f, q, sqe->sync_range_flags, t, completion);
+    }
+}
+
+/* Issues a request on behalf of thread t; link is the chain the request
+ * belongs to, if the chain has members left to issue after it. */
+static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe,
+                           iour_link link, thread t)
 {
     iour_debug("opcode %d, flags 0x%x, user_data %ld", sqe->opcode, sqe->flags,
         sqe->user_data);
     fdesc f = 0;
     s32 res;
-    if (sqe->flags & ~(IOSQE_FIXED_FILE | IOSQE_ASYNC)) {
+    if (sqe->flags & ~(IOSQE_FIXED_FILE | IOSQE_IO_DRAIN | IOSQE_IO_LINK |
+                       IOSQE_IO_HARDLINK | IOSQE_ASYNC)) {
         /* non-supported flags */
         res = -EINVAL;
         goto complete;
@@ -830,22 +1183,30 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
     switch(sqe->opcode) {
     case IORING_OP_READV:
     case IORING_OP_WRITEV:
+    case IORING_OP_FSYNC:
     case IORING_OP_READ_FIXED:
     case IORING_OP_WRITE_FIXED:
     case IORING_OP_POLL_ADD:
+    case IORING_OP_SYNC_FILE_RANGE:
     case IORING_OP_READ:
     case IORING_OP_WRITE:
+    case IORING_OP_SENDMSG:
+    case IORING_OP_RECVMSG:
+    case IORING_OP_ACCEPT:
+    case IORING_OP_CONNECT:
+    case IORING_OP_SEND:
+    case IORING_OP_RECV:
         if (sqe->flags & IOSQE_FIXED_FILE) {
             iour_lock(iour);
             int fd = sqe->fd;
             if ((fd >= 0) && (fd < iour->file_count)) {
                 f = iour->files[fd];
                 if (f)
-                    f->refcnt++;
+                    fetch_and_add(&f->refcnt, 1);
             }
             iour_unlock(iour);
         } else
-            f = fdesc_get(current->p, sqe->fd);
+            f = fdesc_get(t->p, sqe->fd);
         if (!f) {
             res = -EBADF;
             goto complete;
@@ -867,15 +1228,28 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
         struct iovec *iov = pointer_from_u64(sqe->addr);
         u32 len = sqe->len;
         boolean write = (sqe->opcode == IORING_OP_WRITEV);
-        if (!validate_iovec(iov, len, !write)) {
+        if (!validate_iovec(iov, len, !write) ||
+                !fault_in_process_iovec(t->p, iov, len, false)) {
             res = -EFAULT;
             goto complete;
         }
-        iour_iov(iour, f, write, iov, len, sqe->off, sqe->user_data);
+        iour_iov(iour, f, write, iov, len, sqe->off, sqe->user_data, link, t);
         break;
     }
+    case IORING_OP_FSYNC:
+    case IORING_OP_SYNC_FILE_RANGE:
+        if (sqe->addr || sqe->ioprio || sqe->buf_index ||
+                ((sqe->opcode == IORING_OP_FSYNC) &&
+                 (sqe->fsync_flags & ~IORING_FSYNC_DATASYNC))) {
+            res = -EINVAL;
+            goto complete;
+        }
+        iour_sync(iour, f, sqe, link, t);
+        break;
     case IORING_OP_READ_FIXED:
     case IORING_OP_WRITE_FIXED:
+        /* Registered buffers have been validated by iour_register_buffers(),
+         * so checking that the request falls within one is sufficient. */
         res = 0;
         iour_lock(iour);
         u16 buf_index = sqe->buf_index;
@@ -894,7 +1268,8 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
                 res = -EFAULT;
             } else {
                 iour_unlock(iour);
-                iour_rw(iour, f, write, buf, len, sqe->off, sqe->user_data);
+                iour_rw(iour, f, write, buf, len, sqe->off, sqe->user_data,
+                        link, t);
                 return true;
             }
         }
@@ -906,7 +1281,7 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             res = -EINVAL;
             goto complete;
         }
-        iour_poll_add(iour, f, sqe->poll_events, sqe->user_data);
+        iour_poll_add(iour, f, sqe->poll_events, sqe->user_data, link, t);
         break;
     case IORING_OP_POLL_REMOVE:
         if (sqe->ioprio || sqe->off || sqe->len || sqe->poll_events ||
@@ -914,7 +1289,7 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             res = -EINVAL;
             goto complete;
         }
-        iour_poll_remove(iour, sqe->addr, sqe->user_data);
+        iour_poll_remove(iour, sqe->addr, sqe->user_data, link);
         break;
     case IORING_OP_TIMEOUT: {
         struct timespec *ts = (struct timespec *)sqe->addr;
@@ -927,7 +1302,7 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             goto complete;
         }
         iour_timeout_add(iour, ts, sqe->timeout_flags, sqe->off,
-                         sqe->user_data);
+                         sqe->user_data, link);
         break;
     }
     case IORING_OP_TIMEOUT_REMOVE:
@@ -935,7 +1310,7 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             res = -EINVAL;
             goto complete;
         }
-        iour_timeout_remove(iour, sqe->addr, sqe->user_data);
+        iour_timeout_remove(iour, sqe->addr, sqe->user_data, link);
         break;
     case IORING_OP_CLOSE:
         if (sqe->ioprio || sqe->addr || sqe->len || sqe->off || sqe->buf_index
@@ -945,31 +1320,32 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
         }
         int fd = sqe->fd;
         if ((sqe->flags & IOSQE_FIXED_FILE) ||
-                !(f = fdesc_get(current->p, fd)) || (f == &iour->f)) {
+                !(f = fdesc_get(t->p, fd)) || (f == &iour->f)) {
             res = -EBADF;
             goto complete;
         }
         iour_debug("closing fd %d", fd);
-        deallocate_fd(current->p, fd);
+        deallocate_fd(t->p, fd);
         if (fetch_and_add(&f->refcnt, -2) == 2) {
             io_completion completion = closure(iour->h, iour_close_complete,
-                iour, sqe->user_data);
+                iour, sqe->user_data, link);
             if (completion == INVALID_ADDRESS) {
-                iour_complete(iour, sqe->user_data, -ENOMEM, false, false);
+                iour_complete(iour, sqe->user_data, link, -ENOMEM, false,
+                              false);
                 completion = io_completion_ignore;
             } else
                 fetch_and_add(&iour->noncancelable_ops, 1);
             apply(f->close, 0, completion);
         } else
-            iour_complete(iour, sqe->user_data, 0, false, false);
+            iour_complete(iour, sqe->user_data, link, 0, false, false);
         return true;
     case IORING_OP_FILES_UPDATE:
-        if (sqe->flags || sqe->ioprio || sqe->rw_flags) {
+        if ((sqe->flags & IOSQE_FIXED_FILE) || sqe->ioprio || sqe->rw_flags) {
             res = -EINVAL;
             goto complete;
         }
-        res = iour_register_files_update(iour, (int *)sqe->addr, sqe->len,
-            sqe->off);
+        res = iour_register_files_update(iour, t->p, (int *)sqe->addr,
+            sqe->len, sqe->off);
         goto complete;
     case IORING_OP_READ:
     case IORING_OP_WRITE:
@@ -981,25 +1357,312 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             u32 len = sqe->len;
             boolean write = sqe->opcode == IORING_OP_WRITE;
 
-            if (!validate_user_memory(buf, len, !write)) {
+            if (!validate_user_memory(buf, len, !write) ||
+                !fault_in_process_memory(t->p, buf, len, false)) {
                 res = -EFAULT;
                 goto complete;
             }
-            iour_rw(iour, f, write, buf, len, sqe->off, sqe->user_data);
+            iour_rw(iour, f, write, buf, len, sqe->off, sqe->user_data, link, t);
+        }
+        break;
+    case IORING_OP_SENDMSG:
+    case IORING_OP_RECVMSG:
+    case IORING_OP_ACCEPT:
+    case IORING_OP_CONNECT:
+    case IORING_OP_SEND:
+    case IORING_OP_RECV:
+        if (sqe->ioprio || sqe->buf_index) {
+            res = -EINVAL;
+            goto complete;
+        }
+        if (f->type != FDESC_TYPE_SOCKET) {
+            res = -ENOTSOCK;
+            goto complete;
         }
+        res = iour_sock_check((struct sock *)f, sqe, t);
+        if (res)
+            goto complete;
+        iour_sock(iour, (struct sock *)f, sqe, link, t);
         break;
     default:
-        iour_complete(iour, sqe->user_data, -EINVAL, false, false);
+        iour_complete(iour, sqe->user_data, link, -EINVAL, false, false);
         return false;
     }
     return true;
 complete:
-    iour_complete(iour, sqe->user_data, res, false, false);
+    iour_complete(iour, sqe->user_data, link, res, false, false);
     if (f)
         fdesc_put(f);
     return true;
 }
 
+static void iour_link_free(io_uring iour, iour_link link)
+{
+    thread_release(link->t);
+    deallocate(iour->h, link, sizeof(*link) + link->count * sizeof(link->sqes[0]));
+    fetch_and_add(&iour->noncancelable_ops, -1);
+}
+
+/* Issues the next member of a chain, or cancels the remaining members if the
+ * chain has been broken or the ring is being closed. */
+static void iour_link_issue(io_uring iour, iour_link link)
+{
+    if (link->canceled || iour->sq_stop) {
+        while (link->next < link->count)
+            iour_complete(iour, link->sqes[link->next++].user_data, 0,
+                          -ECANCELED, false, false);
+    } else {
+        struct io_uring_sqe *sqe = &link->sqes[link->next++];
+        if (link->next < link->count) {
+            /* the chain may be requeued as soon as the request completes */
+            iour_submit(iour, sqe, link, link->t);
+            return;
+        }
+        iour_submit(iour, sqe, 0, link->t);
+    }
+    iour_link_free(iour, link);
+}
+
+/* Takes a chain (or a single request if it has no link flags) off the head of
+ * the SQ, and issues it, unless it must wait for earlier requests to complete.
+ * Returns the number of SQEs consumed. */
+static unsigned int iour_link_submit(io_uring iour, unsigned int max, thread t)
+{
+    io_rings rings = iour->rings;
+    unsigned int count = 0;
+    u32 head = rings->sq_head;
+    while ((count < max) && (head + count != rings->sq_tail)) {
+        u32 sqe_index = iour->sq_array[(head + count) & iour->sq_mask];
+        if (sqe_index >= iour->sq_entries)
+            break;
+        count++;
+        if (!(iour->sqes[sqe_index].flags &
+              (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)))
+            break;
+    }
+    if (count == 0)
+        return 0;
+    iour_debug("%d SQEs", count);
+    rings->sq_head += count;
+    iour->sq_requests += count;
+    iour_link link = allocate(iour->h,
+                              sizeof(*link) + count * sizeof(link->sqes[0]));
+    if (link == INVALID_ADDRESS) {
+        for (unsigned int i = 0; i < count; i++) {
+            u32 sqe_index = iour->sq_array[(head + i) & iour->sq_mask];
+            iour_complete(iour, iour->sqes[sqe_index].user_data, 0, -ENOMEM,
+                          false, false);
+        }
+        return count;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        u32 sqe_index = iour->sq_array[(head + i) & iour->sq_mask];
+        runtime_memcpy(&link->sqes[i], &iour->sqes[sqe_index],
+                       sizeof(link->sqes[i]));
+    }
+    thread_reserve(t);
+    link->t = t;
+    link->seq = iour->sq_requests - count;
+    link->count = count;
+    link->next = 0;
+    link->drain = !!(link->sqes[0].flags & IOSQE_IO_DRAIN);
+    link->canceled = false;
+    fetch_and_add(&iour->noncancelable_ops, 1);
+    iour_lock(iour);
+    boolean ready = list_empty(&iour->deferred) && iour_link_ready(iour, link);
+    if (ready) {
+        if (link->drain)
+            iour->drain_seq = link->seq + link->count;
+    } else {
+        iour_debug("deferring");
+        list_push_back(&iour->deferred, &link->l);
+    }
+    iour_unlock(iour);
+    if (ready)
+        iour_link_issue(iour, link);
+    return count;
+}
+
+/* Whether requests must go through iour_link_submit() because of earlier
+ * drained requests */
+static boolean iour_draining(io_uring iour)
+{
+    iour_lock(iour);
+    boolean draining = !list_empty(&iour->deferred) ||
+            ((s32)(iour->cq_posted - iour->drain_seq) < 0);
+    iour_unlock(iour);
+    return draining;
+}
+
+/* Submits up to to_submit requests from the SQ on behalf of thread t, which
+ * file descriptors and user memory are resolved against. */
+static unsigned int iour_submit_sqes(io_uring iour, unsigned int to_submit,
+                                     thread t)
+{
+    io_rings rings = iour->rings;
+    read_barrier();
+    iour_debug("SQ head %d, SQ tail %d", rings->sq_head, rings->sq_tail);
+    unsigned int submitted;
+    iour_batch_begin(iour);
+    for (submitted = 0; submitted < to_submit;) {
+        if (rings->sq_head >= rings->sq_tail)
+            break;
+        u32 sqe_index = iour->sq_array[rings->sq_head & iour->sq_mask];
+        if (sqe_index < iour->sq_entries) {
+            struct io_uring_sqe *sqe = &iour->sqes[sqe_index];
+            if ((sqe->flags &
+                 (IOSQE_IO_DRAIN | IOSQE_IO_LINK | IOSQE_IO_HARDLINK)) ||
+                    iour_draining(iour)) {
+                submitted += iour_link_submit(iour, to_submit - submitted, t);
+                continue;
+            }
+            rings->sq_head++;
+            iour->sq_requests++;
+            submitted++;
+            if (!iour_submit(iour, sqe, 0, t))
+                break;
+        } else {
+            iour_debug("sqe dropped: index %d, entries %d", sqe_index,
+                iour->sq_entries);
+            rings->sq_head++;
+            iour->rings->sq_dropped++;
+            break;
+        }
+    }
+    iour_batch_end(iour);
+    return submitted;
+}
+
+/* Stops the deferred submission thunk, unless (if not forced) there is work
+ * left for it. Returns whether the thunk has been stopped. */
+static boolean iour_defer_stop(io_uring iour, boolean force)
+{
+    iour_lock(iour);
+    if (!force && iour_defer_pending(iour)) {
+        iour_unlock(iour);
+        return false;
+    }
+    iour->defer_queued = false;
+    if ((fetch_and_add(&iour->noncancelable_ops, -1) == 1) && iour->shutdown) {
+        iour_release(iour);
+        return true;
+    }
+    blockq bq = iour->bq;
+    iour_unlock(iour);
+    if (bq)
+        blockq_wake_one(bq);
+    return true;
+}
+
+static iour_link iour_defer_next(io_uring iour)
+{
+    iour_link link = 0;
+    iour_lock(iour);
+    if (!list_empty(&iour->links)) {
+        link = struct_from_list(list_begin(&iour->links), iour_link, l);
+    } else if (!list_empty(&iour->deferred)) {
+        link = struct_from_list(list_begin(&iour->deferred), iour_link, l);
+        if (iour->sq_stop || iour_link_ready(iour, link)) {
+            if (link->drain)
+                iour->drain_seq = link->seq + link->count;
+        } else {
+            link = 0;
+        }
+    }
+    if (link)
+        list_delete(&link->l);
+    iour_unlock(iour);
+    return link;
+}
+
+define_closure_function(1, 0, void, iour_defer,
+                        io_uring, iour)
+{
+    io_uring iour = bound(iour);
+    do {
+        iour_link link;
+        while ((link = iour_defer_next(iour))) {
+            iour_batch_begin(iour);
+            iour_link_issue(iour, link);
+            iour_batch_end(iour);
+        }
+    } while (!iour_defer_stop(iour, false));
+}
+
+/* Puts the poller to sleep, unless (if not forced) submissions are pending.
+ * Returns whether the poller has been stopped. */
+static boolean iour_sqpoll_stop(io_uring iour, boolean force)
+{
+    io_rings rings = iour->rings;
+    iour_lock(iour);
+    rings->sq_flags |= IORING_SQ_NEED_WAKEUP;
+    memory_barrier();
+
+    /* An application which has seen the flag clear before it was set is
+     * relying on the poller to pick up its submission. */
+    if (!force && !iour->sq_stop && (rings->sq_head != rings->sq_tail)) {
+        rings->sq_flags &= ~IORING_SQ_NEED_WAKEUP;
+        iour_unlock(iour);
+        return false;
+    }
+    iour_debug("SQ poller idle");
+    iour->sq_polling = false;
+    fetch_and_add(&sqpoll_active, -1);
+    if ((fetch_and_add(&iour->noncancelable_ops, -1) == 1) && iour->shutdown) {
+        iour_release(iour);
+        return true;
+    }
+    blockq bq = iour->bq;
+    iour_unlock(iour);
+    if (bq)
+        blockq_wake_one(bq);
+    return true;
+}
+
+define_closure_function(1, 0, void, iour_sqpoll,
+                        io_uring, iour)
+{
+    io_uring iour = bound(iour);
+    io_rings rings = iour->rings;
+    if (!iour->sq_stop) {
+        timestamp here = now(CLOCK_ID_MONOTONIC);
+        read_barrier();
+        if (rings->sq_head != rings->sq_tail) {
+            /* Submit on behalf of the thread that set up the ring. It may be
+             * running elsewhere meanwhile, so it is passed down rather than
+             * made current here. */
+            iour_submit_sqes(iour, iour->sq_entries, iour->sq_thread);
+            iour->sq_active = here;
+        } else if ((here - iour->sq_active >= iour->sq_idle) &&
+                   iour_sqpoll_stop(iour, false)) {
+            return;
+        }
+        if (enqueue(runqueue, closure_self()))
+            return;
+        msg_err("failed to requeue SQ poller\n");
+    }
+    iour_sqpoll_stop(iour, true);
+}
+
+static void iour_sqpoll_start(io_uring iour)
+{
+    iour_lock(iour);
+    boolean start = !iour->sq_polling && !iour->sq_stop;
+    if (start) {
+        iour_debug("starting SQ poller");
+        iour->sq_polling = true;
+        iour->sq_active = now(CLOCK_ID_MONOTONIC);
+        iour->rings->sq_flags &= ~IORING_SQ_NEED_WAKEUP;
+        fetch_and_add(&iour->noncancelable_ops, 1);
+        fetch_and_add(&sqpoll_active, 1);
+    }
+    iour_unlock(iour);
+    if (start && !enqueue(runqueue, &iour->sqpoll)) {
+        msg_err("failed to enqueue SQ poller\n");
+        iour_sqpoll_stop(iour, true);
+    }
+}
+
 simple_closure_function(7, 1, sysreturn, iour_getevents_bh,
                         io_uring, iour, sysreturn, submitted, unsigned int, min_complete, unsigned int, timeouts, boolean, sig_set, thread, t, io_completion, completion,
                         u64, flags)
@@ -1045,7 +1708,7 @@ sysreturn io_uring_enter(int fd, unsigned int to_submit,
         to_submit, min_complete, flags, sig);
     io_uring iour = iour_from_fd(current->p, fd);
     sysreturn rv;
-    if (flags & ~IORING_ENTER_GETEVENTS) {
+    if (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP)) {
         rv = -EINVAL;
         goto out;
     }
@@ -1061,26 +1724,14 @@ sysreturn io_uring_enter(int fd, unsigned int to_submit,
             goto out;
         }
     }
-    io_rings rings = iour->rings;
-    read_barrier();
-    iour_debug("SQ head %d, SQ tail %d", rings->sq_head, rings->sq_tail);
     unsigned int submitted;
-    for (submitted = 0; submitted < to_submit;) {
-        if (rings->sq_head >= rings->sq_tail)
-            break;
-        u32 sqe_index = iour->sq_array[rings->sq_head & iour->sq_mask];
-        rings->sq_head++;
-        if (sqe_index < iour->sq_entries) {
-            submitted++;
-            if (!iour_submit(iour, &iour->sqes[sqe_index]))
-                break;
-        } else {
-            iour_debug("sqe dropped: index %d, entries %d", sqe_index,
-                iour->sq_entries);
-            iour->rings->sq_dropped++;
-            break;
-        }
-    }
+    if (iour->sq_thread) {
+        /* The poller does the submission; to_submit is only reported back. */
+        if (flags & IORING_ENTER_SQ_WAKEUP)
+            iour_sqpoll_start(iour);
+        submitted = to_submit;
+    } else
+        submitted = iour_submit_sqes(iour, to_submit, current);
     rv = submitted;
     if (flags & IORING_ENTER_GETEVENTS) {
         if (sig) {
@@ -1247,16 +1898,24 @@ static sysreturn iour_register_probe(struct io_uring_probe *probe,
     probe->ops_len = op_count;
     probe->ops[IORING_OP_NOP].flags = probe->ops[IORING_OP_READV].flags =
             probe->ops[IORING_OP_WRITEV].flags =
+            probe->ops[IORING_OP_FSYNC].flags =
             probe->ops[IORING_OP_READ_FIXED].flags =
             probe->ops[IORING_OP_WRITE_FIXED].flags =
             probe->ops[IORING_OP_POLL_ADD].flags =
             probe->ops[IORING_OP_POLL_REMOVE].flags =
+            probe->ops[IORING_OP_SYNC_FILE_RANGE].flags =
             probe->ops[IORING_OP_TIMEOUT].flags =
             probe->ops[IORING_OP_TIMEOUT_REMOVE].flags =
             probe->ops[IORING_OP_CLOSE].flags =
             probe->ops[IORING_OP_FILES_UPDATE].flags =
             probe->ops[IORING_OP_READ].flags =
-            probe->ops[IORING_OP_WRITE].flags = IO_URING_OP_SUPPORTED;
+            probe->ops[IORING_OP_WRITE].flags =
+            probe->ops[IORING_OP_SENDMSG].flags =
+            probe->ops[IORING_OP_RECVMSG].flags =
+            probe->ops[IORING_OP_ACCEPT].flags =
+            probe->ops[IORING_OP_CONNECT].flags =
+            probe->ops[IORING_OP_SEND].flags =
+            probe->ops[IORING_OP_RECV].flags = IO_URING_OP_SUPPORTED;
     return 0;
 }
 
@@ -1292,7 +1951,8 @@ sysreturn io_uring_register(int fd, unsigned int opcode, void *arg,
         else if (fu->resv)
             rv = -EINVAL;
         else
-            rv = iour_register_files_update(iour, fu->fds, nr_args, fu->offset);
+            rv = iour_register_files_update(iour, current->p, fu->fds,
+                                            nr_args, fu->offset);
         break;
     }
     case IORING_UNREGISTER_FILES:
@@ -3,7 +3,8 @@
 
 static boolean vmap_attr_equal(vmap a, vmap b)
 {
-    return a->flags == b->flags;
+    return a->flags == b->flags && a->cache_node == b->cache_node &&
+        (!a->cache_node || a->node_offset - a->node.r.start == b->node_offset - b->node.r.start);
 }
 
 static inline u64 page_map_flags(u64 vmflags)
@@ -16,29 +17,334 @@ static inline u64 page_map_flags(u64 vmflags)
     return flags;
 }
 
+/* Private file mappings that may be written to are never backed by
+   the cache pages themselves: the kernel runs with CR0.WP clear, so a
+   write from a syscall to a read-only pte would land in the page cache
+   rather than fault. Such pages are instead copied at fault time. */
+static inline boolean vmap_is_private_writable(u64 vmflags)
+{
+    return (vmflags & (VMAP_FLAG_SHARED | VMAP_FLAG_WRITABLE)) == VMAP_FLAG_WRITABLE;
+}
+
+#define MMAP_WRITEBACK_INTERVAL_SECONDS 5
+#define FAULT_AROUND_DEFAULT_PAGES      16
+
 #define vmap_lock(p) u64 _savedflags = spin_lock_irq(&(p)->vmap_lock)
 #define vmap_unlock(p) spin_unlock_irq(&(p)->vmap_lock, _savedflags)
 
-boolean do_demand_page(u64 vaddr, vmap vm)
+closure_function(4, 1, void, demand_page_fill_complete,
+                 thread, t, u64, vaddr, u64, phys, boolean, restart,
+                 status, s)
+{
+    thread t = bound(t);
+    if (!is_ok(s)) {
+        msg_err("unable to fill page at 0x%lx: %v\n", bound(vaddr), s);
+        if (bound(phys) != INVALID_PHYSICAL)
+            deallocate_u64((heap)heap_physical(get_kernel_heaps()), bound(phys), PAGESIZE);
+        if (bound(restart)) {
+            /* back out of the restart and fail the syscall instead */
+            thread_frame(t)[FRAME_RIP] += 2;
+            set_syscall_error(t, EFAULT);
+        } else {
+            struct siginfo si = {
+                .si_signo = SIGBUS,
+                .si_errno = 0,
+                .si_code = BUS_ADRERR,
+                .sifields.sigfault = {
+                    .addr = bound(vaddr),
+                }
+            };
+            deliver_signal_to_thread(t, &si);
+        }
+    }
+    thread_wakeup(t);
+    closure_finish();
+}
+
+/* Point the thread at its syscall instruction again, so that it is
+   reissued once the thread runs. */
+static inline void restart_syscall(thread t)
+{
+    context f = thread_frame(t);
+    f[FRAME_RAX] = f[FRAME_VECTOR];
+    f[FRAME_RIP] -= 2;          /* length of syscall instruction */
+}
+
+/* A fault is taken as part of a sequential run if it lands within a
+   fault-around window past the last fault in the same vmap. */
+static inline boolean fault_is_sequential(process p, vmap vm, u64 vaddr)
+{
+    return p->fault_around > 1 && vaddr > vm->last_fault &&
+        vaddr - vm->last_fault <= (p->fault_around << PAGELOG);
+}
+
+static inline range fault_around_window(process p, vmap vm, u64 vaddr)
+{
+    return range_intersection(irangel(vaddr, p->fault_around << PAGELOG), vm->node.r);
+}
+
+/* Allocate a physical page for a fault, reclaiming memory directly if
+   there is none and reclaim is given. Reclaim needs the kernel lock; if
+   it is busy, the allocation fails as it would have otherwise. */
+static u64 allocate_fault_page(boolean reclaim)
+{
+    heap physical = (heap)heap_physical(get_kernel_heaps());
+    u64 phys = allocate_u64(physical, PAGESIZE);
+    if (phys != INVALID_PHYSICAL || !reclaim)
+        return phys;
+    cpuinfo ci = current_cpu();
+    boolean unlock = false;
+    if (!ci->have_kernel_lock) {
+        if (!kern_try_lock())
+            return INVALID_PHYSICAL;
+        unlock = true;
+    }
+    if (mm_reclaim(PAGESIZE))
+        phys = allocate_u64(physical, PAGESIZE);
+    if (unlock)
+        kern_unlock();
+    return phys;
+}
+
+/* Map the file page at vaddr. A user thread sleeps until the page is
+   filled. With restart, which is only given while a syscall has yet to
+   do anything (see fault_in_user_memory), the syscall is instead
+   reissued once the page is in. Neither is possible from any other
+   context, so the page must already be resident there. */
+static demand_page_result demand_file_page(u64 vaddr, vmap vm, u64 node_offset, boolean user,
+                                           boolean restart, boolean reclaim, boolean sequential)
+{
+    process p = current->p;
+    thread t = current;
+    cpuinfo ci = current_cpu();
+
+    /* The pagecache and filesystem are only safe to enter with the
+       kernel lock held; if it is busy, have the thread try again. */
+    boolean unlock = false;
+    if (!ci->have_kernel_lock) {
+        if (!kern_try_lock()) {
+            if (!user && !restart)
+                return DEMAND_PAGE_FAILED;
+            if (restart)
+                restart_syscall(t);
+            schedule_frame(thread_frame(t));
+            return DEMAND_PAGE_PENDING;
+        }
+        unlock = true;
+    }
+
+    u64 phys = INVALID_PHYSICAL;
+    if (vmap_is_private_writable(vm->flags)) {
+        phys = allocate_fault_page(reclaim);
+        if (phys == INVALID_PHYSICAL) {
+            msg_err("cannot get physical page; OOM\n");
+            goto fail;
+        }
+    }
+
+    status_handler complete = 0;
+    context f = thread_frame(t);
+    u64 rip = f[FRAME_RIP];
+    u64 rax = f[FRAME_RAX];
+    if (user || restart) {
+        complete = closure(heap_general(get_kernel_heaps()), demand_page_fill_complete,
+                           t, vaddr, phys, restart);
+        if (complete == INVALID_ADDRESS)
+            goto fail_dealloc;
+        assert(!t->blocked_on);
+        t->blocked_on = INVALID_ADDRESS;
+        if (restart)
+            restart_syscall(t);
+    }
+
+    demand_page_result result = DEMAND_PAGE_PENDING;
+    if (pagecache_map_page(vm->cache_node, node_offset, vaddr, page_map_flags(vm->flags), phys, complete)) {
+        if (complete) {
+            t->blocked_on = 0;
+            f[FRAME_RIP] = rip;
+            f[FRAME_RAX] = rax;
+            deallocate_closure(complete);
+        }
+        result = DEMAND_PAGE_MAPPED;
+    } else if (!complete) {
+        /* not resident; it is being read in the background */
+        goto fail_dealloc;
+    }
+
+    /* Map whatever of the window is already cached; copies for private
+       writable mappings are left to their own faults. */
+    if (result == DEMAND_PAGE_MAPPED && p->fault_around > 1 && !vmap_is_private_writable(vm->flags)) {
+        range w = fault_around_window(p, vm, vaddr);
+        fetch_and_add_64(&p->faults.around,
+                         pagecache_map_resident(vm->cache_node, w, vm->node_offset + (w.start - vm->node.r.start),
+                                                page_map_flags(vm->flags)));
+    }
+    if (sequential)
+        fetch_and_add_64(&p->faults.readahead,
+                         pagecache_readahead(vm->cache_node,
+                                             irangel(node_offset + PAGESIZE,
+                                                     (2 * p->fault_around) << PAGELOG)));
+    fetch_and_add_64(result == DEMAND_PAGE_MAPPED ? &p->faults.minor : &p->faults.major, 1);
+    if (unlock)
+        kern_unlock();
+    return result;
+  fail_dealloc:
+    if (phys != INVALID_PHYSICAL)
+        deallocate_u64((heap)heap_physical(get_kernel_heaps()), phys, PAGESIZE);
+  fail:
+    if (unlock)
+        kern_unlock();
+    return DEMAND_PAGE_FAILED;
+}
+
+/* Map a zeroed page at vaddr, preferring one from the cpu's pool. */
+static boolean map_zeroed_page(u64 vaddr, u64 flags, boolean reclaim)
+{
+    u64 paddr = get_zeroed_page();
+    if (paddr != INVALID_PHYSICAL) {
+        map(vaddr, paddr, PAGESIZE, flags);
+        return true;
+    }
+    paddr = allocate_fault_page(reclaim);
+    if (paddr == INVALID_PHYSICAL)
+        return false;
+    map(vaddr, paddr, PAGESIZE, flags);
+    zero(pointer_from_u64(vaddr), PAGESIZE);
+    return true;
+}
+
+/* Back the 2M block around vaddr with a huge page, provided that it
+   lies wholly within an anonymous vmap and nothing in it is mapped
+   yet. The caller falls back to 4K pages otherwise, or if no 2M
+   physical page is available. */
+static boolean map_huge_anonymous_page(process p, vmap vm, u64 vaddr, u64 flags)
+{
+    u64 base = vaddr & ~MASK(PAGELOG_2M);
+    if (vm->cache_node || (vm->flags & VMAP_FLAG_NOHUGEPAGE) ||
+        base < vm->node.r.start || base + PAGESIZE_2M > vm->node.r.end)
+        return false;
+
+    /* don't allocate and clear a page for a block that is already in
+       use; map_huge_page() checks again in case of a racing fault */
+    if (!huge_page_block_free(base))
+        return false;
+
+    heap physical = (heap)heap_physical(get_kernel_heaps());
+    u64 paddr = allocate_u64(physical, PAGESIZE_2M);
+    if (paddr == INVALID_PHYSICAL) {
+        fetch_and_add_64(&p->faults.huge_fallback, 1);
+        return false;
+    }
+    assert((paddr & MASK(PAGELOG_2M)) == 0); /* id heaps keep 2^n alignment */
+    zero_huge_page(paddr);
+    if (!map_huge_page(base, paddr, flags)) {
+        /* part of the block is already in use */
+        deallocate_u64(physical, paddr, PAGESIZE_2M);
+        return false;
+    }
+    fetch_and_add_64(&p->faults.huge, 1);
+    fetch_and_add_64(&p->faults.minor, 1);
+    return true;
+}
+
+static demand_page_result demand_page(u64 vaddr, vmap vm, boolean user, boolean restart)
 {
     if ((vm->flags & VMAP_FLAG_MMAP) == 0) {
         msg_err("vaddr 0x%lx matched vmap with invalid flags (0x%x)\n",
                 vaddr, vm->flags);
-        return false;
+        return DEMAND_PAGE_FAILED;
     }
 
-    /* XXX make free list */
-    kernel_heaps kh = get_kernel_heaps();
-    u64 paddr = allocate_u64((heap)heap_physical(kh), PAGESIZE);
-    if (paddr == INVALID_PHYSICAL) {
+    process p = current->p;
+    u64 vaddr_aligned = vaddr & ~MASK(PAGELOG);
+    boolean sequential = fault_is_sequential(p, vm, vaddr_aligned);
+
+    /* Reclaim evicts pagecache pages and drains caches, which would pull
+       memory out from under kernel code interrupted with the kernel lock
+       held, e.g. in the middle of a copy; such a fault fails instead and
+       memory is reclaimed from mm_service. A syscall which has yet to do
+       anything has nothing to lose. Only the faulting page may reclaim. */
+    boolean reclaim = restart || !current_cpu()->have_kernel_lock;
+    vm->last_fault = vaddr_aligned;
+    if (vm->cache_node) {
+        u64 node_offset = vm->node_offset + (vaddr_aligned - vm->node.r.start);
+
+        /* pages past the end of file are zero-filled below */
+        if (node_offset < pagecache_node_get_length(vm->cache_node))
+            return demand_file_page(vaddr_aligned, vm, node_offset, user, restart, reclaim,
+                                    sequential);
+    }
+
+    u64 flags = page_map_flags(vm->flags);
+    if (map_huge_anonymous_page(p, vm, vaddr_aligned, flags))
+        return DEMAND_PAGE_MAPPED;
+    if (!map_zeroed_page(vaddr_aligned, flags, reclaim)) {
         msg_err("cannot get physical page; OOM\n");
-        return false;
+        return DEMAND_PAGE_FAILED;
+    }
+    fetch_and_add_64(&p->faults.minor, 1);
+
+    /* Populate ahead of a sequential run, e.g. a heap being warmed up.
+       This is limited to anonymous vmaps so as not to cover file pages
+       with zero pages. */
+    if (sequential && !vm->cache_node) {
+        range w = fault_around_window(p, vm, vaddr_aligned);
+        w.end = MIN(w.end, pad(vaddr_aligned + PAGESIZE, PAGESIZE_2M)); /* leave the next 2M to itself */
+        u64 mapped = 0;
+        for (u64 va = w.start + PAGESIZE; va < w.end; va += PAGESIZE) {
+            if (physical_from_virtual(pointer_from_u64(va)) != INVALID_PHYSICAL)
+                continue;
+            if (!map_zeroed_page(va, flags, false))
+                break;
+            mapped++;
+        }
+        fetch_and_add_64(&p->faults.around, mapped);
     }
+    return DEMAND_PAGE_MAPPED;
+}
 
-    u64 vaddr_aligned = vaddr & ~MASK(PAGELOG);
-    map(vaddr_aligned, paddr, PAGESIZE, page_map_flags(vm->flags));
-    zero(pointer_from_u64(vaddr_aligned), PAGESIZE);
+demand_page_result do_demand_page(u64 vaddr, vmap vm, context frame)
+{
+    return demand_page(vaddr, vm, is_usermode_fault(frame), false);
+}
 
+/* Make the file pages under the user buffer [buf, buf + length) of
+   process p present ahead of a copy to or from it, which may happen from a
+   context that cannot wait for a page to be read in (e.g. an I/O
+   completion). Anonymous pages can be had anywhere and are left to
+   their faults.
+
+   With restart, this must be called from a syscall handler before it
+   has done anything else: if a page has to be read in, the thread
+   sleeps and the syscall is reissued from the start once the page is
+   filled, leaving this call behind. Otherwise, pages which are not
+   resident are read in the background and false is returned, as it is
+   for a buffer that is not mapped. */
+boolean fault_in_process_memory(process p, const void *buf, bytes length,
+                                boolean restart)
+{
+    u64 end = u64_from_pointer(buf) + length;
+    vmap vm = INVALID_ADDRESS;
+    assert(!restart || current_cpu()->state == cpu_syscall);
+    for (u64 va = u64_from_pointer(buf) & ~MASK(PAGELOG); va < end; va += PAGESIZE) {
+        if (vm == INVALID_ADDRESS || !point_in_range(vm->node.r, va)) {
+            vm = vmap_from_vaddr(p, va);
+            if (vm == INVALID_ADDRESS)
+                return false;
+        }
+        if (!vm->cache_node)
+            continue;
+        if (physical_from_virtual(pointer_from_u64(va)) != INVALID_PHYSICAL)
+            continue;
+        switch (demand_page(va, vm, false, restart)) {
+        case DEMAND_PAGE_MAPPED:
+            break;
+        case DEMAND_PAGE_PENDING:
+            runloop();
+        default:
+            return false;
+        }
+    }
     return true;
 }
 
@@ -70,9 +376,10 @@ closure_function(0, 1, void, vmap_dump_node,
                  rmnode, n)
 {
     vmap curr = (vmap)n;
-    rprintf("  %R, %s%s%s%s\n", curr->node.r,
+    rprintf("  %R, %s%s%s%s%s\n", curr->node.r,
             (curr->flags & VMAP_FLAG_MMAP) ? "mmap " : "",
             (curr->flags & VMAP_FLAG_ANONYMOUS) ? "anonymous " : "",
+            (curr->flags & VMAP_FLAG_SHARED) ? "shared " : "",
             (curr->flags & VMAP_FLAG_WRITABLE) ? "writable " : "",
             (curr->flags & VMAP_FLAG_EXEC) ? "exec " : "");
 }
@@ -91,6 +398,9 @@ vmap allocate_vmap(rangemap rm, range r, u64 flags)
         return vm;
     rmnode_init(&vm->node, r);
     vm->flags = flags;
+    vm->cache_node = 0;
+    vm->node_offset = 0;
+    vm->last_fault = 0;
     if (!rangemap_insert(rm, &vm->node)) {
         deallocate(rm->h, vm, sizeof(struct vmap));
         return INVALID_ADDRESS;
@@ -98,6 +408,69 @@ vmap allocate_vmap(rangemap rm, range r, u64 flags)
     return vm;
 }
 
+/* File offset that would back virtual address zero; stays constant
+   for all pieces of a split file mapping. */
+static inline u64 vmap_offset_base(vmap vm)
+{
+    return vm->node_offset - vm->node.r.start;
+}
+
+/* Allocate a vmap for a piece of src, which may have been trimmed
+   already; offset_base is taken from src beforehand. */
+static vmap allocate_vmap_split(rangemap rm, range r, u64 flags, vmap src, u64 offset_base)
+{
+    vmap vm = allocate_vmap(rm, r, flags);
+    if (vm != INVALID_ADDRESS && src->cache_node) {
+        vm->cache_node = src->cache_node;
+        vm->node_offset = offset_base + r.start;
+    }
+    return vm;
+}
+
+/* Drop any mappings of cache pages from a file-backed vmap within r. */
+static void vmap_unmap_cache_pages(vmap vm, range r)
+{
+    if (vm->cache_node)
+        pagecache_unmap_pages(vm->cache_node, r, vmap_offset_base(vm) + r.start);
+}
+
+/* Move the dirty state of pages written through a shared file
+   mapping within r to the page cache. */
+static void vmap_collect_dirty(vmap vm, range r)
+{
+    if (vm->cache_node && (vm->flags & VMAP_FLAG_SHARED))
+        pagecache_collect_dirty(vm->cache_node, r, vmap_offset_base(vm) + r.start);
+}
+
+/* Collect dirty pages from the mappings of pn, or from all file
+   mappings if pn is zero. */
+void mmap_collect_dirty_node(process p, pagecache_node pn)
+{
+    vmap_lock(p);
+    vmap vm = (vmap)rangemap_first_node(p->vmaps);
+    while (vm != INVALID_ADDRESS) {
+        if (!pn || vm->cache_node == pn)
+            vmap_collect_dirty(vm, vm->node.r);
+        vm = (vmap)rangemap_next_node(p->vmaps, &vm->node);
+    }
+    vmap_unlock(p);
+}
+
+void mmap_collect_dirty(process p)
+{
+    mmap_collect_dirty_node(p, 0);
+}
+
+/* Periodically write back pages dirtied through shared mappings. */
+closure_function(1, 1, void, mmap_writeback,
+                 process, p,
+                 u64, overruns /* ignored */)
+{
+    process p = bound(p);
+    mmap_collect_dirty(p);
+    filesystem_flush(p->fs, ignore_status);
+}
+
 boolean adjust_process_heap(process p, range new)
 {
     vmap_lock(p);
@@ -233,14 +606,15 @@ closure_function(3, 3, boolean, mincore_fill_vec,
     u64 pgoff, i;
 
     if (pt_entry_is_present(e)) {
-        pgoff = (addr - bound(base)) >> PAGELOG;
-
         if (pt_entry_is_fat(level, e)) {
-            /* whole level is mapped */
-            for (i = 0; (i < 512) && (pgoff + i < bound(nr_pgs)); i++) {
+            /* whole level is mapped, possibly starting before base */
+            u64 start = MAX(addr, bound(base));
+            u64 end = MIN(addr + PAGESIZE_2M, bound(base) + (bound(nr_pgs) << PAGELOG));
+            pgoff = (start - bound(base)) >> PAGELOG;
+            for (i = 0; i < (end - start) >> PAGELOG; i++)
                 bound(vec)[pgoff + i] = 1;
-	    }
         } else if (pt_entry_is_pte(level, e)) {
+            pgoff = (addr - bound(base)) >> PAGELOG;
             bound(vec)[pgoff] = 1;
         }
     }
@@ -288,48 +662,6 @@ static sysreturn mincore(void *addr, u64 length, u8 *vec)
     return 0;
 }
 
-closure_function(5, 2, void, mmap_read_complete,
-                 thread, t, u64, where, u64, buf_len, buffer, b, u64, mapflags,
-                 status, s, bytes, length)
-{
-    thread t = bound(t);
-    u64 where = bound(where);
-    buffer b = bound(b);
-    u64 mapflags = bound(mapflags);
-
-    if (!is_ok(s)) {
-        deallocate_buffer(b);
-        set_syscall_error(t, EACCES);
-        goto out;
-    }
-
-    u64 buf_len = bound(buf_len);
-    assert((buf_len & (PAGESIZE - 1)) == 0);
-    void * buf = buffer_ref(b, 0);
-
-    /* free existing pages */
-    unmap_and_free_phys(where, buf_len);
-
-    /* Note that we rely on the backed heap being physically
-       contiguous. If this behavior changes or faulted-in pages are
-       ever used, revise this to use the page walker. */
-    map(where, physical_from_virtual(buf), buf_len, mapflags);
-
-    /* zero pad */
-    if (length < buf_len)
-        zero(pointer_from_u64(where + length), buf_len - length);
-
-    /* XXX This is gross. Either support this within the buffer interface or use something besides
-       a buffer... */
-    physically_backed_dealloc_virtual(b->h, u64_from_pointer(buf), pad(bound(buf_len), b->h->pagesize));
-    deallocate(b->h, b, sizeof(struct buffer));
-
-    set_syscall_return(t, where);
-  out:
-    file_op_maybe_wake(t);
-    closure_finish();
-}
-
 #if 0
 closure_function(0, 1, void, vmap_dump_node,
                  rmnode, n)
@@ -351,15 +683,16 @@ static void vmap_dump(rangemap pvmap)
 #endif
 
 /* XXX refactor */
-closure_function(3, 1, void, vmap_attribute_update_intersection,
-                 heap, h, rangemap, pvmap, vmap, q,
+closure_function(4, 1, void, vmap_attribute_update_intersection,
+                 heap, h, rangemap, pvmap, vmap, q, u64, mask,
                  rmnode, node)
 {
     rangemap pvmap = bound(pvmap);
     vmap q = bound(q);
 
     vmap match = (vmap)node;
-    if (vmap_attr_equal(q, match))
+    u64 newflags = (match->flags & ~bound(mask)) | q->flags;
+    if (newflags == match->flags)
         return;
 
     range rn = node->r;
@@ -396,7 +729,12 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
 
     */
 
-    u64 newflags = (match->flags & ~(VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC)) | q->flags;
+    u64 offset_base = vmap_offset_base(match);
+
+    /* cache pages mapped read-only must be replaced with private
+       copies (on next fault) before the mapping becomes writable */
+    if (vmap_is_private_writable(newflags) && !vmap_is_private_writable(match->flags))
+        vmap_unmap_cache_pages(match, ri);
 
     if (head) {
         u64 rtend = rn.end;
@@ -406,22 +744,23 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
         assert(rangemap_reinsert(pvmap, node, rhl));
 
         /* create node for intersection */
-        vmap mh = allocate_vmap(pvmap, ri, newflags);
+        vmap mh = allocate_vmap_split(pvmap, ri, newflags, match, offset_base);
         assert(mh != INVALID_ADDRESS);
 
         if (tail) {
             /* create node at tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(pvmap, rt, match->flags);
+            vmap mt = allocate_vmap_split(pvmap, rt, match->flags, match, offset_base);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
         /* move node start back */
         range rt = { ri.end, node->r.end };
         assert(rangemap_reinsert(pvmap, node, rt));
+        match->node_offset = offset_base + rt.start;
 
         /* create node for intersection */
-        vmap mt = allocate_vmap(pvmap, ri, newflags);
+        vmap mt = allocate_vmap_split(pvmap, ri, newflags, match, offset_base);
         assert(mt != INVALID_ADDRESS);
     } else {
         /* key (range) remains the same, no need to reinsert */
@@ -435,7 +774,9 @@ closure_function(0, 1, void, vmap_attribute_update_gap,
     thread_log(current, "   found gap [0x%lx, 0x%lx)", r.start, r.end);
 }
 
-static boolean vmap_attribute_update(heap h, rangemap pvmap, vmap q)
+/* Replace the flags selected by mask with those of q for the vmaps
+   within q's range, splitting vmaps as needed. */
+static boolean vmap_attribute_update(heap h, rangemap pvmap, vmap q, u64 mask)
 {
     range rq = q->node.r;
     assert((rq.start & MASK(PAGELOG)) == 0);
@@ -448,11 +789,12 @@ static boolean vmap_attribute_update(heap h, rangemap pvmap, vmap q)
         return false;
     }
 
-    rmnode_handler nh = stack_closure(vmap_attribute_update_intersection, h, pvmap, q);
+    rmnode_handler nh = stack_closure(vmap_attribute_update_intersection, h, pvmap, q, mask);
     if (!rangemap_range_lookup(pvmap, rq, nh))
         return false;
 
-    update_map_flags(rq.start, range_span(rq), page_map_flags(q->flags));
+    if (mask & (VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC))
+        update_map_flags(rq.start, range_span(rq), page_map_flags(q->flags));
     return true;
 }
 
@@ -479,10 +821,37 @@ sysreturn mprotect(void * addr, u64 len, int prot)
     struct vmap q;
     q.node.r = r;
     q.flags = new_vmflags;
+    q.cache_node = 0;
+    q.node_offset = 0;
+
+    process p = current->p;
+    vmap_lock(p);
+    boolean result = vmap_attribute_update(h, p->vmaps, &q, VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC);
+    vmap_unlock(p);
+    return result ? 0 : -ENOMEM;
+}
+
+/* Only the huge page hints are acted upon; other advice is accepted
+   and ignored. */
+static sysreturn madvise(void *addr, u64 len, int advice)
+{
+    thread_log(current, "madvise: addr %p, len 0x%lx, advice %d", addr, len, advice);
+    u64 where = u64_from_pointer(addr);
+    if (where & MASK(PAGELOG))
+        return -EINVAL;
+    if ((advice != MADV_HUGEPAGE && advice != MADV_NOHUGEPAGE) || len == 0)
+        return 0;
+
+    struct vmap q;
+    q.node.r = irange(where, where + pad(len, PAGESIZE));
+    q.flags = advice == MADV_NOHUGEPAGE ? VMAP_FLAG_NOHUGEPAGE : 0;
+    q.cache_node = 0;
+    q.node_offset = 0;
 
     process p = current->p;
     vmap_lock(p);
-    boolean result = vmap_attribute_update(h, p->vmaps, &q);
+    boolean result = vmap_attribute_update(heap_general(get_kernel_heaps()), p->vmaps, &q,
+                                           VMAP_FLAG_NOHUGEPAGE);
     vmap_unlock(p);
     return result ? 0 : -ENOMEM;
 }
@@ -512,12 +881,15 @@ closure_function(3, 1, void, vmap_paint_intersection,
     if (range_equal(ri, rn)) {
         /* key (range) remains the same, no need to reinsert */
         match->flags = q->flags;
+        match->cache_node = q->cache_node;
+        match->node_offset = vmap_offset_base(q) + rn.start;
         return;
     }
 
     /* trim match at both head and tail ends */
     boolean head = ri.start > rn.start;
     boolean tail = ri.end < rn.end;
+    u64 offset_base = vmap_offset_base(match);
 
     if (head) {
         /* truncate node at start */
@@ -528,13 +900,14 @@ closure_function(3, 1, void, vmap_paint_intersection,
         if (tail) {
             /* create node at tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(pvmap, rt, match->flags);
+            vmap mt = allocate_vmap_split(pvmap, rt, match->flags, match, offset_base);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
         /* move node start back */
         range rt = { ri.end, rn.end };
         rangemap_reinsert(pvmap, node, rt);
+        match->node_offset = offset_base + rt.start;
     }
 }
 
@@ -542,12 +915,22 @@ closure_function(3, 1, void, vmap_paint_gap,
                  heap, h, rangemap, pvmap, vmap, q,
                  range, r)
 {
-    vmap mt = allocate_vmap(bound(pvmap), r, bound(q)->flags);
+    vmap q = bound(q);
+    vmap mt = allocate_vmap_split(bound(pvmap), r, q->flags, q, vmap_offset_base(q));
     assert(mt != INVALID_ADDRESS);
 }
 
-/* Paint into process vmap */
-static void vmap_paint(heap h, process p, u64 where, u64 len, u64 vmflags)
+closure_function(1, 1, void, vmap_paint_unmap_cache_pages,
+                 range, rq,
+                 rmnode, node)
+{
+    vmap_unmap_cache_pages((vmap)node, range_intersection(bound(rq), node->r));
+}
+
+/* Paint into process vmap; cache_node and node_offset give the backing
+   of a file mapping */
+static void vmap_paint(heap h, process p, u64 where, u64 len, u64 vmflags,
+                       pagecache_node cache_node, u64 node_offset)
 {
     range rq = irange(where, where + len);
     assert((rq.start & MASK(PAGELOG)) == 0);
@@ -556,9 +939,13 @@ static void vmap_paint(heap h, process p, u64 where, u64 len, u64 vmflags)
     struct vmap q;
     q.node.r = rq;
     q.flags = vmflags;
+    q.cache_node = cache_node;
+    q.node_offset = node_offset;
     rangemap pvmap = p->vmaps;
 
     vmap_lock(p);
+    /* release cache pages of any file mappings being replaced */
+    rangemap_range_lookup(pvmap, rq, stack_closure(vmap_paint_unmap_cache_pages, rq));
     rangemap_range_lookup(pvmap, rq, stack_closure(vmap_paint_intersection, h, pvmap, &q));
     rangemap_range_find_gaps(pvmap, rq, stack_closure(vmap_paint_gap, h, pvmap, &q));
 
@@ -629,6 +1016,7 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
     /* Don't really try to honor a hint, only fixed. */
     boolean fixed = (flags & MAP_FIXED) != 0;
     u64 where = fixed ? u64_from_pointer(target) : 0;
+    pagecache_node cache_node = 0;
 
     if (!(flags & MAP_ANONYMOUS)) {
         fdesc desc = resolve_fd(p, fd);
@@ -640,10 +1028,23 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
                 vmflags |= VMAP_FLAG_PREALLOC;
                 ret = io_uring_mmap(desc, len, page_map_flags(vmflags), offset);
                 if (ret > 0)
-                    vmap_paint(h, p, (u64)ret, len, vmflags);
+                    vmap_paint(h, p, (u64)ret, len, vmflags, 0, 0);
             }
             return ret;
         }
+
+        if (desc->type != FDESC_TYPE_REGULAR) {
+            thread_log(current, "   fail: fd %d is not a regular file", fd);
+            return -ENODEV;
+        }
+        if (offset & MASK(PAGELOG))
+            return -EINVAL;
+        if ((flags & MAP_SHARED)) {
+            if ((prot & PROT_WRITE) && (desc->flags & O_ACCMODE) != O_RDWR)
+                return -EACCES;
+            vmflags |= VMAP_FLAG_SHARED;
+        }
+        cache_node = fsfile_get_cachenode(file_get_fsfile((file)desc));
     }
 
     if (fixed) {
@@ -684,7 +1085,7 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
         }
     }
 
-    vmap_paint(h, p, where, len, vmflags);
+    vmap_paint(h, p, where, len, vmflags, cache_node, offset);
 
     if (flags & MAP_ANONYMOUS) {
         thread_log(current, "   anon target: 0x%lx, len: 0x%lx (given size: 0x%lx)", where, len, size);
@@ -693,18 +1094,12 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
         return where;
     }
 
-    file f = resolve_fd(p, fd);
-    u64 flen = MIN(pad(f->length, PAGESIZE), len);
-    if (flen == 0)
-        return where;
-    heap mh = heap_backed(kh);
-    buffer b = allocate_buffer(mh, pad(flen, mh->pagesize));
-
-    thread_log(current, "  read file at 0x%lx, flen %ld, blocking...", where, flen);
-    file_op_begin(current);
-    filesystem_read_linear(file_get_fsfile(f), buffer_ref(b, 0), irangel(offset, flen),
-                           closure(h, mmap_read_complete, current, where, flen, b, page_map_flags(vmflags)));
-    return file_op_maybe_sleep(current);
+    /* File pages are faulted in on demand; drop anything left mapped
+       here by a previous mapping. */
+    thread_log(current, "   file target: 0x%lx, len: 0x%lx, offset 0x%lx%s", where, len, offset,
+               (flags & MAP_SHARED) ? ", shared" : "");
+    unmap_and_free_phys(where, len);
+    return where;
 }
 
 /* invoked with vmap lock taken */
@@ -720,6 +1115,10 @@ closure_function(2, 1, void, process_unmap_intersection,
     /* similar logic to attribute update above */
     boolean head = ri.start > rn.start;
     boolean tail = ri.end < rn.end;
+    u64 offset_base = vmap_offset_base(match);
+
+    /* cache pages go back to the cache rather than the physical heap */
+    vmap_unmap_cache_pages(match, ri);
 
 //    rprintf("unmap q %R, node %R, head %d, tail %d\n", bound(rq), node->r, head, tail);
 
@@ -733,13 +1132,14 @@ closure_function(2, 1, void, process_unmap_intersection,
         if (tail) {
             /* create node for tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(p->vmaps, rt, match->flags);
+            vmap mt = allocate_vmap_split(p->vmaps, rt, match->flags, match, offset_base);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
         /* move node start back */
         range rt = { ri.end, node->r.end };
         assert(rangemap_reinsert(p->vmaps, node, rt));
+        match->node_offset = offset_base + rt.start;
     } else {
         /* delete outright */
         rangemap_remove_node(p->vmaps, node);
@@ -788,6 +1188,92 @@ static sysreturn munmap(void *addr, u64 length)
     return 0;
 }
 
+closure_function(3, 1, void, msync_complete,
+                 thread, t, filesystem, fs, boolean, log_flushed,
+                 status, s)
+{
+    thread t = bound(t);
+    /* storage allocated by writeback is only committed with the log */
+    if (is_ok(s) && !bound(log_flushed)) {
+        bound(log_flushed) = true;
+        filesystem_flush_log(bound(fs), (status_handler)closure_self());
+        return;
+    }
+    thread_log(t, "%s: status %v", __func__, s);
+    set_syscall_return(t, is_ok(s) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+closure_function(0, 1, void, msync_vmap_gap,
+                 range, r)
+{
+    thread_log(current, "   found gap [0x%lx, 0x%lx)", r.start, r.end);
+}
+
+closure_function(2, 1, void, msync_vmap,
+                 range, q, vector, nodes,
+                 rmnode, node)
+{
+    vmap vm = (vmap)node;
+    if (!vm->cache_node || !(vm->flags & VMAP_FLAG_SHARED))
+        return;
+    vmap_collect_dirty(vm, range_intersection(bound(q), node->r));
+
+    pagecache_node pn;
+    vector_foreach(bound(nodes), pn) {
+        if (pn == vm->cache_node)
+            return;
+    }
+    vector_push(bound(nodes), vm->cache_node);
+}
+
+static sysreturn msync(void *addr, u64 length, int flags)
+{
+    process p = current->p;
+    heap h = heap_general(get_kernel_heaps());
+    thread_log(current, "msync: addr %p, length 0x%lx, flags 0x%x", addr, length, flags);
+
+    u64 where = u64_from_pointer(addr);
+    if ((where & MASK(PAGELOG)) || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+        return -EINVAL;
+    if (length == 0)
+        return 0;
+
+    /* find the file nodes behind any shared mappings in the range */
+    range q = irange(where, where + pad(length, PAGESIZE));
+    vector nodes = allocate_vector(h, 4);
+    if (nodes == INVALID_ADDRESS)
+        return -ENOMEM;
+    vmap_lock(p);
+    boolean gap = rangemap_range_find_gaps(p->vmaps, q, stack_closure(msync_vmap_gap));
+    if (!gap)
+        rangemap_range_lookup(p->vmaps, q, stack_closure(msync_vmap, q, nodes));
+    vmap_unlock(p);
+
+    sysreturn rv = gap ? -ENOMEM : 0;
+    pagecache_node pn;
+    if (gap || !(flags & MS_SYNC)) {
+        /* MS_ASYNC: start writeback without waiting for it */
+        if (!gap) {
+            vector_foreach(nodes, pn)
+                pagecache_sync_node(pn, ignore_status);
+        }
+        deallocate_vector(nodes);
+        return rv;
+    }
+
+    file_op_begin(current);
+    merge m = allocate_merge(h, closure(h, msync_complete, current, p->fs, false));
+    status_handler sh = apply_merge(m);
+    vector_foreach(nodes, pn)
+        pagecache_sync_node(pn, apply_merge(m));
+    deallocate_vector(nodes);
+    apply(sh, STATUS_OK);
+    return file_op_maybe_sleep(current);
+}
+
 /* kernel start */
 extern void * START;
 
@@ -843,6 +1329,21 @@ void mmap_process_init(process p)
     /* Track vsyscall page */
     assert(allocate_vmap(p->vmaps, irange(VSYSCALL_BASE, VSYSCALL_BASE + PAGESIZE), VMAP_FLAG_EXEC)
            != INVALID_ADDRESS);
+
+    /* fault-around window, in pages; 0 or 1 disables it along with readahead */
+    p->fault_around = FAULT_AROUND_DEFAULT_PAGES;
+    value v = table_find(p->process_root, sym(fault_around));
+    if (v) {
+        u64 pages;
+        if (u64_from_value(v, &pages))
+            p->fault_around = pages > 1 ? U64_FROM_BIT(msb(pages)) : 0;
+        else
+            msg_err("invalid fault_around value\n");
+    }
+    zero(&p->faults, sizeof(p->faults));
+
+    register_timer(runloop_timers, CLOCK_ID_MONOTONIC, seconds(MMAP_WRITEBACK_INTERVAL_SECONDS), false,
+                   seconds(MMAP_WRITEBACK_INTERVAL_SECONDS), closure(h, mmap_writeback, p));
 }
 
 void register_mmap_syscalls(struct syscall *map)
@@ -851,6 +1352,7 @@ void register_mmap_syscalls(struct syscall *map)
     register_syscall(map, mmap, mmap);
     register_syscall(map, mremap, mremap);
     register_syscall(map, munmap, munmap);
+    register_syscall(map, msync, msync);
     register_syscall(map, mprotect, mprotect);
-    register_syscall(map, madvise, syscall_ignore);
+    register_syscall(map, madvise, madvise);
 }
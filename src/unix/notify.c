@@ -3,6 +3,7 @@
 struct notify_entry {
     u64 eventmask;
     event_handler eh;
+    boolean exclusive;
     struct list l;
 };
 
@@ -37,6 +38,7 @@ notify_entry notify_add(notify_set s, u64 eventmask, event_handler eh)
         return n;
     n->eventmask = eventmask;
     n->eh = eh;
+    n->exclusive = false;
     /* XXX take mutex */
     list_insert_before(&s->entries, &n->l);
     /* XXX release mutex */
@@ -58,6 +60,11 @@ void notify_entry_update_eventmask(notify_entry n, u64 eventmask)
     n->eventmask = eventmask;
 }
 
+void notify_entry_set_exclusive(notify_entry n)
+{
+    n->exclusive = true;
+}
+
 u64 notify_get_eventmask_union(notify_set s)
 {
     u64 u = 0;
@@ -72,6 +79,7 @@ u64 notify_get_eventmask_union(notify_set s)
 
 void notify_dispatch_for_thread(notify_set s, u64 events, thread t)
 {
+    notify_entry woke = 0;
     /* XXX take mutex */
     list_foreach(&s->entries, l) {
         notify_entry n = struct_from_list(l, notify_entry, l);
@@ -79,7 +87,17 @@ void notify_dispatch_for_thread(notify_set s, u64 events, thread t)
         /* no guarantee that a transition is represented here; event
            handler needs to keep track itself if edge trigger is used */
         assert(n->eh);
-        apply(n->eh, events & n->eventmask, t);
+        boolean exclusive = n->exclusive; /* handler may remove the entry */
+        if (exclusive && woke)
+            continue;
+        if (apply(n->eh, events & n->eventmask, t) && exclusive)
+            woke = n;
+    }
+
+    /* rotate so that the next events are offered to another exclusive entry first */
+    if (woke) {
+        list_delete(&woke->l);
+        list_push_back(&s->entries, &woke->l);
     }
     /* XXX release mutex */
 }
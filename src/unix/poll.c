@@ -23,6 +23,8 @@ typedef struct epollfd {
     boolean registered;
     boolean zombie;		/* freed or masked by oneshot */
     notify_entry notify_handle;
+    struct list ready_list;     /* on epoll ready list, pending a check */
+    struct list polled_list;    /* on epoll polled list */
 } *epollfd;
 
 typedef struct epoll_blocked *epoll_blocked;
@@ -72,6 +74,8 @@ struct epoll {
     vector events;		/* epollfds indexed by fd */
     int nfds;
     bitmap fds;			/* fds being watched / epollfd registered */
+    struct list ready_head;     /* epollfds that may have events to report */
+    struct list polled_head;    /* epollfds to be checked on every wait */
 };
     
 define_closure_function(1, 0, void, epoll_free,
@@ -93,6 +97,8 @@ static epoll epoll_alloc_internal(void)
 	return e;
 
     list_init(&e->blocked_head);
+    list_init(&e->ready_head);
+    list_init(&e->polled_head);
     init_refcount(&e->refcount, 1, init_closure(&e->free, epoll_free, e));
     e->h = heap_general(get_kernel_heaps());
     e->events = allocate_vector(e->h, 8);
@@ -135,6 +141,8 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     init_refcount(&efd->refcount, 1, init_closure(&efd->free, epollfd_free, efd));
     efd->registered = false;
     efd->zombie = false;
+    list_init(&efd->ready_list);
+    list_init(&efd->polled_list);
     vector_set(e->events, fd, efd);
     bitmap_set(e->fds, fd, 1);
     if (fd >= e->nfds)
@@ -154,6 +162,14 @@ static void unregister_epollfd(epollfd efd)
     refcount_release(&efd->refcount); /* registration */
 }
 
+static inline void epollfd_list_remove(list l)
+{
+    if (!list_empty(l)) {
+        list_delete(l);
+        list_init(l);
+    }
+}
+
 static void release_epollfd(epollfd efd)
 {
     epoll e = efd->e;
@@ -165,9 +181,28 @@ static void release_epollfd(epollfd efd)
     efd->zombie = true;
     if (efd->registered)
         unregister_epollfd(efd);
+    epollfd_list_remove(&efd->ready_list);
+    epollfd_list_remove(&efd->polled_list);
     refcount_release(&efd->refcount); /* alloc */
 }
 
+/* Queue the epollfd for a check on the next epoll_wait. Entries are
+   only hints; the fd's current events are taken when the list is
+   drained, so stale entries cost no more than a check. */
+static inline void epollfd_set_ready(epollfd efd)
+{
+    if (list_empty(&efd->ready_list))
+        list_push_back(&efd->e->ready_head, &efd->ready_list);
+}
+
+/* Sources that don't dispatch notifications on every change of their
+   events must be checked on each wait. Special files (e.g. /dev/urandom)
+   compute their events on demand. */
+static inline boolean fdesc_needs_poll(fdesc f)
+{
+    return f->type == FDESC_TYPE_SPECIAL;
+}
+
 /* XXX maybe merge alloc and registration */
 static boolean register_epollfd(epollfd efd, event_handler eh)
 {
@@ -184,6 +219,8 @@ static boolean register_epollfd(epollfd efd, event_handler eh)
     epoll_debug("fd %d, eventmask 0x%x, handler %p\n", efd->fd, efd->eventmask, eh);
     efd->notify_handle = notify_add(f->ns, efd->eventmask | (EPOLLERR | EPOLLHUP), eh);
     assert(efd->notify_handle != INVALID_ADDRESS);
+    if (efd->eventmask & EPOLLEXCLUSIVE)
+        notify_entry_set_exclusive(efd->notify_handle);
     return true;
 }
 
@@ -277,47 +314,73 @@ static inline u32 report_from_notify_events(epollfd efd, u64 notify_events)
     return edge_detect ? ~efd->lastevents & events : events;
 }
 
-closure_function(1, 2, void, epoll_wait_notify,
+/* Pick the blocked waiter to take a report for thread t (any, if t is
+   zero): the first with room, preferring one that has nothing to
+   return yet. The waiter taking a report moves to the back of the
+   list, so that events are dealt out to the waiters in turn rather than
+   piling onto one thread. */
+static epoll_blocked epoll_pick_waiter(epoll e, thread t)
+{
+    epoll_blocked pick = 0;
+    list_foreach(&e->blocked_head, l) {
+        epoll_blocked w = struct_from_list(l, epoll_blocked, blocked_list);
+        if ((t && t != w->t) || !w->user_events ||
+            (w->user_events->length - w->user_events->end) <= 0)
+            continue;
+        if (w->user_events->end == 0)
+            return w;
+        if (!pick)
+            pick = w;
+    }
+    return pick;
+}
+
+closure_function(1, 2, boolean, epoll_wait_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
 {
     epollfd efd = bound(efd);
-    list l = list_get_next(&efd->e->blocked_head);
+    epoll e = efd->e;
 
     /* only path to freedom - even fd removals trigger release */
     if (notify_events == NOTIFY_EVENTS_RELEASE) {
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
+
+        /* fd closed; let the next wait find and release the epollfd */
+        if (!efd->zombie)
+            epollfd_set_ready(efd);
         closure_finish();
-        return;
+        return false;
     }
 
-    epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
     u32 events = (u32)notify_events;
     u32 report = report_from_notify_events(efd, events);
     assert(efd->registered);
-    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, blocked %p, zombie %d\n",
-                efd->fd, events, report, w, efd->zombie);
-
-    /* XXX need to do some work to properly dole out to multiple epoll_waits (threads)... */
-    if (report == 0 || !w || efd->zombie)
-        return;
+    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, zombie %d\n",
+                efd->fd, events, report, efd->zombie);
 
-    if (t && t != w->t)
-        return;
+    if (report == 0 || efd->zombie)
+        return false;
 
-    if (!w->user_events || (w->user_events->length - w->user_events->end) <= 0) {
-        /* XXX here we should advance to the next blocked head, probably */
-        epoll_debug("   user_events null or full\n");
-        return;
+    /* Anything that can't be reported now is left on the ready list
+       for the next epoll_wait. */
+    epoll_blocked w = epoll_pick_waiter(e, t);
+    if (!w) {
+        epoll_debug("   no waiter with room\n");
+        epollfd_set_ready(efd);
+        return false;
     }
 
-    struct epoll_event *e = buffer_ref(w->user_events, w->user_events->end);
-    e->data = efd->data;
-    e->events = report;
+    struct epoll_event *ev = buffer_ref(w->user_events, w->user_events->end);
+    ev->data = efd->data;
+    ev->events = report;
     w->user_events->end += sizeof(struct epoll_event);
-    epoll_debug("   epoll_event %p, data 0x%lx, events 0x%x\n", e, e->data, e->events);
+    epoll_debug("   w %p (tid %d), epoll_event %p, data 0x%lx, events 0x%x\n",
+                w, w->t->tid, ev, ev->data, ev->events);
+    list_delete(&w->blocked_list);
+    list_push_back(&e->blocked_head, &w->blocked_list);
 
     /* XXX check this */
     if (efd->eventmask & EPOLLONESHOT)
@@ -325,7 +388,12 @@ closure_function(1, 2, void, epoll_wait_notify,
 
     /* now that we've reported these events, update last */
     efd->lastevents |= report;
+
+    /* level-triggered events are reported again while they persist */
+    if (!efd->zombie && !(efd->eventmask & EPOLLET))
+        epollfd_set_ready(efd);
     blockq_wake_one(w->t->thread_bq);
+    return true;
 }
 
 static epoll_blocked alloc_epoll_blocked(epoll e)
@@ -350,6 +418,22 @@ static void check_fdesc(fdesc f, thread t)
     notify_dispatch_for_thread(f->ns, apply(f->events, t), t);
 }
 
+static void check_epollfd(epollfd efd)
+{
+    if (efd->zombie)
+        return;
+
+    fdesc f = resolve_fd_noret(current->p, efd->fd);
+    if (!f) {
+        epoll_debug("   x fd %d\n", efd->fd);
+        release_epollfd(efd);
+        return;
+    }
+
+    if (efd->registered)
+        check_fdesc(f, current);
+}
+
 /* It would be nice to devise a way to allow a poll waiter to continue
    to collect events between wakeup (first event) and running. */
 
@@ -389,13 +473,34 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
     return set_syscall_return(t, rv);
 }
 
+/* An epoll_wait that is not to block, on an instance with nothing on its
+   ready and polled lists, has nothing to report, which can be told
+   without the kernel lock (see lockless_syscalls). The lists only change
+   under the lock, and a notification racing with the check is no
+   different from one that arrives after the call. Anything else has the
+   syscall run again with the lock. */
+static sysreturn epoll_wait_lockless(int epfd, int timeout)
+{
+    fdesc f = fdesc_get(current->p, epfd);
+    if (!f)
+        return -EBADF;
+    sysreturn rv = SYSRETURN_KERNEL_LOCK;
+    if (f->type == FDESC_TYPE_EPOLL && timeout == 0) {
+        epoll e = (epoll)f;
+        if (list_empty(&e->ready_head) && list_empty(&e->polled_head))
+            rv = 0;
+    }
+    fdesc_put_lockless(f);
+    return rv;
+}
+
 /* Depending on the epoll flags given, we may:
-   - notify all waiters on a match (default)
+   - notify one waiter on a match, dealing matches out to blocked waiters in turn (default)
    - notify on a match only once until condition is reset (EPOLLET)
    - notify once before removing the registration, handled upstream (EPOLLONESHOT)
-   - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE)
-     - XXX Not implemented; will require tracking reported events on a per fd - not per
-           registration - basis.
+   - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE);
+     the epoll instances sharing the fd exclusively are offered matches in turn, and those
+     after the first to wake a waiter are skipped (see notify_dispatch_for_thread)
 */
 sysreturn epoll_wait(int epfd,
                      struct epoll_event *events,
@@ -404,6 +509,8 @@ sysreturn epoll_wait(int epfd,
 {
     if (!validate_user_memory(events, sizeof(struct epoll_event) * maxevents, true))
         return -EFAULT;
+    if (!current_cpu()->have_kernel_lock)
+        return epoll_wait_lockless(epfd, timeout);
 
     epoll e = resolve_fd(current->p, epfd);
     epoll_blocked w = alloc_epoll_blocked(e);
@@ -415,25 +522,23 @@ sysreturn epoll_wait(int epfd,
     w->user_events = wrap_buffer(e->h, events, maxevents * sizeof(struct epoll_event));
     w->user_events->end = 0;
 
-    bitmap_foreach_set(e->fds, fd) {
-	epollfd efd = vector_get(e->events, fd);
-	assert(efd);
-        assert(efd->fd == fd);
-
-        if (efd->zombie)
-            continue;
-
-        fdesc f = resolve_fd_noret(current->p, efd->fd);
-        if (!f) {
-            epoll_debug("   x fd %d\n", efd->fd);
-            release_epollfd(efd);
-            continue;
-        }
+    /* Only fds that were notified since their last check are looked at;
+       checks that find events to report put them back on the ready list
+       (for level-triggered events, or for lack of room), so the list is
+       detached first. */
+    struct list ready;
+    list_move(&ready, &e->ready_head);
+    list l;
+    while ((l = list_get_next(&ready))) {
+        list_delete(l);
+        list_init(l);
+        check_epollfd(struct_from_list(l, epollfd, ready_list));
+    }
 
-        /* event transitions may in some cases need to be polled for
-           (e.g. due to change in lwIP internal state), so request a check */
-        if (efd->registered)
-            check_fdesc(f, current);
+    /* event transitions for some sources need to be polled for, so
+       request a check */
+    list_foreach(&e->polled_head, l) {
+        check_epollfd(struct_from_list(l, epollfd, polled_list));
     }
 
     return blockq_check_timeout(w->t->thread_bq, current,
@@ -475,16 +580,21 @@ static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
     }
 
     epoll_debug("   adding %d, events 0x%x, data 0x%lx\n", fd, events, data);
-    if (efd == INVALID_ADDRESS) {
-        if (alloc_epollfd(e, fd, events | EPOLLERR | EPOLLHUP, data) ==
-                INVALID_ADDRESS)
-            return -ENOMEM;
-        efd = epollfd_from_fd(e, fd);
-        assert(efd != INVALID_ADDRESS);
-    }
+
+    /* left over from a closed fd */
+    if (efd != INVALID_ADDRESS)
+        release_epollfd(efd);
+    if (alloc_epollfd(e, fd, events | EPOLLERR | EPOLLHUP, data) == INVALID_ADDRESS)
+        return -ENOMEM;
+    efd = epollfd_from_fd(e, fd);
+    assert(efd != INVALID_ADDRESS);
     fdesc f = resolve_fd_noret(current->p, efd->fd);
     assert(f);
     register_epollfd(efd, closure(e->h, epoll_wait_notify, efd));
+    if (fdesc_needs_poll(f))
+        list_push_back(&e->polled_head, &efd->polled_list);
+    else
+        epollfd_set_ready(efd);
 
     /* apply check(s) for any current waiters */
     epollfd_update(efd, f);
@@ -502,6 +612,9 @@ static sysreturn remove_fd(epoll e, int fd)
     return 0;
 }
 
+#define EPOLLEXCLUSIVE_OK_BITS  (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLWAKEUP | \
+                                 EPOLLET | EPOLLEXCLUSIVE)
+
 sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
     epoll e = resolve_fd(current->p, epfd);    
@@ -513,16 +626,22 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_error(current, EFAULT);
     }
 
-    /* EPOLLEXCLUSIVE not yet implemented */
-    if (event && (event->events & EPOLLEXCLUSIVE)) {
-        msg_err("add: EPOLLEXCLUSIVE not supported\n");
-        return set_syscall_error(current, EINVAL);
-    }
-
     if ((f->type == FDESC_TYPE_REGULAR) || (f->type == FDESC_TYPE_DIRECTORY)) {
 	return set_syscall_error(current, EPERM);
     }
 
+    /* EPOLLEXCLUSIVE may only be given on add, with a limited set of
+       flags, and the registration can't be modified afterwards */
+    if (op == EPOLL_CTL_MOD) {
+        epollfd efd = epollfd_from_fd(e, fd);
+        if ((event->events & EPOLLEXCLUSIVE) ||
+            (efd != INVALID_ADDRESS && (efd->eventmask & EPOLLEXCLUSIVE)))
+            return set_syscall_error(current, EINVAL);
+    } else if (op == EPOLL_CTL_ADD && (event->events & EPOLLEXCLUSIVE)) {
+        if ((event->events & ~EPOLLEXCLUSIVE_OK_BITS) || f->type == FDESC_TYPE_EPOLL)
+            return set_syscall_error(current, EINVAL);
+    }
+
     /* XXX verify that fd is not an epoll instance*/
     switch(op) {
     case EPOLL_CTL_ADD:
@@ -549,7 +668,7 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 #define POLLFDMASK_WRITE	(EPOLLOUT | EPOLLHUP | EPOLLERR)
 #define POLLFDMASK_EXCEPT	(EPOLLPRI)
 
-closure_function(1, 2, void, select_notify,
+closure_function(1, 2, boolean, select_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -561,7 +680,7 @@ closure_function(1, 2, void, select_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -570,10 +689,10 @@ closure_function(1, 2, void, select_notify,
 	    efd->fd, events, w, efd->zombie);
 
     if (efd->zombie || !w || efd->fd >= w->nfds)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     assert(w->epoll_type == EPOLL_TYPE_SELECT);
     int count = 0;
@@ -590,11 +709,12 @@ closure_function(1, 2, void, select_notify,
         bitmap_set(w->eset, efd->fd, 1);
         count++;
     }
-    if (count > 0) {
-        fetch_and_add(&w->retcount, count);
-        epoll_debug("   event on %d, events 0x%x\n", efd->fd, events);
-        blockq_wake_one(w->t->thread_bq);
-    }
+    if (count == 0)
+        return false;
+    fetch_and_add(&w->retcount, count);
+    epoll_debug("   event on %d, events 0x%x\n", efd->fd, events);
+    blockq_wake_one(w->t->thread_bq);
+    return true;
 }
 
 closure_function(3, 1, sysreturn, select_bh,
@@ -791,7 +911,7 @@ sysreturn select(int nfds,
     return select_internal(nfds, readfds, writefds, exceptfds, timeout ? time_from_timeval(timeout) : infinity, 0);
 }
 
-closure_function(1, 2, void, poll_notify,
+closure_function(1, 2, boolean, poll_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -803,7 +923,7 @@ closure_function(1, 2, void, poll_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -813,16 +933,17 @@ closure_function(1, 2, void, poll_notify,
     assert(efd->registered);
 
     if (events == 0 || !w || efd->zombie)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     struct pollfd *pfd = buffer_ref(w->poll_fds, efd->data * sizeof(struct pollfd));
     fetch_and_add(&w->poll_retcount, 1);
     pfd->revents = events;
     epoll_debug("   event on %d (%d), events 0x%x\n", efd->fd, pfd->fd, pfd->revents);
     blockq_wake_one(w->t->thread_bq);
+    return true;
 }
 
 closure_function(3, 1, sysreturn, poll_bh,
@@ -339,8 +339,8 @@ static sysreturn unixsock_listen(struct sock *sock, int backlog)
     return 0;
 }
 
-closure_function(2, 1, sysreturn, connect_bh,
-                 unixsock, s, thread, t,
+closure_function(3, 1, sysreturn, connect_bh,
+                 unixsock, s, thread, t, io_completion, completion,
                  u64, bqflags)
 {
     unixsock s = bound(s);
@@ -365,44 +365,41 @@ closure_function(2, 1, sysreturn, connect_bh,
     s->connecting = false;  /* connection has been established */
     rv = 0;
 out:
-    set_syscall_return(t, rv);
-    if (bqflags & BLOCKQ_ACTION_BLOCKED) {
-        thread_wakeup(t);
-    }
+    blockq_handle_completion(s->sock.txbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn unixsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen)
+        socklen_t addrlen, thread t, boolean bh, io_completion completion)
 {
     unixsock s = (unixsock) sock;
     if (unixsock_is_connecting(s)) {
-        return -EALREADY;
+        return io_complete(completion, t, -EALREADY);
     } else if (unixsock_is_connected(s)) {
-        return -EISCONN;
+        return io_complete(completion, t, -EISCONN);
     }
 
     struct sockaddr_un *unixaddr = (struct sockaddr_un *) addr;
-    tuple t;
+    tuple n;
     buffer b;
     unixsock listener, peer;
-    if (filesystem_get_tuple(unixaddr->sun_path, &t) < 0) {
-        return -ECONNREFUSED;
+    if (filesystem_get_tuple(unixaddr->sun_path, &n) < 0) {
+        return io_complete(completion, t, -ECONNREFUSED);
     }
-    b = table_find(t, sym(socket));
+    b = table_find(n, sym(socket));
     if (!b || (buffer_length(b) != sizeof(u64))) {
-        return -ECONNREFUSED;
+        return io_complete(completion, t, -ECONNREFUSED);
     }
     listener = pointer_from_u64(*((u64 *) buffer_ref(b, 0)));
     assert(listener);
     if (!s->connecting) {
         if (!listener->conn_q || queue_full(listener->conn_q)) {
-            return -ECONNREFUSED;
+            return io_complete(completion, t, -ECONNREFUSED);
         }
         peer = unixsock_alloc(sock->h, sock->type, 0);
         if (!peer) {
-            return -ENOMEM;
+            return io_complete(completion, t, -ENOMEM);
         }
 
         peer->peer = s;
@@ -410,12 +407,12 @@ static sysreturn unixsock_connect(struct sock *sock, struct sockaddr *addr,
         s->connecting = true;
         unixsock_notify_reader(listener);
     }
-    blockq_action ba = closure(sock->h, connect_bh, s, current);
-    return blockq_check(sock->txbq, current, ba, false);
+    blockq_action ba = closure(sock->h, connect_bh, s, t, completion);
+    return blockq_check(sock->txbq, t, ba, bh);
 }
 
-closure_function(5, 1, sysreturn, accept_bh,
-                 unixsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags,
+closure_function(6, 1, sysreturn, accept_bh,
+                 unixsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags, io_completion, completion,
                  u64, bqflags)
 {
     unixsock s = bound(s);
@@ -453,44 +450,42 @@ closure_function(5, 1, sysreturn, accept_bh,
     child->peer->peer = child;
     unixsock_notify_writer(child->peer);
 out:
-    set_syscall_return(t, rv);
-    if (bqflags & BLOCKQ_ACTION_BLOCKED) {
-        thread_wakeup(t);
-    }
+    blockq_handle_completion(s->sock.rxbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn unixsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags)
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion)
 {
     unixsock s = (unixsock) sock;
     if (!s->conn_q) {
-        return -EINVAL;
+        return io_complete(completion, t, -EINVAL);
     }
-    blockq_action ba = closure(sock->h, accept_bh, s, current, addr, addrlen,
-            flags);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, accept_bh, s, t, addr, addrlen,
+            flags, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn unixsock_sendto(struct sock *sock, void *buf, u64 len, int flags,
-        struct sockaddr *dest_addr, socklen_t addrlen)
+        struct sockaddr *dest_addr, socklen_t addrlen, thread t, boolean bh,
+        io_completion completion)
 {
     /* Non-connected sockets are not supported, so destination address is
      * ignored. */
-    return apply(sock->f.write, buf, len, 0, current, false,
-            syscall_io_complete);
+    return apply(sock->f.write, buf, len, 0, t, bh, completion);
 }
 
 sysreturn unixsock_recvfrom(struct sock *sock, void *buf, u64 len, int flags,
-        struct sockaddr *dest_addr, socklen_t *addrlen)
+        struct sockaddr *dest_addr, socklen_t *addrlen, thread t, boolean bh,
+        io_completion completion)
 {
     /* Non-connected sockets are not supported, so source address is not set. */
     if (addrlen) {
         *addrlen = 0;
     }
-    return apply(sock->f.read, buf, len, 0, current, false,
-            syscall_io_complete);
+    return apply(sock->f.read, buf, len, 0, t, bh, completion);
 }
 
 static unixsock unixsock_alloc(heap h, int type, u32 flags)
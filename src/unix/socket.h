@@ -10,6 +10,16 @@ struct sockaddr_storage {
 
 typedef u32 socklen_t;
 
+struct msghdr {
+    void *msg_name;
+    socklen_t msg_namelen;
+    struct iovec *msg_iov;
+    u64 msg_iovlen;
+    void *msg_control;
+    u64 msg_controllen;
+    int msg_flags;
+};
+
 struct sock {
     struct fdesc f;              /* must be first */
     int fd;
@@ -22,15 +32,28 @@ struct sock {
     sysreturn (*bind)(struct sock *sock, struct sockaddr *addr,
             socklen_t addrlen);
     sysreturn (*listen)(struct sock *sock, int backlog);
+
+    /* As with file_io, operations which may block are done on behalf of
+       thread t and deliver their result to the completion; if bh is set,
+       the operation never puts t to sleep and may complete later from a
+       network stack callback. */
     sysreturn (*connect)(struct sock *sock, struct sockaddr *addr,
-            socklen_t addrlen);
+            socklen_t addrlen, thread t, boolean bh, io_completion completion);
     sysreturn (*accept4)(struct sock *sock, struct sockaddr *addr,
-            socklen_t *addrlen, int flags);
+            socklen_t *addrlen, int flags, thread t, boolean bh,
+            io_completion completion);
     sysreturn (*sendto)(struct sock *sock, void *buf, u64 len, int flags,
-             struct sockaddr *dest_addr, socklen_t addrlen);
+            struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+            boolean bh, io_completion completion);
     sysreturn (*recvfrom)(struct sock *sock, void *buf, u64 len, int flags,
-             struct sockaddr *dest_addr, socklen_t *addrlen);
+            struct sockaddr *dest_addr, socklen_t *addrlen, thread t,
+            boolean bh, io_completion completion);
+    sysreturn (*sendmsg)(struct sock *sock, const struct msghdr *msg,
+            int flags, thread t, boolean bh, io_completion completion);
+    sysreturn (*recvmsg)(struct sock *sock, struct msghdr *msg, int flags,
+            thread t, boolean bh, io_completion completion);
     sysreturn (*shutdown)(struct sock *sock, int how);
+    u64 (*send_space)(struct sock *sock);   /* bytes writable without blocking */
 };
 
 static inline int socket_init(process p, heap h, int domain, int type, u32 flags,
@@ -101,4 +124,15 @@ static inline sysreturn socket_ioctl(struct sock *s, unsigned long request,
     }
 }
 
+static inline boolean validate_msghdr(struct msghdr *mh, boolean write)
+{
+    if (!validate_user_memory(mh, sizeof(struct msghdr), false))
+        return false;
+    if (mh->msg_name && !validate_user_memory(mh->msg_name, mh->msg_namelen, false))
+        return false;
+    if (mh->msg_control && !validate_user_memory(mh->msg_control, mh->msg_controllen, write))
+        return false;
+    return validate_iovec(mh->msg_iov, mh->msg_iovlen, write);
+}
+
 sysreturn unixsock_open(int type, int protocol);
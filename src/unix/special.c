@@ -112,10 +112,43 @@ static u32 cpu_online_events(file f)
     return text_events(cpu_online, sizeof(cpu_online) - 1, f);
 }
 
+/* demand paging counters of the process, named after their linux
+   /proc/vmstat counterparts where there is one */
+static sysreturn vmstat_read(file f, void *dest, u64 length, u64 offset)
+{
+    process p = current->p;
+    struct pagecache_stats ps;
+    buffer b = allocate_buffer(heap_general(get_kernel_heaps()), 512);
+    if (b == INVALID_ADDRESS)
+        return -ENOMEM;
+    bprintf(b, "pgfault %ld\npgmajfault %ld\nfault_around_window %ld\n"
+            "fault_around_pages %ld\nreadahead_pages %ld\n"
+            "thp_fault_alloc %ld\nthp_fault_fallback %ld\n",
+            p->faults.minor + p->faults.major, p->faults.major, p->fault_around,
+            p->faults.around, p->faults.readahead, p->faults.huge, p->faults.huge_fallback);
+
+    /* the page cache is shared by all */
+    pagecache_get_stats(fs_pagecache(p->fs), &ps);
+    bprintf(b, "pagecache_hit %ld\npagecache_miss %ld\npagecache_readahead %ld\n"
+            "pagecache_readahead_hit %ld\npagecache_readahead_wasted %ld\n"
+            "pagecache_refault %ld\n",
+            ps.hits, ps.misses, ps.readahead, ps.readahead_hits, ps.readahead_wasted,
+            ps.refaults);
+    sysreturn nr = text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+    deallocate_buffer(b);
+    return nr;
+}
+
+static u32 vmstat_events(file f)
+{
+    return EPOLLIN;
+}
+
 static special_file special_files[] = {
     { "/dev/urandom", .read = urandom_read, .write = 0, .events = urandom_events },
     { "/dev/null", .read = null_read, .write = null_write, .events = null_events },
     { "/proc/self/maps", .read = maps_read, .events = maps_events, },
+    { "/proc/vmstat", .read = vmstat_read, .events = vmstat_events, },
     { "/sys/devices/system/cpu/online", .read = cpu_online_read, .write = null_write, .events = cpu_online_events },
     FTRACE_SPECIAL_FILES
 };
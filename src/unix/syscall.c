@@ -1,6 +1,8 @@
+#include <net_system_structs.h>
 #include <unix_internal.h>
 #include <filesystem.h>
 #include <page.h>
+#include <socket.h>
 
 // lifted from linux UAPI
 #define DT_UNKNOWN	0
@@ -20,7 +22,6 @@ io_completion io_completion_ignore;
 
 void register_other_syscalls(struct syscall *map)
 {
-    register_syscall(map, msync, 0);
     register_syscall(map, shmget, 0);
     register_syscall(map, shmat, 0);
     register_syscall(map, shmctl, 0);
@@ -164,7 +165,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, get_robust_list, 0);
     register_syscall(map, splice, 0);
     register_syscall(map, tee, 0);
-    register_syscall(map, sync_file_range, 0);
     register_syscall(map, vmsplice, 0);
     register_syscall(map, move_pages, 0);
     register_syscall(map, utimensat, 0);
@@ -314,6 +314,18 @@ boolean validate_iovec(struct iovec *iov, u64 len, boolean write)
     return true;
 }
 
+boolean fault_in_process_iovec(process p, struct iovec *iov, u64 len,
+                               boolean restart)
+{
+    for (u64 i = 0; i < len; i++) {
+        if ((iov[i].iov_len != 0) &&
+                !fault_in_process_memory(p, iov[i].iov_base, iov[i].iov_len,
+                                         restart))
+            return false;
+    }
+    return true;
+}
+
 struct iov_progress {
     boolean initialized;
     boolean blocking;
@@ -390,12 +402,12 @@ closure_function(5, 2, void, iov_op_each_complete,
 }
 
 void iov_op(fdesc f, boolean write, struct iovec *iov, int iovcnt, u64 offset,
-            boolean blocking, io_completion completion)
+            thread t, boolean blocking, io_completion completion)
 {
     if (iovcnt < 0 || iovcnt > IOV_MAX)
-        apply(completion, current, -EINVAL);
+        apply(completion, t, -EINVAL);
     if (iovcnt == 0)
-        apply(completion, current, 0);
+        apply(completion, t, 0);
 
     heap h = heap_general(get_kernel_heaps());
     struct iov_progress p;
@@ -408,12 +420,13 @@ void iov_op(fdesc f, boolean write, struct iovec *iov, int iovcnt, u64 offset,
     p.completion = completion;
     io_completion each = closure(h, iov_op_each_complete, f, write, iov, iovcnt,
         p);
-    apply(each, current, 0);
+    apply(each, t, 0);
 }
 
 sysreturn read(int fd, u8 *dest, bytes length)
 {
-    if (!validate_user_memory(dest, length, true))
+    if (!validate_user_memory(dest, length, true) ||
+        !fault_in_user_memory(dest, length, true))
         return -EFAULT;
     fdesc f = resolve_fd(current->p, fd);
     if (!f->read)
@@ -423,10 +436,53 @@ sysreturn read(int fd, u8 *dest, bytes length)
     return apply(f->read, dest, length, infinity, current, false, syscall_io_complete);
 }
 
+#define FILE_ATIME_INTERVAL seconds(1)
+
+/* Reads through a file update the atime at most once a second, which
+   leaves most of them with no change to the file's metadata to make. */
+static boolean file_read_atime_due(file f)
+{
+    return f->length > 0 && !(f->f.flags & O_NOATIME) &&
+        (!f->atime_updated || now(CLOCK_ID_MONOTONIC) - f->atime_updated >= FILE_ATIME_INTERVAL);
+}
+
+/* A pread of resident pages of a regular file, taken without the kernel
+   lock (see lockless_syscalls). The pages are copied straight to the
+   faulted-in buffer by pagecache_read_resident(), which allocates
+   nothing, takes no locks but the page cache's own and never waits.
+   Anything else, from a page that has to be read in to an atime update,
+   has the syscall run again with the kernel lock. */
+static sysreturn pread_lockless(int fd, u8 *dest, bytes length, s64 offset)
+{
+    fdesc desc = fdesc_get(current->p, fd);
+    if (!desc)
+        return -EBADF;
+    file f = (file)desc;
+    sysreturn rv = SYSRETURN_KERNEL_LOCK;
+    if (desc->type == FDESC_TYPE_REGULAR && offset >= 0 && offset < f->length &&
+        !file_read_atime_due(f)) {
+        pagecache_node pn = fsfile_get_cachenode(f->fsf);
+        u64 count = pagecache_read_resident(pn, dest, irangel(offset, length));
+        if (count > 0) {
+            /* readahead may issue reads, so it waits for the lock to be free */
+            if (kern_try_lock()) {
+                pagecache_readahead_resident(pn, irangel(offset, count));
+                kern_unlock();
+            }
+            rv = count;
+        }
+    }
+    fdesc_put_lockless(desc);
+    return rv;
+}
+
 sysreturn pread(int fd, u8 *dest, bytes length, s64 offset)
 {
-    if (!validate_user_memory(dest, length, true))
+    if (!validate_user_memory(dest, length, true) ||
+        !fault_in_user_memory(dest, length, true))
         return -EFAULT;
+    if (!current_cpu()->have_kernel_lock)
+        return pread_lockless(fd, dest, length, offset);
     fdesc f = resolve_fd(current->p, fd);
     if (!f->read || offset < 0)
         return set_syscall_error(current, EINVAL);
@@ -437,16 +493,17 @@ sysreturn pread(int fd, u8 *dest, bytes length, s64 offset)
 
 sysreturn readv(int fd, struct iovec *iov, int iovcnt)
 {
-    if (!validate_iovec(iov, iovcnt, true))
+    if (!validate_iovec(iov, iovcnt, true) || !fault_in_iovec(iov, iovcnt, true))
         return -EFAULT;
     fdesc f = resolve_fd(current->p, fd);
-    iov_op(f, false, iov, iovcnt, infinity, true, syscall_io_complete);
+    iov_op(f, false, iov, iovcnt, infinity, current, true, syscall_io_complete);
     return get_syscall_return(current);
 }
 
 sysreturn write(int fd, u8 *body, bytes length)
 {
-    if (!validate_user_memory(body, length, false))
+    if (!validate_user_memory(body, length, false) ||
+        !fault_in_user_memory(body, length, true))
         return -EFAULT;
     fdesc f = resolve_fd(current->p, fd);
     if (!f->write)
@@ -458,7 +515,8 @@ sysreturn write(int fd, u8 *body, bytes length)
 
 sysreturn pwrite(int fd, u8 *body, bytes length, s64 offset)
 {
-    if (!validate_user_memory(body, length, false))
+    if (!validate_user_memory(body, length, false) ||
+        !fault_in_user_memory(body, length, true))
         return -EFAULT;
     fdesc f = resolve_fd(current->p, fd);
     if (!f->write || offset < 0)
@@ -469,10 +527,10 @@ sysreturn pwrite(int fd, u8 *body, bytes length, s64 offset)
 
 sysreturn writev(int fd, struct iovec *iov, int iovcnt)
 {
-    if (!validate_iovec(iov, iovcnt, false))
+    if (!validate_iovec(iov, iovcnt, false) || !fault_in_iovec(iov, iovcnt, true))
         return -EFAULT;
     fdesc f = resolve_fd(current->p, fd);
-    iov_op(f, true, iov, iovcnt, infinity, true, syscall_io_complete);
+    iov_op(f, true, iov, iovcnt, infinity, current, true, syscall_io_complete);
     return get_syscall_return(current);
 }
 
@@ -499,7 +557,8 @@ closure_function(9, 2, void, sendfile_bh,
                 thread_log(t, "   rewound %ld bytes to %ld", rewind, f_in->offset);
             }
             rv = bound(written) == 0 ? -EAGAIN : bound(written);
-            sg_buf_release(bound(cur_buf));
+            if (bound(cur_buf))
+                sg_buf_release(bound(cur_buf));
             thread_log(t, "   write would block, returning %ld", rv);
         } else {
             thread_log(t, "   zero or error, rv %ld", rv);
@@ -518,10 +577,18 @@ closure_function(9, 2, void, sendfile_bh,
            (io_status_handler for linear) in the middle */
         if (bound(offset))
             *bound(offset) += rv;
-        bound(cur_buf) = sg_list_head_remove(bound(sg)); /* initial dequeue */
-        assert(bound(cur_buf) != INVALID_ADDRESS);
-        bound(cur_buf)->offset = 0; /* offset for our use */
         thread_log(t, "   read %ld bytes\n", rv);
+        if (!bound(out)->sg_write) {
+            bound(cur_buf) = sg_list_head_remove(bound(sg)); /* initial dequeue */
+            assert(bound(cur_buf) != INVALID_ADDRESS);
+            bound(cur_buf)->offset = 0; /* offset for our use */
+        }
+    } else if (bound(out)->sg_write) {
+        bound(written) += rv;
+        if (bound(written) == bound(readlen)) {
+            rv = bound(written);
+            goto out_complete;
+        }
     } else {
         bound(written) += rv;
         bound(cur_buf)->offset += rv;
@@ -538,7 +605,13 @@ closure_function(9, 2, void, sendfile_bh,
         assert(bound(cur_buf)->offset < bound(cur_buf)->size);
     }
 
-    /* issue next write */
+    /* issue next write; an sg_write consumes buffers from the list as
+       they are written, possibly holding references beyond completion */
+    if (bound(out)->sg_write) {
+        apply(bound(out)->sg_write, bound(sg), bound(readlen) - bound(written), 0, t, true,
+              (io_completion)closure_self());
+        return;
+    }
     assert(bound(cur_buf));
     void *buf = bound(cur_buf)->buf + bound(cur_buf)->offset;
     u32 n = bound(cur_buf)->size - bound(cur_buf)->offset;
@@ -554,13 +627,23 @@ out_complete:
     closure_finish();
 }
 
-/* Should be determined more intelligently based on available
-   buffering on output side, modulated by link capacity
-   (e.g. bandwidth delay product). Right now assuming the common mode
-   is tcp output with 64kB max window size... */
+/* Read size for outputs that don't report available buffering; for
+   sockets that do, the read follows the space in the send buffer, so
+   that pages are handed over as the window opens rather than being
+   held while waiting for it. */
 
 #define SENDFILE_READ_MAX (64 * KB)
 
+static u64 sendfile_read_size(fdesc out)
+{
+    if (out->type == FDESC_TYPE_SOCKET) {
+        struct sock *s = (struct sock *)out;
+        if (s->send_space)
+            return MAX(s->send_space(s), PAGESIZE);
+    }
+    return SENDFILE_READ_MAX;
+}
+
 /* requires infile to have sg_read method - so sendfile from special files isn't supported */
 static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 {
@@ -577,18 +660,24 @@ static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
     if (sg == INVALID_ADDRESS)
         return set_syscall_error(current, ENOMEM);
 
-    u64 n = MIN(count, SENDFILE_READ_MAX);
+    u64 n = MIN(count, sendfile_read_size(outfile));
     io_completion read_complete = closure(heap_general(get_kernel_heaps()), sendfile_bh, infile, outfile,
                                           offset, sg, 0, n, 0, 0, false);
     apply(infile->sg_read, sg, n, offset ? *offset : infinity, current, false, read_complete);
     return sysreturn_value(current);
 }
 
-static void begin_file_read(thread t, file f)
+static void file_read_update_atime(thread t, file f)
 {
-    if ((f->length > 0) && !(f->f.flags & O_NOATIME)) {
+    if (file_read_atime_due(f)) {
+        f->atime_updated = now(CLOCK_ID_MONOTONIC);
         filesystem_update_atime(t->p->fs, file_get_meta(f));
     }
+}
+
+static void begin_file_read(thread t, file f)
+{
+    file_read_update_atime(t, f);
     file_op_begin(t);
 }
 
@@ -631,6 +720,20 @@ closure_function(2, 6, sysreturn, file_read,
     if (offset >= f->length) {
         return io_complete(completion, t, 0);
     }
+
+    /* Small reads of cached data are copied directly, bypassing the
+       sg list, completion closure and blocking machinery. */
+    pagecache_node pn = fsfile_get_cachenode(bound(fsf));
+    u64 count = pagecache_read_resident(pn, dest, irangel(offset, length));
+    if (count > 0) {
+        thread_log(t, "   read %ld resident", count);
+        pagecache_readahead_resident(pn, irangel(offset, count));
+        file_read_update_atime(t, f);
+        if (is_file_offset)
+            f->offset += count;
+        return io_complete(completion, t, count);
+    }
+
     sg_list sg = allocate_sg_list();
     if (sg == INVALID_ADDRESS) {
         thread_log(t, "   unable to allocate sg list");
@@ -758,6 +861,8 @@ closure_function(2, 2, sysreturn, file_close,
 
     if (f->f.type == FDESC_TYPE_SPECIAL) {
         ret = spec_close(f);
+    } else if (bound(fsf) && (f->f.flags & O_ACCMODE) != O_RDONLY) {
+        fsfile_trim(bound(fsf));
     }
         
     if (ret == 0) {
@@ -879,13 +984,6 @@ sysreturn open_internal(tuple cwd, const char *name, int flags, int mode)
         return set_syscall_error(current, ENOMEM);
     }
 
-    int fd = allocate_fd(current->p, f);
-    if (fd == INVALID_PHYSICAL) {
-        thread_log(current, "failed to allocate fd");
-        unix_cache_free(uh, file, f);
-        return set_syscall_error(current, EMFILE);
-    }
-
     init_fdesc(h, &f->f, type);
     f->f.read = closure(h, file_read, f, fsf);
     f->f.write = closure(h, file_write, f, fsf);
@@ -904,18 +1002,26 @@ sysreturn open_internal(tuple cwd, const char *name, int flags, int mode)
     }
     f->length = length;
     f->offset = (flags & O_APPEND) ? length : 0;
+    f->atime_updated = 0;
 
     if (type == FDESC_TYPE_SPECIAL) {
         int spec_ret = spec_open(f);
         if (spec_ret != 0) {
             assert(spec_ret < 0);
             thread_log(current, "spec_open failed (%d)\n", spec_ret);
-            deallocate_fd(current->p, fd);
             unix_cache_free(uh, file, f);
             return set_syscall_return(current, spec_ret);
         }
     }
 
+    /* the file must be complete once it can be found by fdesc_get() */
+    int fd = allocate_fd(current->p, f);
+    if (fd == INVALID_PHYSICAL) {
+        thread_log(current, "failed to allocate fd");
+        apply(f->f.close, current, io_completion_ignore);
+        return set_syscall_error(current, EMFILE);
+    }
+
     thread_log(current, "   fd %d, length %ld, offset %ld", fd, f->length, f->offset);
     return fd;
 }
@@ -948,7 +1054,7 @@ sysreturn dup2(int oldfd, int newfd)
     if (newfd != oldfd) {
         fdesc newf = fdesc_get(current->p, newfd);
         if (newf) {
-            vector_set(current->p->files, newfd, f);
+            set_fd(current->p, newfd, f);
             if (fetch_and_add(&newf->refcnt, -2) == 2)
                 apply(newf->close, current, io_completion_ignore);
         } else {
@@ -1264,6 +1370,7 @@ closure_function(1, 1, void, sync_complete,
 
 sysreturn sync(void)
 {
+    mmap_collect_dirty(current->p);
     file_op_begin(current);
     filesystem_flush(current->p->fs, closure(heap_general(get_kernel_heaps()),
                                              sync_complete, current));
@@ -1278,16 +1385,123 @@ sysreturn syncfs(int fd)
     return sync();
 }
 
-/* We don't currently have a per-file flush, so flush all filesystem
-   writes for fsync and fdatasync. */
+closure_function(2, 1, void, file_sync_complete,
+                 thread, t, io_completion, completion,
+                 status, s)
+{
+    thread t = bound(t);
+    thread_log(t, "%s: status %v", __func__, s);
+    apply(bound(completion), t, is_ok(s) ? 0 : -EIO);
+    closure_finish();
+}
+
+/* Flush the dirty pages of a regular file along with the log records
+   needed to reach them; other unrelated dirty data stays cached. */
+void file_sync(fdesc f, boolean datasync, thread t, io_completion completion)
+{
+    heap h = heap_general(get_kernel_heaps());
+    status_handler sh;
+    switch (f->type) {
+    case FDESC_TYPE_REGULAR: {
+        fsfile fsf = ((file)f)->fsf;
+        mmap_collect_dirty_node(t->p, fsfile_get_cachenode(fsf));
+        sh = closure(h, file_sync_complete, t, completion);
+        if (sh == INVALID_ADDRESS)
+            break;
+        fsfile_flush(fsf, datasync, sh);
+        return;
+    }
+    case FDESC_TYPE_DIRECTORY:
+    case FDESC_TYPE_SYMLINK:
+        /* only metadata to write */
+        sh = closure(h, file_sync_complete, t, completion);
+        if (sh == INVALID_ADDRESS)
+            break;
+        filesystem_flush_log(t->p->fs, sh);
+        return;
+    case FDESC_TYPE_SPECIAL:
+        apply(completion, t, 0);
+        return;
+    default:
+        apply(completion, t, -EINVAL);
+        return;
+    }
+    apply(completion, t, -ENOMEM);
+}
+
+#define SYNC_FILE_RANGE_WAIT_BEFORE 1
+#define SYNC_FILE_RANGE_WRITE       2
+#define SYNC_FILE_RANGE_WAIT_AFTER  4
+
+/* As on Linux, only data pages within the range are written back, and
+   neither file metadata nor the extents backing the data are
+   guaranteed to be persistent on completion. The WAIT_BEFORE and
+   WAIT_AFTER stages are merged into a single wait following the
+   writeback. */
+void file_sync_range(fdesc f, range q, u32 flags, thread t, io_completion completion)
+{
+    if (flags & ~(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                  SYNC_FILE_RANGE_WAIT_AFTER)) {
+        apply(completion, t, -EINVAL);
+        return;
+    }
+    switch (f->type) {
+    case FDESC_TYPE_REGULAR:
+        break;
+    case FDESC_TYPE_DIRECTORY:
+    case FDESC_TYPE_SYMLINK:
+    case FDESC_TYPE_SPECIAL:
+        apply(completion, t, 0);
+        return;
+    default:
+        apply(completion, t, -ESPIPE);
+        return;
+    }
+    if (!(flags & (SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER))) {
+        if (flags & SYNC_FILE_RANGE_WRITE)
+            pagecache_sync_node_range(fsfile_get_cachenode(((file)f)->fsf), q, true, 0);
+        apply(completion, t, 0);
+        return;
+    }
+    status_handler sh = closure(heap_general(get_kernel_heaps()), file_sync_complete,
+                                t, completion);
+    if (sh == INVALID_ADDRESS) {
+        apply(completion, t, -ENOMEM);
+        return;
+    }
+    pagecache_sync_node_range(fsfile_get_cachenode(((file)f)->fsf), q,
+                              (flags & SYNC_FILE_RANGE_WRITE) != 0, sh);
+}
+
 sysreturn fsync(int fd)
 {
-    return syncfs(fd);
+    fdesc f = resolve_fd(current->p, fd);
+    file_op_begin(current);
+    file_sync(f, false, current, syscall_io_complete);
+    return file_op_maybe_sleep(current);
 }
 
 sysreturn fdatasync(int fd)
 {
-    return fsync(fd);
+    fdesc f = resolve_fd(current->p, fd);
+    file_op_begin(current);
+    file_sync(f, true, current, syscall_io_complete);
+    return file_op_maybe_sleep(current);
+}
+
+sysreturn sync_file_range(int fd, s64 offset, s64 nbytes, unsigned int flags)
+{
+    fdesc f = resolve_fd(current->p, fd);
+    thread_log(current, "%s: fd %d, offset %ld, nbytes %ld, flags 0x%x", __func__,
+               fd, offset, nbytes, flags);
+    if (offset < 0 || nbytes < 0 || offset + nbytes < offset)
+        return set_syscall_error(current, EINVAL);
+    range q = irangel(offset, nbytes);
+    if (nbytes == 0)
+        q.end = infinity;
+    file_op_begin(current);
+    file_sync_range(f, q, flags, current, syscall_io_complete);
+    return file_op_maybe_sleep(current);
 }
 
 sysreturn access(const char *name, int mode)
@@ -1562,6 +1776,8 @@ static sysreturn getrusage(int who, struct rusage *usage)
         case RUSAGE_SELF:
             timeval_from_time(&usage->ru_utime, proc_utime(current->p));
             timeval_from_time(&usage->ru_stime, proc_stime(current->p));
+            usage->ru_minflt = current->p->faults.minor;
+            usage->ru_majflt = current->p->faults.major;
             break;
         case RUSAGE_CHILDREN:
             /* There are no children. */
@@ -1588,31 +1804,27 @@ static sysreturn getcwd(char *buf, u64 length)
     return cwd_len;
 }
 
+/* The heap is demand paged like an anonymous mapping, which allows
+   it to be backed by huge pages. */
 static sysreturn brk(void *x)
 {
     process p = current->p;
-    kernel_heaps kh = get_kernel_heaps();
 
     if (x) {
+        u64 old_end = pad(u64_from_pointer(p->brk), PAGESIZE);
+        u64 new_end = pad(u64_from_pointer(x), PAGESIZE);
         if (p->brk > x) {
             /* on failure, return the current break */
             if (u64_from_pointer(x) < p->heap_base)
                 goto fail;
             p->brk = x;
-            assert(adjust_process_heap(p, irange(p->heap_base, u64_from_pointer(x))));
-            // free
+            assert(adjust_process_heap(p, irange(p->heap_base, new_end)));
+            if (new_end < old_end)
+                unmap_and_free_phys(new_end, old_end - new_end);
         } else if (p->brk < x) {
-            // I guess assuming we're aligned
-            u64 alloc = pad(u64_from_pointer(x), PAGESIZE) - pad(u64_from_pointer(p->brk), PAGESIZE);
-            assert(adjust_process_heap(p, irange(p->heap_base, u64_from_pointer(p->brk) + alloc)));
-            u64 phys = allocate_u64((heap)heap_physical(kh), alloc);
-            if (phys == INVALID_PHYSICAL)
+            if (new_end > old_end && !adjust_process_heap(p, irange(p->heap_base, new_end)))
                 goto fail;
-            /* XXX no exec configurable? */
-            map(u64_from_pointer(p->brk), phys, alloc, PAGE_WRITABLE | PAGE_NO_EXEC | PAGE_USER);
-            // people shouldn't depend on this
-            zero(p->brk, alloc);
-            p->brk += alloc;         
+            p->brk = x;
         }
     }
   fail:
@@ -2115,6 +2327,7 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, fsync, fsync);
     register_syscall(map, sync, sync);
     register_syscall(map, syncfs, syncfs);
+    register_syscall(map, sync_file_range, sync_file_range);
     register_syscall(map, io_setup, io_setup);
     register_syscall(map, io_submit, io_submit);
     register_syscall(map, io_getevents, io_getevents);
@@ -2182,6 +2395,7 @@ void register_file_syscalls(struct syscall *map)
 }
 
 #define SYSCALL_F_NOTRACE 0x1
+#define SYSCALL_F_NOLOCK  0x2    /* handler may run without the kernel lock */
 
 struct syscall {
     void *handler;
@@ -2194,6 +2408,8 @@ struct syscall *linux_syscalls = _linux_syscalls;
 
 extern u64 kernel_lock;
 
+static void syscall_schedule_locked(context f);
+
 void syscall_debug(context f)
 {
     u64 call = f[FRAME_VECTOR];
@@ -2206,8 +2422,7 @@ void syscall_debug(context f)
         runloop();
     }
     t->syscall = call;
-    // should we cache this for performance?
-    void *debugsyscalls = table_find(current->p->process_root, sym(debugsyscalls));
+    boolean debugsyscalls = current->p->debugsyscalls;
     struct syscall *s = current->p->syscalls + call;
     if (debugsyscalls) {
         if (s->name)
@@ -2219,7 +2434,17 @@ void syscall_debug(context f)
     if (h) {
         thread_enter_system(current);
 
+        /* The handler may have the syscall reissued while it has yet to
+           do anything (see fault_in_user_memory); runloop resets the
+           state if we block. */
+        current_cpu()->state = cpu_syscall;
         sysreturn rv = h(f[FRAME_RDI], f[FRAME_RSI], f[FRAME_RDX], f[FRAME_R10], f[FRAME_R8], f[FRAME_R9]);
+        current_cpu()->state = cpu_kernel;
+        if (rv == SYSRETURN_KERNEL_LOCK) {
+            assert(!current_cpu()->have_kernel_lock);
+            current->syscall = -1;
+            syscall_schedule_locked(f);
+        }
         set_syscall_return(current, rv);
         if (debugsyscalls)
             thread_log(current, "direct return: %ld, rsp 0x%lx", rv, f[FRAME_RSP]);
@@ -2260,10 +2485,9 @@ closure_function(0, 2, void, io_complete_ignore,
 {
 }
 
-// some validation can be moved up here
-static void syscall_schedule(context f, u64 call)
+/* Run the syscall with the kernel lock, deferring it if the lock is busy. */
+static void syscall_schedule_locked(context f)
 {
-    /* kernel context set on syscall entry */
     if (kern_try_lock()) {
         current_cpu()->state = cpu_kernel;
         syscall_debug(f);
@@ -2274,6 +2498,18 @@ static void syscall_schedule(context f, u64 call)
     }
 }
 
+// some validation can be moved up here
+static void syscall_schedule(context f, u64 call)
+{
+    /* kernel context set on syscall entry */
+    if (call < SYS_MAX && (current->p->syscalls[call].flags & SYSCALL_F_NOLOCK)) {
+        current_cpu()->state = cpu_kernel;
+        syscall_debug(f);
+    } else {
+        syscall_schedule_locked(f);
+    }
+}
+
 void init_syscalls()
 {
     //syscall = b->contents;
@@ -2291,8 +2527,48 @@ void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *n
     m[n].name = name;
 }
 
+/* Syscalls which only touch state private to the calling thread, or
+   state that is immutable once the process is running, can proceed
+   concurrently on multiple cpus without taking the kernel lock. Any
+   syscall which may allocate from the kernel heaps, block or touch
+   shared kernel structures must not be listed here, unless its handler
+   returns SYSRETURN_KERNEL_LOCK to be run with the lock whenever it
+   would: pread does for all but resident file pages, and epoll_wait
+   for all but a poll of an instance with nothing pending.
+
+   Socket I/O and timers are not split off: lwIP, notify sets and the
+   runloop timer heap have no locks of their own, so writes to a socket
+   and the timer syscalls still serialize on the kernel lock. */
+static const int lockless_syscalls[] = {
+    SYS_getpid,
+    SYS_gettid,
+    SYS_getuid,
+    SYS_geteuid,
+    SYS_getgid,
+    SYS_getegid,
+    SYS_uname,
+    SYS_sched_yield,
+    SYS_clock_getres,
+    SYS_gettimeofday,
+    SYS_time,
+    SYS_pread64,
+    SYS_epoll_wait,
+    SYS_epoll_pwait,
+};
+
+static void configure_lockless_syscalls(process p)
+{
+    /* thread_log and syscall debugging aren't safe outside the kernel lock */
+    if (p->debugsyscalls || table_find(p->process_root, sym(trace)))
+        return;
+    for (int i = 0; i < sizeof(lockless_syscalls) / sizeof(lockless_syscalls[0]); i++)
+        p->syscalls[lockless_syscalls[i]].flags |= SYSCALL_F_NOLOCK;
+}
+
 void configure_syscalls(process p)
 {
+    p->debugsyscalls = table_find(p->process_root, sym(debugsyscalls)) != 0;
+    configure_lockless_syscalls(p);
     void *notrace = table_find(p->process_root, sym(notrace));
     if (notrace) {
         table_foreach(notrace, k, v) {
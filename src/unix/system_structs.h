@@ -113,6 +113,7 @@ typedef struct iovec {
 #define O_RDONLY	00000000
 #define O_WRONLY	00000001
 #define O_RDWR		00000002
+#define O_ACCMODE	00000003
 #define O_CREAT		00000100
 #define O_EXCL          00000200
 #define O_NOCTTY        00000400
@@ -182,6 +183,7 @@ struct flock {
 #define AT_NO_AUTOMOUNT     0x800       /* Suppress terminal automount traversal */
 #define AT_EMPTY_PATH       0x1000      /* Allow empty relative pathname */
 
+#define MAP_SHARED	0x01
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_PRIVATE	0x02
@@ -194,6 +196,13 @@ struct flock {
 #define PROT_WRITE      0x2
 #define PROT_EXEC       0x4
 
+#define MADV_HUGEPAGE   14
+#define MADV_NOHUGEPAGE 15
+
+#define MS_ASYNC        0x1
+#define MS_INVALIDATE   0x2
+#define MS_SYNC         0x4
+
 // straight from linux
 #define ARCH_SET_GS 0x1001
 #define ARCH_SET_FS 0x1002
@@ -371,6 +380,13 @@ struct rusage {
 # define SEGV_PKUERR    4   /* failed protection key checks */
 #define NSIGSEGV    4
 
+/*
+ * SIGBUS si_codes
+ */
+#define BUS_ADRALN  1   /* invalid address alignment */
+#define BUS_ADRERR  2   /* non-existent physical address */
+#define BUS_OBJERR  3   /* object specific hardware error */
+
 typedef union sigval {
     s32 sival_int;
     void * sival_ptr;
@@ -763,7 +779,7 @@ struct epoll_event {
 #define EPOLLWRBAND	0x00000200
 #define EPOLLMSG	0x00000400
 #define EPOLLRDHUP	0x00002000
-#define EPOLLEXCLUSIVE	(1u << 29)
+#define EPOLLEXCLUSIVE	(1u << 28)
 #define EPOLLWAKEUP	(1u << 29)
 #define EPOLLONESHOT	(1u << 30)
 #define EPOLLET		(1u << 31)
@@ -151,7 +151,12 @@ static inline void run_thread_frame(thread t)
     check_stop_conditions(t);
     kern_lock(); // xx - make thread entry a separate exclusion region for performance
     thread old = current;
-    current_cpu()->current_thread = t;
+    cpuinfo ci = current_cpu();
+    ci->current_thread = t;
+
+    /* the thread is now homed on this cpu until it is stolen by another */
+    t->default_frame[FRAME_CPU] = ci->id;
+    t->sighandler_frame[FRAME_CPU] = ci->id;
     ftrace_thread_switch(old, current);    /* ftrace needs to know about the switch event */
     thread_enter_user(old, t);
 
@@ -188,7 +193,7 @@ define_closure_function(1, 0, void, run_sighandler,
 static void setup_thread_frame(heap h, context frame, thread t)
 {
     frame[FRAME_FAULT_HANDLER] = u64_from_pointer(&t->fault_handler);
-    frame[FRAME_QUEUE] = u64_from_pointer(thread_queue);
+    frame[FRAME_CPU] = current_cpu()->id;
     frame[FRAME_IS_SYSCALL] = 1;
     frame[FRAME_CS] = 0x2b; // where is this defined?
     frame[FRAME_THREAD] = u64_from_pointer(t);
@@ -366,9 +371,9 @@ void exit_thread(thread t)
     t->thread_bq = INVALID_ADDRESS;
 
     t->default_frame[FRAME_RUN] = INVALID_PHYSICAL;
-    t->default_frame[FRAME_QUEUE] = INVALID_PHYSICAL;
+    t->default_frame[FRAME_CPU] = INVALID_PHYSICAL;
     t->sighandler_frame[FRAME_RUN] = INVALID_PHYSICAL;
-    t->sighandler_frame[FRAME_QUEUE] = INVALID_PHYSICAL;
+    t->sighandler_frame[FRAME_CPU] = INVALID_PHYSICAL;
     t->default_frame[FRAME_FAULT_HANDLER] = INVALID_PHYSICAL;
     deallocate_frame(t->default_frame);
     deallocate_frame(t->sighandler_frame);
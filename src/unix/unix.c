@@ -10,6 +10,16 @@
 #define pf_debug(x, ...)
 #endif
 
+/* Point fd at f, as fdesc_get() may be looking it up without the
+   kernel lock. */
+boolean set_fd(process p, int fd, void *f)
+{
+    u64 flags = spin_lock_irq(&p->fd_lock);
+    boolean r = vector_set(p->files, fd, f);
+    spin_unlock_irq(&p->fd_lock, flags);
+    return r;
+}
+
 u64 allocate_fd(process p, void *f)
 {
     u64 fd = allocate_u64((heap)p->fdallocator, 1);
@@ -17,7 +27,7 @@ u64 allocate_fd(process p, void *f)
 	msg_err("fail; maxed out\n");
 	return fd;
     }
-    if (!vector_set(p->files, fd, f)) {
+    if (!set_fd(p, fd, f)) {
         deallocate_u64((heap)p->fdallocator, fd, 1);
         fd = INVALID_PHYSICAL;
     }
@@ -31,14 +41,14 @@ u64 allocate_fd_gte(process p, u64 min, void *f)
         msg_err("failed\n");
     }
     else {
-        vector_set(p->files, fd, f);
+        set_fd(p, fd, f);
     }
     return fd;
 }
 
 void deallocate_fd(process p, int fd)
 {
-    vector_set(p->files, fd, 0);
+    set_fd(p, fd, 0);
     deallocate_u64((heap)p->fdallocator, fd, 1);
 }
 
@@ -127,15 +137,18 @@ define_closure_function(1, 1, context, default_fault_handler,
             return 0;
         }
 
-        if (do_demand_page(fault_address(frame), vm)) {
+        switch (do_demand_page(fault_address(frame), vm, frame)) {
+        case DEMAND_PAGE_MAPPED:
             /* If we're in the kernel context, return to the frame directly. */
-            if (frame == current_cpu()->kernel_frame) {
-                current_cpu()->state = cpu_kernel;
+            if (frame == current_cpu()->kernel_frame)
                 return frame;
-                frame_return(frame);
-            }
             schedule_frame(frame);
             return 0;
+        case DEMAND_PAGE_PENDING:
+            /* thread is rescheduled once the page is filled */
+            return 0;
+        default:
+            break;
         }
     } else if (frame[FRAME_VECTOR] == 13) {
         if (current_cpu()->state == cpu_user) {
@@ -248,6 +261,10 @@ process create_process(unix_heaps uh, tuple root, filesystem fs)
     p->brk = 0;
     p->pid = allocate_u64((heap)uh->processes, 1);
 
+    p->fs = fs;
+    p->cwd = root;
+    p->process_root = root;
+
     /* don't need these for kernel process */
     if (p->pid > 1) {
         /* start huge virtual at zero so that parent allocations abide
@@ -273,10 +290,8 @@ process create_process(unix_heaps uh, tuple root, filesystem fs)
         p->virtual = p->virtual_page = p->virtual32 = 0;
         p->vareas = p->vmaps = INVALID_ADDRESS;
     }
-    p->fs = fs;
-    p->cwd = root;
-    p->process_root = root;
     p->fdallocator = create_id_heap(h, h, 0, infinity, 1);
+    spin_lock_init(&p->fd_lock);
     p->files = allocate_vector(h, 64);
     zero(p->files, sizeof(p->files));
     create_stdfiles(uh, p);
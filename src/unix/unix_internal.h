@@ -127,6 +127,10 @@ typedef struct unix_heaps {
 /* This value must not alias any legitimate syscall return value (i.e. -errno). */
 #define SYSRETURN_INVALID           (0xffffffff00000000ull) /* outside the range of int errno */
 #define SYSRETURN_CONTINUE_BLOCKING SYSRETURN_INVALID
+/* Returned by a handler run without the kernel lock (see lockless_syscalls)
+   which needs it after all, before it has done anything; the syscall is
+   then run again with the lock. */
+#define SYSRETURN_KERNEL_LOCK       (SYSRETURN_INVALID + 1)
 #define BLOCKQ_BLOCK_REQUIRED       SYSRETURN_INVALID
 
 typedef closure_type(io_completion, void, thread t, sysreturn rv);
@@ -308,6 +312,7 @@ struct file {
     };
     u64 offset;
     u64 length;
+    timestamp atime_updated;    /* by a read, on the monotonic clock */
 };
 
 void epoll_finish(epoll e);
@@ -317,10 +322,15 @@ void epoll_finish(epoll e);
 #define VMAP_FLAG_WRITABLE      4
 #define VMAP_FLAG_EXEC          8
 #define VMAP_FLAG_PREALLOC     16
+#define VMAP_FLAG_SHARED       32
+#define VMAP_FLAG_NOHUGEPAGE   64
 
 typedef struct vmap {
     struct rmnode node;
     u64 flags;
+    pagecache_node cache_node;  /* backing for file mappings */
+    u64 node_offset;            /* file offset at node.r.start */
+    u64 last_fault;             /* page of last fault, for sequential detection */
 } *vmap;
 
 typedef closure_type(vmap_handler, void, vmap);
@@ -349,12 +359,21 @@ typedef struct process {
     fault_handler     handler;
     vector            threads;
     struct syscall   *syscalls;
+    boolean           debugsyscalls;
     vector            files;
+    struct spinlock   fd_lock;  /* files, for lookups without the kernel lock */
     rangemap          vareas;   /* available address space */
     struct spinlock   vmap_lock;
     rangemap          vmaps;    /* process mappings */
     vmap              stack_map;
     vmap              heap_map;
+    u64               fault_around; /* pages mapped around a sequential fault */
+    struct {
+        u64 minor, major;       /* faults resolved without and with waiting for a fill */
+        u64 around;             /* additional pages mapped by fault-around */
+        u64 readahead;          /* file pages read ahead on sequential faults */
+        u64 huge, huge_fallback; /* 2M anonymous faults, and those served with 4K pages */
+    } faults;
     timestamp         utime, stime;
     struct sigstate   signals;
     struct sigaction  sigactions[NSIG];
@@ -443,12 +462,13 @@ static inline int fdesc_type(fdesc f)
 
 static inline fdesc fdesc_get(process p, int fd)
 {
-    /* XXX To ensure atomicity, we need a mutex that protects against concurrent
-     * access to fdesc vector; the same mutex will have to be taken at every fd
-     * number allocation/deallocation. */
+    /* the entry can't be replaced, nor the vector resized, before the
+       reference is taken */
+    u64 flags = spin_lock_irq(&p->fd_lock);
     fdesc f = vector_get(p->files, fd);
     if (f)
         fetch_and_add(&f->refcnt, 1);
+    spin_unlock_irq(&p->fd_lock, flags);
     return f;
 }
 
@@ -458,6 +478,17 @@ static inline void fdesc_put(fdesc f)
         apply(f->close, 0, io_completion_ignore);
 }
 
+/* fdesc_put() from a handler run without the kernel lock (see
+   lockless_syscalls); closing the file is left to the lock holder */
+static inline void fdesc_put_lockless(fdesc f)
+{
+    if (fetch_and_add(&f->refcnt, -1) == 1) {
+        kern_lock();
+        apply(f->close, 0, io_completion_ignore);
+        kern_unlock();
+    }
+}
+
 static inline void fdesc_notify_events(fdesc f)
 {
     u32 events = apply(f->events, 0);
@@ -471,9 +502,13 @@ u64 allocate_fd_gte(process p, u64 min, void *f);
 
 void deallocate_fd(process p, int fd);
 
+boolean set_fd(process p, int fd, void *f);
+
 void init_vdso(process p);
 
 void mmap_process_init(process p);
+void mmap_collect_dirty(process p);
+void mmap_collect_dirty_node(process p, pagecache_node pn);
 
 /* This "validation" is just a simple limit check right now, but this
    could optionally expand to do more rigorous validation (e.g. vmap
@@ -595,7 +630,22 @@ boolean unix_timers_init(unix_heaps uh);
 #define sysreturn_from_pointer(__x) ((s64)u64_from_pointer(__x));
 
 extern sysreturn syscall_ignore();
-boolean do_demand_page(u64 vaddr, vmap vm);
+typedef enum {
+    DEMAND_PAGE_FAILED,
+    DEMAND_PAGE_MAPPED,
+    DEMAND_PAGE_PENDING,        /* faulting context resumes when page is ready */
+} demand_page_result;
+
+demand_page_result do_demand_page(u64 vaddr, vmap vm, context frame);
+boolean fault_in_process_memory(process p, const void *buf, bytes length,
+                                boolean restart);
+
+static inline boolean fault_in_user_memory(const void *buf, bytes length,
+                                           boolean restart)
+{
+    return fault_in_process_memory(current->p, buf, length, restart);
+}
+
 vmap vmap_from_vaddr(process p, u64 vaddr);
 void vmap_iterator(process p, vmap_handler vmh);
 
@@ -671,7 +721,10 @@ static inline void file_op_maybe_wake(thread t)
 }
 
 void iov_op(fdesc f, boolean write, struct iovec *iov, int iovcnt, u64 offset,
-            boolean blocking, io_completion completion);
+            thread t, boolean blocking, io_completion completion);
+
+void file_sync(fdesc f, boolean datasync, thread t, io_completion completion);
+void file_sync_range(fdesc f, range q, u32 flags, thread t, io_completion completion);
 
 #define resolve_fd_noret(__p, __fd) vector_get(__p->files, __fd)
 #define resolve_fd(__p, __fd) ({void *f ; if (!(f = resolve_fd_noret(__p, __fd))) return set_syscall_error(current, EBADF); f;})
@@ -732,4 +785,12 @@ u32 spec_events(file f);
 void syscall_debug(context f);
 
 boolean validate_iovec(struct iovec *iov, u64 len, boolean write);
+boolean fault_in_process_iovec(process p, struct iovec *iov, u64 len,
+                               boolean restart);
+
+static inline boolean fault_in_iovec(struct iovec *iov, u64 len, boolean restart)
+{
+    return fault_in_process_iovec(current->p, iov, len, restart);
+}
+
 boolean validate_user_string(const char *name);
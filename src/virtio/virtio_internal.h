@@ -87,6 +87,10 @@ u16 virtqueue_entries(virtqueue vq);
 
 typedef struct vqmsg *vqmsg;
 
+/* Chains longer than this are placed in the ring directly, even where
+   indirect descriptors are negotiated; a table fills one page. */
+#define VQMSG_MAX_INDIRECT      (PAGESIZE / 16)
+
 vqmsg allocate_vqmsg(virtqueue vq);
 void deallocate_vqmsg(virtqueue vq, vqmsg m);
 void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write);
@@ -41,6 +41,8 @@
 #include "lwip/etharp.h"
 #include "lwip/dhcp.h"
 #include "lwip/timeouts.h"
+#include "lwip/prot/ip.h"
+#include "lwip/prot/tcp.h"
 #include "netif/ethernet.h"
 #include "virtio_internal.h"
 #include "virtio_net.h"
@@ -53,53 +55,365 @@
 # define virtio_net_debug(...) do { } while(0)
 #endif // defined(VIRTIO_NET_DEBUG)
 
-typedef struct vnet {
+#define VIRTIO_NET_FEATURES (VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF |     \
+                             VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |  \
+                             VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+                             VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+                             VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)
+
+#define VNET_MAX_FRAME          0xffff  /* limit of pbuf tot_len */
+#define VNET_TX_HDR_MAX         128     /* ethernet + ip + tcp with options */
+#define VNET_TX_MAX_SEGS        48
+#define VNET_TX_MAX_DESC        64
+#define VNET_TSO_MIN_SEG        536     /* smaller segments are sent right away */
+#define VNET_RX_LARGE_BUFFERS   64
+
+typedef struct vnet_tx *vnet_tx;
+typedef struct vnet *vnet;
+
+/* An rx/tx virtqueue pair. With VIRTIO_NET_F_MQ, there is one for each
+   cpu (within the limits of the device), and the interrupts of pair i
+   are directed at cpu i. */
+typedef struct vnet_queue {
+    vnet vn;
+    int index;
+    struct virtqueue *txq;
+    struct virtqueue *rxq;
+    struct spinlock tx_lock;
+    vnet_tx tx_pending;         /* tcp frame open for coalescing */
+    boolean tx_flush_queued;
+    thunk tx_flush;
+    struct xpbuf *rx_head;      /* packet spanning merged rx buffers */
+    u32 rx_len;
+    u16 rx_remain;
+    u8 rx_flags;
+} *vnet_queue;
+
+struct vnet {
     vtpci dev;
     u16 port;
     heap rxbuffers;
+    heap txframes;
     bytes net_header_len;
     int rxbuflen;
     struct netif *n;
-    struct virtqueue *txq;
-    struct virtqueue *rxq;
     struct virtqueue *ctl;
-    void *empty; // just a mac..fix, from pre-heap days
-} *vnet;
+    int max_queues;             /* queue pairs set up */
+    int nqueues;                /* queue pairs in use */
+    int rx_active;              /* pair whose rx is being input, or -1 */
+    struct vnet_queue *queues;
+};
 
 typedef struct xpbuf
 {
     struct pbuf_custom p;
-    vnet vn;
+    vnet_queue q;
 } *xpbuf;
 
+/* command buffer for the control virtqueue */
+struct vnet_ctrl_mq_cmd {
+    struct virtio_net_ctrl_hdr hdr;
+    struct virtio_net_ctrl_mq mq;
+    u8 ack;
+};
+
+/* An outgoing frame. With checksum offload, the headers are copied out
+   of the pbuf chain so that the tcp checksum field can be seeded with
+   the pseudo-header sum (and, for a frame coalesced from several
+   segments, the lengths adjusted) without touching lwIP's copy, which
+   may be retransmitted later. lwIP itself never builds segments larger
+   than the MSS, so consecutive full-sized segments of a connection
+   that are output together are merged here into a single GSO frame
+   for the host to segment. */
+struct vnet_tx {
+    struct virtio_net_hdr_mrg_rxbuf vhdr;
+    u8 headers[VNET_TX_HDR_MAX];
+    u16 hdr_len;                /* bytes in headers; 0 if passed through as is */
+    u16 l3;                     /* offsets of ip and tcp headers */
+    u16 l4;
+    boolean ipv6;
+    u32 len;                    /* total frame length */
+    u32 next_seq;               /* sequence number following the last segment */
+    u16 seg_size;
+    u16 last_seg_len;
+    int ndesc;
+    int nsegs;
+    struct pbuf *segs[VNET_TX_MAX_SEGS];
+};
+
+static inline u16 get_be16(u8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_be16(u8 *p, u16 v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline u32 get_be32(u8 *p)
+{
+    return ((u32)get_be16(p) << 16) | get_be16(p + 2);
+}
+
+/* One's complement sum of big-endian 16-bit words, which may continue
+   across fragments of odd length. */
+static u64 vnet_csum_add(u64 sum, u8 *p, u32 len, boolean *odd)
+{
+    if (len > 0 && *odd) {
+        sum += *p++;
+        len--;
+        *odd = false;
+    }
+    for (; len >= 2; p += 2, len -= 2)
+        sum += get_be16(p);
+    if (len > 0) {
+        sum += *p << 8;
+        *odd = true;
+    }
+    return sum;
+}
+
+static u16 vnet_csum_fold(u64 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/* Sum of the ip pseudo-header for a transport segment of length len */
+static u64 vnet_pseudo_sum(u8 *l3, boolean ipv6, u8 proto, u32 len)
+{
+    boolean odd = false;
+    u64 sum = ipv6 ? vnet_csum_add(0, l3 + 8, 32, &odd) : vnet_csum_add(0, l3 + 12, 8, &odd);
+    return sum + proto + (len >> 16) + (len & 0xffff);
+}
+
+static u16 vnet_pbuf_count(struct pbuf *p)
+{
+    u16 n = 0;
+    for (; p; p = p->next)
+        n++;
+    return n;
+}
+
+/* Find the headers of an outgoing tcp segment (the only protocol with
+   checksums left to the device). Returns the tcp payload length, or
+   -1 if the frame isn't a candidate for offload. */
+static int vnet_tx_parse(u8 *h, u16 caplen, u16 tot_len, u16 *l3, u16 *l4, u16 *hdr_len,
+                         boolean *ipv6)
+{
+    if (caplen < SIZEOF_ETH_HDR)
+        return -1;
+    u16 type = get_be16(h + 12);
+    *l3 = SIZEOF_ETH_HDR;
+    if (type == ETHTYPE_IP) {
+        u8 *ip = h + *l3;
+        if (caplen < *l3 + IP_HLEN || ip[9] != IP_PROTO_TCP ||
+            (get_be16(ip + 6) & 0x3fff) != 0) /* fragment */
+            return -1;
+        *l4 = *l3 + (ip[0] & 0xf) * 4;
+        *ipv6 = false;
+    } else if (type == ETHTYPE_IPV6) {
+        if (caplen < *l3 + IP6_HLEN || h[*l3 + 6] != IP_PROTO_TCP)
+            return -1;
+        *l4 = *l3 + IP6_HLEN;
+        *ipv6 = true;
+    } else {
+        return -1;
+    }
+    if (caplen < *l4 + TCP_HLEN)
+        return -1;
+    *hdr_len = *l4 + (h[*l4 + 12] >> 4) * 4;
+    if (*hdr_len > caplen || *hdr_len > tot_len)
+        return -1;
+    return tot_len - *hdr_len;
+}
 
-closure_function(1, 1, void, tx_complete,
-                 struct pbuf *, p,
+closure_function(2, 1, void, tx_complete,
+                 vnet, vn, vnet_tx, tx,
                  u64, len)
 {
-    // unfortunately we dont have control over the allocation
-    // path (?)
-    // free me!
-    pbuf_free(bound(p));
+    vnet_tx tx = bound(tx);
+    for (int i = 0; i < tx->nsegs; i++)
+        pbuf_free(tx->segs[i]);
+    deallocate(bound(vn)->txframes, tx, sizeof(struct vnet_tx));
     closure_finish();
 }
 
+/* push pbuf chain contents, starting at offset, onto the message */
+static void vnet_push_pbuf(vnet_queue q, vqmsg m, struct pbuf *p, u16 offset)
+{
+    for (; p != NULL; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        vqmsg_push(q->txq, m, p->payload + offset, p->len - offset, false);
+        offset = 0;
+    }
+}
 
-static err_t low_level_output(struct netif *netif, struct pbuf *p)
+/* fill in lengths and checksum fields and hand the frame to the device */
+static void vnet_tx_commit(vnet_queue q, vnet_tx tx)
 {
-    vnet vn = netif->state;
+    vnet vn = q->vn;
+    struct virtio_net_hdr *vh = &tx->vhdr.hdr;
+    if (tx->hdr_len > 0) {
+        u8 *ip = tx->headers + tx->l3;
+        u8 *tcp = tx->headers + tx->l4;
+        u32 tcp_len = tx->len - tx->l4;
+        if (tx->ipv6) {
+            put_be16(ip + 4, tx->len - tx->l4);
+        } else if (tx->nsegs > 1) {
+            put_be16(ip + 2, tx->len - tx->l3);
+            put_be16(ip + 10, 0);
+            boolean odd = false;
+            put_be16(ip + 10, ~vnet_csum_fold(vnet_csum_add(0, ip, tx->l4 - tx->l3, &odd)));
+        }
+        put_be16(tcp + 16, vnet_csum_fold(vnet_pseudo_sum(ip, tx->ipv6, IP_PROTO_TCP, tcp_len)));
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->csum_start = tx->l4;
+        vh->csum_offset = 16;
+        if (tx->nsegs > 1) {
+            vh->gso_type = tx->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+            vh->gso_size = tx->seg_size;
+            vh->hdr_len = tx->hdr_len;
+        }
+    }
 
-    vqmsg m = allocate_vqmsg(vn->txq);
+    vqmsg m = allocate_vqmsg(q->txq);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->txq, m, vn->empty, vn->net_header_len, false);
+    vqmsg_push(q->txq, m, (void *)&tx->vhdr, vn->net_header_len, false);
+    if (tx->hdr_len > 0)
+        vqmsg_push(q->txq, m, tx->headers, tx->hdr_len, false);
+    for (int i = 0; i < tx->nsegs; i++)
+        vnet_push_pbuf(q, m, tx->segs[i], tx->hdr_len);
+    vqmsg_commit(q->txq, m, closure(vn->dev->general, tx_complete, vn, tx));
+}
+
+/* Try to append a segment to the open frame; h holds its headers. */
+static boolean vnet_tx_merge(vnet_tx tx, struct pbuf *p, u8 *h, u16 hdr_len, u16 l4,
+                             int payload, u16 ndesc)
+{
+    u8 *th = tx->headers + tx->l4;
+    u8 *nth = h + l4;
+    if (hdr_len != tx->hdr_len || l4 != tx->l4 || payload <= 0 ||
+        payload > tx->seg_size || tx->last_seg_len != tx->seg_size ||
+        tx->nsegs == VNET_TX_MAX_SEGS || tx->ndesc + ndesc > VNET_TX_MAX_DESC ||
+        tx->len + payload > VNET_MAX_FRAME ||
+        (nth[13] & ~(TCP_ACK | TCP_PSH)) != 0 || (th[13] & TCP_PSH) ||
+        get_be32(nth + 4) != tx->next_seq)
+        return false;
+
+    /* same link and ip addresses, ports, ack and tcp options */
+    u16 addr = tx->ipv6 ? 8 : 12;
+    if (runtime_memcmp(h, tx->headers, SIZEOF_ETH_HDR) ||
+        runtime_memcmp(h + tx->l3 + addr, tx->headers + tx->l3 + addr, l4 - tx->l3 - addr) ||
+        runtime_memcmp(nth, th, 4) || runtime_memcmp(nth + 8, th + 8, 4) ||
+        runtime_memcmp(nth + TCP_HLEN, th + TCP_HLEN, hdr_len - l4 - TCP_HLEN))
+        return false;
 
+    th[13] |= nth[13];
+    put_be16(th + 14, get_be16(nth + 14)); /* latest window */
+    tx->segs[tx->nsegs++] = p;
+    tx->ndesc += ndesc;
+    tx->len += payload;
+    tx->next_seq += payload;
+    tx->last_seg_len = payload;
+    return true;
+}
+
+closure_function(1, 0, void, vnet_tx_flush,
+                 vnet_queue, q)
+{
+    vnet_queue q = bound(q);
+    spin_lock(&q->tx_lock);
+    q->tx_flush_queued = false;
+    if (q->tx_pending) {
+        vnet_tx_commit(q, q->tx_pending);
+        q->tx_pending = 0;
+    }
+    spin_unlock(&q->tx_lock);
+}
+
+/* Replies go out on the pair that the request came in on; otherwise the
+   current cpu's pair is used. Since the device steers received packets
+   of a flow to the pair that it was last transmitted on, a connection
+   then stays with the cpu of the thread driving it. lwIP runs under the
+   kernel lock, so rx_active is stable here. */
+static vnet_queue vnet_tx_queue(vnet vn)
+{
+    if (vn->rx_active >= 0)
+        return &vn->queues[vn->rx_active];
+    return &vn->queues[current_cpu()->id % vn->nqueues];
+}
+
+static err_t low_level_output(struct netif *netif, struct pbuf *p)
+{
+    vnet vn = netif->state;
+    u8 h[VNET_TX_HDR_MAX];
+    u16 l3 = 0, l4 = 0, hdr_len = 0;
+    boolean ipv6 = false;
+    int payload = -1;
+
+    if (vn->dev->features & VIRTIO_NET_F_CSUM) {
+        u16 caplen = pbuf_copy_partial(p, h, VNET_TX_HDR_MAX, 0);
+        payload = vnet_tx_parse(h, caplen, p->tot_len, &l3, &l4, &hdr_len, &ipv6);
+    }
+    u16 ndesc = vnet_pbuf_count(p);
     pbuf_ref(p);
 
-    for (struct pbuf * q = p; q != NULL; q = q->next)
-        vqmsg_push(vn->txq, m, q->payload, q->len, false);
+    vnet_queue q = vnet_tx_queue(vn);
+    spin_lock(&q->tx_lock);
+    vnet_tx tx = q->tx_pending;
+    if (tx) {
+        if (payload > 0 && vnet_tx_merge(tx, p, h, hdr_len, l4, payload, ndesc)) {
+            if (payload < tx->seg_size || (h[l4 + 13] & TCP_PSH)) {
+                vnet_tx_commit(q, tx);
+                q->tx_pending = 0;
+            }
+            goto out;
+        }
+        vnet_tx_commit(q, tx);
+        q->tx_pending = 0;
+    }
+
+    tx = allocate(vn->txframes, sizeof(struct vnet_tx));
+    assert(tx != INVALID_ADDRESS);
+    zero(&tx->vhdr, sizeof(tx->vhdr));
+    tx->segs[0] = p;
+    tx->nsegs = 1;
+    tx->ndesc = ndesc;
+    tx->len = p->tot_len;
+    if (payload < 0) {
+        tx->hdr_len = 0;
+        vnet_tx_commit(q, tx);
+        goto out;
+    }
+    runtime_memcpy(tx->headers, h, hdr_len);
+    tx->hdr_len = hdr_len;
+    tx->l3 = l3;
+    tx->l4 = l4;
+    tx->ipv6 = ipv6;
+    tx->seg_size = tx->last_seg_len = payload;
+    tx->next_seq = get_be32(h + l4 + 4) + payload;
+
+    /* hold a full-sized data segment in case more of the stream follows */
+    if (payload >= VNET_TSO_MIN_SEG && (h[l4 + 13] & ~TCP_ACK) == 0 &&
+        (vn->dev->features & (ipv6 ? VIRTIO_NET_F_HOST_TSO6 : VIRTIO_NET_F_HOST_TSO4))) {
+        q->tx_pending = tx;
+        if (!q->tx_flush_queued) {
+            q->tx_flush_queued = true;
+            enqueue_bh(q->tx_flush);
+        }
+    } else {
+        vnet_tx_commit(q, tx);
+    }
+  out:
+    spin_unlock(&q->tx_lock);
 
-    vqmsg_commit(vn->txq, m, closure(vn->dev->general, tx_complete, p));
-    
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
     if (((u8_t *)p->payload)[0] & 1) {
         /* broadcast or multicast packet*/
@@ -118,11 +432,91 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
 static void receive_buffer_release(struct pbuf *p)
 {
     xpbuf x  = (void *)p;
-    deallocate(x->vn->rxbuffers, x, x->vn->rxbuflen + sizeof(struct xpbuf));
+    vnet vn = x->q->vn;
+    deallocate(vn->rxbuffers, x, vn->rxbuflen + sizeof(struct xpbuf));
 }
 
-static void post_receive(vnet vn);
+static void post_receive(vnet_queue q);
+
+/* Verify the transport checksum of a received frame which the device
+   didn't vouch for; lwIP's own tcp and udp checks are disabled when
+   the device reports checksum status. Fragments are left unverified. */
+static boolean vnet_rx_csum_ok(struct pbuf *p)
+{
+    u8 *h = p->payload;
+    if (p->len < SIZEOF_ETH_HDR)
+        return true;
+    u16 l3 = SIZEOF_ETH_HDR;
+    u16 type = get_be16(h + 12);
+    if (type == ETHTYPE_VLAN && p->len >= l3 + SIZEOF_VLAN_HDR) {
+        type = get_be16(h + l3 + 2);
+        l3 += SIZEOF_VLAN_HDR;
+    }
 
+    boolean ipv6;
+    u32 l4, len;
+    u8 proto;
+    u8 *ip = h + l3;
+    if (type == ETHTYPE_IP) {
+        if (p->len < l3 + IP_HLEN || (get_be16(ip + 6) & 0x3fff) != 0)
+            return true;
+        ipv6 = false;
+        proto = ip[9];
+        l4 = l3 + (ip[0] & 0xf) * 4;
+        len = get_be16(ip + 2) - (l4 - l3);
+    } else if (type == ETHTYPE_IPV6) {
+        if (p->len < l3 + IP6_HLEN)
+            return true;
+        ipv6 = true;
+        proto = ip[6];
+        l4 = l3 + IP6_HLEN;
+        len = get_be16(ip + 4);
+    } else {
+        return true;
+    }
+    if (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP)
+        return true;
+    if (l4 + len > p->tot_len || l4 + 8 > p->len)
+        return false;
+    if (proto == IP_PROTO_UDP && !ipv6 && get_be16(h + l4 + 6) == 0)
+        return true;            /* no udp checksum */
+
+    u64 sum = vnet_pseudo_sum(ip, ipv6, proto, len);
+    boolean odd = false;
+    u32 offset = l4;
+    for (struct pbuf *q = p; q && len > 0; q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        u32 n = MIN(len, q->len - offset);
+        sum = vnet_csum_add(sum, q->payload + offset, n, &odd);
+        len -= n;
+        offset = 0;
+    }
+    return vnet_csum_fold(sum) == 0xffff;
+}
+
+static void vnet_input(vnet_queue q, struct pbuf *p, u8 flags)
+{
+    vnet vn = q->vn;
+    if ((vn->dev->features & VIRTIO_NET_F_GUEST_CSUM) &&
+        (flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) == 0 &&
+        !vnet_rx_csum_ok(p)) {
+        virtio_net_debug("%s: checksum error, dropping\n", __func__);
+        LINK_STATS_INC(link.chkerr);
+        pbuf_free(p);
+        return;
+    }
+    vn->rx_active = q->index;
+    if (vn->n->input(p, vn->n) != ERR_OK)
+        pbuf_free(p);
+    vn->rx_active = -1;
+}
+
+/* With mergeable rx buffers, a large (GSO) frame arrives as a run of
+   buffers with only the first carrying the header; they are chained
+   into a single pbuf before input. */
 closure_function(1, 1, void, input,
                  xpbuf, x,
                  u64, len)
@@ -130,30 +524,58 @@ closure_function(1, 1, void, input,
     virtio_net_debug("%s: len %ld\n", __func__, len);
 
     xpbuf x = bound(x);
-    vnet vn= x->vn;
+    vnet_queue q = x->q;
+    vnet vn = q->vn;
     // under what conditions does a virtio queue give us zero?
     if (x != NULL) {
-        len -= vn->net_header_len;
-        assert(len <= x->p.pbuf.len);
-        x->p.pbuf.tot_len = x->p.pbuf.len = len;
-        x->p.pbuf.payload += vn->net_header_len;
-        if (vn->n->input(&x->p.pbuf, vn->n) != ERR_OK) {
-            receive_buffer_release(&x->p.pbuf);
+        struct pbuf *p = &x->p.pbuf;
+        if (q->rx_head) {
+            assert(len <= p->len);
+            p->tot_len = p->len = len;
+            q->rx_len += len;
+            if (q->rx_len <= VNET_MAX_FRAME)
+                pbuf_cat(&q->rx_head->p.pbuf, p);
+            else
+                pbuf_free(p);
+            if (--q->rx_remain == 0) {
+                p = &q->rx_head->p.pbuf;
+                q->rx_head = 0;
+                if (q->rx_len <= VNET_MAX_FRAME)
+                    vnet_input(q, p, q->rx_flags);
+                else
+                    pbuf_free(p);
+            }
+        } else {
+            struct virtio_net_hdr_mrg_rxbuf *hdr = p->payload;
+            u16 nbufs = (vn->dev->features & VIRTIO_NET_F_MRG_RXBUF) ? hdr->num_buffers : 1;
+            len -= vn->net_header_len;
+            assert(len <= p->len);
+            p->tot_len = p->len = len;
+            p->payload += vn->net_header_len;
+            if (nbufs > 1) {
+                q->rx_head = x;
+                q->rx_len = len;
+                q->rx_remain = nbufs - 1;
+                q->rx_flags = hdr->hdr.flags;
+            } else {
+                vnet_input(q, p, hdr->hdr.flags);
+            }
         }
     } else {
         rprintf("virtio null\n");
     }
     // we need to get a signal from the device side that there was
     // an underrun here to open up the window
-    post_receive(vn);
+    post_receive(q);
     closure_finish();
 }
 
 
-static void post_receive(vnet vn)
+static void post_receive(vnet_queue q)
 {
+    vnet vn = q->vn;
     xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
-    x->vn = vn;
+    x->q = q;
     x->p.custom_free_function = receive_buffer_release;
     pbuf_alloced_custom(PBUF_RAW,
                         vn->rxbuflen,
@@ -162,10 +584,72 @@ static void post_receive(vnet vn)
                         x+1,
                         vn->rxbuflen);
 
-    vqmsg m = allocate_vqmsg(vn->rxq);
+    vqmsg m = allocate_vqmsg(q->rxq);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->rxq, m, x+1, vn->rxbuflen, true);
-    vqmsg_commit(vn->rxq, m, closure(vn->dev->general, input, x));
+    vqmsg_push(q->rxq, m, x+1, vn->rxbuflen, true);
+    vqmsg_commit(q->rxq, m, closure(vn->dev->general, input, x));
+}
+
+/* buffers sized for GSO frames are only used without merging */
+static void vnet_fill_rxq(vnet_queue q)
+{
+    int nrx = virtqueue_entries(q->rxq);
+    if (q->vn->rxbuflen > PAGESIZE)
+        nrx = MIN(nrx, VNET_RX_LARGE_BUFFERS);
+    for (int i = 0; i < nrx; i++)
+        post_receive(q);
+}
+
+closure_function(2, 1, void, vnet_mq_complete,
+                 vnet, vn, struct vnet_ctrl_mq_cmd *, c,
+                 u64, len)
+{
+    vnet vn = bound(vn);
+    struct vnet_ctrl_mq_cmd *c = bound(c);
+    if (c->ack == VIRTIO_NET_OK) {
+        virtio_net_debug("%s: using %d queue pairs\n", __func__, c->mq.virtqueue_pairs);
+        vn->nqueues = c->mq.virtqueue_pairs;
+    } else {
+        msg_err("failed to enable %d queue pairs\n", c->mq.virtqueue_pairs);
+    }
+    deallocate(vn->dev->contiguous, c, pad(sizeof(*c), vn->dev->contiguous->pagesize));
+    closure_finish();
+}
+
+/* The device is attached before the application processors are
+   started, so the number of pairs to use is settled afterwards, from
+   the runqueue: each pair in use has its vectors directed at its cpu
+   and receive buffers posted before the device is told to steer flows
+   across them. Until the device acknowledges, all traffic stays on
+   pair 0. */
+closure_function(1, 0, void, vnet_mq_enable,
+                 vnet, vn)
+{
+    vnet vn = bound(vn);
+    int n = MIN(vn->max_queues, total_processors);
+    if (n > 1) {
+        for (int i = 0; i < n; i++) {
+            vnet_queue q = &vn->queues[i];
+            pci_set_msix_target(vn->dev->dev, i * 2, i);
+            pci_set_msix_target(vn->dev->dev, i * 2 + 1, i);
+            if (i > 0)
+                vnet_fill_rxq(q);
+        }
+
+        struct vnet_ctrl_mq_cmd *c = allocate(vn->dev->contiguous, sizeof(*c));
+        assert(c != INVALID_ADDRESS);
+        c->hdr.class = VIRTIO_NET_CTRL_MQ;
+        c->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+        c->mq.virtqueue_pairs = n;
+        c->ack = VIRTIO_NET_ERR;
+        vqmsg m = allocate_vqmsg(vn->ctl);
+        assert(m != INVALID_ADDRESS);
+        vqmsg_push(vn->ctl, m, &c->hdr, sizeof(c->hdr), false);
+        vqmsg_push(vn->ctl, m, &c->mq, sizeof(c->mq), false);
+        vqmsg_push(vn->ctl, m, &c->ack, sizeof(c->ack), true);
+        vqmsg_commit(vn->ctl, m, closure(vn->dev->general, vnet_mq_complete, vn, c));
+    }
+    closure_finish();
 }
 
 void lwip_status_callback(struct netif *netif);
@@ -201,35 +685,79 @@ static err_t virtioif_init(struct netif *netif)
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
 
-    for (int i = 0; i < virtqueue_entries(vn->rxq); i++)
-        post_receive(vn);
-    
+    /* Leave tcp checksums to the device (see low_level_output) and,
+       where the device reports checksum status, tcp and udp
+       verification to the input path. UDP checksums are still
+       generated here, as large datagrams may be fragmented. */
+    u16 chksum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+    if (vn->dev->features & VIRTIO_NET_F_CSUM)
+        chksum_flags &= ~NETIF_CHECKSUM_GEN_TCP;
+    if (vn->dev->features & VIRTIO_NET_F_GUEST_CSUM)
+        chksum_flags &= ~(NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP);
+    NETIF_SET_CHECKSUM_CTRL(netif, chksum_flags);
+
+    vnet_fill_rxq(&vn->queues[0]);
+
     return ERR_OK;
 }
 
 static void virtio_net_attach(heap general, heap page_allocator, pci_dev d)
 {
-    //u32 badness = VIRTIO_F_BAD_FEATURE | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
-    //    VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |  VIRTIO_NET_F_GUEST_ECN|
-    //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_MQ;
-
-    vtpci dev = attach_vtpci(general, page_allocator, d, VIRTIO_NET_F_MAC);
+    vtpci dev = attach_vtpci(general, page_allocator, d, VIRTIO_NET_FEATURES);
     vnet vn = allocate(dev->general, sizeof(struct vnet));
     vn->n = allocate(dev->general, sizeof(struct netif));
     vn->net_header_len = vtpci_is_modern(dev) || (dev->features & VIRTIO_NET_F_MRG_RXBUF) != 0 ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
     vn->rxbuflen = vn->net_header_len + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + 1500;
-    virtio_net_debug("%s: net_header_len %d, rxbuflen %d\n", __func__, vn->net_header_len, vn->rxbuflen);
+
+    /* Without mergeable buffers, each one must be able to take a whole
+       GSO frame if the device may send those. */
+    if ((dev->features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)) &&
+        !(dev->features & VIRTIO_NET_F_MRG_RXBUF))
+        vn->rxbuflen = vn->net_header_len + VNET_MAX_FRAME;
+    virtio_net_debug("%s: features 0x%lx, net_header_len %d, rxbuflen %d\n", __func__,
+                     dev->features, vn->net_header_len, vn->rxbuflen);
     vn->rxbuffers = allocate_objcache(dev->general, page_allocator,
 				      vn->rxbuflen + sizeof(struct xpbuf), PAGESIZE_2M);
-    /* rx = 0, tx = 1, ctl = 2 by 
-       page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
+    vn->txframes = allocate_objcache(dev->general, page_allocator,
+                                     sizeof(struct vnet_tx), PAGESIZE_2M);
     vn->dev = dev;
-    vtpci_alloc_virtqueue(dev, "virtio net tx", 1, &vn->txq);
-    vtpci_alloc_virtqueue(dev, "virtio net rx", 0, &vn->rxq);
-    // just need vn->net_header_len contig bytes really
-    vn->empty = allocate(dev->contiguous, dev->contiguous->pagesize);
-    for (int i = 0; i < vn->net_header_len; i++)  ((u8 *)vn->empty)[i] = 0;
+
+    /* One pair per possible cpu, as far as the device and its MSI-X
+       table allow; the control queue takes the vector after them. */
+    u16 max_pairs = 1;
+    if (dev->features & VIRTIO_NET_F_MQ)
+        max_pairs = pci_bar_read_2(&dev->device_config,
+                                   offsetof(struct virtio_net_config *, max_virtqueue_pairs));
+    vn->max_queues = MIN(MIN(max_pairs, MAX_CPUS), (pci_get_msix_count(dev->dev) - 1) / 2);
+    if (vn->max_queues < 1)
+        vn->max_queues = 1;
+    vn->nqueues = 1;
+    vn->rx_active = -1;
+    vn->queues = allocate_zero(dev->general, vn->max_queues * sizeof(struct vnet_queue));
+    assert(vn->queues != INVALID_ADDRESS);
+    virtio_net_debug("%s: max_virtqueue_pairs %d, using up to %d\n", __func__,
+                     max_pairs, vn->max_queues);
+
+    /* rx = 2N, tx = 2N + 1, ctl = 2 * max_virtqueue_pairs by
+       section 5.1.2 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
+    for (int i = 0; i < vn->max_queues; i++) {
+        vnet_queue q = &vn->queues[i];
+        q->vn = vn;
+        q->index = i;
+        vtpci_alloc_virtqueue(dev, "virtio net tx", i * 2 + 1, &q->txq);
+        vtpci_alloc_virtqueue(dev, "virtio net rx", i * 2, &q->rxq);
+        spin_lock_init(&q->tx_lock);
+        q->tx_pending = 0;
+        q->tx_flush_queued = false;
+        q->tx_flush = closure(dev->general, vnet_tx_flush, q);
+        q->rx_head = 0;
+    }
+    if (vn->max_queues > 1) {
+        vtpci_alloc_virtqueue_vector(dev, "virtio net ctl", max_pairs * 2,
+                                     vn->max_queues * 2, &vn->ctl);
+        enqueue(runqueue, closure(dev->general, vnet_mq_enable, vn));
+    }
     vn->n->state = vn;
     // initialization complete
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
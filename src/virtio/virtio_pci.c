@@ -186,6 +186,16 @@ status vtpci_alloc_virtqueue(vtpci dev,
                              const char *name,
                              int idx,
                              struct virtqueue **result)
+{
+    return vtpci_alloc_virtqueue_vector(dev, name, idx, idx, result);
+}
+
+/* as above, with the MSI-X table entry given separately from the queue index */
+status vtpci_alloc_virtqueue_vector(vtpci dev,
+                                    const char *name,
+                                    int idx,
+                                    int msi_slot,
+                                    struct virtqueue **result)
 {
     // allocate virtqueue
     struct virtqueue *vq;
@@ -200,10 +210,10 @@ status vtpci_alloc_virtqueue(vtpci dev,
         return s;
 
     // setup virtqueue MSI-X interrupt
-    pci_setup_msix(dev->dev, idx, handler, name);
-    pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR], idx);
-    int check_idx = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
-    if (check_idx != idx)
+    pci_setup_msix(dev->dev, msi_slot, handler, name);
+    pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR], msi_slot);
+    int check_slot = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
+    if (check_slot != msi_slot)
         return timm("status", "cannot configure virtqueue MSI-X vector");
 
     // queue ring
@@ -1,6 +1,7 @@
 #include <kernel.h>
 #include <drivers/storage.h>
 #include <io.h>
+#include <page.h>
 
 #include "virtio_internal.h"
 
@@ -53,6 +54,16 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_R_TOPOLOGY_OPT_IO_SIZE	(offsetof(struct virtio_blk_config *, topology) + offsetof(struct virtio_blk_topology *, opt_io_size))
 #define VIRTIO_BLK_R_RESERVED			(offsetof(struct virtio_blk_config *, reserved))
 
+/* feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX   U64_FROM_BIT(1)
+#define VIRTIO_BLK_F_SEG_MAX    U64_FROM_BIT(2)
+
+#define VIRTIO_BLK_FEATURES     (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | \
+                                 VIRTIO_F_RING_INDIRECT_DESC)
+
+/* largest request handed down by the block queue */
+#define VIRTIO_BLK_MAX_REQUEST  (1 * MB)
+
 #define VIRTIO_BLK_REQ_HEADER_SIZE      16
 #define VIRTIO_BLK_REQ_STATUS_SIZE      1
 
@@ -75,6 +86,8 @@ typedef struct storage {
     struct virtqueue *command;
     u64 capacity;
     u64 block_size;
+    u64 size_max;               /* per data descriptor */
+    u64 seg_max;                /* data descriptors per request */
 } *storage;
 
 static virtio_blk_req allocate_virtio_blk_req(storage st, u32 type, u64 sector)
@@ -106,73 +119,115 @@ closure_function(4, 1, void, complete,
     closure_finish();
 }
 
-static inline void storage_rw_internal(storage st, boolean write, void * buf,
-                                       range sectors, status_handler sh)
+/* Data buffers are only contiguous in virtual memory, so each run of
+   physically contiguous pages gets a descriptor of its own. */
+static void storage_push_data(storage st, vqmsg m, void *buf, u64 length, boolean write)
 {
-    char * err = 0;
-    virtio_blk_debug("virtio_%s: block range %R cap %ld\n", write ? "write" : "read", sectors, st->capacity);
-
-    /* XXX so no, not page aligned but what? 16? */
-    if ((u64_from_pointer(buf) & 15)) {
-        msg_err("misaligned buf: %p\n", buf);
-        err = "write buffer not properly aligned";
-        goto out_inval;
+    while (length > 0) {
+        u64 p = physical_from_virtual(buf);
+        u64 n = MIN(length, PAGESIZE - (u64_from_pointer(buf) & MASK(PAGELOG)));
+        while (n < length) {
+            u64 next = MIN(length - n, PAGESIZE);
+            if (n + next > st->size_max || physical_from_virtual(buf + n) != p + n)
+                break;
+            n += next;
+        }
+        vqmsg_push(st->command, m, buf, n, write);
+        buf += n;
+        length -= n;
     }
+}
 
-    u64 start_sector = sectors.start;
-    u64 nsectors = range_span(sectors);
-    if (nsectors == 0) {
-        err = "length must be > 0";
-        goto out_inval;
+/* A request gathered by the block queue goes to the device as one
+   command, its buffers making up the data descriptors. */
+closure_function(2, 1, void, storage_sg_complete,
+                 sg_list, sg, status_handler, sh,
+                 status, s)
+{
+    sg_list_release(bound(sg));
+    deallocate_sg_list(bound(sg));
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+static void storage_rw_sg(storage st, boolean write, sg_list sg, range sectors, status_handler sh)
+{
+    virtio_blk_debug("virtio_%s sg: block range %R, sg count %ld\n",
+                     write ? "write" : "read", sectors, sg->count);
+    u64 length = range_span(sectors) * st->block_size;
+    status_handler c = closure(st->v->general, storage_sg_complete, sg, sh);
+    if (length == 0 || sg->count < length) {
+        msg_err("invalid request: sectors %R, sg count %ld\n", sectors, sg->count);
+        apply(c, timm("result", "invalid sg request"));
+        return;
     }
 
     virtio_blk_req req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-                                                 start_sector);
+                                                 sectors.start);
     virtqueue vq = st->command;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req, VIRTIO_BLK_REQ_HEADER_SIZE, false);
-    vqmsg_push(vq, m, buf, nsectors * st->block_size, !write);
+    sg_list_foreach(sg, sgb) {
+        /* XXX so no, not page aligned but what? 16? */
+        assert((u64_from_pointer(sgb->buf + sgb->offset) & 15) == 0);
+        u64 n = MIN(length, sgb->size - sgb->offset);
+        storage_push_data(st, m, sgb->buf + sgb->offset, n, !write);
+        length -= n;
+        if (length == 0)
+            break;
+    }
     void * statusp = ((void *)req) + VIRTIO_BLK_REQ_HEADER_SIZE;
     vqmsg_push(vq, m, statusp, VIRTIO_BLK_REQ_STATUS_SIZE, true);
-    vqfinish c = closure(st->v->general, complete, st, sh, statusp, req);
-    vqmsg_commit(vq, m, c);
-    return;
-  out_inval:
-    msg_err("%s", err);               /* yes, bark */
-    apply(sh, timm("result", "%s", err));
+    vqmsg_commit(vq, m, closure(st->v->general, complete, st, c, statusp, req));
 }
 
-closure_function(1, 3, void, storage_write,
+closure_function(1, 3, void, storage_sg_write,
                  storage, st,
-                 void *, source, range, blocks, status_handler, s)
+                 sg_list, sg, range, blocks, status_handler, s)
 {
-    storage_rw_internal(bound(st), true, source, blocks, s);
+    storage_rw_sg(bound(st), true, sg, blocks, s);
 }
 
-closure_function(1, 3, void, storage_read,
+closure_function(1, 3, void, storage_sg_read,
                  storage, st,
-                 void *, target, range, blocks, status_handler, s)
+                 sg_list, sg, range, blocks, status_handler, s)
 {
-    storage_rw_internal(bound(st), false, target, blocks, s);
+    storage_rw_sg(bound(st), false, sg, blocks, s);
 }
 
 static void virtio_blk_attach(heap general, storage_attach a, heap page_allocator, pci_dev d)
 {
     storage s = allocate(general, sizeof(struct storage));
-    s->v = attach_vtpci(general, page_allocator, d, 0);
+    s->v = attach_vtpci(general, page_allocator, d, VIRTIO_BLK_FEATURES);
 
     s->block_size = pci_bar_read_4(&s->v->device_config, VIRTIO_BLK_R_BLOCK_SIZE);
     s->capacity = (pci_bar_read_4(&s->v->device_config, VIRTIO_BLK_R_CAPACITY_LOW) |
 		   ((u64) pci_bar_read_4(&s->v->device_config, VIRTIO_BLK_R_CAPACITY_HIGH) << 32)) * s->block_size;
     virtio_blk_debug("%s: capacity 0x%lx, block size 0x%x\n", __func__, s->capacity, s->block_size);
     vtpci_alloc_virtqueue(s->v, "virtio blk", 0, &s->command);
+
+    /* Without indirect descriptors, a request must fit in the ring along
+       with its header and status. */
+    u64 features = s->v->features;
+    s->size_max = (features & VIRTIO_BLK_F_SIZE_MAX) ?
+        pci_bar_read_4(&s->v->device_config, VIRTIO_BLK_R_SIZE_MAX) : U32_MAX;
+    s->seg_max = (features & VIRTIO_F_RING_INDIRECT_DESC) ? VQMSG_MAX_INDIRECT :
+        virtqueue_entries(s->command);
+    s->seg_max -= 2;
+    if (features & VIRTIO_BLK_F_SEG_MAX)
+        s->seg_max = MIN(s->seg_max, pci_bar_read_4(&s->v->device_config, VIRTIO_BLK_R_SEG_MAX));
+    virtio_blk_debug("%s: features 0x%lx, size_max 0x%lx, seg_max %ld\n", __func__,
+                     features, s->size_max, s->seg_max);
     // initialization complete
     vtpci_set_status(s->v, VIRTIO_CONFIG_STATUS_DRIVER_OK);
 
-    block_io in = closure(general, storage_read, s);
-    block_io out = closure(general, storage_write, s);
-    apply(a, in, out, s->capacity);
+    block_queue bq = allocate_block_queue(general, closure(general, storage_sg_read, s),
+                                          closure(general, storage_sg_write, s),
+                                          find_order(s->block_size),
+                                          VIRTIO_BLK_MAX_REQUEST / s->block_size, s->seg_max);
+    assert(bq != INVALID_ADDRESS);
+    apply(a, block_queue_reader(bq), block_queue_writer(bq), s->capacity);
 }
 
 closure_function(3, 1, boolean, virtio_blk_probe,
@@ -84,6 +84,8 @@ typedef struct vqmsg {
         u64 len;                /* length on return */
     };
     buffer descv;               /* XXX should be a variable stride vector */
+    struct vring_desc *indirect; /* table holding the chain, if not in the ring */
+    bytes indirect_size;
     vqfinish completion;
 } *vqmsg;
     
@@ -123,12 +125,16 @@ vqmsg allocate_vqmsg(virtqueue vq)
         deallocate(h, m, sizeof(struct vqmsg));
         return INVALID_ADDRESS;
     }
+    m->indirect = 0;
+    m->indirect_size = 0;
     m->completion = 0;          /* fill on queue */
     return m;
 }
 
 void deallocate_vqmsg(virtqueue vq, vqmsg m)
 {
+    if (m->indirect)
+        deallocate(vq->dev->contiguous, m->indirect, m->indirect_size);
     deallocate_buffer(m->descv);
     deallocate(vq->dev->general, m, sizeof(struct vqmsg));
 }
@@ -146,8 +152,38 @@ void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write)
 
 static void virtqueue_fill(virtqueue vq);
 
+/* Move a long chain to a table of its own, so that it takes a single
+   ring entry. If the table can't be allocated, the chain goes in the
+   ring as is. */
+static void vqmsg_make_indirect(virtqueue vq, vqmsg m)
+{
+    heap h = vq->dev->contiguous;
+    bytes size = m->count * sizeof(struct vring_desc);
+    bytes alloc_size = pad(size, h->pagesize);
+    struct vring_desc *table = allocate(h, alloc_size);
+    if (table == INVALID_ADDRESS)
+        return;
+    runtime_memcpy(table, buffer_ref(m->descv, 0), size);
+    for (int i = 0; i < m->count - 1; i++) {
+        table[i].flags |= VRING_DESC_F_NEXT;
+        table[i].next = i + 1;
+    }
+    virtqueue_debug("%s: vq %s: msg %p, %d descriptors at %p\n",
+                    __func__, vq->name, m, m->count, table);
+    m->indirect = table;
+    m->indirect_size = alloc_size;
+    buffer_clear(m->descv);
+    m->count = 0;
+    vqmsg_push(vq, m, table, size, false);
+    struct vring_desc *d = buffer_ref(m->descv, 0);
+    d->flags = VRING_DESC_F_INDIRECT;
+}
+
 void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
 {
+    if ((vq->dev->features & VIRTIO_F_RING_INDIRECT_DESC) &&
+        m->count > VQMSG_DEFAULT_SIZE && m->count <= VQMSG_MAX_INDIRECT)
+        vqmsg_make_indirect(vq, m);
     m->completion = completion;
     /* XXX noirq */
     list_push_back(&vq->msgqueue, &m->l);
@@ -201,7 +237,7 @@ closure_function(1, 0, void, vq_interrupt,
         assert(l);
         list_delete(&q);
         assert(enqueue(vq->servicequeue, l));
-        enqueue(bhqueue, vq->service);
+        enqueue_bh(vq->service);
     }
 
     virtqueue_fill(vq);
@@ -652,7 +652,7 @@ static void pvscsi_process_cmp_ring(pvscsi dev)
         /* trick: remove (local) head and queue first element */
         list_delete(&q);
         assert(enqueue(dev->rx_servicequeue, l));
-        enqueue(bhqueue, dev->rx_service);
+        enqueue_bh(dev->rx_service);
     }
 }
 
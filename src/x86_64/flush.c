@@ -13,18 +13,13 @@ typedef struct flush_entry {
     u64 page; // or INVALID_ADDRESS for a full flush
 } *flush_entry;
 
-static void invalidate (u64 page)
-{
-    asm volatile("invlpg (%0)" :: "r" (page) : "memory");            
-}
-
 closure_function(0, 0, void, flush_handler)
 {
     flush_entry f = queue_peek(flush_queue);
     if (f->page == INVALID_PHYSICAL) {
         flush_tlb();
     } else {
-        invalidate(f->page);
+        page_invalidate_local(f->page);
     }
     if (refcount_release(&f->r))
         deallocate(flush_heap, dequeue(flush_queue), sizeof(struct flush_entry));
@@ -39,7 +34,7 @@ void page_invalidate(u64 p, thunk completion)
         // we can choose to delay/amortize this
         apic_ipi(TARGET_EXCLUSIVE_BROADCAST, 0, flush_ipi);        
     } else {
-        invalidate(p);
+        page_invalidate_local(p);
         apply(completion);
     }
 }
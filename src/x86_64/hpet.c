@@ -119,7 +119,7 @@ static void timer_config(int timer, timestamp rate, thunk t, boolean periodic)
     if (!hpet_interrupts[timer]) {
         u32 a, d;
         hpet_interrupts[timer] = allocate_interrupt();
-        msi_format(&a, &d, hpet_interrupts[timer]);
+        msi_format(&a, &d, hpet_interrupts[timer], 0);
         hpet->timers[timer].fsb_int = ((u64)a << 32) | d;
         register_interrupt(hpet_interrupts[timer], t, "hpet timer");
     }
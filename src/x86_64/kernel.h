@@ -8,6 +8,8 @@
 
 #define HUGE_PAGESIZE 0x100000000ull
 
+#define ZEROED_PAGE_POOL_SIZE 32
+
 typedef u64 *context;
 
 context allocate_frame(heap h);
@@ -40,6 +42,22 @@ typedef struct cpuinfo {
     boolean have_kernel_lock;
     u64 frcount;
 
+    /* Runnable user threads homed on this cpu; idle cpus steal from here */
+    struct queue *thread_queue;
+    u64 steal_count;
+
+    /* Bottom halves queued from interrupts taken on this cpu; served by
+       this cpu, or by another which holds the kernel lock meanwhile */
+    struct queue *bh_queue;
+    u64 bh_steal_count;
+
+    /* Pre-zeroed physical pages for anonymous faults, refilled while
+       idle through a private kernel mapping window */
+    u64 zeroed_pages[ZEROED_PAGE_POOL_SIZE];
+    int zeroed_page_count;
+    u64 zero_window;
+    u64 huge_zero_window;
+
     /* The following fields are used rarely or only on initialization. */
 
     /* Stack for exceptions (which may occur in interrupt handlers) */
@@ -57,6 +75,7 @@ typedef struct cpuinfo {
 #define cpu_kernel 2
 #define cpu_interrupt 3
 #define cpu_user 4
+#define cpu_syscall 5
 
 extern struct cpuinfo cpuinfos[];
 
@@ -131,13 +150,13 @@ static inline void set_page_write_protect(boolean enable)
 }
 
 typedef struct queue *queue;
-extern queue bhqueue;
 extern queue runqueue;
-extern queue thread_queue;
+extern u64 sqpoll_active;
 timerheap runloop_timers;
 
 heap physically_backed(heap meta, heap virtual, heap physical, u64 pagesize);
 void physically_backed_dealloc_virtual(heap h, u64 x, bytes length);
+heap allocate_locked_heap(kernel_heaps kh);
 void print_stack(context c);
 void print_frame(context f);
 
@@ -151,10 +170,9 @@ void kernel_delay(timestamp delta);
 void init_clock(void);
 boolean init_hpet(kernel_heaps kh);
 
-void process_bhqueue();
 void install_fallback_fault_handler(fault_handler h);
 
-void msi_format(u32 *address, u32 *data, int vector);
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu);
 
 u64 allocate_interrupt(void);
 void deallocate_interrupt(u64 irq);
@@ -175,13 +193,30 @@ void kern_lock(void);
 boolean kern_try_lock(void);
 void kern_unlock(void);
 void init_scheduler(heap);
+
+/* memory reclaim - a shrinker is asked to release up to the given
+   number of bytes and returns the number released */
+typedef closure_type(shrinker, u64, u64);
+void init_reclaim(kernel_heaps kh);
+void mm_register_shrinker(shrinker s);
+void mm_register_writeback(thunk t);
+void mm_register_mcache(heap h);
+boolean mm_memory_low(void);
+boolean mm_reclaim(u64 bytes);
 void mm_service(void);
 
+u64 get_zeroed_page(void);
+void refill_zeroed_pages(void);
+void zero_huge_page(u64 phys);
+
 extern void interrupt_exit(void);
 extern char **state_strings;
 
-// static inline void schedule_frame(context f) stupid header deps
-#define schedule_frame(__f)  do { assert((__f)[FRAME_QUEUE] != INVALID_PHYSICAL); enqueue((queue)pointer_from_u64((__f)[FRAME_QUEUE]), pointer_from_u64((__f)[FRAME_RUN])); } while(0)
+#define THREAD_QUEUE_SIZE 64
+void schedule_frame(context f);
+
+#define BH_QUEUE_SIZE 2048
+boolean enqueue_bh(thunk t);
 
 void kernel_unlock();
 
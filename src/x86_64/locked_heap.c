@@ -0,0 +1,103 @@
+/* locked heap
+
+   The kernel heaps rely on the kernel lock being held. The locked heap
+   is a general-purpose heap (an mcache, from 32B to 1MB) which can be
+   used without it, as by a syscall that runs without the kernel lock,
+   by taking a spinlock of its own around every operation.
+
+   That alone would not do if the heap shared anything with the other
+   kernel heaps, so it has its own region of virtual address space,
+   with a bitmap which is sized to cover the whole region up front and
+   so never has to be extended from the general heap. Physical pages
+   come from the physical heap, which the page table lock covers. */
+
+#include <kernel.h>
+
+#define LOCKED_HEAP_SIZE        (16 * HUGE_PAGESIZE)
+
+typedef struct locked_heap {
+    struct heap h;
+    heap parent;
+    struct spinlock lock;
+} *locked_heap;
+
+static u64 locked_heap_alloc(heap h, bytes b)
+{
+    locked_heap lh = (locked_heap)h;
+    u64 flags = spin_lock_irq(&lh->lock);
+    u64 a = allocate_u64(lh->parent, b);
+    spin_unlock_irq(&lh->lock, flags);
+    return a;
+}
+
+static void locked_heap_dealloc(heap h, u64 a, bytes b)
+{
+    locked_heap lh = (locked_heap)h;
+    u64 flags = spin_lock_irq(&lh->lock);
+    deallocate_u64(lh->parent, a, b);
+    spin_unlock_irq(&lh->lock, flags);
+}
+
+static bytes locked_heap_allocated(heap h)
+{
+    return heap_allocated(((locked_heap)h)->parent);
+}
+
+static bytes locked_heap_total(heap h)
+{
+    return heap_total(((locked_heap)h)->parent);
+}
+
+closure_function(1, 1, u64, locked_heap_shrink,
+                 locked_heap, lh,
+                 u64, bytes)
+{
+    locked_heap lh = bound(lh);
+    u64 flags = spin_lock_irq(&lh->lock);
+    u64 released = mcache_drain(lh->parent, bytes);
+    spin_unlock_irq(&lh->lock, flags);
+    return released;
+}
+
+heap allocate_locked_heap(kernel_heaps kh)
+{
+    heap h = heap_general(kh);
+    heap p = (heap)heap_physical(kh);
+    u64 base = allocate_u64((heap)heap_virtual_huge(kh), LOCKED_HEAP_SIZE);
+    if (base == INVALID_PHYSICAL)
+        return INVALID_ADDRESS;
+    id_heap v = create_id_heap(h, h, base, LOCKED_HEAP_SIZE, PAGESIZE_2M);
+    if (v == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+
+    /* touch the last page of the region, so that the bitmap is extended
+       to cover all of it now */
+    u64 last = base + LOCKED_HEAP_SIZE - PAGESIZE_2M;
+    assert(id_heap_set_area(v, last, PAGESIZE_2M, true, true));
+    assert(id_heap_set_area(v, last, PAGESIZE_2M, true, false));
+
+    heap backed = physically_backed(h, (heap)v, p, p->pagesize);
+    if (backed == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+    heap m = allocate_mcache(h, backed, 5, 20, PAGESIZE_2M);
+    if (m == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+
+    locked_heap lh = allocate(h, sizeof(struct locked_heap));
+    if (lh == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+    lh->h.alloc = locked_heap_alloc;
+    lh->h.dealloc = locked_heap_dealloc;
+    lh->h.destroy = 0;
+    lh->h.allocated = locked_heap_allocated;
+    lh->h.total = locked_heap_total;
+    lh->h.pagesize = m->pagesize;
+    lh->parent = m;
+    spin_lock_init(&lh->lock);
+
+    /* unused pages are released under the lock, unlike mm_register_mcache() */
+    shrinker s = closure(h, locked_heap_shrink, lh);
+    assert(s != INVALID_ADDRESS);
+    mm_register_shrinker(s);
+    return (heap)lh;
+}
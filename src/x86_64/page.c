@@ -340,6 +340,53 @@ static boolean recurse_ptes(u64 pbase, int level, u64 vstart, u64 len, u64 laddr
     return true;
 }
 
+#ifndef BOOT
+/* called with lock held */
+static boolean split_huge_page_locked(u64 vaddr)
+{
+    if ((vaddr & MASK(PAGELOG_2M)) == 0)
+        return true;
+    vaddr &= MASK(VIRTUAL_ADDRESS_BITS);
+    u64 l3 = page_lookup(pagebase(), vaddr, PT1);
+    if (!l3)
+        return true;
+    u64 l2 = page_lookup(l3, vaddr, PT2);
+    if (!l2)
+        return true;
+    u64 *pde = pte_lookup_ptr(l2, vaddr, PT3);
+    u64 e = *pde;
+    if (!pt_entry_is_present(e) || !pt_entry_is_fat(3, e))
+        return true;
+
+    u64 *t = allocate_zero(pageheap, PAGESIZE);
+    if (t == INVALID_ADDRESS)
+        return false;
+    u64 phys = page_from_pte(e);
+    u64 flags = flags_from_pte(e) & ~PAGE_2M_SIZE;
+    for (int i = 0; i < PTE_ENTRIES; i++)
+        t[i] = (phys + (i << PAGELOG)) | flags;
+#ifdef PAGE_UPDATE_DEBUG
+    page_debug("split 2M page at 0x%lx, phys 0x%lx, flags 0x%lx\n", vaddr, phys, flags);
+#endif
+    *pde = pteaddr_from_pointer(t) | PAGE_WRITABLE | PAGE_USER | PAGE_PRESENT;
+    page_invalidate(vaddr & ~MASK(PAGELOG_2M), ignore);
+    return true;
+}
+
+/* Replace any 2M mappings that straddle the edges of the given range
+   with equivalent 4K mappings, so that the range may be operated on
+   page by page. Huge pages wholly within the range are left intact. */
+static void split_huge_pages(u64 vaddr, u64 length)
+{
+    pagetable_lock();
+    if (!split_huge_page_locked(vaddr) || !split_huge_page_locked(vaddr + length))
+        halt("%s: ran out of page table memory\n", __func__);
+    pagetable_unlock();
+}
+#else
+#define split_huge_pages(vaddr, length)
+#endif
+
 boolean traverse_ptes(u64 vaddr, u64 length, entry_handler ph)
 {
 #ifdef TRAVERSE_PTES_DEBUG
@@ -391,9 +438,35 @@ void update_map_flags(u64 vaddr, u64 length, u64 flags)
 {
     flags &= ~PAGE_NO_FAT;
     page_debug("vaddr 0x%lx, length 0x%lx, flags 0x%lx\n", vaddr, length, flags);
+    split_huge_pages(vaddr, length);
     traverse_ptes(vaddr, length, stack_closure(update_pte_flags, flags));
 }
 
+#ifndef BOOT
+/* called with lock held */
+closure_function(1, 3, boolean, clear_dirty_pte,
+                 boolean *, dirty,
+                 int, level, u64, addr, u64 *, entry)
+{
+    if (pt_entry_is_present(*entry) && pt_entry_is_pte(level, *entry) &&
+        atomic_test_and_clear_bit(entry, PAGE_DIRTY_BIT)) {
+        /* drop the dirty state cached in the tlb so that the next write sets it again */
+        page_invalidate(addr, ignore);
+        *bound(dirty) = true;
+    }
+    return true;
+}
+
+/* Clear the dirty bit of any pages mapped within the area, returning
+   true if any were dirty */
+boolean test_and_clear_dirty(u64 vaddr, u64 length)
+{
+    boolean dirty = false;
+    traverse_ptes(vaddr, length, stack_closure(clear_dirty_pte, &dirty));
+    return dirty;
+}
+#endif
+
 /* called with lock held */
 closure_function(2, 3, boolean, remap_entry,
                  u64, new, u64, old,
@@ -413,8 +486,15 @@ closure_function(2, 3, boolean, remap_entry,
     if (!pt_entry_is_present(oldentry) || !pt_entry_is_pte(level, oldentry))
         return true;
 
-    /* transpose mapped page */
-    map_page(pagebase(), new_curr, phys, pt_entry_is_fat(level, oldentry), flags, 0);
+    /* transpose mapped page; a 2M page landing off a 2M boundary is
+       mapped as 4K pages instead */
+    if (pt_entry_is_fat(level, oldentry) && (new_curr & MASK(PAGELOG_2M))) {
+        flags &= ~PAGE_2M_SIZE;
+        for (u64 off = 0; off < PAGESIZE_2M; off += PAGESIZE)
+            map_page(pagebase(), new_curr + off, phys + off, false, flags, 0);
+    } else {
+        map_page(pagebase(), new_curr, phys, pt_entry_is_fat(level, oldentry), flags, 0);
+    }
 
     /* reset old entry */
     *entry = 0;
@@ -438,6 +518,7 @@ void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length)
         return;
     assert(range_empty(range_intersection(irange(vaddr_new, vaddr_new + length),
                                           irange(vaddr_old, vaddr_old + length))));
+    split_huge_pages(vaddr_old, length);
     traverse_ptes(vaddr_old, length, stack_closure(remap_entry, vaddr_new, vaddr_old));
 }
 
@@ -458,6 +539,7 @@ closure_function(0, 3, boolean, zero_page,
 
 void zero_mapped_pages(u64 vaddr, u64 length)
 {
+    split_huge_pages(vaddr, length);
     traverse_ptes(vaddr, length, stack_closure(zero_page));
 }
 
@@ -489,9 +571,67 @@ closure_function(1, 3, boolean, unmap_page,
 void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
 {
     assert(!((virtual & PAGEMASK) || (length & PAGEMASK)));
+    split_huge_pages(virtual, length);
     traverse_ptes(virtual, length, stack_closure(unmap_page, rh));
 }
 
+#ifndef BOOT
+/* Return whether nothing is mapped within the 2M block at vaddr. A
+   page table under the block is returned in table, if there is one. */
+static boolean huge_page_block_free_locked(u64 vaddr, u64 **table)
+{
+    u64 v = vaddr & MASK(VIRTUAL_ADDRESS_BITS);
+    u64 l3 = page_lookup(pagebase(), v, PT1);
+    u64 l2 = l3 ? page_lookup(l3, v, PT2) : 0;
+    *table = 0;
+    if (!l2)
+        return true;
+    u64 e = *pte_lookup_ptr(l2, v, PT3);
+    if (!pt_entry_is_present(e))
+        return true;
+    if (pt_entry_is_fat(3, e))
+        return false;
+    u64 *t = pointer_from_pteaddr(page_from_pte(e));
+    for (int i = 0; i < PTE_ENTRIES; i++) {
+        if (pt_entry_is_present(t[i]))
+            return false;
+    }
+    *table = t;
+    return true;
+}
+
+/* Return whether a 2M page could be mapped at vaddr, so that a caller
+   need not allocate and clear one which map_huge_page() would refuse. */
+boolean huge_page_block_free(u64 vaddr)
+{
+    assert(!(vaddr & MASK(PAGELOG_2M)));
+    u64 *table;
+    pagetable_lock();
+    boolean result = huge_page_block_free_locked(vaddr, &table);
+    pagetable_unlock();
+    return result;
+}
+
+/* Map a 2M page at vaddr, provided that nothing is mapped within its
+   range yet; returns false otherwise. A page table left empty by
+   earlier 4K mappings in the range is released. */
+boolean map_huge_page(u64 vaddr, physical p, u64 flags)
+{
+    assert(!((vaddr & MASK(PAGELOG_2M)) || (p & MASK(PAGELOG_2M))));
+    boolean result = false;
+    u64 *table;
+    pagetable_lock();
+    if (!huge_page_block_free_locked(vaddr, &table))
+        goto out;
+    result = map_page(pagebase(), vaddr, p, true, (flags & ~PAGE_NO_FAT) | PAGE_PRESENT, 0);
+    if (result && table)
+        deallocate(pageheap, table, PAGESIZE);
+  out:
+    pagetable_unlock();
+    return result;
+}
+#endif
+
 // error processing
 static void map_range(u64 virtual, physical p, u64 length, u64 flags)
 {
@@ -4,6 +4,7 @@
 #define PAGE_NO_FAT        0x0200 /* AVL[0] */
 #define PAGE_2M_SIZE       0x0080
 #define PAGE_DIRTY         0x0040
+#define PAGE_DIRTY_BIT     6
 #define PAGE_ACCESSED      0x0020
 #define PAGE_CACHE_DISABLE 0x0010
 #define PAGE_WRITETHROUGH  0x0008
@@ -39,6 +40,8 @@ void map(u64 virtual, physical p, u64 length, u64 flags);
 void unmap(u64 virtual, u64 length);
 void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh);
 void unmap_and_free_phys(u64 virtual, u64 length);
+boolean huge_page_block_free(u64 vaddr);
+boolean map_huge_page(u64 vaddr, physical p, u64 flags);
 
 static inline void unmap_pages(u64 virtual, u64 length)
 {
@@ -46,6 +49,7 @@ static inline void unmap_pages(u64 virtual, u64 length)
 }
 
 void update_map_flags(u64 vaddr, u64 length, u64 flags);
+boolean test_and_clear_dirty(u64 vaddr, u64 length);
 void zero_mapped_pages(u64 vaddr, u64 length);
 void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length);
 
@@ -56,6 +60,13 @@ typedef closure_type(entry_handler, boolean /* success */, int /* level */,
 boolean traverse_ptes(u64 vaddr, u64 length, entry_handler eh);
 void page_invalidate(u64 p, thunk completion);
 void flush_tlb();
+
+/* invalidate a page on the current cpu only */
+static inline void page_invalidate_local(u64 page)
+{
+    asm volatile("invlpg (%0)" :: "r" (page) : "memory");
+}
+
 void init_flush();
 #ifdef STAGE3
 id_heap init_page_tables(heap h, id_heap physical, range initial_map);
@@ -1,6 +1,5 @@
 /* TODO:
-   - per node flush and purge
-   - reinstate free list, keep refault counts
+   - per node purge
    - interface to physical free page list / shootdown epochs
 
    - would be nice to propagate a priority alone with requests to
@@ -72,30 +71,52 @@ static inline void pagelist_touch(pagelist pl, pagecache_page pp)
     list_insert_before(&pl->l, &pp->l);
 }
 
+static inline pagelist ghost_list(pagecache pc, pagecache_page pp)
+{
+    return pp->ghost_active ? &pc->ghost_active : &pc->ghost_new;
+}
+
+/* Bracket changes which a lockless lookup of the node could observe;
+   see pages_seq. Removals and evictions are made under state_lock
+   rather than pages_lock, so the count is bumped atomically. */
+static inline void pages_write_begin(pagecache_node pn)
+{
+    fetch_and_add(&pn->pages_seq, 1);
+}
+
+static inline void pages_write_end(pagecache_node pn)
+{
+    fetch_and_add(&pn->pages_seq, 1);
+}
+
 static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int state)
 {
     int old_state = page_state(pp);
     switch (state) {
-#if 0
-    /* Temporarily disabling use of free until we have a scheme to
-       keep and act on "refault" data */
     case PAGECACHE_PAGESTATE_FREE:
-        assert(old_state == PAGECACHE_PAGESTATE_EVICTED);
-        pagelist_enqueue(&pc->free, pp);
-        break;
-#endif
-    case PAGECACHE_PAGESTATE_EVICTED:
+        /* caller releases the page memory, and sets ghost_active */
         if (old_state == PAGECACHE_PAGESTATE_NEW) {
             pagelist_remove(&pc->new, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_ACTIVE);
             pagelist_remove(&pc->active, pp);
         }
+        pagelist_enqueue(ghost_list(pc, pp), pp);
+        break;
+    case PAGECACHE_PAGESTATE_EVICTED:
+        if (old_state == PAGECACHE_PAGESTATE_NEW) {
+            pagelist_remove(&pc->new, pp);
+        } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
+            pagelist_remove(&pc->active, pp);
+        } else {
+            assert(old_state == PAGECACHE_PAGESTATE_FREE);
+            pagelist_remove(ghost_list(pc, pp), pp);
+        }
         /* caller must do release following state change to evicted */
         break;
     case PAGECACHE_PAGESTATE_ALLOC:
         assert(old_state == PAGECACHE_PAGESTATE_FREE);
-        pagelist_remove(&pc->free, pp);
+        pagelist_remove(ghost_list(pc, pp), pp);
         break;
     case PAGECACHE_PAGESTATE_READING:
         assert(old_state == PAGECACHE_PAGESTATE_ALLOC);
@@ -105,6 +126,8 @@ static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int
             pagelist_move(&pc->writing, &pc->new, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
             pagelist_move(&pc->writing, &pc->active, pp);
+        } else if (old_state == PAGECACHE_PAGESTATE_DIRTY) {
+            pagelist_move(&pc->writing, &pc->dirty, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_WRITING) {
             /* write already pending, move to tail of queue */
             pagelist_touch(&pc->writing, pp);
@@ -119,14 +142,37 @@ static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int
             pagelist_move(&pc->new, &pc->active, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_WRITING) {
             pagelist_move(&pc->new, &pc->writing, pp);
+        } else if (old_state == PAGECACHE_PAGESTATE_DIRTY) {
+            /* dirty page beyond end of node; nothing to write */
+            pagelist_move(&pc->new, &pc->dirty, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_READING);
             pagelist_enqueue(&pc->new, pp);
         }
         break;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        assert(old_state == PAGECACHE_PAGESTATE_NEW);
-        pagelist_move(&pc->active, &pc->new, pp);
+        if (old_state == PAGECACHE_PAGESTATE_READING) {
+            /* refilled after eviction */
+            pagelist_enqueue(&pc->active, pp);
+        } else {
+            assert(old_state == PAGECACHE_PAGESTATE_NEW);
+            pagelist_move(&pc->active, &pc->new, pp);
+        }
+        pp->refs = 0;
+        break;
+    case PAGECACHE_PAGESTATE_DIRTY:
+        if (old_state == PAGECACHE_PAGESTATE_NEW) {
+            pagelist_move(&pc->dirty, &pc->new, pp);
+        } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
+            pagelist_move(&pc->dirty, &pc->active, pp);
+        } else if (old_state == PAGECACHE_PAGESTATE_ALLOC) {
+            /* new page for an append held back from storage */
+            pagelist_enqueue(&pc->dirty, pp);
+        } else {
+            /* redirtied while a write is in flight */
+            assert(old_state == PAGECACHE_PAGESTATE_WRITING);
+            pagelist_move(&pc->dirty, &pc->writing, pp);
+        }
         break;
     default:
         halt("%s: bad state %d, old %d\n", __func__, state, old_state);
@@ -197,7 +243,9 @@ closure_function(3, 1, void, pagecache_read_page_complete,
         msg_err("error reading page 0x%lx: %v\n", page_offset(pp) << pc->page_order, s);
     }
     spin_lock(&pc->state_lock);
-    change_page_state_locked(bound(pc), pp, PAGECACHE_PAGESTATE_NEW);
+    change_page_state_locked(bound(pc), pp, pp->refault ? PAGECACHE_PAGESTATE_ACTIVE :
+                             PAGECACHE_PAGESTATE_NEW);
+    pp->refault = false;
     pagecache_page_queue_completions_locked(pc, pp, s);
     spin_unlock(&pc->state_lock);
     sg_list_release(bound(sg));
@@ -213,6 +261,42 @@ static void enqueue_page_completion_statelocked(pagecache pc, pagecache_page pp,
     vector_push(pp->completions, sh);
 }
 
+/* Count a hit on a page which is in the cache, or being read into it,
+   and move it along the page lists. */
+static void touch_page_locked(pagecache pc, pagecache_page pp)
+{
+    /* The first touch of a page read ahead is the access it was read
+       for, so it doesn't count as a reuse. */
+    boolean first_use = pp->readahead;
+    if (first_use) {
+        pp->readahead = false;
+        pc->stats.readahead_hits++;
+    } else {
+        pc->stats.hits++;
+    }
+    switch (page_state(pp)) {
+    case PAGECACHE_PAGESTATE_ACTIVE:
+        /* move to bottom of active list */
+        pagelist_touch(&pc->active, pp);
+        if (pp->refs < PAGECACHE_PAGE_REFS_MAX)
+            pp->refs++;
+        break;
+    case PAGECACHE_PAGESTATE_NEW:
+        /* cache hit -> active */
+        if (first_use)
+            pagelist_touch(&pc->new, pp);
+        else
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        break;
+    case PAGECACHE_PAGESTATE_READING:
+    case PAGECACHE_PAGESTATE_WRITING:
+    case PAGECACHE_PAGESTATE_DIRTY:
+        break;
+    default:
+        halt("%s: invalid state %d\n", __func__, page_state(pp));
+    }
+}
+
 static void touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page pp, merge m)
 {
     pagecache_volume pv = pn->pv;
@@ -220,10 +304,11 @@ static void touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page pp,
     spin_lock(&pc->state_lock);
     pagecache_debug("%s: pn %p, pp %p, m %p, state %d\n", __func__, pn, pp, m, page_state(pp));
     switch (page_state(pp)) {
-    case PAGECACHE_PAGESTATE_READING:
-        enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
-        break;
     case PAGECACHE_PAGESTATE_ALLOC:
+        if (pp->readahead)
+            pc->stats.readahead++;
+        else
+            pc->stats.misses++;
         enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_READING);
         spin_unlock(&pc->state_lock);
@@ -242,24 +327,40 @@ static void touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page pp,
         apply(pn->fs_read, sg, r,
               closure(pc->h, pagecache_read_page_complete, pc, pp, sg));
         return;
-    case PAGECACHE_PAGESTATE_ACTIVE:
-        /* move to bottom of active list */
-        list_delete(&pp->l);
-        list_insert_before(&pc->active.l, &pp->l);
-        break;
-    case PAGECACHE_PAGESTATE_NEW:
-        /* cache hit -> active */
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
-        break;
-    case PAGECACHE_PAGESTATE_WRITING:
-    case PAGECACHE_PAGESTATE_DIRTY:
+    case PAGECACHE_PAGESTATE_READING:
+        touch_page_locked(pc, pp);
+        enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
         break;
     default:
-        halt("%s: invalid state %d\n", __func__, page_state(pp));
+        touch_page_locked(pc, pp);
     }
     spin_unlock(&pc->state_lock);
 }
 
+/* Apply the hits queued in t. Pages evicted in the meantime are
+   skipped; page structures are never freed, so they remain safe to
+   look at. */
+static void flush_touches_locked(pagecache pc, pagecache_touches t)
+{
+    spin_lock(&t->lock);
+    for (u64 i = 0; i < t->count; i++) {
+        pagecache_page pp = t->pages[i];
+        int state = page_state(pp);
+        if (state != PAGECACHE_PAGESTATE_FREE && state != PAGECACHE_PAGESTATE_EVICTED &&
+            state != PAGECACHE_PAGESTATE_ALLOC)
+            touch_page_locked(pc, pp);
+    }
+    t->count = 0;
+    spin_unlock(&t->lock);
+}
+
+static void flush_all_touches_locked(pagecache pc)
+{
+    for (int i = 0; i < MAX_CPUS; i++)
+        if (pc->touches[i].count > 0)
+            flush_touches_locked(pc, &pc->touches[i]);
+}
+
 define_closure_function(2, 0, void, pagecache_page_free,
                         pagecache, pc, pagecache_page, pp)
 {
@@ -269,7 +370,10 @@ define_closure_function(2, 0, void, pagecache_page_free,
     if (state != PAGECACHE_PAGESTATE_EVICTED)
         halt("%s: pc %p, pp %p, invalid state %d\n", __func__, bound(pc), pp, page_state(pp));
 
+    /* a ghost has already given up its page */
     pagecache pc = bound(pc);
+    if (!pp->kvirt)
+        return;
     deallocate(pc->contiguous, pp->kvirt, cache_pagesize(pc));
     u64 pre = fetch_and_add(&pc->total_pages, -1);
     assert(pre > 0);
@@ -294,12 +398,19 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
     assert((offset >> PAGECACHE_PAGESTATE_SHIFT) == 0);
     pp->state_offset = ((u64)PAGECACHE_PAGESTATE_ALLOC << PAGECACHE_PAGESTATE_SHIFT) | offset;
     pp->write_count = 0;
+    pp->map_count = 0;
     pp->kvirt = p;
     pp->node = pn;
     pp->l.next = pp->l.prev = 0;
     pp->phys = physical_from_virtual(p);
     pp->completions = 0;
+    pp->readahead = false;
+    pp->refault = false;
+    pp->ghost_active = false;
+    pp->refs = 0;
+    pages_write_begin(pn);
     assert(rbtree_insert_node(&pn->pages, &pp->rbnode));
+    pages_write_end(pn);
     fetch_and_add(&pc->total_pages, 1); /* decrement happens without cache lock */
     return pp;
   fail_dealloc_contiguous:
@@ -307,45 +418,131 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
     return INVALID_ADDRESS;
 }
 
+/* Give a ghost page memory again, to be filled as a newly allocated
+   page would be. A read on demand means the page was evicted too
+   soon: the target for the new list moves towards the list it was
+   evicted from, by the ratio of the ghost list sizes, and the page
+   goes to active once filled. */
+static boolean refill_page_nodelocked(pagecache_node pn, pagecache_page pp, boolean demand)
+{
+    pagecache pc = pn->pv->pc;
+    void *p = allocate(pc->contiguous, cache_pagesize(pc));
+    if (p == INVALID_ADDRESS)
+        return false;
+    spin_lock(&pc->state_lock);
+    if (demand) {
+        u64 b1 = pc->ghost_new.pages, b2 = pc->ghost_active.pages;
+        if (pp->ghost_active) {
+            u64 d = MAX(b1 / b2, 1);
+            pc->new_target = pc->new_target > d ? pc->new_target - d : 0;
+        } else {
+            u64 d = MAX(b2 / b1, 1);
+            pc->new_target = MIN(pc->new_target + d, pc->total_pages);
+        }
+        pc->stats.refaults++;
+        pp->refault = true;
+    }
+    change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ALLOC);
+    spin_unlock(&pc->state_lock);
+    pagecache_debug("%s: pp %R, demand %d, new target %ld\n", __func__,
+                    byte_range_from_page(pc, pp), demand, pc->new_target);
+    pp->kvirt = p;
+    pp->phys = physical_from_virtual(p);
+    fetch_and_add(&pc->total_pages, 1);
+    return true;
+}
+
+/* Return the page at index n of pn, given the lookup pp, allocating it
+   or refilling its ghost if it is not resident. Overwriting a whole
+   page isn't a read on demand. */
+static pagecache_page resident_page_nodelocked(pagecache_node pn, pagecache_page pp, u64 n,
+                                               boolean demand)
+{
+    if (pp == INVALID_ADDRESS || page_offset(pp) != n)
+        return allocate_page_nodelocked(pn, n);
+    if (page_state(pp) == PAGECACHE_PAGESTATE_FREE && !refill_page_nodelocked(pn, pp, demand))
+        return INVALID_ADDRESS;
+    return pp;
+}
+
 #ifndef PAGECACHE_READ_ONLY
-static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, u64 pages)
+static void drop_ghost_locked(pagecache pc, pagecache_page pp)
 {
-    u64 evicted = 0;
-    list_foreach(&pl->l, l) {
-        if (evicted >= pages)
-            break;
+    pagecache_debug("%s: pp %R\n", __func__, byte_range_from_page(pc, pp));
+    change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_EVICTED);
+    pages_write_begin(pp->node);
+    rbtree_remove_node(&pp->node->pages, &pp->rbnode);
+    pages_write_end(pp->node);
+    refcount_release(&pp->refcount);
+}
 
-        pagecache_page pp = struct_from_list(l, pagecache_page, l);
-        pagecache_debug("%s: list %s, release pp %R, state %d, count %ld\n", __func__,
-                        pl == &pc->new ? "new" : "active", byte_range_from_page(pc, pp),
-                        page_state(pp), pp->refcount.c);
+/* Keep ghosts of pages evicted from new to no more than the resident
+   pages less those on new, and all ghosts to no more than the resident
+   pages. */
+static void trim_ghosts_locked(pagecache pc)
+{
+    while (pc->ghost_new.pages + pc->ghost_active.pages > pc->total_pages) {
+        pagelist pl = pc->ghost_active.pages == 0 ||
+            (pc->ghost_new.pages > 0 && pc->new.pages + pc->ghost_new.pages > pc->total_pages) ?
+            &pc->ghost_new : &pc->ghost_active;
+        drop_ghost_locked(pc, struct_from_list(list_begin(&pl->l), pagecache_page, l));
+    }
+}
+
+static void evict_page_locked(pagecache pc, pagecache_page pp)
+{
+    pagecache_debug("%s: release pp %R, state %d, count %ld\n", __func__,
+                    byte_range_from_page(pc, pp), page_state(pp), pp->refcount.c);
+    pagecache_node pn = pp->node;
+    if (pp->readahead) {
+        /* read ahead too far for the memory there is */
+        pc->stats.readahead_wasted++;
+        pn->ra_window = MAX(pn->ra_window / 2, PAGECACHE_READAHEAD_MIN_PAGES);
+        pp->readahead = false;
+    }
+    pp->refault = false;
+    pages_write_begin(pn);
+    if (pp->refcount.c > 1) {
+        /* in use elsewhere; let the last user free it */
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_EVICTED);
-        rbtree_remove_node(&pp->node->pages, &pp->rbnode);
+        rbtree_remove_node(&pn->pages, &pp->rbnode);
+        pages_write_end(pn);
         refcount_release(&pp->refcount); /* eviction, as far as cache is concerned */
-        evicted++;
+        return;
     }
-    return evicted;
+    pp->ghost_active = page_state(pp) == PAGECACHE_PAGESTATE_ACTIVE;
+    change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_FREE);
+    pages_write_end(pn);
+    deallocate(pc->contiguous, pp->kvirt, cache_pagesize(pc));
+    pp->kvirt = 0;
+    pp->phys = INVALID_PHYSICAL;
+    fetch_and_add(&pc->total_pages, -1);
 }
 
-static void balance_page_lists_locked(pagecache pc)
+/* Evict up to pages pages from the head of pl. Active pages hit since
+   the last pass are given another at the tail instead. */
+static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, u64 pages)
 {
-    /* balance active and new lists */
-    s64 dp = ((s64)pc->active.pages - (s64)pc->new.pages) / 2;
-    pagecache_debug("%s: active %ld, new %ld, dp %ld\n", __func__, pc->active.pages, pc->new.pages, dp);
-    list_foreach(&pc->active.l, l) {
-        if (dp <= 0)
+    u64 evicted = 0;
+    u64 scan = pl->pages;
+    list_foreach(&pl->l, l) {
+        if (evicted >= pages || scan-- == 0)
             break;
+
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
-        /* We don't presently have a notion of "time" in the cache, so
-           just cull unreferenced buffers in LRU fashion until active
-           pages are equivalent to new...loosely inspired by linux
-           approach. */
-        if (pp->refcount.c == 1) {
-            pagecache_debug("   pp %R -> new\n", byte_range_from_page(pc, pp));
-            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
-            dp--;
+
+        /* pages mapped into user space stay until unmapped */
+        if (pp->map_count > 0)
+            continue;
+        if (pp->refs > 0) {
+            pp->refs--;
+            pagelist_touch(pl, pp);
+            continue;
         }
+        evict_page_locked(pc, pp);
+        evicted++;
     }
+    return evicted;
 }
 
 static pagecache_page page_lookup_nodelocked(pagecache_node pn, u64 n)
@@ -355,21 +552,101 @@ static pagecache_page page_lookup_nodelocked(pagecache_node pn, u64 n)
     return (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
 }
 
+/* Start filling the pages of pn from pi to end which are not in the
+   cache, with completions going to m. Returns the number of pages for
+   which reads were issued. */
+static u64 readahead_pages_nodelocked(pagecache_node pn, u64 pi, u64 end, merge m)
+{
+    u64 issued = 0;
+    for (; pi < end; pi++) {
+        pagecache_page pp = page_lookup_nodelocked(pn, pi);
+        if (pp == INVALID_ADDRESS)
+            pp = allocate_page_nodelocked(pn, pi);
+        else if (page_state(pp) != PAGECACHE_PAGESTATE_FREE)
+            continue;
+        else if (!refill_page_nodelocked(pn, pp, false))
+            pp = INVALID_ADDRESS;
+        if (pp == INVALID_ADDRESS)
+            break;
+        pp->readahead = true;
+        touch_or_fill_page_nodelocked(pn, pp, m);
+        issued++;
+    }
+    return issued;
+}
+
+/* Called with the byte range q of a read of pn, ending at page end.
+   A read that continues the previous one extends the readahead once
+   less than half a window remains ahead of it; any other read resets
+   the window. If the read missed, pages read ahead have been evicted
+   or were never issued, so readahead starts over from the read. */
+static void readahead_sequential_nodelocked(pagecache_node pn, range q, u64 end, boolean missed)
+{
+    pagecache pc = pn->pv->pc;
+    boolean sequential = q.start == pn->ra_next;
+    pn->ra_next = q.end;
+    if (!sequential) {
+        pn->ra_window = PAGECACHE_READAHEAD_MIN_PAGES;
+        pn->ra_end = end;
+        return;
+    }
+    pn->ra_end = missed ? end : MAX(pn->ra_end, end);
+    if (pn->ra_end - end > pn->ra_window / 2)
+        return;
+    u64 ra_end = MIN(pn->ra_end + pn->ra_window,
+                     (pn->length + cache_pagesize(pc) - 1) >> pc->page_order);
+    if (ra_end <= pn->ra_end)
+        return;
+    pagecache_debug("%s: pn %p, q %R, pages [0x%lx, 0x%lx)\n", __func__, pn, q, pn->ra_end, ra_end);
+    merge m = allocate_merge(pc->h, ignore_status);
+    status_handler sh = apply_merge(m);
+    readahead_pages_nodelocked(pn, pn->ra_end, ra_end, m);
+    pn->ra_end = ra_end;
+    pn->ra_window = MIN(pn->ra_window * 2, PAGECACHE_READAHEAD_MAX_PAGES);
+    apply(sh, STATUS_OK);
+}
+
 static void touch_page_by_num_nodelocked(pagecache_node pn, u64 n, merge m)
 {
-    pagecache_page pp = page_lookup_nodelocked(pn, n);
+    pagecache_page pp = resident_page_nodelocked(pn, page_lookup_nodelocked(pn, n), n, true);
     if (pp == INVALID_ADDRESS) {
-        pp = allocate_page_nodelocked(pn, n);
-        if (pp == INVALID_ADDRESS) {
-            apply(apply_merge(m), timm("result", "failed to allocate pagecache_page"));
-            return;
-        }
+        apply(apply_merge(m), timm("result", "failed to allocate pagecache_page"));
+        return;
     }
     touch_or_fill_page_nodelocked(pn, pp, m);
 }
 
-closure_function(5, 1, void, pagecache_write_sg_finish,
-                 pagecache_node, pn, range, q, sg_list, sg, status_handler, completion, boolean, complete,
+/* Account for the completion of a write covering q. A page that was
+   dirtied again while the write was in flight is left on the dirty
+   list. */
+static void write_pages_complete_nodelocked(pagecache_node pn, range q, status s)
+{
+    pagecache pc = pn->pv->pc;
+    u64 pi = q.start >> pc->page_order;
+    u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    pagecache_page pp = page_lookup_nodelocked(pn, pi);
+    do {
+        assert(pp != INVALID_ADDRESS && page_offset(pp) == pi);
+        spin_lock(&pc->state_lock);
+        assert(pp->write_count > 0);
+        if (pp->write_count-- == 1) {
+            if (page_state(pp) == PAGECACHE_PAGESTATE_WRITING)
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
+            pagecache_page_queue_completions_locked(pc, pp, s);
+        }
+        spin_unlock(&pc->state_lock);
+        pi++;
+        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+    } while (pi < end);
+}
+
+static void pagecache_schedule_writeback(pagecache_volume pv);
+
+/* Writes are passed on to the filesystem as they come, except for
+   appends, which are left dirty in the cache so that storage may be
+   allocated for many of them at once on writeback. */
+closure_function(6, 1, void, pagecache_write_sg_finish,
+                 pagecache_node, pn, range, q, sg_list, sg, status_handler, completion, boolean, append, boolean, complete,
                  status, s)
 {
     pagecache_node pn = bound(pn);
@@ -409,18 +686,7 @@ closure_function(5, 1, void, pagecache_write_sg_finish,
             pn->pv->write_error = s;
         }
 
-        do {
-            assert(pp != INVALID_ADDRESS && page_offset(pp) == pi);
-            spin_lock(&pc->state_lock);
-            assert(pp->write_count > 0);
-            if (pp->write_count-- == 1) {
-                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
-                pagecache_page_queue_completions_locked(pc, pp, s);
-            }
-            spin_unlock(&pc->state_lock);
-            pi++;
-            pp = (pagecache_page)rbnode_get_next((rbnode)pp);
-        } while (pi < end);
+        write_pages_complete_nodelocked(pn, q, s);
         spin_unlock(&pn->pages_lock);
         closure_finish();
         return;
@@ -431,7 +697,7 @@ closure_function(5, 1, void, pagecache_write_sg_finish,
     u64 block_offset = q.start & MASK(block_order);
     range r = irange(q.start & ~MASK(block_order), q.end);
     sg_list write_sg;
-    if (sg) {
+    if (sg && !bound(append)) {
         write_sg = allocate_sg_list();
         if (write_sg == INVALID_ADDRESS) {
             spin_unlock(&pn->pages_lock);
@@ -443,9 +709,10 @@ closure_function(5, 1, void, pagecache_write_sg_finish,
         write_sg = 0;
     }
     do {
-        if (pp == INVALID_ADDRESS || page_offset(pp) > pi) {
+        if (pp == INVALID_ADDRESS || page_offset(pp) > pi ||
+            page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
             assert(offset == 0 && block_offset == 0); /* should never alloc for unaligned head */
-            pp = allocate_page_nodelocked(pn, pi);
+            pp = resident_page_nodelocked(pn, pp, pi, false);
             if (pp == INVALID_ADDRESS) {
                 spin_unlock(&pn->pages_lock);
                 apply(bound(completion), timm("result", "failed to allocate pagecache_page"));
@@ -480,13 +747,24 @@ closure_function(5, 1, void, pagecache_write_sg_finish,
             sgb->size = sgb->offset + req_len;
             sgb->refcount = &pp->refcount;
             refcount_reserve(sgb->refcount);
+        }
+        if (sg) {
             u64 res = sg_copy_to_buf(pp->kvirt + offset, sg, copy_len);
             assert(res == copy_len);
         } else {
             zero(pp->kvirt + offset, copy_len);
         }
         spin_lock(&pc->state_lock);
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
+        if (bound(append)) {
+            if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_DIRTY);
+        } else if (page_state(pp) == PAGECACHE_PAGESTATE_DIRTY) {
+            /* The write may not cover the whole page, so leave it
+               for writeback; just account for this request. */
+            pp->write_count++;
+        } else {
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
+        }
         spin_unlock(&pc->state_lock);
         offset = 0;
         block_offset = 0;
@@ -495,6 +773,13 @@ closure_function(5, 1, void, pagecache_write_sg_finish,
     } while (pi < end);
     spin_unlock(&pn->pages_lock);
 
+    if (bound(append)) {
+        pagecache_schedule_writeback(pn->pv);
+        apply(bound(completion), STATUS_OK);
+        closure_finish();
+        return;
+    }
+
     /* issue write */
     bound(complete) = true;
     pagecache_debug("   calling fs_write, range %R, sg %p\n", r, write_sg);
@@ -524,12 +809,16 @@ closure_function(1, 3, void, pagecache_write_sg,
         return;
     }
 
+    /* writes from the start of the last page on are appends */
+    boolean append = sg && q.start >= (pn->length & ~MASK(pc->page_order));
+
     /* extend node length if writing past current end */
     if (q.end > pn->length)
         pn->length = q.end;
 
     /* prepare pages for writing */
-    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_write_sg_finish, pn, q, sg, completion, false));
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_write_sg_finish, pn, q, sg, completion,
+                                            append, false));
     status_handler sh = apply_merge(m);
 
     /* initiate reads for rmw start and/or end */
@@ -560,17 +849,21 @@ closure_function(1, 3, void, pagecache_write_sg,
     apply(sh, STATUS_OK);
 }
 
-/* evict pages from new and active lists, then rebalance */
+/* Evict from new while it is over its target, then from active, then
+   from what is left of new. */
 static u64 evict_pages_locked(pagecache pc, u64 pages)
 {
-    u64 evicted = evict_from_list_locked(pc, &pc->new, pages);
-    if (evicted < pages) {
-        /* To fill the requested pages evictions, we are more
-           aggressive here, evicting even in-use pages (rc > 1) in the
-           active list. */
+    u64 evicted = 0;
+    if (pc->new.pages > pc->new_target)
+        evicted = evict_from_list_locked(pc, &pc->new, MIN(pages, pc->new.pages - pc->new_target));
+    if (evicted < pages)
         evicted += evict_from_list_locked(pc, &pc->active, pages - evicted);
-    }
-    balance_page_lists_locked(pc);
+    if (evicted < pages)
+        evicted += evict_from_list_locked(pc, &pc->new, pages - evicted);
+    trim_ghosts_locked(pc);
+    pagecache_debug("%s: evicted %ld, new %ld, target %ld, active %ld, ghosts %ld/%ld\n", __func__,
+                    evicted, pc->new.pages, pc->new_target, pc->active.pages,
+                    pc->ghost_new.pages, pc->ghost_active.pages);
     return evicted;
 }
 
@@ -578,38 +871,414 @@ u64 pagecache_drain(pagecache pc, u64 drain_bytes)
 {
     u64 pages = pad(drain_bytes, cache_pagesize(pc)) >> pc->page_order;
 
-    /* We could avoid taking both locks here if we keep drained page
-       objects around (which incidentally could be useful to keep
-       refault data). */
+    /* Ghosts are dropped from the search tree here too, so both
+       locks are needed. */
 
     // XXX TODO This is a race issue on SMP now ... the locking scheme here needs to be rehashed
 //    spin_lock(&pc->pages_lock);
     spin_lock(&pc->state_lock);
+    /* credit queued hits before choosing pages to evict */
+    flush_all_touches_locked(pc);
     u64 evicted = evict_pages_locked(pc, pages);
     spin_unlock(&pc->state_lock);
 //    spin_unlock(&pc->pages_lock);
     return evicted << pc->page_order;
 }
 
-void pagecache_sync_volume(pagecache_volume pv, status_handler complete)
+closure_function(3, 1, void, pagecache_writeback_complete,
+                 pagecache_node, pn, range, q, sg_list, sg,
+                 status, s)
 {
-    pagecache_debug("%s: broken, redo!\n", __func__);
-    pagecache pc = pv->pc;
-    assert(complete);
+    pagecache_node pn = bound(pn);
+    pagecache_debug("%s: pn %p, q %R, status %v\n", __func__, pn, bound(q), s);
+    if (!is_ok(s)) {
+        /* see comment in pagecache_write_sg_finish */
+        msg_err("error writing back pages %R: %v\n", bound(q), s);
+        pn->pv->write_error = s;
+    }
+    spin_lock(&pn->pages_lock);
+    write_pages_complete_nodelocked(pn, bound(q), s);
+    spin_unlock(&pn->pages_lock);
+    sg_list_release(bound(sg));
+    deallocate_sg_list(bound(sg));
+    closure_finish();
+}
 
-    pagecache_page pp = 0;
-    /* If writes are pending, tack completion onto the mostly recently written page. */
+/* The sync set is the pages of pn within byte range q, or the pages
+   of any node in pv if pn is zero. */
+static inline boolean page_in_sync_set(pagecache pc, pagecache_page pp, pagecache_volume pv,
+                                       pagecache_node pn, range q)
+{
+    return pn ? pp->node == pn && ranges_intersect(byte_range_from_page(pc, pp), q) :
+        pp->node->pv == pv;
+}
+
+/* Issue writes for dirty pages in the sync set. Runs of contiguous
+   pages on the dirty list are coalesced into a single request. */
+static void pagecache_writeback(pagecache_volume pv, pagecache_node pn, range sync_range)
+{
+    pagecache pc = pv->pc;
+    u64 pagesize = cache_pagesize(pc);
     spin_lock(&pc->state_lock);
-    if (!list_empty(&pc->writing.l)) {
-        list l = pc->writing.l.prev;
-        pp = struct_from_list(l, pagecache_page, l);
-        enqueue_page_completion_statelocked(pc, pp, complete);
+    while (1) {
+        pagecache_node wn = 0;
+        sg_list sg = 0;
+        range q = irange(0, 0);
+        list_foreach(&pc->dirty.l, l) {
+            pagecache_page pp = struct_from_list(l, pagecache_page, l);
+            range r = byte_range_from_page(pc, pp);
+            if (sg) {
+                if (pp->node != wn || r.start != q.end ||
+                    !page_in_sync_set(pc, pp, pv, pn, sync_range))
+                    break;
+            } else if (!page_in_sync_set(pc, pp, pv, pn, sync_range)) {
+                continue;
+            }
+
+            /* mapped pages may lie past a truncated end of node */
+            r.end = MIN(r.end, pp->node->length);
+            if (r.start >= r.end) {
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
+                continue;
+            }
+            if (!sg) {
+                sg = allocate_sg_list();
+                if (sg == INVALID_ADDRESS) {
+                    msg_err("failed to allocate writeback sg\n");
+                    spin_unlock(&pc->state_lock);
+                    return;
+                }
+                wn = pp->node;
+                q.start = r.start;
+            }
+            q.end = r.end;
+
+            /* as with writes past the end of a node, the remainder of
+               the last block must be zero */
+            u64 len = range_span(r);
+            if (len < pagesize)
+                zero(pp->kvirt + len, pagesize - len);
+            u64 req_len = pad(len, U64_FROM_BIT(pv->block_order));
+            sg_buf sgb = sg_list_tail_add(sg, req_len);
+            sgb->buf = pp->kvirt;
+            sgb->offset = 0;
+            sgb->size = req_len;
+            sgb->refcount = &pp->refcount;
+            refcount_reserve(sgb->refcount);
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
+            if (len < pagesize)
+                break;
+        }
+        if (!sg)
+            break;
         spin_unlock(&pc->state_lock);
+        pagecache_debug("%s: pn %p, writing %R\n", __func__, wn, q);
+        apply(wn->fs_write, sg, q, closure(pc->h, pagecache_writeback_complete, wn, q, sg));
+        spin_lock(&pc->state_lock);
+    }
+    spin_unlock(&pc->state_lock);
+}
+
+#ifdef STAGE3
+closure_function(1, 1, void, pagecache_writeback_timer_expired,
+                 pagecache_volume, pv,
+                 u64, overruns /* ignored */)
+{
+    bound(pv)->writeback_timer = 0;
+    pagecache_writeback(bound(pv), 0, irange(0, infinity));
+    closure_finish();
+}
+#endif
+
+/* Dirty pages are written back after a delay, or at once if too much
+   of the cache is dirty, as they can't be evicted until then. */
+static void pagecache_schedule_writeback(pagecache_volume pv)
+{
+    pagecache pc = pv->pc;
+    if (pc->dirty.pages >= PAGECACHE_DIRTY_MAX_PAGES) {
+        pagecache_writeback(pv, 0, irange(0, infinity));
         return;
     }
+#ifdef STAGE3
+    if (!pv->writeback_timer)
+        pv->writeback_timer = register_timer(runloop_timers, CLOCK_ID_MONOTONIC,
+                                             seconds(PAGECACHE_WRITEBACK_DELAY_SECONDS), false, 0,
+                                             closure(pc->h, pagecache_writeback_timer_expired, pv));
+#endif
+}
+
+/* Start writing back every dirty page in the cache, without waiting,
+   so that the pages may be evicted once written. */
+void pagecache_start_writeback(pagecache pc)
+{
+    if (pc->dirty.pages == 0)
+        return;
+    pagecache_debug("%s: %ld dirty pages\n", __func__, pc->dirty.pages);
+    list_foreach(&pc->volumes, l)
+        pagecache_writeback(struct_from_list(l, pagecache_volume, l), 0, irange(0, infinity));
+}
+
+/* Write back dirty pages in the sync set, if write is set, and apply
+   complete (if any) once all writes pending for the set have
+   finished. */
+static void pagecache_sync_internal(pagecache_volume pv, pagecache_node pn, range q,
+                                    boolean write, status_handler complete)
+{
+    pagecache pc = pv->pc;
+    assert(write || complete);
+    if (write)
+        pagecache_writeback(pv, pn, q);
+    if (!complete)
+        return;
+
+    merge m = allocate_merge(pc->h, complete);
+    status_handler sh = apply_merge(m);
+    spin_lock(&pc->state_lock);
+    list_foreach(&pc->writing.l, l) {
+        pagecache_page pp = struct_from_list(l, pagecache_page, l);
+        if (page_in_sync_set(pc, pp, pv, pn, q))
+            enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
+    }
+    spin_unlock(&pc->state_lock);
+    apply(sh, STATUS_OK);
+}
+
+void pagecache_sync_volume(pagecache_volume pv, status_handler complete)
+{
+    pagecache_debug("%s: pv %p, complete %F\n", __func__, pv, complete);
+    pagecache_sync_internal(pv, 0, irange(0, infinity), true, complete);
+}
+
+void pagecache_sync_node(pagecache_node pn, status_handler complete)
+{
+    pagecache_debug("%s: pn %p, complete %F\n", __func__, pn, complete);
+    pagecache_sync_internal(pn->pv, pn, irange(0, infinity), true, complete);
+}
+
+void pagecache_sync_node_range(pagecache_node pn, range q, boolean write, status_handler complete)
+{
+    pagecache_debug("%s: pn %p, q %R, write %d, complete %F\n", __func__, pn, q, write, complete);
+    pagecache_sync_internal(pn->pv, pn, q, write, complete);
+}
+
+#ifdef STAGE3
+/* If phys is valid, map it and fill it with a copy of the page
+   contents. Otherwise map the cache page itself; the mapping holds a
+   reference and keeps the page from being evicted until it is removed
+   with pagecache_unmap_pages(). */
+static void map_page_nodelocked(pagecache pc, pagecache_page pp, u64 vaddr, u64 flags, u64 phys)
+{
+    u64 pagesize = cache_pagesize(pc);
+    if (phys != INVALID_PHYSICAL) {
+        map(vaddr, phys, pagesize, flags);
+        runtime_memcpy(pointer_from_u64(vaddr), pp->kvirt, pagesize);
+        return;
+    }
+
+    /* a fault on another cpu may have beaten us to it */
+    if (physical_from_virtual(pointer_from_u64(vaddr)) == pp->phys)
+        return;
+    spin_lock(&pc->state_lock);
+    pp->map_count++;
+    spin_unlock(&pc->state_lock);
+    refcount_reserve(&pp->refcount);
+    map(vaddr, pp->phys, pagesize, flags);
+}
+
+closure_function(6, 1, void, pagecache_map_page_complete,
+                 pagecache_node, pn, pagecache_page, pp, u64, vaddr, u64, flags, u64, phys, status_handler, complete,
+                 status, s)
+{
+    pagecache_node pn = bound(pn);
+    pagecache_page pp = bound(pp);
+    pagecache pc = pn->pv->pc;
+    status_handler complete = bound(complete);
+    pagecache_debug("%s: pn %p, pp %p, vaddr 0x%lx, status %v\n", __func__, pn, pp, bound(vaddr), s);
+
+    if (is_ok(s)) {
+        spin_lock(&pn->pages_lock);
+        spin_lock(&pc->state_lock);
+        boolean evicted = page_state(pp) == PAGECACHE_PAGESTATE_EVICTED;
+        spin_unlock(&pc->state_lock);
+        if (evicted) {
+            /* reclaimed before we could map it; start over */
+            spin_unlock(&pn->pages_lock);
+            if (pagecache_map_page(pn, page_offset(pp) << pc->page_order, bound(vaddr),
+                                   bound(flags), bound(phys), complete))
+                apply(complete, STATUS_OK);
+            goto out;
+        }
+        map_page_nodelocked(pc, pp, bound(vaddr), bound(flags), bound(phys));
+        spin_unlock(&pn->pages_lock);
+    }
+    apply(complete, s);
+  out:
+    refcount_release(&pp->refcount);
+    closure_finish();
+}
+
+/* Map the page at node_offset to vaddr (see map_page_nodelocked). If
+   the page is resident, the mapping is made immediately and true is
+   returned. Otherwise false is returned and a fill is started; unless
+   complete is zero, the page is mapped once filled and complete is
+   applied then (or once the page has failed to fill). */
+boolean pagecache_map_page(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags,
+                           u64 phys, status_handler complete)
+{
+    pagecache pc = pn->pv->pc;
+    u64 pi = node_offset >> pc->page_order;
+    pagecache_debug("%s: pn %p, offset 0x%lx, vaddr 0x%lx, flags 0x%lx, phys 0x%lx\n",
+                    __func__, pn, node_offset, vaddr, flags, phys);
+    spin_lock(&pn->pages_lock);
+    pagecache_page pp = resident_page_nodelocked(pn, page_lookup_nodelocked(pn, pi), pi, true);
+    if (pp == INVALID_ADDRESS) {
+        spin_unlock(&pn->pages_lock);
+        if (complete)
+            apply(complete, timm("result", "failed to allocate pagecache_page"));
+        return false;
+    }
+
+    spin_lock(&pc->state_lock);
+    int state = page_state(pp);
     spin_unlock(&pc->state_lock);
-    apply(complete, STATUS_OK);
+    if (state != PAGECACHE_PAGESTATE_ALLOC && state != PAGECACHE_PAGESTATE_READING) {
+        touch_or_fill_page_nodelocked(pn, pp, 0);
+        map_page_nodelocked(pc, pp, vaddr, flags, phys);
+        spin_unlock(&pn->pages_lock);
+        return true;
+    }
+
+    if (!complete) {
+        if (state == PAGECACHE_PAGESTATE_ALLOC)
+            touch_or_fill_page_nodelocked(pn, pp, allocate_merge(pc->h, ignore_status));
+        spin_unlock(&pn->pages_lock);
+        return false;
+    }
+
+    /* hold the page until the fill completes */
+    refcount_reserve(&pp->refcount);
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_map_page_complete,
+                                            pn, pp, vaddr, flags, phys, complete));
+    status_handler sh = apply_merge(m);
+    touch_or_fill_page_nodelocked(pn, pp, m);
+    spin_unlock(&pn->pages_lock);
+    apply(sh, STATUS_OK);
+    return false;
+}
+
+/* Map the resident pages of pn within the virtual range v, which maps
+   the node starting at node_offset, wherever no page is mapped yet.
+   Pages being filled are skipped rather than waited on, and nothing is
+   allocated. Returns the number of pages mapped. */
+u64 pagecache_map_resident(pagecache_node pn, range v, u64 node_offset, u64 flags)
+{
+    pagecache pc = pn->pv->pc;
+    struct pagecache_page k;
+    k.state_offset = node_offset >> pc->page_order;
+    u64 end = MIN(k.state_offset + (range_span(v) >> pc->page_order),
+                  (pn->length + cache_pagesize(pc) - 1) >> pc->page_order);
+    u64 mapped = 0;
+    pagecache_debug("%s: pn %p, v %R, offset 0x%lx\n", __func__, pn, v, node_offset);
+
+    spin_lock(&pn->pages_lock);
+    pagecache_page pp = (pagecache_page)rbtree_lookup_max_lte(&pn->pages, &k.rbnode);
+    if (pp == INVALID_ADDRESS)
+        pp = (pagecache_page)rbtree_find_first(&pn->pages);
+    else if (page_offset(pp) < k.state_offset)
+        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+    while (pp != INVALID_ADDRESS && page_offset(pp) < end) {
+        u64 vaddr = v.start + ((page_offset(pp) - k.state_offset) << pc->page_order);
+        spin_lock(&pc->state_lock);
+        int state = page_state(pp);
+        spin_unlock(&pc->state_lock);
+        if (state != PAGECACHE_PAGESTATE_FREE && state != PAGECACHE_PAGESTATE_ALLOC &&
+            state != PAGECACHE_PAGESTATE_READING &&
+            physical_from_virtual(pointer_from_u64(vaddr)) == INVALID_PHYSICAL) {
+            map_page_nodelocked(pc, pp, vaddr, flags, INVALID_PHYSICAL);
+            mapped++;
+        }
+        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+    }
+    spin_unlock(&pn->pages_lock);
+    return mapped;
+}
+
+/* Start filling the pages of pn within the byte range q that are not
+   yet in the cache, without waiting for them. Returns the number of
+   pages for which reads were issued. */
+u64 pagecache_readahead(pagecache_node pn, range q)
+{
+    pagecache pc = pn->pv->pc;
+    u64 pi = q.start >> pc->page_order;
+    u64 end = (MIN(q.end, pn->length) + cache_pagesize(pc) - 1) >> pc->page_order;
+    if (pi >= end)
+        return 0;
+    pagecache_debug("%s: pn %p, q %R\n", __func__, pn, q);
+
+    merge m = allocate_merge(pc->h, ignore_status);
+    status_handler sh = apply_merge(m);
+    spin_lock(&pn->pages_lock);
+    u64 issued = readahead_pages_nodelocked(pn, pi, end, m);
+    spin_unlock(&pn->pages_lock);
+    apply(sh, STATUS_OK);
+    return issued;
 }
+
+/* Visit the pages of pn that are mapped by pagecache_map_page()
+   within the virtual range v, which maps the node starting at
+   node_offset. The dirty state of each mapping is moved to the page,
+   and, if release is set, the mapping is removed. Other pages in the
+   range are left alone. */
+static void scan_mapped_pages(pagecache_node pn, range v, u64 node_offset, boolean release)
+{
+    pagecache pc = pn->pv->pc;
+    struct pagecache_page k;
+    k.state_offset = node_offset >> pc->page_order;
+    u64 end = k.state_offset + (range_span(v) >> pc->page_order);
+    pagecache_debug("%s: pn %p, v %R, offset 0x%lx, release %d\n", __func__, pn, v, node_offset, release);
+
+    spin_lock(&pn->pages_lock);
+    pagecache_page pp = (pagecache_page)rbtree_lookup_max_lte(&pn->pages, &k.rbnode);
+    if (pp == INVALID_ADDRESS)
+        pp = (pagecache_page)rbtree_find_first(&pn->pages);
+    else if (page_offset(pp) < k.state_offset)
+        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+    while (pp != INVALID_ADDRESS && page_offset(pp) < end) {
+        u64 vaddr = v.start + ((page_offset(pp) - k.state_offset) << pc->page_order);
+        if (pp->map_count > 0 &&
+            physical_from_virtual(pointer_from_u64(vaddr)) == pp->phys) {
+            boolean dirty = test_and_clear_dirty(vaddr, cache_pagesize(pc));
+            if (release)
+                unmap(vaddr, cache_pagesize(pc));
+            spin_lock(&pc->state_lock);
+            if (dirty && page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_DIRTY);
+            if (release)
+                pp->map_count--;
+            spin_unlock(&pc->state_lock);
+            if (release)
+                refcount_release(&pp->refcount);
+        }
+        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+    }
+    spin_unlock(&pn->pages_lock);
+}
+
+/* Remove any mappings of cache pages made by pagecache_map_page()
+   within the virtual range v, which maps the node starting at
+   node_offset. Pages written through the mappings become dirty. */
+void pagecache_unmap_pages(pagecache_node pn, range v, u64 node_offset)
+{
+    scan_mapped_pages(pn, v, node_offset, true);
+}
+
+/* Mark pages written through mappings within v as dirty, to be
+   written back by a subsequent sync. */
+void pagecache_collect_dirty(pagecache_node pn, range v, u64 node_offset)
+{
+    scan_mapped_pages(pn, v, node_offset, false);
+}
+#endif
 #endif /* !PAGECACHE_READ_ONLY */
 
 closure_function(1, 3, void, pagecache_read_sg,
@@ -627,11 +1296,14 @@ closure_function(1, 3, void, pagecache_read_sg,
         q.end = pn->length;
     k.state_offset = q.start >> pc->page_order;
     u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    boolean missed = false;
     spin_lock(&pn->pages_lock);
     pagecache_page pp = (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
     for (u64 pi = k.state_offset; pi < end; pi++) {
-        if (pp == INVALID_ADDRESS || page_offset(pp) > pi) {
-            pp = allocate_page_nodelocked(pn, pi);
+        if (pp == INVALID_ADDRESS || page_offset(pp) > pi ||
+            page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
+            missed = true;
+            pp = resident_page_nodelocked(pn, pp, pi, true);
             if (pp == INVALID_ADDRESS) {
                 spin_unlock(&pn->pages_lock);
                 apply(apply_merge(m), timm("result", "failed to allocate pagecache_page"));
@@ -652,12 +1324,170 @@ closure_function(1, 3, void, pagecache_read_sg,
         touch_or_fill_page_nodelocked(pn, pp, m);
         pp = (pagecache_page)rbnode_get_next((rbnode)pp);
     }
+#ifndef PAGECACHE_READ_ONLY
+    if (q.start < q.end)
+        readahead_sequential_nodelocked(pn, q, end, missed);
+#else
+    (void)missed;
+#endif
     spin_unlock(&pn->pages_lock);
 
     /* finished issuing requests */
     apply(sh, STATUS_OK);
 }
 
+#ifndef PAGECACHE_READ_ONLY
+/* bound on the pages a read may cover and still take the resident fast path */
+#define PAGECACHE_READ_RESIDENT_MAX_PAGES 16
+
+/* a red-black tree of 2^64 nodes is no deeper than this */
+#define PAGECACHE_LOOKUP_MAX_DEPTH 128
+
+#ifdef STAGE3
+static inline int touches_cpu(void)
+{
+    return current_cpu()->id;
+}
+#else
+__thread int pagecache_cpu;
+
+static inline int touches_cpu(void)
+{
+    return pagecache_cpu;
+}
+#endif
+
+/* Queue a hit on pp on this cpu, applying the batch once it fills. */
+static void queue_touch(pagecache pc, pagecache_page pp)
+{
+    pagecache_touches t = &pc->touches[touches_cpu()];
+    spin_lock(&t->lock);
+    t->pages[t->count++] = pp;
+    boolean full = t->count == PAGECACHE_TOUCH_BATCH;
+    spin_unlock(&t->lock);
+    if (full) {
+        spin_lock(&pc->state_lock);
+        flush_touches_locked(pc, t);
+        spin_unlock(&pc->state_lock);
+    }
+}
+
+/* Look up page n of pn without pages_lock. The tree may be changing
+   underneath, so the walk is bounded and the result is only good if
+   pages_seq is unchanged afterwards. */
+static pagecache_page page_lookup_lockless(pagecache_node pn, u64 n)
+{
+    rbnode h = *(rbnode volatile *)&pn->pages.root;
+    for (int depth = 0; h && depth < PAGECACHE_LOOKUP_MAX_DEPTH; depth++) {
+        u64 offset = page_offset((pagecache_page)h);
+        if (n == offset)
+            return (pagecache_page)h;
+        h = *(rbnode volatile *)&h->c[n < offset ? 0 : 1];
+    }
+    return INVALID_ADDRESS;
+}
+
+/* Take a reference on a page found by a lockless lookup, unless its
+   last one has already gone. */
+static boolean page_reserve_lockless(pagecache_page pp)
+{
+    word c;
+    do {
+        c = *(volatile word *)&pp->refcount.c;
+        if (c == 0)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&pp->refcount.c, c, c + 1));
+    return true;
+}
+
+/* Copy the byte range q of pn, clipped to the node length, to dest if
+   every page it covers is resident and filled. Nothing is allocated
+   and nothing is waited on; if any page is missing or still being
+   read, or q spans more than PAGECACHE_READ_RESIDENT_MAX_PAGES pages,
+   zero is returned and the caller should take the regular read path.
+
+   No locks are taken: the pages are looked up locklessly, with the
+   lookup abandoned for the regular path if the node changed meanwhile,
+   and the hits are queued to be applied in a batch. A reference is
+   held on each page across the copy, taken before pages_seq is checked
+   again: an eviction either sees it and leaves the memory to the last
+   release, or has moved pages_seq on and the lookup is abandoned. The
+   caller must have faulted dest in (see fault_in_user_memory), as a
+   fault which abandons the copy would leak the references. */
+u64 pagecache_read_resident(pagecache_node pn, void *dest, range q)
+{
+    pagecache pc = pn->pv->pc;
+    pagecache_page pages[PAGECACHE_READ_RESIDENT_MAX_PAGES];
+    if (q.end > pn->length)
+        q.end = pn->length;
+    if (q.start >= q.end)
+        return 0;
+    u64 start = q.start >> pc->page_order;
+    u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    if (end - start > PAGECACHE_READ_RESIDENT_MAX_PAGES)
+        return 0;
+
+    word seq = *(volatile word *)&pn->pages_seq;
+    if (seq & 1)
+        return 0;
+    read_barrier();
+    int n = 0;
+    for (u64 pi = start; pi < end; pi++) {
+        pagecache_page pp = page_lookup_lockless(pn, pi);
+        if (pp == INVALID_ADDRESS)
+            break;
+        int state = page_state(pp);
+        if (state == PAGECACHE_PAGESTATE_FREE || state == PAGECACHE_PAGESTATE_EVICTED ||
+            state == PAGECACHE_PAGESTATE_ALLOC || state == PAGECACHE_PAGESTATE_READING)
+            break;
+        if (!page_reserve_lockless(pp))
+            break;
+        pages[n++] = pp;
+    }
+    /* the reservations are locked operations, ordered before this load
+       as the pages_seq bump in evict_page_locked is before its count check */
+    if (n < end - start || *(volatile word *)&pn->pages_seq != seq) {
+        for (int i = 0; i < n; i++)
+            refcount_release(&pages[i]->refcount);
+        return 0;
+    }
+    for (int i = 0; i < n; i++)
+        queue_touch(pc, pages[i]);
+
+    for (int i = 0; i < n; i++) {
+        range r = byte_range_from_page(pc, pages[i]);
+        range ri = range_intersection(q, r);
+        runtime_memcpy(dest + (ri.start - q.start), pages[i]->kvirt + (ri.start - r.start),
+                       range_span(ri));
+        refcount_release(&pages[i]->refcount);
+    }
+    return range_span(q);
+}
+
+/* Carry a sequential run through a read of q which was served by
+   pagecache_read_resident(), as pagecache_read_sg() would have (see
+   readahead_sequential_nodelocked). Until a read comes within half a
+   window of the end of what has been read ahead, only ra_next moves,
+   which no reader other than the run's own would touch, so pages_lock
+   is left alone for most reads. */
+void pagecache_readahead_resident(pagecache_node pn, range q)
+{
+    pagecache pc = pn->pv->pc;
+    if (q.end > pn->length)
+        q.end = pn->length;
+    if (q.start >= q.end || q.start != pn->ra_next)
+        return;
+    u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    if (pn->ra_end > end && pn->ra_end - end > pn->ra_window / 2) {
+        pn->ra_next = q.end;
+        return;
+    }
+    spin_lock(&pn->pages_lock);
+    readahead_sequential_nodelocked(pn, q, end, false);
+    spin_unlock(&pn->pages_lock);
+}
+#endif
+
 closure_function(1, 1, boolean, pagecache_page_print_key,
                  pagecache, pc,
                  rbnode, n)
@@ -674,11 +1504,24 @@ closure_function(0, 2, int, pagecache_page_compare,
     return oa == ob ? 0 : (oa < ob ? -1 : 1);
 }
 
+void pagecache_get_stats(pagecache pc, struct pagecache_stats *stats)
+{
+    spin_lock(&pc->state_lock);
+    flush_all_touches_locked(pc);
+    *stats = pc->stats;
+    spin_unlock(&pc->state_lock);
+}
+
 void pagecache_set_node_length(pagecache_node pn, u64 length)
 {
     pn->length = length;
 }
 
+u64 pagecache_node_get_length(pagecache_node pn)
+{
+    return pn->length;
+}
+
 void pagecache_deallocate_node(pagecache_node pn)
 {
     /* TODO: We probably need to add a refcount to the node with a
@@ -713,9 +1556,13 @@ pagecache_node pagecache_allocate_node(pagecache_volume pv, sg_io fs_read, sg_io
     list_insert_before(&pv->nodes, &pn->l);
     pn->pv = pv;
     spin_lock_init(&pn->pages_lock);
+    pn->pages_seq = 0;
     init_rbtree(&pn->pages, closure(h, pagecache_page_compare),
                 closure(h, pagecache_page_print_key, pv->pc));
     pn->length = 0;
+    pn->ra_next = 0;
+    pn->ra_end = 0;
+    pn->ra_window = PAGECACHE_READAHEAD_MIN_PAGES;
     pn->cache_read = closure(h, pagecache_read_sg, pn);
 #ifndef PAGECACHE_READ_ONLY
     pn->cache_write = closure(h, pagecache_write_sg, pn);
@@ -727,13 +1574,6 @@ pagecache_node pagecache_allocate_node(pagecache_volume pv, sg_io fs_read, sg_io
     return pn;
 }
 
-// XXX TODO
-void pagecache_sync_node(pagecache_node pn, status_handler sh)
-{
-    /* nop */
-    apply(sh, STATUS_OK);
-}
-
 void *pagecache_get_zero_page(pagecache pc)
 {
     return pc->zero_page;
@@ -755,6 +1595,7 @@ pagecache_volume pagecache_allocate_volume(pagecache pc, u64 length, int block_o
     pv->length = length;
     pv->block_order = block_order;
     pv->write_error = STATUS_OK;
+    pv->writeback_timer = 0;
     return pv;
 }
 
@@ -783,12 +1624,19 @@ pagecache allocate_pagecache(heap general, heap contiguous, u64 pagesize)
     }
 
     spin_lock_init(&pc->state_lock);
-    page_list_init(&pc->free);
+    page_list_init(&pc->ghost_new);
+    page_list_init(&pc->ghost_active);
     page_list_init(&pc->new);
     page_list_init(&pc->active);
     page_list_init(&pc->writing);
     page_list_init(&pc->dirty);
     list_init(&pc->volumes);
+    pc->new_target = 0;
+    zero(&pc->stats, sizeof(pc->stats));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&pc->touches[i].lock);
+        pc->touches[i].count = 0;
+    }
 
 #ifdef STAGE3
     pc->completion_vecs = allocate_queue(general, MAX_PAGE_COMPLETION_VECS);
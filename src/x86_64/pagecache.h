@@ -4,12 +4,32 @@ typedef struct pagecache_volume *pagecache_volume;
 
 typedef struct pagecache_node *pagecache_node;
 
+/* page counts since the cache was allocated */
+struct pagecache_stats {
+    u64 hits;                   /* found in the cache */
+    u64 misses;                 /* filled on demand */
+    u64 readahead;              /* filled ahead of sequential reads */
+    u64 readahead_hits;         /* ...and then read */
+    u64 readahead_wasted;       /* ...and evicted without being read */
+    u64 refaults;               /* misses on pages remembered as evicted */
+};
+
+void pagecache_get_stats(pagecache pc, struct pagecache_stats *stats);
+
 void pagecache_set_node_length(pagecache_node pn, u64 length);
 
+u64 pagecache_node_get_length(pagecache_node pn);
+
 void pagecache_sync_node(pagecache_node pn, status_handler sh);
 
+/* Write back (if write) dirty pages of pn within byte range q, and
+   apply sh (if given) once pending writes within q have completed. */
+void pagecache_sync_node_range(pagecache_node pn, range q, boolean write, status_handler sh);
+
 void pagecache_sync_volume(pagecache_volume pv, status_handler sh);
 
+void pagecache_start_writeback(pagecache pc);
+
 void *pagecache_get_zero_page(pagecache pc);
 
 int pagecache_get_page_order(pagecache pc);
@@ -26,8 +46,23 @@ void pagecache_deallocate_node(pagecache_node pn);
 
 sg_io pagecache_node_get_reader(pagecache_node pn);
 
+u64 pagecache_read_resident(pagecache_node pn, void *dest, range q);
+
+void pagecache_readahead_resident(pagecache_node pn, range q);
+
 sg_io pagecache_node_get_writer(pagecache_node pn);
 
+boolean pagecache_map_page(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags,
+                           u64 phys, status_handler complete);
+
+void pagecache_unmap_pages(pagecache_node pn, range v, u64 node_offset);
+
+void pagecache_collect_dirty(pagecache_node pn, range v, u64 node_offset);
+
+u64 pagecache_map_resident(pagecache_node pn, range v, u64 node_offset, u64 flags);
+
+u64 pagecache_readahead(pagecache_node pn, range q);
+
 pagecache_volume pagecache_allocate_volume(pagecache pc, u64 length, int block_order);
 
 pagecache allocate_pagecache(heap general, heap contiguous, u64 pagesize);
@@ -1,8 +1,42 @@
+/* Appends are held in the cache up to this long or until this many
+   pages are dirty. */
+#define PAGECACHE_WRITEBACK_DELAY_SECONDS   5
+#define PAGECACHE_DIRTY_MAX_PAGES           2048
+
+/* Sequential reads of a node are followed by reads ahead of them, in a
+   window which doubles with each batch up to the maximum and is halved
+   whenever pages read ahead are evicted before use. */
+#define PAGECACHE_READAHEAD_MIN_PAGES       4
+#define PAGECACHE_READAHEAD_MAX_PAGES       256
+
+/* Replacement follows ARC: pages read once sit on the new list and
+   pages hit since on the active list. Evicted pages that nothing else
+   holds are kept in the node search tree without their data, as
+   ghosts, and a read that finds one moves the target size of the new
+   list towards the list it was evicted from. Ghosts are bounded by
+   the number of resident pages. Active pages carry a count of recent
+   hits, each of which buys another pass over the list before
+   eviction. */
+#define PAGECACHE_PAGE_REFS_MAX             3
+
+/* Hits on pages found by the lockless read path are queued on the
+   current cpu and applied to the page lists a batch at a time, rather
+   than taking state_lock for each. */
+#define PAGECACHE_TOUCH_BATCH               32
+
 typedef struct pagelist {
     struct list l;
     u64 pages;
 } *pagelist;
 
+typedef struct pagecache_page *pagecache_page;
+
+typedef struct pagecache_touches {
+    struct spinlock lock;       /* taken elsewhere only to flush */
+    u64 count;
+    pagecache_page pages[PAGECACHE_TOUCH_BATCH];
+} *pagecache_touches;
+
 typedef struct pagecache {
     word total_pages;
     int page_order;
@@ -13,12 +47,18 @@ typedef struct pagecache {
     /* state_lock covers list access, page state changes and
        alterations to page completion vecs */
     struct spinlock state_lock;
-    struct pagelist free;      /* see state descriptions */
+    struct pagelist ghost_new;      /* free pages evicted from new */
+    struct pagelist ghost_active;   /* ...and from active */
     struct pagelist new;
     struct pagelist active;
     struct pagelist writing;
     struct pagelist dirty;     /* phase 2 */
     struct list volumes;
+    u64 new_target;             /* pages, adapted on ghost hits */
+    struct pagecache_stats stats;
+
+    /* per cpu, flushed under state_lock */
+    struct pagecache_touches touches[MAX_CPUS];
 
     /* not under lock */
     queue completion_vecs;
@@ -33,18 +73,27 @@ typedef struct pagecache_volume {
     u64 length;                 /* end of volume */
     int block_order;
     status write_error;         /* pending error from a previous write */
+    timer writeback_timer;      /* for appends held in the cache */
 } *pagecache_volume;
 
 typedef struct pagecache_node {
     struct list l;              /* volume-wide node list */
     pagecache_volume pv;
 
-    /* pages_lock covers traversal, insertions and removals - consider
-       changing to a rw lock or semaphore */
+    /* pages_lock covers traversal, insertions and removals. Lookups
+       may also be made without it, and validated against pages_seq,
+       which is odd while the tree or the residency of its pages is
+       being changed. */
     struct spinlock pages_lock;
     struct rbtree pages;
+    word pages_seq;
     u64 length;
 
+    /* readahead state, under pages_lock */
+    u64 ra_next;                /* byte offset following the last read */
+    u64 ra_end;                 /* page index past those read ahead */
+    u64 ra_window;              /* pages */
+
     sg_io cache_read;
     sg_io cache_write;
     sg_io fs_read;
@@ -62,8 +111,6 @@ typedef struct pagecache_node {
 #define PAGECACHE_PAGESTATE_DIRTY   6 /* page not synced */
 #define PAGECACHE_PAGESTATE_WRITING 7 /* block writes in progress; back to tail of new on completion */
 
-typedef struct pagecache_page *pagecache_page;
-
 declare_closure_struct(2, 0, void, pagecache_page_free,
                        pagecache, pc, pagecache_page, pp);
 
@@ -73,16 +120,26 @@ struct pagecache_page {
     u64 state_offset;           /* 40 - state and offset in pages */
     void *kvirt;                /* 48 */
     int write_count;            /* 56 */
-    int pad0;                   /* 60 */
+    int map_count;              /* 60 - user mappings; pins page in cache */
     /* end of first cacheline */
 
     pagecache_node node;
     struct list l;
     u64 phys;                   /* physical address */
     vector completions;         /* status_handlers */
+    boolean readahead;          /* filled ahead of use and not yet touched */
+    boolean refault;            /* refilled from a ghost; goes to active */
+    boolean ghost_active;       /* free page was evicted from active */
+    u8 refs;                    /* hits while active, see PAGECACHE_PAGE_REFS_MAX */
     closure_struct(pagecache_page_free, free);
 };
 
+#ifndef STAGE3
+/* outside of the kernel, threads reading the cache set their own
+   index into the touch batches */
+extern __thread int pagecache_cpu;
+#endif
+
 static inline void pagecache_release_page(pagecache_page pp)
 {
     refcount_release(&pp->refcount);
@@ -244,11 +244,19 @@ void pci_enable_msix(pci_dev dev)
     pci_cfgwrite(dev, cp + 2, 2, ctrl);
 }
 
-void msi_format(u32 *address, u32 *data, int vector)
+int pci_get_msix_count(pci_dev dev)
+{
+    u32 cp = pci_find_cap(dev, PCIY_MSIX);
+    if (cp == 0)
+        return 0;
+    return (pci_cfgread(dev, cp + 2, 2) & 0x7ff) + 1;
+}
+
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu)
 {
     u32 dm = 0;             // destination mode: ignored if rh == 0
     u32 rh = 0;             // redirection hint: 0 - disabled
-    u32 destination = 0;    // destination APIC
+    u32 destination = target_cpu;    // destination APIC
     *address = (0xfee << 20) | (destination << 12) | (rh << 3) | (dm << 2);
 
     u32 mode = 0;           // delivery mode: 000 fixed, 001 lowest, 010 smi, 100 nmi, 101 init, 111 extint
@@ -265,7 +273,7 @@ void pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
 
     u32 a, d;
     u32 vector_control = 0;
-    msi_format(&a, &d, v);
+    msi_format(&a, &d, v, 0);
 
     dev->msix_table[msi_slot*4] = a;
     dev->msix_table[msi_slot*4 + 1] = 0;
@@ -273,6 +281,20 @@ void pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
     dev->msix_table[msi_slot*4 + 3] = vector_control;
 }
 
+/* Redirect an MSI-X table entry set up by pci_setup_msix to another cpu.
+   The entry is masked while the address is rewritten. */
+void pci_set_msix_target(pci_dev dev, int msi_slot, u32 target_cpu)
+{
+    u32 a, d;
+    msi_format(&a, &d, dev->msix_table[msi_slot*4 + 2] & 0xff, target_cpu);
+    pci_debug("%s: msi %d: cpu %d\n", __func__, msi_slot, target_cpu);
+
+    dev->msix_table[msi_slot*4 + 3] |= 1;
+    dev->msix_table[msi_slot*4] = a;
+    dev->msix_table[msi_slot*4 + 1] = 0;
+    dev->msix_table[msi_slot*4 + 3] &= ~1;
+}
+
 void register_pci_driver(pci_probe probe)
 {
     struct pci_driver *d = allocate(drivers->h, sizeof(struct pci_driver));
@@ -121,6 +121,8 @@ void pci_discover();
 void pci_set_bus_master(pci_dev dev);
 void pci_enable_msix(pci_dev dev);
 void pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name);
+void pci_set_msix_target(pci_dev dev, int msi_slot, u32 target_cpu);
+int pci_get_msix_count(pci_dev dev);
 
 /* PCI config header registers for all devices */
 #define PCIR_COMMAND 0x04
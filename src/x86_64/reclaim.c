@@ -0,0 +1,145 @@
+/* memory reclaim
+
+   Free physical memory is checked on each pass of the runloop. Once it
+   falls below the high watermark, dirty data is sent to storage, so
+   that it can be evicted by the time it must be. Below the low
+   watermark, the shrinkers are called upon until free memory is back
+   above the high watermark.
+
+   Memory released by a cache, such as the page cache, usually goes
+   back to a kernel heap rather than to the physical heap; the
+   shrinkers of those heaps can only return pages once emptied. So
+   shrinkers are called in passes, for as long as a pass releases
+   anything, up to MM_RECLAIM_MAX_PASSES.
+
+   An allocation that fails may reclaim directly with mm_reclaim(). */
+
+#include <kernel.h>
+
+//#define MM_DEBUG
+#ifdef MM_DEBUG
+#define mm_debug(x, ...) do {rprintf("MM:   " x, ##__VA_ARGS__);} while(0)
+#else
+#define mm_debug(x, ...) do { } while(0)
+#endif
+
+static heap mm_heap;
+static heap mm_physical;
+static vector shrinkers;
+static vector writebacks;
+
+static inline u64 physical_free(void)
+{
+    return heap_total(mm_physical) - heap_allocated(mm_physical);
+}
+
+static u64 low_watermark(void)
+{
+    u64 low = heap_total(mm_physical) >> MM_LOW_WATERMARK_ORDER;
+    return MIN(MAX(low, MM_LOW_WATERMARK_MIN), MM_LOW_WATERMARK_MAX);
+}
+
+static inline u64 high_watermark(void)
+{
+    u64 low = low_watermark();
+    return low + low / 2;
+}
+
+void mm_register_shrinker(shrinker s)
+{
+    vector_push(shrinkers, s);
+}
+
+void mm_register_writeback(thunk t)
+{
+    vector_push(writebacks, t);
+}
+
+closure_function(1, 1, u64, mcache_shrink,
+                 heap, h,
+                 u64, bytes)
+{
+    return mcache_drain(bound(h), bytes);
+}
+
+/* Have unused pages of an mcache returned to its parent heap. */
+void mm_register_mcache(heap h)
+{
+    shrinker s = closure(mm_heap, mcache_shrink, h);
+    assert(s != INVALID_ADDRESS);
+    mm_register_shrinker(s);
+}
+
+/* free memory is short of the high watermark */
+boolean mm_memory_low(void)
+{
+    return mm_physical && physical_free() < high_watermark();
+}
+
+static void start_writeback(void)
+{
+    thunk t;
+    vector_foreach(writebacks, t)
+        apply(t);
+}
+
+/* Call on the shrinkers until free memory reaches target, or a pass
+   releases nothing. Returns free memory. */
+static u64 shrink(u64 target)
+{
+    u64 free = physical_free();
+    for (int pass = 0; pass < MM_RECLAIM_MAX_PASSES && free < target; pass++) {
+        u64 released = 0;
+        shrinker s;
+        vector_foreach(shrinkers, s) {
+            released += apply(s, target - free);
+            free = physical_free();
+            if (free >= target)
+                break;
+        }
+        mm_debug("%s: pass %d, released %ld, free %ld, target %ld\n", __func__,
+                 pass, released, free, target);
+        if (released == 0)
+            break;
+    }
+    return free;
+}
+
+/* Called from the runloop with the kernel lock held. */
+void mm_service(void)
+{
+    if (!mm_physical)
+        return;
+    u64 free = physical_free();
+    u64 high = high_watermark();
+    if (free >= high)
+        return;
+    start_writeback();
+    if (free < low_watermark()) {
+        mm_debug("%s: total %ld, free %ld, high %ld\n", __func__, heap_total(mm_physical), free, high);
+        shrink(high);
+    }
+}
+
+/* Reclaim for an allocation of the given number of bytes which has
+   failed, reaching that far beyond the high watermark. Must be called
+   with the kernel lock held. Returns true if there is now enough free
+   memory for the allocation to be retried. */
+boolean mm_reclaim(u64 bytes)
+{
+    if (!mm_physical)
+        return false;
+    mm_debug("%s: %ld bytes, free %ld\n", __func__, bytes, physical_free());
+    start_writeback();
+    return shrink(high_watermark() + bytes) >= bytes;
+}
+
+void init_reclaim(kernel_heaps kh)
+{
+    mm_heap = heap_general(kh);
+    shrinkers = allocate_vector(mm_heap, 8);
+    writebacks = allocate_vector(mm_heap, 2);
+    assert(shrinkers != INVALID_ADDRESS && writebacks != INVALID_ADDRESS);
+    mm_physical = (heap)heap_physical(kh);
+    mm_register_mcache(mm_heap);
+}
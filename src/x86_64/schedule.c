@@ -23,6 +23,7 @@ static char *state_strings_backing[] = {
     "kernel",
     "interrupt",
     "user",         
+    "syscall",
 };
 
 char **state_strings = state_strings_backing;
@@ -31,8 +32,8 @@ int shutdown_vector;
 boolean shutting_down;
 
 queue runqueue;                 /* kernel space from ?*/
-queue bhqueue;                  /* kernel from interrupt */
-queue thread_queue;             /* kernel to user */
+static u64 runqueue_cpu;        /* last to serve runqueue; keeps serving it rather than halting */
+u64 sqpoll_active;              /* io_uring SQ pollers requeueing themselves on runqueue */
 timerheap runloop_timers;
 u64 idle_cpu_mask;              /* xxx - limited to 64 aps. consider merging with bitmask */
 timestamp last_timer_update;
@@ -70,27 +71,89 @@ void kern_unlock()
     spin_unlock(&kernel_lock);
 }
 
+static inline void wakeup_cpu(u64 cpu)
+{
+    if (atomic_test_and_clear_bit(&idle_cpu_mask, cpu)) {
+        sched_debug("sending wakeup ipi to %d %x\n", cpu, wakeup_vector);
+        apic_ipi(cpu, 0, wakeup_vector);
+    }
+}
+
+/* Wake one idle cpu, other than the current one, so that it may pick up
+   global kernel work or steal from a busy thread queue. */
+static void wakeup_idle_cpu(void)
+{
+    u64 mask = idle_cpu_mask & ~U64_FROM_BIT(current_cpu()->id);
+    if (mask)
+        wakeup_cpu(lsb(mask));
+}
+
+void schedule_frame(context f)
+{
+    assert(f[FRAME_CPU] != INVALID_PHYSICAL);
+    cpuinfo ci = cpuinfo_from_id(f[FRAME_CPU]);
+    thunk t = pointer_from_u64(f[FRAME_RUN]);
+
+    /* spill to the least loaded queue if the home queue is full */
+    if (!enqueue(ci->thread_queue, t)) {
+        cpuinfo target = 0;
+        for (int i = 0; i < MAX_CPUS; i++) {
+            cpuinfo c = cpuinfo_from_id(i);
+            if (c->state == cpu_not_present || queue_full(c->thread_queue))
+                continue;
+            if (!target || queue_length(c->thread_queue) < queue_length(target->thread_queue))
+                target = c;
+        }
+        if (!target || !enqueue(target->thread_queue, t))
+            halt("%s: all thread queues full\n", __func__);
+        ci = target;
+    }
+
+    /* order the enqueue before reading the idle mask; pairs with the
+       recheck in kernel_sleep() */
+    memory_barrier();
+    if (ci != current_cpu())
+        wakeup_cpu(ci->id);
+    else if (queue_length(ci->thread_queue) > 1)
+        wakeup_idle_cpu();
+}
+
+/* Take a runnable thread from the longest queue of another cpu. */
+static thunk steal_thread(cpuinfo ci)
+{
+    cpuinfo victim = 0;
+    u64 max = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo c = cpuinfo_from_id(i);
+        if (c == ci || c->state == cpu_not_present)
+            continue;
+        u64 len = queue_length(c->thread_queue);
+        if (len > max) {
+            max = len;
+            victim = c;
+        }
+    }
+    if (!victim)
+        return INVALID_ADDRESS;
+    thunk t = dequeue(victim->thread_queue);
+    if (t != INVALID_ADDRESS) {
+        sched_debug("stole thread thunk %p from cpu %d\n", t, victim->id);
+        ci->steal_count++;
+    }
+    return t;
+}
+
 static void run_thunk(thunk t, int cpustate)
 {
     cpuinfo ci = current_cpu();
     sched_debug(" run: %F state: %s\n", t, state_strings[cpustate]);
     // as we are walking by, if there is work to be done and an idle cpu,
-    // get it to wake up and examine the queue
+    // get it to wake up and examine the queues
     if (idle_cpu_mask &&
-        ((queue_length(bhqueue) > 0) ||
+        ((queue_length(ci->bh_queue) > 0) ||
          (queue_length(runqueue) > 0) ||
-         (queue_length(thread_queue) > 0))) {
-        // unfortunately, if idle cpu mask is zero (which can happen since this
-        // is racy), the result is the previous value ... so asm here
-        u64 mask_copy = idle_cpu_mask;
-        u64 cpu = msb(mask_copy);        
-        // this really shouldn't ever be current_cpu() ? 
-        if (cpu != INVALID_PHYSICAL && cpu != current_cpu()->id) {
-            sched_debug("sending wakeup ipi to %d %x\n", cpu, wakeup_vector);
-            atomic_clear_bit(&idle_cpu_mask, cpu);
-            apic_ipi(cpu, 0, wakeup_vector);
-        }
-    }
+         (queue_length(ci->thread_queue) > 0)))
+        wakeup_idle_cpu();
 
     ci->state = cpustate;
     apply(t);
@@ -99,6 +162,26 @@ static void run_thunk(thunk t, int cpustate)
     //    halt("handler returned %d", cpustate);
 }
 
+/* Queue a bottom half on the current cpu, typically from an interrupt
+   handler, so that it runs where the interrupt was taken. */
+boolean enqueue_bh(thunk t)
+{
+    return enqueue(current_cpu()->bh_queue, t);
+}
+
+/* called with kernel lock held */
+static void serve_bh_queue(cpuinfo ci, cpuinfo owner)
+{
+    thunk t;
+    while ((t = dequeue(owner->bh_queue)) != INVALID_ADDRESS) {
+        if (owner != ci) {
+            sched_debug("stole bh thunk %p from cpu %d\n", t, owner->id);
+            ci->bh_steal_count++;
+        }
+        run_thunk(t, cpu_kernel);
+    }
+}
+
 /* called with kernel lock held */
 static inline void update_timer(void)
 {
@@ -118,10 +201,16 @@ NOTRACE void __attribute__((noreturn)) kernel_sleep(void)
     // handler...we shouldn't return here if we do get interrupted
     cpuinfo ci = get_cpuinfo();
     sched_debug("sleep\n");
-    ci->state = cpu_idle;
+    /* Advertise idleness before the final look at our queue, so that a
+       schedule_frame() racing with us either sees the bit and sends an
+       IPI or has its enqueue seen here. */
     atomic_set_bit(&idle_cpu_mask, ci->id);
+    ci->state = cpu_idle;
     if (ci->have_kernel_lock)
         kern_unlock();
+    if (!shutting_down && queue_length(ci->thread_queue) > 0 &&
+        atomic_test_and_clear_bit(&idle_cpu_mask, ci->id))
+        runloop();
 
     /* loop to absorb spurious wakeups from hlt - happens on some platforms (e.g. xen) */
     while (1)
@@ -136,7 +225,7 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
 
     disable_interrupts();
     sched_debug("runloop from %s b:%d r:%d t:%d i:%x lock:%d\n", state_strings[ci->state],
-                queue_length(bhqueue), queue_length(runqueue), queue_length(thread_queue),
+                queue_length(ci->bh_queue), queue_length(runqueue), queue_length(ci->thread_queue),
                 idle_cpu_mask, ci->have_kernel_lock);
     ci->state = cpu_kernel;
     if (kern_try_lock()) {
@@ -144,13 +233,20 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
         ci->state = cpu_kernel;
         timer_service(runloop_timers, now(CLOCK_ID_MONOTONIC));
 
-        /* serve bhqueue to completion */
-        while ((t = dequeue(bhqueue)) != INVALID_ADDRESS) {
-            run_thunk(t, cpu_kernel);
+        /* serve bottom halves to completion, this cpu's own first; those
+           of other cpus are stolen, as their owners may be kept from the
+           kernel lock for a while */
+        serve_bh_queue(ci, ci);
+        for (int i = 0; i < MAX_CPUS; i++) {
+            cpuinfo c = cpuinfo_from_id(i);
+            if (c != ci && c->state != cpu_not_present)
+                serve_bh_queue(ci, c);
         }
 
         /* serve existing, but not additionally queued (deferred), items on runqueue */
         u64 n_rq = queue_length(runqueue);
+        if (n_rq > 0)
+            runqueue_cpu = ci->id;
         while (n_rq-- > 0 && (t = dequeue(runqueue)) != INVALID_ADDRESS) {
             run_thunk(t, cpu_kernel);
         }
@@ -162,12 +258,27 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
         kern_unlock();
     }
 
-    if (!shutting_down && (t = dequeue(thread_queue)) != INVALID_ADDRESS)
-        run_thunk(t, cpu_user);
+    if (!shutting_down) {
+        t = dequeue(ci->thread_queue);
+        if (t == INVALID_ADDRESS)
+            t = steal_thread(ci);
+        if (t != INVALID_ADDRESS)
+            run_thunk(t, cpu_user);
+    }
 // XXX redo with frame pause
     if (ci->current_thread)
         thread_pause(ci->current_thread);
 
+    /* an SQ poller is active and requeues itself; go around again rather
+       than halting until the next interrupt. Other deferred items wait for
+       an interrupt as before, and one cpu is enough to poll. */
+    if (!shutting_down && sqpoll_active > 0 && runqueue_cpu == ci->id &&
+        queue_length(runqueue) > 0)
+        runloop();
+
+    /* nothing to run; use the idle time to top up the zeroed page pool */
+    if (!shutting_down)
+        refill_zeroed_pages();
     kernel_sleep();
 }    
 
@@ -188,9 +299,17 @@ void init_scheduler(heap h)
     assert(wakeup_vector != INVALID_PHYSICAL);
     /* scheduling queues init */
     runqueue = allocate_queue(h, 64);
-    bhqueue = allocate_queue(h, 2048);
-    thread_queue = allocate_queue(h, 64);
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        ci->thread_queue = allocate_queue(h, THREAD_QUEUE_SIZE);
+        assert(ci->thread_queue != INVALID_ADDRESS);
+        ci->steal_count = 0;
+        ci->bh_queue = allocate_queue(h, BH_QUEUE_SIZE);
+        assert(ci->bh_queue != INVALID_ADDRESS);
+        ci->bh_steal_count = 0;
+    }
     runloop_timers = allocate_timerheap(h, "runloop");
     assert(runloop_timers != INVALID_ADDRESS);
+    sqpoll_active = 0;
     shutting_down = false;
 }
@@ -4,7 +4,6 @@
 #include <pci.h>
 #include <pagecache.h>
 #include <tfs.h>
-#include <pagecache.h>
 #include <apic.h>
 #include <region.h>
 #include <page.h>
@@ -20,7 +19,6 @@
 //#define SMP_DUMP_FRAME_RETURN_COUNT
 
 //#define STAGE3_INIT_DEBUG
-//#define MM_DEBUG
 #ifdef STAGE3_INIT_DEBUG
 #define init_debug(x, ...) do {rprintf("INIT: " x "\n", ##__VA_ARGS__);} while(0)
 #else
@@ -51,7 +49,10 @@ static heap allocate_tagged_region(kernel_heaps kh, u64 tag)
 
     /* tagged mcache range of 32 to 1M bytes (131072 table buckets) */
     build_assert(TABLE_MAX_BUCKETS * sizeof(void *) <= 1 << 20);
-    return allocate_mcache(h, backed, 5, 20, PAGESIZE_2M);
+    heap m = allocate_mcache(h, backed, 5, 20, PAGESIZE_2M);
+    if (m != INVALID_ADDRESS)
+        mm_register_mcache(m);
+    return m;
 }
 
 #define BOOTSTRAP_REGION_SIZE_KB	2048
@@ -99,6 +100,15 @@ closure_function(2, 3, void, offset_block_io,
 void init_extra_prints(); 
 thunk create_init(kernel_heaps kh, tuple root, filesystem fs);
 
+closure_function(1, 1, u64, log_shrink,
+                 filesystem, fs,
+                 u64, bytes)
+{
+    /* compaction gives memory back once done */
+    filesystem_shrink_log(bound(fs));
+    return 0;
+}
+
 closure_function(1, 2, void, fsstarted,
                  tuple, root,
                  filesystem, fs, status, s)
@@ -107,6 +117,7 @@ closure_function(1, 2, void, fsstarted,
         halt("unable to open filesystem: %v\n", s);
 
     root_fs = fs;
+    mm_register_shrinker(closure(heap_general(&heaps), log_shrink, fs));
     enqueue(runqueue, create_init(&heaps, bound(root), fs));
     closure_finish();
 }
@@ -114,30 +125,60 @@ closure_function(1, 2, void, fsstarted,
 /* will become list I guess */
 static pagecache global_pagecache;
 
-/* This is very simplistic and uses a fixed drain threshold. This
-   should also take all cached data in system into account. For now we
-   just pick on the single pagecache... */
+closure_function(1, 1, u64, pagecache_shrink,
+                 pagecache, pc,
+                 u64, bytes)
+{
+    return pagecache_drain(bound(pc), bytes);
+}
 
-#ifdef MM_DEBUG
-#define mm_debug(x, ...) do {rprintf("MM:   " x, ##__VA_ARGS__);} while(0)
-#else
-#define mm_debug(x, ...) do { } while(0)
-#endif
-void mm_service(void)
+closure_function(1, 0, void, pagecache_start_writeback_thunk,
+                 pagecache, pc)
 {
-    if (!global_pagecache)
-        return;
+    pagecache_start_writeback(bound(pc));
+}
+
+/* Take a pre-zeroed page from this cpu's pool, if any. The pool is
+   only touched by its own cpu with interrupts disabled, so no locking
+   is needed. */
+u64 get_zeroed_page(void)
+{
+    cpuinfo ci = current_cpu();
+    if (ci->zeroed_page_count == 0)
+        return INVALID_PHYSICAL;
+    return ci->zeroed_pages[--ci->zeroed_page_count];
+}
+
+/* Called from the runloop before the cpu goes idle. Pages are zeroed
+   through a per-cpu mapping window; the slot ptes are replaced without
+   a global shootdown, as no other cpu references them. */
+void refill_zeroed_pages(void)
+{
+    cpuinfo ci = current_cpu();
     heap p = (heap)heap_physical(&heaps);
-    u64 free = heap_total(p) - heap_allocated(p);
-    mm_debug("%s: total %ld, alloc %ld, free %ld\n", __func__, heap_total(p), heap_allocated(p), free);
-    if (free < CACHE_DRAIN_CUTOFF) {
-        u64 drain_bytes = CACHE_DRAIN_CUTOFF - free;
-        u64 drained = pagecache_drain(global_pagecache, drain_bytes);
-        if (drained > 0)
-            mm_debug("   drained %ld / %ld requested...\n", drained, drain_bytes);
+    if (ci->zeroed_page_count == ZEROED_PAGE_POOL_SIZE || mm_memory_low())
+        return;
+    while (ci->zeroed_page_count < ZEROED_PAGE_POOL_SIZE) {
+        u64 phys = allocate_u64(p, PAGESIZE);
+        if (phys == INVALID_PHYSICAL)
+            break;
+        u64 va = ci->zero_window + ci->zeroed_page_count * PAGESIZE;
+        map(va, phys, PAGESIZE, PAGE_WRITABLE | PAGE_NO_EXEC);
+        page_invalidate_local(va);
+        zero(pointer_from_u64(va), PAGESIZE);
+        ci->zeroed_pages[ci->zeroed_page_count++] = phys;
     }
 }
 
+/* Zero a 2M physical page through this cpu's huge window, so that it
+   is never visible to user space before it is clear. */
+void zero_huge_page(u64 phys)
+{
+    cpuinfo ci = current_cpu();
+    map(ci->huge_zero_window, phys, PAGESIZE_2M, PAGE_WRITABLE | PAGE_NO_EXEC);
+    zero(pointer_from_u64(ci->huge_zero_window), PAGESIZE_2M);
+}
+
 closure_function(2, 3, void, attach_storage,
                  tuple, root, u64, fs_offset,
                  block_io, r, block_io, w, u64, length)
@@ -146,12 +187,16 @@ closure_function(2, 3, void, attach_storage,
     heap h = heap_general(&heaps);
     u64 offset = bound(fs_offset);
     length -= offset;
-    pagecache pc = allocate_pagecache(h, h, PAGESIZE);
+    /* the last reference to a page may be dropped without the kernel
+       lock (see pagecache_read_resident) */
+    pagecache pc = allocate_pagecache(h, heap_locked(&heaps), PAGESIZE);
     if (pc == INVALID_ADDRESS)
         halt("unable to create pagecache\n");
 
     /* figure that later pagecaches will register themselves with backing - glue for now */
     global_pagecache = pc;
+    mm_register_shrinker(closure(h, pagecache_shrink, pc));
+    mm_register_writeback(closure(h, pagecache_start_writeback_thunk, pc));
     create_filesystem(h,
                       SECTOR_SIZE,
                       length,
@@ -249,11 +294,12 @@ static tuple root;
 void vm_exit(u8 code)
 {
 #ifdef SMP_DUMP_FRAME_RETURN_COUNT
-    rprintf("cpu\tframe returns\n");
+    rprintf("cpu\tframe returns\tsteals\tbh steals\n");
     for (int i = 0; i < MAX_CPUS; i++) {
         cpuinfo ci = cpuinfo_from_id(i);
         if (ci->frcount)
-            rprintf("%d\t%ld\n", i, ci->frcount);
+            rprintf("%d\t%ld\t\t%ld\t%ld\n", i, ci->frcount, ci->steal_count,
+                    ci->bh_steal_count);
     }
 #endif
 
@@ -306,6 +352,12 @@ static void init_cpuinfos(kernel_heaps kh)
         ci->state = cpu_not_present;
         ci->have_kernel_lock = false;
         ci->frcount = 0;
+        ci->zeroed_page_count = 0;
+        ci->zero_window = allocate_u64((heap)heap_virtual_page(kh), ZEROED_PAGE_POOL_SIZE * PAGESIZE);
+        assert(ci->zero_window != INVALID_PHYSICAL);
+        ci->huge_zero_window = allocate_u64((heap)heap_virtual_page(kh), PAGESIZE_2M);
+        assert(ci->huge_zero_window != INVALID_PHYSICAL &&
+               (ci->huge_zero_window & MASK(PAGELOG_2M)) == 0);
         /* frame and stacks */
         ci->kernel_frame = allocate_frame(h);
         ci->kernel_stack = allocate_stack(backed, KERNEL_STACK_SIZE);
@@ -346,6 +398,9 @@ static void __attribute__((noinline)) init_service_new_stack()
     init_debug("in init_service_new_stack");
     init_debug("runtime");    
     init_runtime(misc);
+    init_reclaim(kh);
+    heaps.locked = allocate_locked_heap(kh);
+    assert(heaps.locked != INVALID_ADDRESS);
     init_tuples(allocate_tagged_region(kh, tag_tuple));
     init_symbols(allocate_tagged_region(kh, tag_symbol), misc);
     init_sg(misc);
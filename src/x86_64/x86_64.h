@@ -112,6 +112,13 @@ static inline void atomic_clear_bit(u64 *target, u64 bit)
     asm volatile("lock btrq %1, %0": "+m"(*target):"r"(bit) : "memory");
 }
 
+static inline boolean atomic_test_and_clear_bit(u64 *target, u64 bit)
+{
+    u8 oldbit;
+    asm volatile("lock btrq %2, %0; setc %1": "+m"(*target), "=qm"(oldbit): "r"(bit) : "memory");
+    return oldbit != 0;
+}
+
 static inline u64 fetch_and_add_64(u64 *target, u64 num)
 {
     return __sync_fetch_and_add(target, num);
@@ -296,7 +296,7 @@ static void xennet_service_tx_ring(xennet_dev xd)
             /* trick: remove (local) head and queue first element */
             list_delete(&q);
             assert(enqueue(xd->tx_servicequeue, l));
-            enqueue(bhqueue, xd->tx_service);
+            enqueue_bh(xd->tx_service);
         }
         RING_FINAL_CHECK_FOR_RESPONSES(&xd->tx_ring, more);
     } while (more);
@@ -621,7 +621,7 @@ static void xennet_service_rx_ring(xennet_dev xd)
             list_delete(&q);
             assert(l->prev);
             assert(enqueue(xd->rx_servicequeue, l));
-            enqueue(bhqueue, xd->rx_service);
+            enqueue_bh(xd->rx_service);
         }
         RING_FINAL_CHECK_FOR_RESPONSES(&xd->rx_ring, more);
     } while (more);
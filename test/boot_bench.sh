@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Boot the boot_bench test program on images with growing numbers of
+# files and tabulate the time to main, the time of the first lookup and
+# that of a walk of the whole tree.
+#
+# usage: boot_bench.sh [file counts...]
+#
+# Files are spread over directories of DIR_SIZE entries each, and all
+# have the contents of the same small host file.
+
+COUNTS=${@:-1000 10000 100000}
+DIR_SIZE=${DIR_SIZE:-1000}
+MANIFEST=/tmp/boot_bench.manifest
+LOG=/tmp/boot_bench.log
+LEAF=test/runtime/boot_bench.c
+
+cd $(dirname $0)/..
+
+make_manifest() {
+    local files=$1
+    local dirs=$(( (files + DIR_SIZE - 1) / DIR_SIZE ))
+    cat <<EOF
+(
+    boot:(children:(kernel:(contents:(host:output/stage3/bin/stage3.img))))
+    children:(
+        boot_bench:(contents:(host:output/test/runtime/bin/boot_bench))
+        tree:(children:(
+EOF
+    for ((d = 0; d < dirs; d++)); do
+        echo "            d$d:(children:("
+        for ((f = d * DIR_SIZE; f < files && f < (d + 1) * DIR_SIZE; f++)); do
+            echo "                f$f:(contents:(host:$LEAF))"
+        done
+        echo "            ))"
+    done
+    cat <<EOF
+        ))
+    )
+    program:/boot_bench
+    arguments:[boot_bench /tree/d$((dirs - 1))/f$((files - 1)) /tree]
+    environment:(USER:bobby PWD:/)
+)
+EOF
+}
+
+echo -e "files\tmkfs s\tboot to main us\tfirst lookup us\twalk us"
+for n in $COUNTS; do
+    make_manifest $n > $MANIFEST
+    start=$(date +%s.%N)
+    make image TARGET=boot_bench MANIFEST=$MANIFEST > $LOG 2>&1 || { echo "image build failed; see $LOG"; exit 1; }
+    end=$(date +%s.%N)
+    make run TARGET=boot_bench MANIFEST=$MANIFEST >> $LOG 2>&1
+    result=$(grep -A1 '^boot to main us' $LOG | tail -1)
+    if [ -z "$result" ]; then
+        echo "no result for $n files; see $LOG"
+        exit 1
+    fi
+    read boot lookup walk entries <<< "$result"
+    echo -e "$n\t$(echo "$end - $start" | bc)\t$boot\t$lookup\t$walk"
+done
@@ -0,0 +1,78 @@
+/* boot and first-lookup latency against filesystem size
+
+   Run as the program of an image with a large tree of files (see
+   test/boot_bench.sh), this reports the time from boot to main, which
+   includes mounting the root filesystem, then the time to open and read
+   the file given as the first argument, which is the first lookup of
+   anything in the tree. Last, the directory given as the second
+   argument is walked, so that the cost of loading every entry may be
+   compared to that of loading just the ones on a path. */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+static unsigned long long now_usec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static int walk(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        fail_perror("opendir %s", path);
+    struct dirent *d;
+    int n = 0;
+    while ((d = readdir(dir))) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        n++;
+        if (d->d_type == DT_DIR) {
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", path, d->d_name);
+            n += walk(sub);
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long boot = now_usec(CLOCK_BOOTTIME);
+    if (argc < 3) {
+        printf("usage: %s <file> <directory>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long start = now_usec(CLOCK_MONOTONIC);
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+        fail_perror("open %s", argv[1]);
+    char buf[4096];
+    ssize_t rv;
+    while ((rv = read(fd, buf, sizeof(buf))) > 0);
+    if (rv < 0)
+        fail_perror("read %s", argv[1]);
+    close(fd);
+    unsigned long long lookup = now_usec(CLOCK_MONOTONIC) - start;
+
+    start = now_usec(CLOCK_MONOTONIC);
+    int entries = walk(argv[2]);
+    unsigned long long tree = now_usec(CLOCK_MONOTONIC) - start;
+
+    printf("boot to main us\tfirst lookup us\twalk us\tentries\n");
+    printf("%llu\t%llu\t%llu\t%d\n", boot, lookup, tree, entries);
+    exit(EXIT_SUCCESS);
+}
@@ -3,8 +3,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 
 /* Covers EPOLL_CTL_ADD and EPOLL_CTL_DEL epoll_ctl operations */
 void test_ctl()
@@ -67,9 +70,94 @@ void test_ctl()
     exit(EXIT_FAILURE);
 }
 
+static void *exclusive_waiter(void *arg)
+{
+    struct epoll_event event;
+    return (void *)(long)epoll_wait(*(int *)arg, &event, 1, 500);
+}
+
+/* Covers EPOLLEXCLUSIVE: flag validation, and a single wakeup for an fd
+   added exclusively to two epoll instances with a waiter on each */
+void test_exclusive()
+{
+    struct epoll_event event;
+    int epfds[2];
+    pthread_t threads[2];
+    int woken = 0;
+
+    int evfd = eventfd(0, EFD_NONBLOCK);
+    if (evfd < 0) {
+        printf("Cannot create eventfd\n");
+        goto fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        epfds[i] = epoll_create1(0);
+        if (epfds[i] < 0) {
+            printf("Cannot create epoll\n");
+            goto fail;
+        }
+    }
+
+    event.data.fd = evfd;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE | EPOLLONESHOT;
+    if ((epoll_ctl(epfds[0], EPOLL_CTL_ADD, evfd, &event) != -1) || (errno != EINVAL)) {
+        printf("EPOLLEXCLUSIVE with EPOLLONESHOT is not allowed\n");
+        goto fail;
+    }
+
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    for (int i = 0; i < 2; i++) {
+        if (epoll_ctl(epfds[i], EPOLL_CTL_ADD, evfd, &event)) {
+            printf("Cannot add descriptor to epoll with EPOLLEXCLUSIVE\n");
+            goto fail;
+        }
+    }
+
+    event.events = EPOLLIN;
+    if ((epoll_ctl(epfds[0], EPOLL_CTL_MOD, evfd, &event) != -1) || (errno != EINVAL)) {
+        printf("EPOLL_CTL_MOD is not allowed for an EPOLLEXCLUSIVE descriptor\n");
+        goto fail;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], 0, exclusive_waiter, &epfds[i])) {
+            printf("Cannot create thread\n");
+            goto fail;
+        }
+    }
+    usleep(100000);
+    uint64_t val = 1;
+    if (write(evfd, &val, sizeof(val)) != sizeof(val)) {
+        printf("Cannot write eventfd\n");
+        goto fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        void *rv;
+        pthread_join(threads[i], &rv);
+        if ((long)rv < 0) {
+            printf("epoll_wait failed\n");
+            goto fail;
+        }
+        woken += (long)rv;
+    }
+    if (woken != 1) {
+        printf("%d waiters woken for an EPOLLEXCLUSIVE event, expected 1\n", woken);
+        goto fail;
+    }
+
+    close(epfds[0]);
+    close(epfds[1]);
+    close(evfd);
+    return;
+  fail:
+    printf("test failed\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
     test_ctl();
+    test_exclusive();
 
     printf("test passed\n");
     return EXIT_SUCCESS;
@@ -0,0 +1,99 @@
+/* epoll_wait latency against the number of idle fds
+
+   Idle eventfds are registered on an epoll instance in growing numbers
+   (10, 100, ... up to the count given as the first argument), along
+   with one active eventfd that is signaled and collected in a loop.
+   For each count, the mean latency of an epoll_wait returning the one
+   ready event is reported, as well as that of a wait which finds
+   nothing ready. Neither should grow with the number of idle fds. */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ITERATIONS    20000
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_fd(int epfd, int fd)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        fail_perror("epoll_ctl add %d", fd);
+}
+
+static unsigned long long wait_ready(int epfd, int active)
+{
+    struct epoll_event ev;
+    unsigned long long total = 0;
+    uint64_t val = 1;
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        if (write(active, &val, sizeof(val)) != sizeof(val))
+            fail_perror("eventfd write");
+        unsigned long long start = now_nsec();
+        int n = epoll_wait(epfd, &ev, 1, -1);
+        total += now_nsec() - start;
+        if (n != 1 || ev.data.fd != active)
+            fail_perror("epoll_wait returned %d, fd %d", n, ev.data.fd);
+        if (read(active, &val, sizeof(val)) != sizeof(val))
+            fail_perror("eventfd read");
+    }
+    return total / BENCH_ITERATIONS;
+}
+
+static unsigned long long wait_idle(int epfd)
+{
+    struct epoll_event ev;
+    unsigned long long start = now_nsec();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        int n = epoll_wait(epfd, &ev, 1, 0);
+        if (n != 0)
+            fail_perror("idle epoll_wait returned %d", n);
+    }
+    return (now_nsec() - start) / BENCH_ITERATIONS;
+}
+
+int main(int argc, char **argv)
+{
+    int max_idle = argc > 1 ? atoi(argv[1]) : 10000;
+    if (max_idle < 10) {
+        printf("usage: %s [max idle fds (at least 10)]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        fail_perror("epoll_create1");
+    int active = eventfd(0, EFD_NONBLOCK);
+    if (active < 0)
+        fail_perror("eventfd");
+    add_fd(epfd, active);
+
+    printf("idle fds\tready wait ns\tidle wait ns\n");
+    int nidle = 0;
+    for (int target = 10; target <= max_idle; target *= 10) {
+        for (; nidle < target; nidle++) {
+            int fd = eventfd(0, EFD_NONBLOCK);
+            if (fd < 0)
+                fail_perror("eventfd (%d idle)", nidle);
+            add_fd(epfd, fd);
+        }
+        unsigned long long ready = wait_ready(epfd, active);
+        printf("%d\t%llu\t%llu\n", nidle, ready, wait_idle(epfd));
+    }
+    exit(EXIT_SUCCESS);
+}
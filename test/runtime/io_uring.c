@@ -1,5 +1,7 @@
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -9,6 +11,7 @@
 #include <string.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
 #include <time.h>
@@ -26,8 +29,11 @@
 #define SYS_io_uring_register   427
 #endif
 
+#define IORING_SETUP_SQPOLL     (1 << 1)
 #define IORING_SETUP_CQSIZE     (1 << 3)
 
+#define IORING_SQ_NEED_WAKEUP   (1 << 0)
+
 #define IO_URING_OP_SUPPORTED   (1 << 0)
 
 #define IORING_OFF_SQ_RING  0ULL
@@ -149,15 +155,31 @@ enum {
     IORING_OP_STATX,
     IORING_OP_READ,
     IORING_OP_WRITE,
+    IORING_OP_FADVISE,
+    IORING_OP_MADVISE,
+    IORING_OP_SEND,
+    IORING_OP_RECV,
 };
 
 #define IORING_FEAT_SINGLE_MMAP (1 << 0)
 
 #define IOSQE_FIXED_FILE    (1 << 0)
+#define IOSQE_IO_DRAIN      (1 << 1)
+#define IOSQE_IO_LINK       (1 << 2)
+#define IOSQE_IO_HARDLINK   (1 << 3)
 
 #define IORING_TIMEOUT_ABS  (1 << 0)
 
+#define IORING_FSYNC_DATASYNC   (1 << 0)
+
+#ifndef SYNC_FILE_RANGE_WRITE
+#define SYNC_FILE_RANGE_WAIT_BEFORE 1
+#define SYNC_FILE_RANGE_WRITE       2
+#define SYNC_FILE_RANGE_WAIT_AFTER  4
+#endif
+
 #define IORING_ENTER_GETEVENTS  (1 << 0)
+#define IORING_ENTER_SQ_WAKEUP  (1 << 1)
 
 #define IORING_REGISTER_BUFFERS         0
 #define IORING_UNREGISTER_BUFFERS       1
@@ -171,6 +193,12 @@ enum {
 
 #define BUF_SIZE        8192
 
+#define SQPOLL_IDLE_MS      10
+#define BENCH_QUEUE_DEPTH   32
+#define BENCH_BLOCK_SIZE    4096
+#define BENCH_FILE_BLOCKS   256
+#define BENCH_OPS           100000
+
 #define test_assert(expr) do { \
     if (!(expr)) { \
         printf("Error: %s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
@@ -185,6 +213,7 @@ struct iour {
     struct io_uring_sqe *sqes;
     uint32_t *sq_head;
     uint32_t *sq_tail;
+    uint32_t *sq_flags;
     uint32_t sq_mask;
     uint32_t *sq_array;
     uint32_t *cq_head;
@@ -213,6 +242,7 @@ static int iour_init(struct iour *iour, unsigned int entries)
 
     iour->sq_head = (uint32_t *)(iour->rings + iour->params.sq_off.head);
     iour->sq_tail = (uint32_t *)(iour->rings + iour->params.sq_off.tail);
+    iour->sq_flags = (uint32_t *)(iour->rings + iour->params.sq_off.flags);
     iour->sq_mask = *(uint32_t *)(iour->rings + iour->params.sq_off.ring_mask);
     iour->sq_array = (uint32_t *)(iour->rings + iour->params.sq_off.array);
     iour->cq_head = (uint32_t *)(iour->rings + iour->params.cq_off.head);
@@ -269,6 +299,14 @@ static void iour_setup_sqe(struct iour *iour, uint8_t opcode, int fd,
     (*iour->sq_tail)++;
 }
 
+/* Sets the flags of the last SQE set up */
+static void iour_set_flags(struct iour *iour, uint8_t flags)
+{
+    uint32_t index = iour->sq_array[(*iour->sq_tail - 1) & iour->sq_mask];
+
+    iour->sqes[index].flags = flags;
+}
+
 static void iour_setup_nop(struct iour *iour, uint64_t user_data)
 {
     iour_setup_sqe(iour, IORING_OP_NOP, 0, 0, 0, 0, user_data);
@@ -394,6 +432,24 @@ static void iour_setup_write(struct iour *iour, int fd, uint8_t *buf,
         user_data);
 }
 
+static void iour_setup_fsync(struct iour *iour, int fd, uint32_t flags,
+                             uint64_t user_data)
+{
+    iour_setup_sqe(iour, IORING_OP_FSYNC, fd, 0, 0, 0, user_data);
+    iour->sqes[iour->sq_array[(*iour->sq_tail - 1) & iour->sq_mask]].fsync_flags =
+        flags;
+}
+
+static void iour_setup_sync_file_range(struct iour *iour, int fd,
+                                       uint64_t offset, uint32_t len,
+                                       uint32_t flags, uint64_t user_data)
+{
+    iour_setup_sqe(iour, IORING_OP_SYNC_FILE_RANGE, fd, 0, len, offset,
+                   user_data);
+    iour->sqes[iour->sq_array[(*iour->sq_tail - 1) & iour->sq_mask]].sync_range_flags =
+        flags;
+}
+
 static int iour_submit(struct iour *iour, unsigned int count,
                        unsigned int min_complete)
 {
@@ -415,6 +471,34 @@ static struct io_uring_cqe *iour_get_cqe(struct iour *iour)
     return cqe;
 }
 
+/* With SQ polling, submission only needs a syscall if the poller has gone
+ * idle. */
+static void iour_sqpoll_kick(struct iour *iour)
+{
+    memory_barrier();
+    if (*iour->sq_flags & IORING_SQ_NEED_WAKEUP)
+        test_assert(syscall(SYS_io_uring_enter, iour->fd, 0, 0,
+                            IORING_ENTER_SQ_WAKEUP, NULL) == 0);
+}
+
+static struct io_uring_cqe *iour_wait_cqe(struct iour *iour)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Spin for a while before blocking, to give the poller a chance to
+     * complete the request without a syscall. */
+    for (int i = 0; i < 1000; i++) {
+        cqe = iour_get_cqe(iour);
+        if (cqe)
+            return cqe;
+    }
+    test_assert(syscall(SYS_io_uring_enter, iour->fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL) == 0);
+    cqe = iour_get_cqe(iour);
+    test_assert(cqe);
+    return cqe;
+}
+
 static int iour_exit(struct iour *iour)
 {
     return close(iour->fd);
@@ -426,7 +510,7 @@ static void iour_test_basic(void)
     struct io_uring_params params;
     int fd;
     struct io_uring_probe *probe;
-    const int probe_ops = IORING_OP_WRITE + 1;
+    const int probe_ops = IORING_OP_RECV + 1;
     void *ptr;
     struct timespec ts;
     struct io_uring_cqe *cqe;
@@ -474,16 +558,24 @@ static void iour_test_basic(void)
         case IORING_OP_NOP:
         case IORING_OP_READV:
         case IORING_OP_WRITEV:
+        case IORING_OP_FSYNC:
         case IORING_OP_READ_FIXED:
         case IORING_OP_WRITE_FIXED:
         case IORING_OP_POLL_ADD:
         case IORING_OP_POLL_REMOVE:
+        case IORING_OP_SYNC_FILE_RANGE:
         case IORING_OP_TIMEOUT:
         case IORING_OP_TIMEOUT_REMOVE:
         case IORING_OP_CLOSE:
         case IORING_OP_FILES_UPDATE:
         case IORING_OP_READ:
         case IORING_OP_WRITE:
+        case IORING_OP_SENDMSG:
+        case IORING_OP_RECVMSG:
+        case IORING_OP_ACCEPT:
+        case IORING_OP_CONNECT:
+        case IORING_OP_SEND:
+        case IORING_OP_RECV:
             test_assert(probe->ops[i].flags & IO_URING_OP_SUPPORTED);
             break;
         default:
@@ -1182,6 +1274,403 @@ static void iour_test_register_files(void)
     test_assert(iour_exit(&iour) == 0);
 }
 
+static void iour_test_link(void)
+{
+    struct iour iour;
+    int fd, efd, pipe_fds[2];
+    uint8_t buf[8];
+    uint64_t efd_val;
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    fd = open("file_link", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    test_assert(fd > 0);
+    test_assert(pipe(pipe_fds) == 0);
+    memset(&iour.params, 0, sizeof(iour.params));
+    test_assert(iour_init(&iour, 8) == 0);
+
+    /* A read linked to a write sees the written data. */
+    iour_setup_write(&iour, fd, (uint8_t *)"link", strlen("link"), 0, 1);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_read(&iour, fd, buf, sizeof(buf), 0, 2);
+    test_assert(iour_submit(&iour, 2, 2) == 2);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 1) && (cqe->res == strlen("link")));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 2) && (cqe->res == strlen("link")));
+    test_assert(!memcmp(buf, "link", strlen("link")));
+
+    /* A failed request cancels the rest of the chain... */
+    iour_setup_read(&iour, -1, buf, sizeof(buf), 0, 3);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_nop(&iour, 4);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_nop(&iour, 5);
+    test_assert(iour_submit(&iour, 3, 3) == 3);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 3) && (cqe->res == -EBADF));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 4) && (cqe->res == -ECANCELED));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 5) && (cqe->res == -ECANCELED));
+
+    /* ...unless it is hard-linked. */
+    iour_setup_read(&iour, -1, buf, sizeof(buf), 0, 6);
+    iour_set_flags(&iour, IOSQE_IO_HARDLINK);
+    iour_setup_nop(&iour, 7);
+    test_assert(iour_submit(&iour, 2, 2) == 2);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 6) && (cqe->res == -EBADF));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 7) && (cqe->res == 0));
+
+    /* Completions posted by a single submission are signaled once. */
+    efd = eventfd(0, EFD_NONBLOCK);
+    test_assert(efd > 0);
+    ret = syscall(SYS_io_uring_register, iour.fd, IORING_REGISTER_EVENTFD, &efd,
+        1);
+    test_assert(ret == 0);
+    for (int i = 0; i < 4; i++)
+        iour_setup_nop(&iour, i);
+    test_assert(iour_submit(&iour, 4, 4) == 4);
+    test_assert(read(efd, &efd_val, sizeof(efd_val)) == sizeof(efd_val));
+    test_assert(efd_val == 1);
+    for (int i = 0; i < 4; i++) {
+        cqe = iour_get_cqe(&iour);
+        test_assert(cqe && (cqe->user_data == i) && (cqe->res == 0));
+    }
+    test_assert(close(efd) == 0);
+
+    /* A drained request, and anything submitted after it, waits for the
+     * completion of earlier requests. */
+    iour_setup_poll_add(&iour, pipe_fds[0], POLLIN, 8);
+    iour_setup_nop(&iour, 9);
+    iour_set_flags(&iour, IOSQE_IO_DRAIN);
+    iour_setup_nop(&iour, 10);
+    test_assert(iour_submit(&iour, 3, 0) == 3);
+    test_assert(iour_get_cqe(&iour) == NULL);
+    test_assert(write(pipe_fds[1], buf, sizeof(buf)) == sizeof(buf));
+    test_assert(iour_submit(&iour, 0, 3) == 0);
+    for (uint64_t user_data = 8; user_data <= 10; user_data++) {
+        cqe = iour_get_cqe(&iour);
+        test_assert(cqe && (cqe->user_data == user_data));
+    }
+    test_assert(read(pipe_fds[0], buf, sizeof(buf)) == sizeof(buf));
+
+    /* A chain still pending when the ring is closed is canceled. */
+    iour_setup_poll_add(&iour, pipe_fds[0], POLLIN, 11);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_nop(&iour, 12);
+    test_assert(iour_submit(&iour, 2, 0) == 2);
+    test_assert(iour_get_cqe(&iour) == NULL);
+
+    test_assert(iour_exit(&iour) == 0);
+    test_assert(close(pipe_fds[0]) == 0);
+    test_assert(close(pipe_fds[1]) == 0);
+    test_assert(close(fd) == 0);
+}
+
+static void iour_test_fsync(void)
+{
+    struct iour iour;
+    int fd, pipe_fds[2];
+    uint8_t buf[4096];
+    struct io_uring_cqe *cqe;
+
+    fd = open("file_fsync", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    test_assert(fd > 0);
+    test_assert(pipe(pipe_fds) == 0);
+    memset(&iour.params, 0, sizeof(iour.params));
+    test_assert(iour_init(&iour, 8) == 0);
+    memset(buf, 0xa5, sizeof(buf));
+
+    /* A commit: data write followed by an fsync of the file. */
+    iour_setup_write(&iour, fd, buf, sizeof(buf), 0, 1);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_fsync(&iour, fd, 0, 2);
+    test_assert(iour_submit(&iour, 2, 2) == 2);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 1) && (cqe->res == sizeof(buf)));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 2) && (cqe->res == 0));
+
+    /* Appending write and fdatasync */
+    iour_setup_write(&iour, fd, buf, sizeof(buf), sizeof(buf), 3);
+    iour_set_flags(&iour, IOSQE_IO_LINK);
+    iour_setup_fsync(&iour, fd, IORING_FSYNC_DATASYNC, 4);
+    test_assert(iour_submit(&iour, 2, 2) == 2);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 3) && (cqe->res == sizeof(buf)));
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 4) && (cqe->res == 0));
+    test_assert(pread(fd, buf, sizeof(buf), sizeof(buf)) == sizeof(buf));
+    for (int i = 0; i < sizeof(buf); i++)
+        test_assert(buf[i] == 0xa5);
+
+    /* Partial range write-back, and write-back to the end of the file. */
+    test_assert(pwrite(fd, buf, 16, 100) == 16);
+    iour_setup_sync_file_range(&iour, fd, 0, 512, SYNC_FILE_RANGE_WAIT_BEFORE |
+        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER, 5);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 5) && (cqe->res == 0));
+    iour_setup_sync_file_range(&iour, fd, 512, 0, SYNC_FILE_RANGE_WRITE, 6);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 6) && (cqe->res == 0));
+
+    /* Invalid requests */
+    iour_setup_fsync(&iour, fd, ~IORING_FSYNC_DATASYNC, 7);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 7) && (cqe->res == -EINVAL));
+    iour_setup_fsync(&iour, -1, 0, 8);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 8) && (cqe->res == -EBADF));
+    iour_setup_sync_file_range(&iour, fd, 0, 0, ~0, 9);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 9) && (cqe->res == -EINVAL));
+    iour_setup_sync_file_range(&iour, pipe_fds[0], 0, 0, SYNC_FILE_RANGE_WRITE,
+        10);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 10) && (cqe->res == -ESPIPE));
+
+    test_assert(iour_exit(&iour) == 0);
+    test_assert(close(pipe_fds[0]) == 0);
+    test_assert(close(pipe_fds[1]) == 0);
+    test_assert(close(fd) == 0);
+}
+
+static void iour_test_net(void)
+{
+    struct iour iour;
+    struct io_uring_cqe *cqe;
+    struct sockaddr_in addr, peer_addr;
+    socklen_t addrlen = sizeof(addr), peer_addrlen = sizeof(peer_addr);
+    char send_buf[] = "io_uring network test";
+    char recv_buf[BUF_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    int fd, ls, cs, as = -1;
+    bool accepted = false, connected = false;
+
+    memset(&iour.params, 0, sizeof(iour.params));
+    test_assert(iour_init(&iour, 4) == 0);
+
+    fd = open("file_net", O_RDWR | O_CREAT, S_IRWXU);
+    test_assert(fd > 0);
+    iour_setup_sqe(&iour, IORING_OP_RECV, fd, (uint64_t)recv_buf,
+                   sizeof(recv_buf), 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->res == -ENOTSOCK));
+    test_assert(close(fd) == 0);
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(ls >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    test_assert(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    test_assert(getsockname(ls, (struct sockaddr *)&addr, &addrlen) == 0);
+    test_assert(listen(ls, 1) == 0);
+    cs = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(cs >= 0);
+
+    /* The accept is pending when the connect is submitted, and both complete
+     * asynchronously. */
+    iour_setup_sqe(&iour, IORING_OP_ACCEPT, ls, (uint64_t)&peer_addr, 0,
+                   (uint64_t)&peer_addrlen, 1);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    iour_setup_sqe(&iour, IORING_OP_CONNECT, cs, (uint64_t)&addr, 0, addrlen,
+                   2);
+    test_assert(iour_submit(&iour, 1, 2) == 1);
+    while ((cqe = iour_get_cqe(&iour))) {
+        if (cqe->user_data == 1) {
+            test_assert(cqe->res > 0);
+            as = cqe->res;
+            accepted = true;
+        } else {
+            test_assert((cqe->user_data == 2) && (cqe->res == 0));
+            connected = true;
+        }
+    }
+    test_assert(accepted && connected);
+    test_assert((peer_addrlen == sizeof(peer_addr)) &&
+                (peer_addr.sin_family == AF_INET));
+
+    /* A receive posted ahead of the data */
+    iour_setup_sqe(&iour, IORING_OP_RECV, as, (uint64_t)recv_buf,
+                   sizeof(recv_buf), 0, 3);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    test_assert(iour_get_cqe(&iour) == NULL);
+    iour_setup_sqe(&iour, IORING_OP_SEND, cs, (uint64_t)send_buf,
+                   sizeof(send_buf), 0, 4);
+    test_assert(iour_submit(&iour, 1, 2) == 1);
+    for (int i = 0; i < 2; i++) {
+        cqe = iour_get_cqe(&iour);
+        test_assert(cqe && (cqe->res == sizeof(send_buf)));
+        test_assert((cqe->user_data == 3) || (cqe->user_data == 4));
+    }
+    test_assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+
+    /* Scatter-gather in both directions */
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = send_buf;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = send_buf + 3;
+    iov[1].iov_len = sizeof(send_buf) - 3;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iour_setup_sqe(&iour, IORING_OP_SENDMSG, as, (uint64_t)&msg, 1, 0, 5);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 5) &&
+                (cqe->res == sizeof(send_buf)));
+    memset(recv_buf, 0, sizeof(recv_buf));
+    iov[0].iov_base = recv_buf;
+    iov[0].iov_len = sizeof(recv_buf);
+    msg.msg_iovlen = 1;
+    iour_setup_sqe(&iour, IORING_OP_RECVMSG, cs, (uint64_t)&msg, 1, 0, 6);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 6) &&
+                (cqe->res == sizeof(send_buf)));
+    test_assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+
+    /* A receive on a connection closed by the peer */
+    test_assert(close(as) == 0);
+    iour_setup_sqe(&iour, IORING_OP_RECV, cs, (uint64_t)recv_buf,
+                   sizeof(recv_buf), 0, 7);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 7) && (cqe->res == 0));
+
+    test_assert(close(cs) == 0);
+    test_assert(close(ls) == 0);
+    test_assert(iour_exit(&iour) == 0);
+}
+
+static void iour_test_sqpoll(void)
+{
+    struct iour iour;
+    struct io_uring_cqe *cqe;
+    struct timespec ts;
+
+    memset(&iour.params, 0, sizeof(iour.params));
+    iour.params.flags = IORING_SETUP_SQPOLL;
+    iour.params.sq_thread_idle = SQPOLL_IDLE_MS;
+    test_assert(iour_init(&iour, 1) == 0);
+
+    /* Submission without a syscall */
+    iour_setup_nop(&iour, 1);
+    iour_sqpoll_kick(&iour);
+    cqe = iour_wait_cqe(&iour);
+    test_assert((cqe->res == 0) && (cqe->user_data == 1));
+    test_assert(*iour.sq_head == *iour.sq_tail);
+
+    /* Once idle, the poller must be woken up. */
+    ts.tv_sec = 0;
+    ts.tv_nsec = 5 * SQPOLL_IDLE_MS * 1000000;
+    test_assert(nanosleep(&ts, NULL) == 0);
+    read_barrier();
+    test_assert(*iour.sq_flags & IORING_SQ_NEED_WAKEUP);
+    iour_setup_nop(&iour, 2);
+    test_assert(syscall(SYS_io_uring_enter, iour.fd, 1, 1,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP,
+                        NULL) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->res == 0) && (cqe->user_data == 2));
+
+    test_assert(iour_exit(&iour) == 0);
+}
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Reads of registered buffers at pseudo-random offsets, with a fixed queue
+ * depth; returns the number of I/O operations per second. */
+static unsigned long long iour_bench(int fd, bool sqpoll)
+{
+    static uint8_t bufs[BENCH_QUEUE_DEPTH][BENCH_BLOCK_SIZE];
+    struct iour iour;
+    struct iovec iov;
+    struct io_uring_cqe *cqe;
+    unsigned int seed = 1;
+    unsigned int submitted = 0, completed = 0, inflight = 0;
+
+    memset(&iour.params, 0, sizeof(iour.params));
+    if (sqpoll)
+        iour.params.flags = IORING_SETUP_SQPOLL;
+    test_assert(iour_init(&iour, BENCH_QUEUE_DEPTH) == 0);
+    iov.iov_base = bufs;
+    iov.iov_len = sizeof(bufs);
+    test_assert(syscall(SYS_io_uring_register, iour.fd,
+                        IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+
+    unsigned long long start = now_nsec();
+    while (completed < BENCH_OPS) {
+        unsigned int to_submit = 0;
+        while ((inflight + to_submit < BENCH_QUEUE_DEPTH) &&
+               (submitted + to_submit < BENCH_OPS)) {
+            int slot = (submitted + to_submit) % BENCH_QUEUE_DEPTH;
+            off_t offset = (rand_r(&seed) % BENCH_FILE_BLOCKS) *
+                    BENCH_BLOCK_SIZE;
+            iour_setup_rw_fixed(&iour, fd, 0, false, bufs[slot],
+                                BENCH_BLOCK_SIZE, offset, slot);
+            to_submit++;
+        }
+        if (sqpoll) {
+            if (to_submit)
+                iour_sqpoll_kick(&iour);
+            cqe = iour_wait_cqe(&iour);
+        } else {
+            test_assert(iour_submit(&iour, to_submit, 1) == to_submit);
+            cqe = iour_get_cqe(&iour);
+            test_assert(cqe);
+        }
+        submitted += to_submit;
+        inflight += to_submit;
+        do {
+            test_assert(cqe->res == BENCH_BLOCK_SIZE);
+            completed++;
+            inflight--;
+        } while ((cqe = iour_get_cqe(&iour)));
+    }
+    unsigned long long elapsed = now_nsec() - start;
+    test_assert(iour_exit(&iour) == 0);
+    return completed * 1000000000ull / elapsed;
+}
+
+static void iour_test_sqpoll_bench(void)
+{
+    static uint8_t buf[BENCH_BLOCK_SIZE];
+    int fd;
+
+    fd = open("file_sqpoll_bench", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    test_assert(fd > 0);
+    for (int i = 0; i < BENCH_FILE_BLOCKS; i++) {
+        memset(buf, i, sizeof(buf));
+        test_assert(write(fd, buf, sizeof(buf)) == sizeof(buf));
+    }
+    unsigned long long iops = iour_bench(fd, false);
+    unsigned long long iops_sqpoll = iour_bench(fd, true);
+    printf("%d-byte fixed buffer reads, queue depth %d: %llu IOPS, "
+           "%llu IOPS with SQPOLL\n", BENCH_BLOCK_SIZE, BENCH_QUEUE_DEPTH, iops,
+           iops_sqpoll);
+    test_assert(close(fd) == 0);
+    test_assert(unlink("file_sqpoll_bench") == 0);
+}
+
 int main(int argc, char **argv)
 {
     setbuf(stdout, NULL);
@@ -1197,6 +1686,11 @@ int main(int argc, char **argv)
     iour_test_close();
     iour_test_sig();
     iour_test_register_files();
+    iour_test_link();
+    iour_test_fsync();
+    iour_test_net();
+    iour_test_sqpoll();
+    iour_test_sqpoll_bench();
     printf("IO uring test OK\n");
     return EXIT_SUCCESS;
 }
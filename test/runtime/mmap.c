@@ -1,6 +1,7 @@
 /* tests for mmap, munmap, mremap, and mincore */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -11,6 +12,7 @@
 #include <stdint.h>
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -188,6 +190,314 @@ static void mmap_newfile_test(void)
     }
 }
 
+#define FILE_BACKED_PAGES 4
+
+static void check_page_fill(const char *what, const unsigned char *p, unsigned char c)
+{
+    for (int i = 0; i < PAGESIZE; i++) {
+        if (p[i] != c) {
+            fprintf(stderr, "%s: byte %d is 0x%02x, expected 0x%02x\n", what, i, p[i], c);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * File mappings are faulted in from the page cache: check that private
+ * writes stay private, that shared mappings see writes to the file, and
+ * that file offsets are kept across partial munmap and mprotect.
+ */
+static void mmap_file_backed_test(void)
+{
+    unsigned char buf[PAGESIZE];
+    unsigned char *private, *shared;
+    const size_t len = FILE_BACKED_PAGES * PAGESIZE;
+    int fd, i;
+
+    printf("  performing file-backed mmap test...\n");
+    fd = open("file_backed", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("file-backed open");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < FILE_BACKED_PAGES; i++) {
+        memset(buf, 'a' + i, PAGESIZE);
+        if (write(fd, buf, PAGESIZE) != PAGESIZE) {
+            perror("file-backed write");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    private = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    shared = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (private == MAP_FAILED || shared == MAP_FAILED) {
+        perror("file-backed mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < FILE_BACKED_PAGES; i++) {
+        check_page_fill("private", private + i * PAGESIZE, 'a' + i);
+        check_page_fill("shared", shared + i * PAGESIZE, 'a' + i);
+    }
+
+    /* a private write is visible neither in the file nor elsewhere */
+    memset(private + PAGESIZE, 'x', PAGESIZE);
+    check_page_fill("shared after private write", shared + PAGESIZE, 'b');
+    if (pread(fd, buf, PAGESIZE, PAGESIZE) != PAGESIZE) {
+        perror("file-backed pread");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("file after private write", buf, 'b');
+
+    /* a write to the file shows through the shared mapping */
+    memset(buf, 'y', PAGESIZE);
+    if (pwrite(fd, buf, PAGESIZE, 2 * PAGESIZE) != PAGESIZE) {
+        perror("file-backed pwrite");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("shared after file write", shared + 2 * PAGESIZE, 'y');
+
+    /* remaining pieces keep their file offsets */
+    if (munmap(shared + PAGESIZE, PAGESIZE)) {
+        perror("file-backed munmap");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("shared head", shared, 'a');
+    check_page_fill("shared tail", shared + 3 * PAGESIZE, 'd');
+    if (munmap(shared, len)) {
+        perror("file-backed munmap");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a read-only private mapping made writable goes private */
+    private = mmap(private, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (private == MAP_FAILED) {
+        perror("file-backed mmap fixed");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("private remap", private + PAGESIZE, 'b');
+    check_page_fill("private remap", private + 3 * PAGESIZE, 'd');
+    if (mprotect(private + 3 * PAGESIZE, PAGESIZE, PROT_READ | PROT_WRITE)) {
+        perror("file-backed mprotect");
+        exit(EXIT_FAILURE);
+    }
+    memset(private + 3 * PAGESIZE, 'z', PAGESIZE);
+    if (pread(fd, buf, PAGESIZE, 3 * PAGESIZE) != PAGESIZE) {
+        perror("file-backed pread");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("file after mprotect write", buf, 'd');
+    check_page_fill("private after mprotect", private + 2 * PAGESIZE, 'y');
+    if (munmap(private, len)) {
+        perror("file-backed munmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/*
+ * Writes through a shared mapping reach the file: check them with
+ * msync, after munmap, and at the end of a file whose length is not a
+ * multiple of the page size.
+ */
+static void mmap_shared_writeback_test(void)
+{
+    unsigned char buf[PAGESIZE];
+    unsigned char *shared;
+    const size_t len = FILE_BACKED_PAGES * PAGESIZE;
+    const off_t filelen = len - PAGESIZE / 2;
+    struct stat st;
+    int fd, i;
+
+    printf("  performing shared writeback test...\n");
+    fd = open("shared_writeback", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("shared writeback open");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, filelen)) {
+        perror("shared writeback ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    shared = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) {
+        perror("shared writeback mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < FILE_BACKED_PAGES - 1; i++)
+        memset(shared + i * PAGESIZE, 'a' + i, PAGESIZE);
+    memset(shared + len - PAGESIZE, 'z', PAGESIZE);
+
+    if (msync(shared + 1, PAGESIZE, MS_SYNC) == 0 || errno != EINVAL ||
+        msync(shared, PAGESIZE, MS_SYNC | MS_ASYNC) == 0 || errno != EINVAL) {
+        fprintf(stderr, "msync with bad arguments did not fail with EINVAL\n");
+        exit(EXIT_FAILURE);
+    }
+    if (msync(shared, len, MS_ASYNC) || msync(shared, len, MS_SYNC)) {
+        perror("shared writeback msync");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < FILE_BACKED_PAGES - 1; i++) {
+        if (pread(fd, buf, PAGESIZE, i * PAGESIZE) != PAGESIZE) {
+            perror("shared writeback pread");
+            exit(EXIT_FAILURE);
+        }
+        check_page_fill("file after msync", buf, 'a' + i);
+    }
+
+    /* writes past the end of file don't extend it */
+    if (fstat(fd, &st) || st.st_size != filelen) {
+        fprintf(stderr, "file size %ld after msync, expected %ld\n", st.st_size, filelen);
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, buf, PAGESIZE, len - PAGESIZE) != PAGESIZE / 2) {
+        perror("shared writeback pread tail");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < PAGESIZE / 2; i++) {
+        if (buf[i] != 'z') {
+            fprintf(stderr, "tail byte %d is 0x%02x, expected 'z'\n", i, buf[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* dirty pages survive munmap */
+    memset(shared + PAGESIZE, 'q', PAGESIZE);
+    if (munmap(shared, len)) {
+        perror("shared writeback munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (msync(shared, len, MS_SYNC) == 0 || errno != ENOMEM) {
+        fprintf(stderr, "msync of unmapped range did not fail with ENOMEM\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    fd = open("shared_writeback", O_RDONLY);
+    if (fd < 0 || pread(fd, buf, PAGESIZE, PAGESIZE) != PAGESIZE) {
+        perror("shared writeback reopen");
+        exit(EXIT_FAILURE);
+    }
+    check_page_fill("file after munmap", buf, 'q');
+    close(fd);
+}
+
+#define FAULT_TEST_PAGES 64
+
+/*
+ * Touch an anonymous mapping sequentially, as a warming heap would, and
+ * check that the pages come up zeroed and are counted as faults.
+ */
+static void mmap_fault_stats_test(void)
+{
+    struct rusage before, after;
+    static char buf[16384];
+
+    printf("  performing fault stats test...\n");
+    unsigned char *p = mmap(NULL, FAULT_TEST_PAGES * PAGESIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    if (getrusage(RUSAGE_SELF, &before) < 0) {
+        perror("getrusage");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < FAULT_TEST_PAGES; i++) {
+        check_page_fill("sequential anonymous fault", p + i * PAGESIZE, 0);
+        memset(p + i * PAGESIZE, i + 1, PAGESIZE);
+    }
+    for (int i = 0; i < FAULT_TEST_PAGES; i++)
+        check_page_fill("sequential anonymous fault", p + i * PAGESIZE, i + 1);
+    if (getrusage(RUSAGE_SELF, &after) < 0) {
+        perror("getrusage");
+        exit(EXIT_FAILURE);
+    }
+    if (after.ru_minflt <= before.ru_minflt) {
+        printf("minor fault count did not advance (%ld -> %ld)\n",
+               before.ru_minflt, after.ru_minflt);
+        exit(EXIT_FAILURE);
+    }
+    do_munmap(p, FAULT_TEST_PAGES * PAGESIZE);
+
+    int fd = open("/proc/vmstat", O_RDONLY);
+    if (fd < 0) {
+        perror("open /proc/vmstat");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    if (len == 0) {
+        perror("read /proc/vmstat");
+        exit(EXIT_FAILURE);
+    }
+    buf[len] = '\0';
+    if (strncmp(buf, "pgfault ", 8) && !strstr(buf, "\npgfault ")) {
+        printf("pgfault missing from /proc/vmstat\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+#define HUGE_TEST_SIZE (4 << 20)
+
+/*
+ * Large anonymous mappings may be backed by 2M pages; check that their
+ * contents are preserved when they are partially unmapped and
+ * reprotected, and that the pages on either side remain usable.
+ */
+static void mmap_huge_page_test(void)
+{
+    printf("  performing huge page test...\n");
+    unsigned char *p = mmap(NULL, HUGE_TEST_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    if (madvise(p, HUGE_TEST_SIZE, MADV_HUGEPAGE) < 0 && errno != EINVAL) {
+        perror("madvise");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < HUGE_TEST_SIZE / PAGESIZE; i++)
+        check_page_fill("huge page fault", p + i * PAGESIZE, 0);
+    for (int i = 0; i < HUGE_TEST_SIZE / PAGESIZE; i++)
+        memset(p + i * PAGESIZE, i & 0xff, PAGESIZE);
+
+    /* punch a hole in the middle of the first 2M */
+    unsigned char *hole = p + (1 << 20);
+    if (munmap(hole, PAGESIZE) < 0) {
+        perror("munmap hole");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char vec;
+    if (mincore(hole, PAGESIZE, &vec) == 0 || errno != ENOMEM) {
+        printf("mincore on punched hole should fail with ENOMEM\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* make a single page read-only in the middle of the second 2M */
+    unsigned char *ro = p + (3 << 20);
+    if (mprotect(ro, PAGESIZE, PROT_READ) < 0) {
+        perror("mprotect");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < HUGE_TEST_SIZE / PAGESIZE; i++) {
+        unsigned char *q = p + i * PAGESIZE;
+        if (q != hole)
+            check_page_fill("after huge page split", q, i & 0xff);
+    }
+    memset(ro + PAGESIZE, 0x5a, PAGESIZE);
+    memset(hole - PAGESIZE, 0xa5, PAGESIZE);
+    check_page_fill("write next to read-only page", ro + PAGESIZE, 0x5a);
+    check_page_fill("write next to hole", hole - PAGESIZE, 0xa5);
+    check_page_fill("read-only page", ro, (ro - p) / PAGESIZE & 0xff);
+
+    do_munmap(p, hole - p);
+    do_munmap(hole + PAGESIZE, p + HUGE_TEST_SIZE - (hole + PAGESIZE));
+}
+
 /*
  * Test correctness of virtual memory space tracking.
  *
@@ -366,6 +676,10 @@ static void mmap_test(void)
     printf("** starting mmap tests\n");
 
     mmap_newfile_test();
+    mmap_file_backed_test();
+    mmap_shared_writeback_test();
+    mmap_fault_stats_test();
+    mmap_huge_page_test();
 
     printf("  performing large mmap...\n");
     void * map_addr = mmap(NULL, LARGE_MMAP_SIZE, PROT_READ|PROT_WRITE,
@@ -556,6 +870,12 @@ static void mincore_test(void)
             exit(EXIT_FAILURE);
         }
 
+        /* a huge page would make every page resident */
+        if (madvise(addr, PAGESIZE*512, MADV_NOHUGEPAGE) < 0 && errno != EINVAL) {
+            perror("madvise failed");
+            exit(EXIT_FAILURE);
+        }
+
         for (i = 0; i < 512; i++) {
             if (i % 5 == 0) {
                 memset(addr + (i << PAGELOG), 0, PAGESIZE);
@@ -0,0 +1,86 @@
+/* pread microbenchmark
+
+   A file is written and then read back with pread(2) in a tight loop,
+   at pseudo-random offsets, for a fixed period per read size. The call
+   rate and throughput are reported for each size, so that reads served
+   directly from resident cache pages can be compared with those
+   large enough to take the regular path. The file size in KB may be
+   given as the first argument. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DURATION_NSEC 1000000000ull
+#define BENCH_FILE          "pread_bench.dat"
+#define MAX_READ_SIZE       (256 * 1024)
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+static const size_t read_sizes[] = { 64, 512, 4096, 16384, 65536, MAX_READ_SIZE };
+
+static char buf[MAX_READ_SIZE];
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run_size(int fd, size_t file_size, size_t size)
+{
+    unsigned long long calls = 0, bytes = 0;
+    unsigned int seed = 1;
+    unsigned long long start = now_nsec(), elapsed;
+    do {
+        /* batch between clock reads to keep them out of the measurement */
+        for (int i = 0; i < 64; i++) {
+            off_t offset = (rand_r(&seed) % (file_size - size + 1)) & ~63ull;
+            ssize_t rv = pread(fd, buf, size, offset);
+            if (rv != size)
+                fail_perror("pread of %zu at %ld returned %ld", size, offset, rv);
+            bytes += rv;
+        }
+        calls += 64;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_DURATION_NSEC);
+    printf("%zu\t%llu\t%.0f\n", size, calls * 1000000000ull / elapsed,
+           (double)bytes * 1000000000.0 / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+    size_t file_size = (argc > 1 ? atoi(argv[1]) : 1024) * 1024;
+    if (file_size < MAX_READ_SIZE) {
+        printf("usage: %s [file size in KB (at least %d)]\n", argv[0], MAX_READ_SIZE / 1024);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        fail_perror("open");
+    for (size_t off = 0; off < file_size; off += sizeof(buf)) {
+        memset(buf, off / sizeof(buf), sizeof(buf));
+        size_t n = file_size - off < sizeof(buf) ? file_size - off : sizeof(buf);
+        if (write(fd, buf, n) != n)
+            fail_perror("write");
+    }
+
+    /* one pass to make sure that everything is resident */
+    for (size_t off = 0; off < file_size; off += sizeof(buf)) {
+        if (pread(fd, buf, sizeof(buf), off) < 0)
+            fail_perror("pread");
+    }
+
+    printf("size\tcalls/sec\tMB/sec\n");
+    for (int i = 0; i < sizeof(read_sizes) / sizeof(read_sizes[0]); i++)
+        run_size(fd, file_size, read_sizes[i]);
+    close(fd);
+    unlink(BENCH_FILE);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,186 @@
+/* Thread dispatch throughput benchmark
+
+   Pairs of threads ping-pong a token through futexes, forcing a
+   wakeup / schedule / dispatch cycle for every handoff. The total
+   number of handoffs per second is reported for 1, 2, 4, ... pairs,
+   up to the number given as the first argument.
+
+   Then as many threads each write a block to a file of their own and
+   sync it, so that every operation waits on a device interrupt and
+   its bottom half. The total number of syncs per second is reported
+   for 1, 2, 4, ... threads.
+
+   Run with QEMU_FLAGS set to e.g. "-smp 4" and compare results across
+   vCPU counts. */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DURATION_NSEC 2000000000ull
+#define MAX_PAIRS           64
+#define SYNC_BLOCK_SIZE     4096
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+struct pair {
+    volatile int token;         /* 0: ping's turn, 1: pong's turn */
+    volatile int stop;
+    unsigned long long handoffs;
+} __attribute__((aligned(64)));
+
+static struct pair pairs[MAX_PAIRS];
+
+struct syncer {
+    int fd;
+    volatile int stop;
+    unsigned long long syncs;
+} __attribute__((aligned(64)));
+
+static struct syncer syncers[MAX_PAIRS];
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void futex_wait(volatile int *uaddr, int val)
+{
+    if (syscall(SYS_futex, uaddr, FUTEX_WAIT, val, 0, 0, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        fail_perror("futex wait");
+}
+
+static void futex_wake(volatile int *uaddr)
+{
+    if (syscall(SYS_futex, uaddr, FUTEX_WAKE, 1, 0, 0, 0) < 0)
+        fail_perror("futex wake");
+}
+
+static void run_side(struct pair *p, int me)
+{
+    while (!p->stop) {
+        while (p->token != me) {
+            if (p->stop)
+                return;
+            futex_wait(&p->token, !me);
+        }
+        p->token = !me;
+        if (me == 0)
+            p->handoffs++;
+        futex_wake(&p->token);
+    }
+}
+
+static void *ping(void *arg)
+{
+    run_side(arg, 0);
+    return 0;
+}
+
+static void *pong(void *arg)
+{
+    run_side(arg, 1);
+    return 0;
+}
+
+static unsigned long long run_pairs(int npairs)
+{
+    pthread_t threads[MAX_PAIRS * 2];
+    struct timespec ts = { BENCH_DURATION_NSEC / 1000000000ull, BENCH_DURATION_NSEC % 1000000000ull };
+
+    for (int i = 0; i < npairs; i++) {
+        memset(&pairs[i], 0, sizeof(pairs[i]));
+        if (pthread_create(&threads[i * 2], 0, ping, &pairs[i]) ||
+            pthread_create(&threads[i * 2 + 1], 0, pong, &pairs[i]))
+            fail_perror("pthread_create");
+    }
+
+    unsigned long long start = now_nsec();
+    nanosleep(&ts, 0);
+    for (int i = 0; i < npairs; i++) {
+        pairs[i].stop = 1;
+        pairs[i].token = -1;
+        syscall(SYS_futex, &pairs[i].token, FUTEX_WAKE, 2, 0, 0, 0);
+    }
+    unsigned long long elapsed = now_nsec() - start;
+
+    unsigned long long total = 0;
+    for (int i = 0; i < npairs * 2; i++)
+        pthread_join(threads[i], 0);
+    for (int i = 0; i < npairs; i++)
+        total += pairs[i].handoffs;
+    return total * 1000000000ull / elapsed;
+}
+
+static void *sync_loop(void *arg)
+{
+    struct syncer *s = arg;
+    char buf[SYNC_BLOCK_SIZE];
+    memset(buf, s->fd, sizeof(buf));
+    while (!s->stop) {
+        if (pwrite(s->fd, buf, sizeof(buf), 0) != sizeof(buf))
+            fail_perror("pwrite");
+        if (fdatasync(s->fd) < 0)
+            fail_perror("fdatasync");
+        s->syncs++;
+    }
+    return 0;
+}
+
+static unsigned long long run_syncers(int nthreads)
+{
+    pthread_t threads[MAX_PAIRS];
+    struct timespec ts = { BENCH_DURATION_NSEC / 1000000000ull, BENCH_DURATION_NSEC % 1000000000ull };
+
+    for (int i = 0; i < nthreads; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "sched_bench_sync%d", i);
+        memset(&syncers[i], 0, sizeof(syncers[i]));
+        syncers[i].fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (syncers[i].fd < 0)
+            fail_perror("open %s", name);
+        if (pthread_create(&threads[i], 0, sync_loop, &syncers[i]))
+            fail_perror("pthread_create");
+    }
+
+    unsigned long long start = now_nsec();
+    nanosleep(&ts, 0);
+    for (int i = 0; i < nthreads; i++)
+        syncers[i].stop = 1;
+    unsigned long long elapsed = now_nsec() - start;
+
+    unsigned long long total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], 0);
+        total += syncers[i].syncs;
+        close(syncers[i].fd);
+    }
+    return total * 1000000000ull / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    int max_pairs = argc > 1 ? atoi(argv[1]) : 8;
+    if (max_pairs < 1 || max_pairs > MAX_PAIRS) {
+        printf("usage: %s [max pairs (1-%d)]\n", argv[0], MAX_PAIRS);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("pairs\thandoffs/sec\n");
+    for (int n = 1; n <= max_pairs; n *= 2)
+        printf("%d\t%llu\n", n, run_pairs(n));
+
+    printf("threads\tsyncs/sec\n");
+    for (int n = 1; n <= max_pairs; n *= 2)
+        printf("%d\t%llu\n", n, run_syncers(n));
+    exit(EXIT_SUCCESS);
+}
@@ -8,6 +8,9 @@
 #include <sys/sendfile.h>
 #include <errno.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #define BUF_LEN 10
 
@@ -26,6 +29,76 @@
 } while (0)
 
 
+/* send the contents of fd_in over a loopback TCP connection and
+   compare what arrives with expected */
+static int sendfile_socket_test(int fd_in, const char *expected, int len)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char rbuf[BUF_LEN];
+    off_t offset = 0;
+    int ls, cs, as = -1, ret, n;
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls < 0) {
+        sf_err("socket error %d\n", errno);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(ls, (struct sockaddr *)&addr, &addrlen) < 0 ||
+        listen(ls, 1) < 0) {
+        sf_err("listen socket setup error %d\n", errno);
+        goto out_ls;
+    }
+    cs = socket(AF_INET, SOCK_STREAM, 0);
+    if (cs < 0) {
+        sf_err("socket error %d\n", errno);
+        goto out_ls;
+    }
+    if (connect(cs, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        sf_err("connect error %d\n", errno);
+        goto out_cs;
+    }
+    as = accept(ls, 0, 0);
+    if (as < 0) {
+        sf_err("accept error %d\n", errno);
+        goto out_cs;
+    }
+
+    ret = sendfile(cs, fd_in, &offset, len);
+    if (ret != len || offset != len) {
+        sf_err("sendfile to socket error %d, wrote %d of %d, offset %ld\n",
+               errno, ret, len, (long)offset);
+        goto out_as;
+    }
+    for (n = 0; n < len; n += ret) {
+        ret = read(as, rbuf + n, len - n);
+        if (ret <= 0) {
+            sf_err("socket read error %d, ret %d\n", errno, ret);
+            goto out_as;
+        }
+    }
+    if (memcmp(rbuf, expected, len) != 0) {
+        sf_err("sendfile to socket: content mismatch\n");
+        goto out_as;
+    }
+    close(as);
+    close(cs);
+    close(ls);
+    return 0;
+out_as:
+    close(as);
+out_cs:
+    close(cs);
+out_ls:
+    close(ls);
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     int ret;
@@ -83,6 +156,10 @@ int main(int argc, char *argv[])
     if (memcmp(buf, cmp_buf, sizeof(buf)) != 0)
         sf_err_goto(err_fop, "sendfile() failed!!\n");
 
+    if (sendfile_socket_test(fd_in, buf, BUF_LEN) < 0)
+        sf_err_goto(err_fop, "sendfile() to socket failed!!\n");
+    printf("sendfile() to socket success\n");
+
     close(fd_out);
     close(fd_in);
 
@@ -0,0 +1,151 @@
+/* Multi-threaded syscall storm
+
+   Worker threads issue raw syscalls in a tight loop for a fixed period,
+   and the aggregate rate is reported for 1, 2, 4, ... threads up to the
+   count given as the first argument. Syscalls that may run without
+   the kernel lock (getpid, pread of a file in the page cache, and an
+   epoll_wait that finds nothing ready) and ones that serialize on it
+   (write to a UDP socket, and getrusage) are measured so that the
+   scaling of each can be compared across vCPU counts (e.g.
+   QEMU_FLAGS="-smp 4"). */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STORM_DURATION_NSEC 1000000000ull
+#define MAX_THREADS         64
+#define PREAD_SIZE          512
+#define WRITE_SIZE          64
+#define DISCARD_PORT        9
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+struct worker {
+    long nr;
+    volatile int *stop;
+    unsigned long long count;
+} __attribute__((aligned(64)));
+
+static struct worker workers[MAX_THREADS];
+static int storm_fd;
+static int storm_epfd;
+static int storm_sockfd;
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *storm(void *arg)
+{
+    struct worker *w = arg;
+    struct rusage ru;
+    char buf[PREAD_SIZE];
+    while (!*w->stop) {
+        if (w->nr == SYS_getrusage)
+            syscall(SYS_getrusage, RUSAGE_SELF, &ru);
+        else if (w->nr == SYS_pread64)
+            syscall(SYS_pread64, storm_fd, buf, sizeof(buf), 0);
+        else if (w->nr == SYS_epoll_wait) {
+            struct epoll_event ev;
+            syscall(SYS_epoll_wait, storm_epfd, &ev, 1, 0);
+        } else if (w->nr == SYS_write)
+            syscall(SYS_write, storm_sockfd, buf, WRITE_SIZE);
+        else
+            syscall(w->nr);
+        w->count++;
+    }
+    return 0;
+}
+
+static unsigned long long run_storm(long nr, int nthreads)
+{
+    pthread_t threads[MAX_THREADS];
+    volatile int stop = 0;
+    struct timespec ts = { STORM_DURATION_NSEC / 1000000000ull, STORM_DURATION_NSEC % 1000000000ull };
+
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].nr = nr;
+        workers[i].stop = &stop;
+        workers[i].count = 0;
+        if (pthread_create(&threads[i], 0, storm, &workers[i]))
+            fail_perror("pthread_create");
+    }
+    unsigned long long start = now_nsec();
+    nanosleep(&ts, 0);
+    stop = 1;
+    unsigned long long elapsed = now_nsec() - start;
+
+    unsigned long long total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], 0);
+        total += workers[i].count;
+    }
+    return total * 1000000000ull / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        printf("usage: %s [max threads (1-%d)]\n", argv[0], MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the program's own file, which is in the page cache once read */
+    storm_fd = open(argv[0], O_RDONLY);
+    if (storm_fd < 0)
+        fail_perror("open %s", argv[0]);
+    char buf[PREAD_SIZE];
+    if (pread(storm_fd, buf, sizeof(buf), 0) != sizeof(buf))
+        fail_perror("pread");
+
+    /* an epoll instance watching the read end of an empty pipe */
+    int pipefds[2];
+    if (pipe(pipefds) < 0)
+        fail_perror("pipe");
+    storm_epfd = epoll_create1(0);
+    if (storm_epfd < 0)
+        fail_perror("epoll_create1");
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (epoll_ctl(storm_epfd, EPOLL_CTL_ADD, pipefds[0], &ev) < 0)
+        fail_perror("epoll_ctl");
+
+    /* a UDP socket sending to the discard port on the loopback interface */
+    storm_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (storm_sockfd < 0)
+        fail_perror("socket");
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DISCARD_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(storm_sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        fail_perror("connect");
+
+    printf("threads\tgetpid/sec\tpread/sec\tepoll_wait/sec\twrite/sec\tgetrusage/sec\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        unsigned long long lockless = run_storm(SYS_getpid, n);
+        unsigned long long pread_rate = run_storm(SYS_pread64, n);
+        unsigned long long epoll_rate = run_storm(SYS_epoll_wait, n);
+        unsigned long long write_rate = run_storm(SYS_write, n);
+        unsigned long long locked = run_storm(SYS_getrusage, n);
+        printf("%d\t%llu\t%llu\t%llu\t%llu\t%llu\n", n, lockless, pread_rate,
+               epoll_rate, write_rate, locked);
+    }
+    exit(EXIT_SUCCESS);
+}
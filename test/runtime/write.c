@@ -212,6 +212,44 @@ void append_write_test()
     exit(EXIT_FAILURE);
 }
 
+void sync_test()
+{
+    ssize_t rv;
+    int fd = open("sync", O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    _WRITE(str, strlen(str));
+    if (fdatasync(fd) < 0) {
+        perror("fdatasync");
+        goto out_fail;
+    }
+    _WRITE(str, strlen(str));
+    if (sync_file_range(fd, 0, strlen(str), SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+        perror("sync_file_range");
+        goto out_fail;
+    }
+    if (sync_file_range(fd, strlen(str), 0, SYNC_FILE_RANGE_WRITE) < 0) {
+        perror("sync_file_range to end of file");
+        goto out_fail;
+    }
+    if (fsync(fd) < 0) {
+        perror("fsync");
+        goto out_fail;
+    }
+    if (sync_file_range(fd, -1, 0, SYNC_FILE_RANGE_WRITE) == 0 || errno != EINVAL) {
+        printf("sync_file_range with negative offset: unexpected result\n");
+        goto out_fail;
+    }
+    close(fd);
+    return;
+  out_fail:
+    close(fd);
+    exit(EXIT_FAILURE);
+}
+
 void truncate_test()
 {
     unsigned char tmp[BUFLEN];
@@ -648,6 +686,7 @@ int main(int argc, char **argv)
         basic_write_test();
         scatter_write_test(1 << 18, 64, 1 << 12);
         append_write_test();
+        sync_test();
         truncate_test();
     }
 
@@ -0,0 +1,140 @@
+/* extent allocation test
+
+   A file on a memory-backed disk is grown by many small appends. These
+   are held in the cache and given storage ahead of them, so that the
+   file should end up with a handful of extents rather than one per
+   write. Trimming must then give back what was allocated past the end
+   of the file, and the contents must survive a remount. A second file
+   written in pages, each flushed on its own, checks that extents which
+   continue one another in storage are merged. */
+
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <pagecache.h>
+#include <tfs.h>
+#include <stdlib.h>
+#include "memdisk.h"
+
+#define APPEND_SIZE     200
+#define APPEND_COUNT    10000
+#define APPEND_LENGTH   (APPEND_SIZE * APPEND_COUNT)
+#define MAX_EXTENTS     (APPEND_LENGTH / MAX_EXTENT_SIZE + 2)
+#define PAGE_WRITES     64
+
+extern heap init_process_runtime();
+
+static u64 extent_field(tuple e, symbol a)
+{
+    u64 v;
+    if (!u64_from_value(table_find(e, a), &v))
+        return infinity;
+    return v;
+}
+
+/* number of extents in the file metadata, and the blocks they cover and
+   hold in storage */
+static int file_extents(fsfile f, u64 *length, u64 *allocated)
+{
+    tuple extents = table_find(fsfile_get_meta(f), sym(extents));
+    *length = *allocated = 0;
+    if (!extents)
+        return 0;
+    table_foreach(extents, k, v) {
+        (void)k;
+        *length += extent_field(v, sym(length));
+        *allocated += extent_field(v, sym(allocated));
+    }
+    return table_elements(extents);
+}
+
+static boolean append_test(heap h)
+{
+    u64 length, allocated;
+    filesystem fs = memdisk_mount(h, true, allocate_tuple());
+    test_assert(fs);
+    tuple root = allocate_tuple();
+    table_set(root, sym(children), allocate_tuple());
+    filesystem_write_tuple(fs, root);
+
+    tuple t = filesystem_creat(fs, root, "appended");
+    test_assert(t);
+    fsfile f = fsfile_from_node(fs, t);
+    for (u64 off = 0; off < APPEND_LENGTH; off += APPEND_SIZE)
+        test_assert(write_file(h, f, 0, irangel(off, APPEND_SIZE)));
+    test_assert(fsfile_get_length(f) == APPEND_LENGTH);
+    test_assert(memdisk_flush(h, fs));
+
+    int n = file_extents(f, &length, &allocated);
+    rprintf("%d appends of %d bytes: %d extents, %ld blocks allocated for %ld\n",
+            APPEND_COUNT, APPEND_SIZE, n, allocated, length);
+    test_assert(n > 0 && n <= MAX_EXTENTS);
+    test_assert(length == (APPEND_LENGTH + SECTOR_SIZE - 1) >> SECTOR_OFFSET);
+    test_assert(allocated >= length);
+
+    fsfile_trim(f);
+    test_assert(memdisk_flush(h, fs));
+    test_assert(file_extents(f, &length, &allocated) == n);
+    test_assert(allocated - length < (MIN_EXTENT_SIZE >> SECTOR_OFFSET));
+
+    /* an overwrite in the middle goes to the storage already there */
+    test_assert(write_file(h, f, 0, irangel(APPEND_LENGTH / 2, PAGESIZE)));
+    test_assert(memdisk_flush(h, fs));
+    test_assert(file_extents(f, &length, &allocated) == n);
+
+    fs = memdisk_mount(h, false, allocate_tuple());
+    test_assert(fs);
+    t = lookup(filesystem_getroot(fs), sym(appended));
+    test_assert(t);
+    f = fsfile_from_node(fs, t);
+    test_assert(check_file(h, f, 0, APPEND_LENGTH));
+    test_assert(file_extents(f, &length, &allocated) == n);
+    return true;
+  fail:
+    return false;
+}
+
+static boolean merge_test(heap h)
+{
+    u64 length, allocated;
+    filesystem fs = memdisk_mount(h, false, allocate_tuple());
+    test_assert(fs);
+    tuple t = filesystem_creat(fs, filesystem_getroot(fs), "merged");
+    test_assert(t);
+    fsfile f = fsfile_from_node(fs, t);
+    for (int i = 0; i < PAGE_WRITES; i++) {
+        test_assert(write_file(h, f, 1, irangel(i * PAGESIZE, PAGESIZE)));
+        test_assert(memdisk_flush(h, fs));
+    }
+    fsfile_trim(f);
+    test_assert(memdisk_flush(h, fs));
+    int n = file_extents(f, &length, &allocated);
+    rprintf("%d flushed page writes: %d extents\n", PAGE_WRITES, n);
+    test_assert(n == 1);
+    test_assert(length == PAGE_WRITES * (PAGESIZE >> SECTOR_OFFSET) && allocated == length);
+
+    fs = memdisk_mount(h, false, allocate_tuple());
+    test_assert(fs);
+    f = fsfile_from_node(fs, lookup(filesystem_getroot(fs), sym(merged)));
+    test_assert(check_file(h, f, 1, PAGE_WRITES * PAGESIZE));
+    test_assert(file_extents(f, &length, &allocated) == 1);
+    f = fsfile_from_node(fs, lookup(filesystem_getroot(fs), sym(appended)));
+    test_assert(check_file(h, f, 0, APPEND_LENGTH));
+    return true;
+  fail:
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    if (!memdisk_init()) {
+        msg_err("failed to allocate disk\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!append_test(h) || !merge_test(h)) {
+        msg_err("Test failed\n");
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,139 @@
+#include <runtime.h>
+#include <pagecache.h>
+#include <tfs.h>
+#include <stdlib.h>
+#include "memdisk.h"
+
+static u8 *disk;
+static filesystem mounted;
+status last_status;
+int completions;
+
+closure_function(0, 3, void, disk_read,
+                 void *, dest, range, blocks, status_handler, c)
+{
+    runtime_memcpy(dest, disk + (blocks.start << SECTOR_OFFSET), range_span(blocks) << SECTOR_OFFSET);
+    apply(c, STATUS_OK);
+}
+
+closure_function(0, 3, void, disk_write,
+                 void *, src, range, blocks, status_handler, c)
+{
+    runtime_memcpy(disk + (blocks.start << SECTOR_OFFSET), src, range_span(blocks) << SECTOR_OFFSET);
+    apply(c, STATUS_OK);
+}
+
+closure_function(0, 2, void, fs_mounted,
+                 filesystem, fs, status, s)
+{
+    mounted = is_ok(s) ? fs : 0;
+    last_status = s;
+}
+
+closure_function(0, 1, void, op_complete,
+                 status, s)
+{
+    last_status = s;
+    completions++;
+}
+
+closure_function(0, 2, void, fs_op_complete,
+                 fsfile, f, fs_status, s)
+{
+    last_status = s == FS_STATUS_OK ? STATUS_OK : timm("result", "fs status %d", s);
+    completions++;
+}
+
+closure_function(0, 2, void, io_complete,
+                 status, s, bytes, length)
+{
+    last_status = s;
+    completions++;
+}
+
+boolean memdisk_init(void)
+{
+    disk = malloc(DISK_SIZE);
+    if (!disk)
+        return false;
+    memdisk_clear();
+    return true;
+}
+
+void memdisk_clear(void)
+{
+    runtime_memset(disk, 0, DISK_SIZE);
+}
+
+/* Mount the filesystem on the disk, or make a new one if initialize. */
+filesystem memdisk_mount(heap h, boolean initialize, tuple root)
+{
+    pagecache pc = allocate_pagecache(h, h, PAGESIZE);
+    assert(pc != INVALID_ADDRESS);
+    mounted = 0;
+    create_filesystem(h, SECTOR_SIZE, DISK_SIZE, initialize ? 0 : closure(h, disk_read),
+                      closure(h, disk_write), pc, root, initialize, closure(h, fs_mounted));
+    if (!mounted)
+        msg_err("mount failed: %v\n", last_status);
+    return mounted;
+}
+
+boolean memdisk_flush(heap h, filesystem fs)
+{
+    completions = 0;
+    filesystem_flush(fs, closure(h, op_complete));
+    return completions == 1 && is_ok(last_status);
+}
+
+status_handler memdisk_op_complete(heap h)
+{
+    completions = 0;
+    return closure(h, op_complete);
+}
+
+fs_status_handler memdisk_fs_op_complete(heap h)
+{
+    completions = 0;
+    return closure(h, fs_op_complete);
+}
+
+u8 file_byte(int file, u64 offset)
+{
+    return (file * 31 + offset / 7) & 0xff;
+}
+
+boolean write_file(heap h, fsfile f, int file, range q)
+{
+    u8 *data = allocate(h, range_span(q));
+    test_assert(data != INVALID_ADDRESS);
+    for (u64 j = 0; j < range_span(q); j++)
+        data[j] = file_byte(file, q.start + j);
+    completions = 0;
+    filesystem_write_linear(f, data, q, closure(h, io_complete));
+    deallocate(h, data, range_span(q));
+    test_assert(completions == 1 && is_ok(last_status));
+    return true;
+  fail:
+    return false;
+}
+
+boolean check_file(heap h, fsfile f, int file, u64 length)
+{
+    u8 *data = 0;
+    test_assert(f);
+    test_assert(fsfile_get_length(f) == length);
+    data = allocate(h, length);
+    test_assert(data != INVALID_ADDRESS);
+    completions = 0;
+    runtime_memset(data, 0, length);
+    filesystem_read_linear(f, data, irange(0, length), closure(h, io_complete));
+    test_assert(completions == 1 && is_ok(last_status));
+    for (u64 j = 0; j < length; j++)
+        test_assert(data[j] == file_byte(file, j));
+    deallocate(h, data, length);
+    return true;
+  fail:
+    if (data && data != INVALID_ADDRESS)
+        deallocate(h, data, length);
+    return false;
+}
@@ -0,0 +1,27 @@
+/* A memory-backed disk for the filesystem tests, with helpers to mount
+   a filesystem on it and to write and check file contents. Operations
+   complete synchronously, leaving their status in last_status and
+   counting themselves in completions. */
+
+#define test_assert(expr) do { \
+if (expr) ; else { \
+	msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+	goto fail; \
+} \
+} while (0)
+
+#define DISK_SIZE       (64 * MB)
+
+extern status last_status;
+extern int completions;
+
+boolean memdisk_init(void);
+void memdisk_clear(void);
+filesystem memdisk_mount(heap h, boolean initialize, tuple root);
+boolean memdisk_flush(heap h, filesystem fs);
+status_handler memdisk_op_complete(heap h);
+fs_status_handler memdisk_fs_op_complete(heap h);
+
+u8 file_byte(int file, u64 offset);
+boolean write_file(heap h, fsfile f, int file, range q);
+boolean check_file(heap h, fsfile f, int file, u64 length);
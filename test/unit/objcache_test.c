@@ -108,6 +108,19 @@ boolean objcache_test(heap meta, heap parent, int objsize)
 	msg_err("allocated (%d) should be 0; fail\n", heap_allocated(h));
 	return false;
     }
+
+    /* hold one object, then drain the page left empty */
+    if (!alloc_vec(h, 1, objsize, objs))
+	return false;
+    bytes released = objcache_drain(h, infinity);
+    if (released != TEST_PAGESIZE || heap_total(h) != opp * objsize || !validate(h)) {
+	msg_err("drain released %ld, total %ld; fail\n", released, heap_total(h));
+	return false;
+    }
+    deallocate(h, vector_get(objs, 0), objsize);
+    vector_clear(objs);
+    if (!alloc_vec(h, opp + 1, objsize, objs) || !dealloc_vec(h, objsize, objs))
+	return false;
     h->destroy(h);
     return true;
 }
@@ -0,0 +1,178 @@
+/* concurrent pread benchmark
+
+   A node is read into the cache, then threads read it through the
+   resident fast path at random offsets for a fixed time. Each thread
+   count is run twice: lockless, as reads now go, and through the node
+   reader, which takes pages_lock and state_lock and hands back an sg
+   list to be copied from, as reads went before. Reads per second are
+   reported for both; the data read is checked, and the hits made by
+   the threads must all be counted once the batches are flushed. */
+
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <pagecache.h>
+#include <pagecache_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "pagecache_stub.h"
+
+#define NODE_PAGES      1024
+#define NODE_LENGTH     (NODE_PAGES * PAGESIZE)
+#define READ_SIZE       512
+#define MAX_THREADS     8
+#define RUN_NSEC        (200 * 1000 * 1000ull)
+
+typedef struct reader {
+    pthread_t thread;
+    int index;
+    u64 seed;
+    u64 reads;
+    u64 pages;
+    status_handler complete;
+    boolean done;
+    boolean failed;
+} *reader;
+
+static pagecache pc;
+static pagecache_node pn;
+static heap h;
+static sg_io node_reader;
+static boolean locked;
+static volatile boolean stop;
+
+extern heap init_process_runtime();
+
+static u64 now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* applied for every locked read of a reader, so not finished here */
+closure_function(1, 1, void, reader_read_complete,
+                 reader, r,
+                 status, s)
+{
+    if (!is_ok(s))
+        bound(r)->failed = true;
+    bound(r)->done = true;
+}
+
+/* the regular read path, as file_read takes it, with the pages resident */
+static u64 read_locked(reader r, u8 *buf, u64 offset)
+{
+    sg_list sg = allocate_sg_list();
+    if (sg == INVALID_ADDRESS)
+        return 0;
+    r->done = false;
+    apply(node_reader, sg, irangel(offset, READ_SIZE), r->complete);
+    if (!r->done || r->failed) {
+        sg_list_release(sg);
+        deallocate_sg_list(sg);
+        return 0;
+    }
+    return sg_copy_to_buf_and_release(buf, sg, READ_SIZE);
+}
+
+/* xorshift, one state per thread */
+static u64 reader_random(reader r)
+{
+    r->seed ^= r->seed << 13;
+    r->seed ^= r->seed >> 7;
+    r->seed ^= r->seed << 17;
+    return r->seed;
+}
+
+static void *reader_thread(void *arg)
+{
+    reader r = arg;
+    u8 buf[READ_SIZE];
+    pagecache_cpu = r->index;
+    while (!stop) {
+        u64 offset = reader_random(r) % (NODE_LENGTH - READ_SIZE);
+        u64 count = locked ? read_locked(r, buf, offset) :
+            pagecache_read_resident(pn, buf, irangel(offset, READ_SIZE));
+        if (count != READ_SIZE || buf[0] != node_byte(0, offset) ||
+            buf[READ_SIZE - 1] != node_byte(0, offset + READ_SIZE - 1)) {
+            r->failed = true;
+            break;
+        }
+        r->reads++;
+        r->pages += ((offset + READ_SIZE - 1) / PAGESIZE) - offset / PAGESIZE + 1;
+    }
+    return 0;
+}
+
+static boolean run(int nthreads, boolean use_reader, u64 *reads_per_sec)
+{
+    struct reader readers[MAX_THREADS];
+    struct pagecache_stats before, after;
+    u64 reads = 0, pages = 0;
+    boolean ok = true;
+
+    pagecache_get_stats(pc, &before);
+    locked = use_reader;
+    stop = false;
+    for (int i = 0; i < nthreads; i++) {
+        reader r = &readers[i];
+        zero(r, sizeof(*r));
+        r->index = i;
+        r->seed = 0x2545f4914f6cdd1dull + i;
+        r->complete = closure(h, reader_read_complete, r);
+        if (pthread_create(&r->thread, 0, reader_thread, r)) {
+            msg_err("unable to create thread\n");
+            return false;
+        }
+    }
+    u64 start = now_nsec();
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = RUN_NSEC };
+    nanosleep(&ts, 0);
+    stop = true;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(readers[i].thread, 0);
+        if (readers[i].failed) {
+            msg_err("thread %d: bad read\n", i);
+            ok = false;
+        }
+        reads += readers[i].reads;
+        pages += readers[i].pages;
+        deallocate_closure(readers[i].complete);
+    }
+    u64 elapsed = now_nsec() - start;
+    pagecache_get_stats(pc, &after);
+    if (after.hits - before.hits != pages) {
+        msg_err("%ld hits counted for %ld pages read\n", after.hits - before.hits, pages);
+        ok = false;
+    }
+    *reads_per_sec = reads * 1000000000ull / elapsed;
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    h = init_process_runtime();
+    pn = stub_node(stub_volume(h, &pc), h, 0, NODE_LENGTH, true);
+    node_reader = pagecache_node_get_reader(pn);
+
+    /* make every page resident */
+    sg_list sg = allocate_sg_list();
+    assert(sg != INVALID_ADDRESS);
+    apply(node_reader, sg, irange(0, NODE_LENGTH), stub_read_complete(h));
+    assert(completions == 1 && is_ok(last_status));
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
+
+    rprintf("threads\tlockless reads/s\tlocked reads/s\n");
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        u64 lockless, locked_reads;
+        if (!run(n, false, &lockless) || !run(n, true, &locked_reads)) {
+            msg_err("Test failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rprintf("%d\t%ld\t%ld\n", n, lockless, locked_reads);
+    }
+    exit(EXIT_SUCCESS);
+}
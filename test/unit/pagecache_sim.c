@@ -0,0 +1,222 @@
+/* page cache replacement benchmark
+
+   Traces of page reads are replayed through a cache held to a fixed
+   number of pages, and the hit ratio is reported next to that of a
+   plain LRU cache of the same size fed the same trace. Hits count
+   pages read again while resident; pages read ahead and then read
+   count as neither hits nor misses and are reported on their own.
+
+   The built-in traces are a loop over slightly more pages than the
+   cache holds, in an order that defeats readahead, a hot set
+   interleaved with scans of pages never read again, and skewed random
+   reads. A trace file given as argument is replayed instead, one
+   "node page" pair of decimal numbers per line. */
+
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <pagecache.h>
+#include <pagecache_internal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "pagecache_stub.h"
+
+#define CACHE_PAGES     1024
+#define MAX_NODES       16
+#define NODE_PAGES      (1ull << 20)
+
+#define LOOP_PAGES      (CACHE_PAGES + CACHE_PAGES / 4)
+#define LOOP_STRIDE     97      /* coprime with LOOP_PAGES */
+#define LOOP_ROUNDS     8
+#define HOT_PAGES       (CACHE_PAGES / 4)
+#define SCAN_PAGES      (2 * CACHE_PAGES)
+#define SCAN_ROUNDS     16
+#define SKEW_PAGES      (4 * CACHE_PAGES)
+#define SKEW_ACCESSES   (64 * CACHE_PAGES)
+
+typedef struct access {
+    u64 node;
+    u64 page;
+} *access;
+
+typedef struct trace {
+    const char *name;
+    access a;
+    u64 count;
+    u64 size;
+} *trace;
+
+typedef struct lru_entry {
+    struct list l;
+    u64 key;
+} *lru_entry;
+
+extern heap init_process_runtime();
+
+static u64 seed = 0x2545f4914f6cdd1dull;
+
+/* xorshift, so that runs can be compared */
+static u64 trace_random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static void trace_add(heap h, trace t, u64 node, u64 page)
+{
+    assert(node < MAX_NODES && page < NODE_PAGES);
+    if (t->count == t->size) {
+        u64 size = t->size ? t->size * 2 : 1024;
+        access a = allocate(h, size * sizeof(struct access));
+        assert(a != INVALID_ADDRESS);
+        if (t->a) {
+            runtime_memcpy(a, t->a, t->count * sizeof(struct access));
+            deallocate(h, t->a, t->size * sizeof(struct access));
+        }
+        t->a = a;
+        t->size = size;
+    }
+    t->a[t->count].node = node;
+    t->a[t->count].page = page;
+    t->count++;
+}
+
+static void loop_trace(heap h, trace t)
+{
+    t->name = "loop";
+    for (int r = 0; r < LOOP_ROUNDS; r++)
+        for (u64 i = 0; i < LOOP_PAGES; i++)
+            trace_add(h, t, 0, (i * LOOP_STRIDE) % LOOP_PAGES);
+}
+
+static void scan_trace(heap h, trace t)
+{
+    t->name = "scan";
+    for (int r = 0; r < SCAN_ROUNDS; r++) {
+        for (int i = 0; i < 4 * HOT_PAGES; i++)
+            trace_add(h, t, 1, trace_random() % HOT_PAGES);
+        for (u64 pi = 0; pi < SCAN_PAGES; pi++)
+            trace_add(h, t, 2, r * SCAN_PAGES + pi);
+    }
+}
+
+/* four in five reads go to one in five pages */
+static void skew_trace(heap h, trace t)
+{
+    t->name = "skew";
+    for (int i = 0; i < SKEW_ACCESSES; i++) {
+        u64 r = trace_random();
+        u64 pi = (r >> 8) % (SKEW_PAGES / 5);
+        if ((r & 0xff) >= 205)
+            pi += SKEW_PAGES / 5 + (r >> 8) % (SKEW_PAGES - SKEW_PAGES / 5);
+        trace_add(h, t, 3, pi);
+    }
+}
+
+static boolean file_trace(heap h, trace t, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        msg_err("unable to open %s\n", path);
+        return false;
+    }
+    unsigned long long node, page;
+    t->name = "file";
+    while (fscanf(f, "%llu %llu", &node, &page) == 2) {
+        if (node >= MAX_NODES || page >= NODE_PAGES) {
+            msg_err("access to node %lld page %lld out of range\n", node, page);
+            fclose(f);
+            return false;
+        }
+        trace_add(h, t, node, page);
+    }
+    fclose(f);
+    return true;
+}
+
+static u64 lru_replay(heap h, trace t)
+{
+    table resident = allocate_table(h, identity_key, pointer_equal);
+    struct list lru;
+    u64 pages = 0, hits = 0;
+    list_init(&lru);
+    for (u64 i = 0; i < t->count; i++) {
+        u64 key = ((t->a[i].node << 32) | t->a[i].page) + 1;
+        lru_entry e = table_find(resident, pointer_from_u64(key));
+        if (e) {
+            hits++;
+            list_delete(&e->l);
+            list_insert_before(&lru, &e->l);
+            continue;
+        }
+        if (pages == CACHE_PAGES) {
+            e = struct_from_list(list_begin(&lru), lru_entry, l);
+            list_delete(&e->l);
+            table_set(resident, pointer_from_u64(e->key), 0);
+        } else {
+            e = allocate(h, sizeof(struct lru_entry));
+            assert(e != INVALID_ADDRESS);
+            pages++;
+        }
+        e->key = key;
+        list_insert_before(&lru, &e->l);
+        table_set(resident, pointer_from_u64(key), e);
+    }
+    return hits;
+}
+
+static void cache_replay(heap h, trace t, struct pagecache_stats *stats)
+{
+    pagecache pc;
+    pagecache_volume pv = stub_volume(h, &pc);
+    pagecache_node nodes[MAX_NODES];
+    for (int n = 0; n < MAX_NODES; n++)
+        nodes[n] = stub_node(pv, h, n, NODE_PAGES * PAGESIZE, false);
+    status_handler complete = stub_read_complete(h);
+    for (u64 i = 0; i < t->count; i++) {
+        sg_list sg = allocate_sg_list();
+        assert(sg != INVALID_ADDRESS);
+        apply(pagecache_node_get_reader(nodes[t->a[i].node]), sg,
+              irangel(t->a[i].page * PAGESIZE, PAGESIZE), complete);
+        assert(is_ok(last_status));
+        sg_list_release(sg);
+        deallocate_sg_list(sg);
+        if (pc->total_pages > CACHE_PAGES)
+            pagecache_drain(pc, (pc->total_pages - CACHE_PAGES) * PAGESIZE);
+    }
+    pagecache_get_stats(pc, stats);
+}
+
+static void report(heap h, trace t)
+{
+    struct pagecache_stats s;
+    cache_replay(h, t, &s);
+    u64 lru_hits = lru_replay(h, t);
+    rprintf("%s\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n", t->name, t->count,
+            s.hits * 100 / t->count, lru_hits * 100 / t->count,
+            s.readahead_hits, s.readahead_wasted, s.refaults);
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    struct trace t;
+    rprintf("trace\taccesses\thit pct\tlru hit pct\treadahead hits\treadahead wasted\trefaults\n");
+    if (argc > 1) {
+        zero(&t, sizeof(t));
+        if (!file_trace(h, &t, argv[1]))
+            exit(EXIT_FAILURE);
+        report(h, &t);
+        exit(EXIT_SUCCESS);
+    }
+
+    void (*traces[])(heap, trace) = { loop_trace, scan_trace, skew_trace };
+    for (int i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+        zero(&t, sizeof(t));
+        traces[i](h, &t);
+        report(h, &t);
+    }
+    exit(EXIT_SUCCESS);
+}
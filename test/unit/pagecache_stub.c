@@ -0,0 +1,68 @@
+#include <runtime.h>
+#include <pagecache.h>
+#include "pagecache_stub.h"
+
+status last_status;
+int completions;
+u64 fs_pages_read;
+
+u8 node_byte(int node, u64 offset)
+{
+    return (node * 31 + offset / 5) & 0xff;
+}
+
+closure_function(2, 3, void, fs_read,
+                 int, node, boolean, contents,
+                 sg_list, sg, range, q, status_handler, sh)
+{
+    u64 offset = q.start;
+    sg_buf sgb;
+    while (offset < q.end && (sgb = sg_list_head_remove(sg)) != INVALID_ADDRESS) {
+        u8 *p = sgb->buf + sgb->offset;
+        if (bound(contents)) {
+            for (u64 i = 0; i < sgb->size - sgb->offset; i++)
+                p[i] = node_byte(bound(node), offset + i);
+        }
+        offset += sgb->size - sgb->offset;
+        sg_buf_release(sgb);
+    }
+    fs_pages_read += range_span(q) / PAGESIZE;
+    apply(sh, STATUS_OK);
+}
+
+closure_function(0, 3, void, fs_write,
+                 sg_list, sg, range, q, status_handler, sh)
+{
+    halt("unexpected write\n");
+}
+
+closure_function(0, 1, void, read_complete,
+                 status, s)
+{
+    last_status = s;
+    completions++;
+}
+
+pagecache_volume stub_volume(heap h, pagecache *pc)
+{
+    *pc = allocate_pagecache(h, h, PAGESIZE);
+    assert(*pc != INVALID_ADDRESS);
+    pagecache_volume pv = pagecache_allocate_volume(*pc, infinity, PAGELOG);
+    assert(pv != INVALID_ADDRESS);
+    return pv;
+}
+
+pagecache_node stub_node(pagecache_volume pv, heap h, int node, u64 length, boolean contents)
+{
+    pagecache_node pn = pagecache_allocate_node(pv, closure(h, fs_read, node, contents),
+                                                closure(h, fs_write));
+    assert(pn != INVALID_ADDRESS);
+    pagecache_set_node_length(pn, length);
+    return pn;
+}
+
+status_handler stub_read_complete(heap h)
+{
+    completions = 0;
+    return closure(h, read_complete);
+}
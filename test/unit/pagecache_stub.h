@@ -0,0 +1,15 @@
+/* A pagecache volume over a stub filesystem, for the pagecache tests.
+   Node contents are generated by node_byte() as they are read, unless
+   the node was made without contents, and are never written back. Reads
+   completed through stub_read_complete() leave their status in
+   last_status and count themselves in completions; fs_pages_read counts
+   the pages read from the filesystem. */
+
+extern status last_status;
+extern int completions;
+extern u64 fs_pages_read;
+
+pagecache_volume stub_volume(heap h, pagecache *pc);
+pagecache_node stub_node(pagecache_volume pv, heap h, int node, u64 length, boolean contents);
+status_handler stub_read_complete(heap h);
+u8 node_byte(int node, u64 offset);
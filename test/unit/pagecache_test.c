@@ -0,0 +1,251 @@
+/* pagecache readahead test
+
+   A node backed by a synthetic file is read through the cache in
+   page-sized pieces. Read sequentially, nearly every page should be
+   found already read ahead, also when the reads are smaller pieces
+   served by the resident fast path where they can be, as file_read
+   takes them; read in a scattered order, nothing should be read
+   ahead. Last, the cache is drained while a sequential reader
+   is well ahead of itself, which must be counted as wasted readahead
+   and shrink the window.
+
+   With the cache held to a fixed size, a hot set of pages must survive
+   a scan of a larger node, and a read of a page evicted by the scan
+   must be counted as a refault and make room for more new pages. */
+
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <pagecache.h>
+#include <pagecache_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagecache_stub.h"
+
+#define test_assert(expr) do { \
+if (expr) ; else { \
+	msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+	goto fail; \
+} \
+} while (0)
+
+#define NODE_PAGES      1024
+#define NODE_LENGTH     (NODE_PAGES * PAGESIZE)
+#define SCATTER_STRIDE  97      /* coprime with NODE_PAGES */
+#define CACHE_PAGES     (NODE_PAGES / 2)
+#define HOT_PAGES       64
+#define CHUNK_SIZE      1000    /* straddles page boundaries */
+
+extern heap init_process_runtime();
+
+static boolean read_page(heap h, pagecache_node pn, int node, u64 pi)
+{
+    u8 buf[PAGESIZE];
+    sg_list sg = allocate_sg_list();
+    test_assert(sg != INVALID_ADDRESS);
+    apply(pagecache_node_get_reader(pn), sg, irangel(pi * PAGESIZE, PAGESIZE),
+          stub_read_complete(h));
+    test_assert(completions == 1 && is_ok(last_status));
+    test_assert(sg_copy_to_buf_and_release(buf, sg, PAGESIZE) == PAGESIZE);
+    for (int i = 0; i < PAGESIZE; i++)
+        test_assert(buf[i] == node_byte(node, pi * PAGESIZE + i));
+    return true;
+  fail:
+    return false;
+}
+
+static boolean sequential_test(heap h, pagecache pc, pagecache_volume pv)
+{
+    struct pagecache_stats before, after;
+    pagecache_node pn = stub_node(pv, h, 0, NODE_LENGTH, true);
+    pagecache_get_stats(pc, &before);
+    fs_pages_read = 0;
+    for (u64 pi = 0; pi < NODE_PAGES; pi++)
+        test_assert(read_page(h, pn, 0, pi));
+    pagecache_get_stats(pc, &after);
+    u64 misses = after.misses - before.misses;
+    u64 ra_hits = after.readahead_hits - before.readahead_hits;
+    rprintf("sequential: %ld misses, %ld readahead hits, %ld pages read ahead\n",
+            misses, ra_hits, after.readahead - before.readahead);
+    test_assert(misses == 1);
+    test_assert(ra_hits == NODE_PAGES - 1);
+    test_assert(after.readahead - before.readahead == NODE_PAGES - 1);
+    test_assert(fs_pages_read == NODE_PAGES);
+
+    /* a second pass is all hits */
+    for (u64 pi = 0; pi < NODE_PAGES; pi++)
+        test_assert(read_page(h, pn, 0, pi));
+    pagecache_get_stats(pc, &before);
+    test_assert(before.hits - after.hits == NODE_PAGES);
+    test_assert(before.misses == after.misses && before.readahead == after.readahead);
+    return true;
+  fail:
+    return false;
+}
+
+/* Read q of pn the way file_read does, returning true if it was
+   served from resident pages. */
+static boolean read_chunk(heap h, pagecache_node pn, int node, range q, boolean *resident)
+{
+    u8 buf[CHUNK_SIZE];
+    u64 length = range_span(q);
+    *resident = pagecache_read_resident(pn, buf, q) == length;
+    if (*resident) {
+        pagecache_readahead_resident(pn, q);
+    } else {
+        sg_list sg = allocate_sg_list();
+        test_assert(sg != INVALID_ADDRESS);
+        apply(pagecache_node_get_reader(pn), sg, q, stub_read_complete(h));
+        test_assert(completions == 1 && is_ok(last_status));
+        test_assert(sg_copy_to_buf_and_release(buf, sg, length) == length);
+    }
+    for (int i = 0; i < length; i++)
+        test_assert(buf[i] == node_byte(node, q.start + i));
+    return true;
+  fail:
+    return false;
+}
+
+static boolean chunked_test(heap h, pagecache pc, pagecache_volume pv)
+{
+    struct pagecache_stats before, after;
+    pagecache_node pn = stub_node(pv, h, 5, NODE_LENGTH, true);
+    u64 resident = 0, chunks = 0;
+    pagecache_get_stats(pc, &before);
+    fs_pages_read = 0;
+    for (u64 offset = 0; offset < NODE_LENGTH; offset += CHUNK_SIZE, chunks++) {
+        boolean r;
+        test_assert(read_chunk(h, pn, 5, irange(offset, MIN(offset + CHUNK_SIZE, NODE_LENGTH)), &r));
+        if (r)
+            resident++;
+    }
+    pagecache_get_stats(pc, &after);
+    u64 misses = after.misses - before.misses;
+    rprintf("chunked: %ld of %ld reads resident, %ld misses, %ld pages read ahead\n",
+            resident, chunks, misses, after.readahead - before.readahead);
+
+    /* the fast path must keep the run going, so that only the first
+       read misses and the window keeps ahead of the reader */
+    test_assert(misses == 1);
+    test_assert(after.readahead - before.readahead == NODE_PAGES - 1);
+    test_assert(fs_pages_read == NODE_PAGES);
+    test_assert(resident == chunks - 1);
+    return true;
+  fail:
+    return false;
+}
+
+static boolean scattered_test(heap h, pagecache pc, pagecache_volume pv)
+{
+    struct pagecache_stats before, after;
+    pagecache_node pn = stub_node(pv, h, 1, NODE_LENGTH, true);
+    pagecache_get_stats(pc, &before);
+    for (u64 i = 1; i <= NODE_PAGES; i++)
+        test_assert(read_page(h, pn, 1, (i * SCATTER_STRIDE) % NODE_PAGES));
+    pagecache_get_stats(pc, &after);
+    rprintf("scattered: %ld misses, %ld pages read ahead\n",
+            after.misses - before.misses, after.readahead - before.readahead);
+    test_assert(after.misses - before.misses == NODE_PAGES);
+    test_assert(after.readahead == before.readahead);
+    return true;
+  fail:
+    return false;
+}
+
+static boolean thrash_test(heap h, pagecache pc, pagecache_volume pv)
+{
+    struct pagecache_stats before, after;
+    pagecache_node pn = stub_node(pv, h, 2, NODE_LENGTH, true);
+    u64 pi;
+    for (pi = 0; pi < NODE_PAGES / 2; pi++)
+        test_assert(read_page(h, pn, 2, pi));
+    test_assert(pn->ra_window == PAGECACHE_READAHEAD_MAX_PAGES);
+    test_assert(pn->ra_end > pi);
+
+    pagecache_get_stats(pc, &before);
+    pagecache_drain(pc, 4 * NODE_LENGTH);
+    pagecache_get_stats(pc, &after);
+    rprintf("drained: %ld pages read ahead wasted\n",
+            after.readahead_wasted - before.readahead_wasted);
+    test_assert(after.readahead_wasted - before.readahead_wasted == pn->ra_end - pi);
+    test_assert(pn->ra_window == PAGECACHE_READAHEAD_MIN_PAGES);
+
+    /* the reader misses once, then readahead starts over */
+    for (; pi < NODE_PAGES; pi++)
+        test_assert(read_page(h, pn, 2, pi));
+    pagecache_get_stats(pc, &before);
+    test_assert(before.misses - after.misses == 1);
+    return true;
+  fail:
+    return false;
+}
+
+/* evict down to the given number of resident pages */
+static void limit_cache(pagecache pc, u64 pages)
+{
+    if (pc->total_pages > pages)
+        pagecache_drain(pc, (pc->total_pages - pages) * PAGESIZE);
+}
+
+static int node_page_state(pagecache_node pn, u64 pi)
+{
+    struct pagecache_page k;
+    k.state_offset = pi;
+    pagecache_page pp = (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
+    return pp == INVALID_ADDRESS ? -1 : pp->state_offset >> PAGECACHE_PAGESTATE_SHIFT;
+}
+
+static boolean scan_test(heap h, pagecache pc, pagecache_volume pv)
+{
+    struct pagecache_stats before, after;
+    pagecache_node hot = stub_node(pv, h, 3, NODE_LENGTH, true);
+    pagecache_node scan = stub_node(pv, h, 4, NODE_LENGTH, true);
+    while (pagecache_drain(pc, 4 * NODE_LENGTH) > 0);
+    test_assert(pc->total_pages == 0);
+
+    /* read twice, hot pages are active */
+    for (int pass = 0; pass < 2; pass++)
+        for (u64 i = 1; i <= HOT_PAGES; i++)
+            test_assert(read_page(h, hot, 3, (i * SCATTER_STRIDE) % NODE_PAGES));
+    for (u64 pi = 0; pi < NODE_PAGES; pi++) {
+        test_assert(read_page(h, scan, 4, pi));
+        limit_cache(pc, CACHE_PAGES);
+    }
+
+    pagecache_get_stats(pc, &before);
+    for (u64 i = 1; i <= HOT_PAGES; i++)
+        test_assert(read_page(h, hot, 3, (i * SCATTER_STRIDE) % NODE_PAGES));
+    pagecache_get_stats(pc, &after);
+    rprintf("scan: %ld of %d hot pages hit\n", after.hits - before.hits, HOT_PAGES);
+    test_assert(after.hits - before.hits == HOT_PAGES);
+
+    /* the most recently evicted scan pages are remembered */
+    u64 pi;
+    for (pi = 0; pi < NODE_PAGES; pi++)
+        if (node_page_state(scan, pi) == PAGECACHE_PAGESTATE_FREE)
+            break;
+    test_assert(pi < NODE_PAGES);
+    u64 target = pc->new_target;
+    test_assert(read_page(h, scan, 4, pi));
+    pagecache_get_stats(pc, &before);
+    test_assert(before.refaults - after.refaults == 1);
+    test_assert(node_page_state(scan, pi) == PAGECACHE_PAGESTATE_ACTIVE);
+    test_assert(pc->new_target > target);
+    test_assert(pc->ghost_new.pages + pc->ghost_active.pages <= pc->total_pages);
+    return true;
+  fail:
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    pagecache pc;
+    pagecache_volume pv = stub_volume(h, &pc);
+
+    if (!sequential_test(h, pc, pv) || !scattered_test(h, pc, pv) || !thrash_test(h, pc, pv) ||
+        !scan_test(h, pc, pv) || !chunked_test(h, pc, pv)) {
+        msg_err("Test failed\n");
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,257 @@
+/* tlog compaction test
+
+   A filesystem on a memory-backed disk is churned with directory
+   entries, most of which are then removed, so that the log grows to
+   several extensions while the tree it describes stays small. The
+   filesystem is mounted, compacted, modified and mounted again, and
+   the contents are checked against what was written. Mount times and
+   log sizes before and after compaction are reported.
+
+   Directories in the compacted log are indexed and only loaded as
+   entries are looked up, which is checked on a subdirectory that a
+   later record reaches into. A file written before the others are
+   loaded must not land in their storage. A log compacted before
+   anything reaches storage, as mkfs does, is checked to be replaced
+   by the snapshot. Last, storage released after a snapshot must be
+   free again once mounted. */
+
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <pagecache.h>
+#include <tfs.h>
+#include <stdlib.h>
+#include "memdisk.h"
+
+#define CHURN_ENTRIES   40000
+#define CHURN_KEEP      10      /* one in this many entries survives */
+#define CHURN_FLUSH     1000
+#define TEST_FILES      4
+#define TEST_FILE_SIZE  (3 * PAGESIZE + 123)
+
+extern heap init_process_runtime();
+
+static filesystem mount(heap h, boolean initialize, timestamp *elapsed)
+{
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    filesystem fs = memdisk_mount(h, initialize, allocate_tuple());
+    if (elapsed)
+        *elapsed = now(CLOCK_ID_MONOTONIC) - start;
+    return fs;
+}
+
+/* the file of a node that may not have been found */
+static fsfile fsfile_node(filesystem fs, tuple t)
+{
+    return t ? fsfile_from_node(fs, t) : 0;
+}
+
+static void file_name(char *buf, int n)
+{
+    buf[0] = 'f';
+    buf[1] = '0' + n;
+    buf[2] = '\0';
+}
+
+static void entry_name(char *buf, int n)
+{
+    buf[0] = 'd';
+    for (int i = 0; i < 6; i++) {
+        buf[6 - i] = '0' + n % 10;
+        n /= 10;
+    }
+    buf[7] = '\0';
+}
+
+static boolean populate(heap h)
+{
+    filesystem fs = mount(h, true, 0);
+    char name[8];
+    test_assert(fs);
+
+    /* as written by mkfs, the first tuple logged becomes the root at mount */
+    tuple root = allocate_tuple();
+    table_set(root, sym(children), allocate_tuple());
+    filesystem_write_tuple(fs, root);
+
+    for (int i = 0; i < CHURN_ENTRIES; i++) {
+        entry_name(name, i);
+        filesystem_mkdir(fs, root, name);
+        if (i % CHURN_KEEP != 0)
+            filesystem_delete(fs, root, sym_this(name));
+        if (i % CHURN_FLUSH == 0)
+            test_assert(memdisk_flush(h, fs));
+    }
+
+    for (int i = 0; i < TEST_FILES; i++) {
+        file_name(name, i);
+        tuple t = filesystem_creat(fs, root, name);
+        test_assert(t && write_file(h, fsfile_from_node(fs, t), i, irange(0, TEST_FILE_SIZE)));
+    }
+
+    tuple sub = filesystem_mkdir(fs, root, "sub");
+    filesystem_mkdir(fs, sub, "deeper");
+    tuple t = filesystem_creat(fs, sub, "inner");
+    test_assert(t && write_file(h, fsfile_from_node(fs, t), TEST_FILES, irange(0, TEST_FILE_SIZE)));
+    test_assert(memdisk_flush(h, fs));
+    return true;
+  fail:
+    return false;
+}
+
+static boolean verify(heap h, filesystem fs, boolean compacted)
+{
+    tuple c = children(filesystem_getroot(fs));
+    char name[8];
+    test_assert(c);
+    for (int i = 0; i < CHURN_ENTRIES; i++) {
+        entry_name(name, i);
+        tuple t = table_find(c, sym_this(name));
+        if (i % CHURN_KEEP == 0)
+            test_assert(t && children(t));
+        else
+            test_assert(!t);
+    }
+    test_assert(!table_find(c, sym(after)) == !compacted);
+
+    for (int i = 0; i < TEST_FILES; i++) {
+        file_name(name, i);
+        test_assert(check_file(h, fsfile_node(fs, table_find(c, sym_this(name))), i, TEST_FILE_SIZE));
+    }
+
+    tuple sub = table_find(c, sym(sub));
+    test_assert(sub && lookup(sub, sym(deeper)));
+    test_assert(check_file(h, fsfile_node(fs, lookup(sub, sym(inner))), TEST_FILES,
+                           compacted ? 2 * TEST_FILE_SIZE : TEST_FILE_SIZE));
+    return true;
+  fail:
+    return false;
+}
+
+/* Only the entry that the post-compaction write touched, along with the
+   directory back-links, should be in before anything is looked up. */
+static boolean verify_lazy(filesystem fs)
+{
+    tuple sub = lookup(filesystem_getroot(fs), sym(sub));
+    test_assert(sub);
+    tuple c = table_find(sub, sym(children));
+    test_assert(c && table_elements(c) == 3);
+    test_assert(table_find(c, sym(inner)) && !table_find(c, sym(deeper)));
+    tuple deeper = lookup(sub, sym(deeper));
+    test_assert(deeper && table_elements(c) == 4);
+    test_assert(lookup(deeper, sym_this("..")) == sub);
+    test_assert(table_elements(children(sub)) == 4);
+    return true;
+  fail:
+    return false;
+}
+
+static boolean compact_test(heap h)
+{
+    timestamp before, after;
+    u64 size_before, size_after;
+    test_assert(populate(h));
+
+    filesystem fs = mount(h, false, &before);
+    test_assert(fs);
+    test_assert(verify(h, fs, false));
+    size_before = filesystem_log_size(fs);
+
+    filesystem_compact_log(fs, memdisk_op_complete(h));
+    test_assert(completions == 1 && is_ok(last_status));
+    size_after = filesystem_log_size(fs);
+    test_assert(size_after < size_before);
+
+    /* records logged after compaction go to the new chain */
+    tuple root = filesystem_getroot(fs);
+    filesystem_mkdir(fs, root, "after");
+    tuple inner = lookup(lookup(root, sym(sub)), sym(inner));
+    test_assert(write_file(h, fsfile_from_node(fs, inner), TEST_FILES, irange(TEST_FILE_SIZE, 2 * TEST_FILE_SIZE)));
+    test_assert(memdisk_flush(h, fs));
+
+    fs = mount(h, false, &after);
+    test_assert(fs);
+    test_assert(verify_lazy(fs));
+    tuple late = filesystem_creat(fs, filesystem_getroot(fs), "late");
+    test_assert(late && write_file(h, fsfile_from_node(fs, late), TEST_FILES + 1, irange(0, 4 * TEST_FILE_SIZE)));
+    test_assert(verify(h, fs, true));
+    test_assert(check_file(h, fsfile_node(fs, late), TEST_FILES + 1, 4 * TEST_FILE_SIZE));
+    test_assert(filesystem_log_size(fs) == size_after);
+
+    rprintf("log size %ld KB -> %ld KB, mount time %ld us -> %ld us\n",
+            size_before / KB, size_after / KB,
+            usec_from_timestamp(before), usec_from_timestamp(after));
+    return true;
+  fail:
+    return false;
+}
+
+static boolean initial_snapshot_test(heap h)
+{
+    memdisk_clear();
+    filesystem fs = mount(h, true, 0);
+    test_assert(fs);
+    tuple root = allocate_tuple();
+    table_set(root, sym(children), allocate_tuple());
+    filesystem_write_tuple(fs, root);
+    tuple sub = filesystem_mkdir(fs, root, "sub");
+    tuple t = filesystem_creat(fs, sub, "inner");
+    test_assert(t && write_file(h, fsfile_from_node(fs, t), 0, irange(0, TEST_FILE_SIZE)));
+
+    filesystem_compact_log(fs, memdisk_op_complete(h));
+    test_assert(completions == 1 && is_ok(last_status));
+    test_assert(filesystem_log_size(fs) == TFS_LOG_DEFAULT_EXTENSION_SIZE);
+
+    fs = mount(h, false, 0);
+    test_assert(fs);
+    sub = lookup(filesystem_getroot(fs), sym(sub));
+    test_assert(sub && table_elements(table_find(sub, sym(children))) == 2);
+    test_assert(check_file(h, fsfile_node(fs, lookup(sub, sym(inner))), 0, TEST_FILE_SIZE));
+    return true;
+  fail:
+    return false;
+}
+
+static boolean release_test(heap h)
+{
+    memdisk_clear();
+    filesystem fs = mount(h, true, 0);
+    test_assert(fs);
+    tuple root = allocate_tuple();
+    table_set(root, sym(children), allocate_tuple());
+    filesystem_write_tuple(fs, root);
+    tuple t = filesystem_creat(fs, root, "gone");
+    test_assert(t && write_file(h, fsfile_from_node(fs, t), 0, irange(0, 4 * TEST_FILE_SIZE)));
+    test_assert(memdisk_flush(h, fs));
+
+    /* the snapshot records the file's storage as in use */
+    filesystem_compact_log(fs, memdisk_op_complete(h));
+    test_assert(completions == 1 && is_ok(last_status));
+    u64 used = fs_freeblocks(fs);
+    filesystem_dealloc(fs, t, 0, 4 * TEST_FILE_SIZE, memdisk_fs_op_complete(h));
+    test_assert(completions == 1 && is_ok(last_status));
+    test_assert(memdisk_flush(h, fs));
+    u64 released = fs_freeblocks(fs);
+    test_assert(released > used);
+
+    fs = mount(h, false, 0);
+    test_assert(fs);
+    test_assert(fs_freeblocks(fs) == released);
+    return true;
+  fail:
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    if (!memdisk_init()) {
+        msg_err("failed to allocate disk\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!compact_test(h) || !initial_snapshot_test(h) || !release_test(h)) {
+        msg_err("Test failed\n");
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Drive many parallel connections through the webg test server and
+# check that every request succeeds.
+#
+# usage: webg_parallel.sh [connections] [requests]
+#
+# By default, webg runs on a single vCPU with user networking forwarded
+# to localhost. To exercise multiqueue virtio-net, run it over a tap
+# bridge with more vCPUs and queue pairs and give the guest address:
+#
+#   HOST=10.3.3.6 SMP=4 NETWORK_QUEUES=4 test/webg_parallel.sh 256 20000
+
+CONNS=${1:-64}
+REQUESTS=${2:-10000}
+SMP=${SMP:-1}
+NETWORK_QUEUES=${NETWORK_QUEUES:-1}
+PORT=8080
+LOG=/tmp/webg_parallel.log
+OUT=/tmp/webg_parallel.out
+
+if [ -n "$HOST" ]; then
+    RUN=run-bridge
+else
+    RUN=run
+    HOST=127.0.0.1
+fi
+
+cd $(dirname $0)/..
+setsid make $RUN TARGET=webg NETWORK_QUEUES=$NETWORK_QUEUES QEMU_FLAGS="-smp $SMP" > $LOG 2>&1 &
+PGID=$!
+trap "kill -- -$PGID 2>/dev/null" EXIT
+
+for i in $(seq 60); do
+    curl -s -o /dev/null http://$HOST:$PORT/ && break
+    if ! kill -0 $PGID 2>/dev/null; then
+        echo "webg exited before serving; see $LOG"
+        exit 1
+    fi
+    sleep 1
+done
+
+start=$(date +%s.%N)
+seq $REQUESTS | xargs -P $CONNS -I{} curl -s -o /dev/null -w "%{http_code}\n" http://$HOST:$PORT/ > $OUT
+end=$(date +%s.%N)
+
+ok=$(grep -c '^200$' $OUT)
+echo "$ok/$REQUESTS requests ok, $CONNS connections, $SMP cpus, $NETWORK_QUEUES queue pairs"
+echo "$(echo "$REQUESTS / ($end - $start)" | bc) requests/sec"
+[ "$ok" -eq "$REQUESTS" ] || exit 1